@@ -2,11 +2,11 @@ package main
 
 import (
 	"encoding/json"
-	//	"fmt"
+	"fmt"
 	log "github.com/Sirupsen/logrus"
 	"os"
 	"path"
-	//	"strconv"
+	"strconv"
 	"strings"
 	//	"regexp"
 )
@@ -27,6 +27,7 @@ type containerConfig struct {
 	Pid          int
 	Rootfs       string
 	Env          map[string]string
+	DeviceRules  string
 	Accelerators *acceleratorConfig
 }
 
@@ -42,11 +43,42 @@ type Process struct {
 	Env []string `json:"env,omitempty"`
 }
 
+// LinuxDeviceCgroup represents a device rule for the whitelist controller
+// github.com/opencontainers/runtime-spec/blob/v1.0.0/specs-go/config.go#L274-L286
+type LinuxDeviceCgroup struct {
+	Allow  bool   `json:"allow"`
+	Type   string `json:"type,omitempty"`
+	Major  *int64 `json:"major,omitempty"`
+	Minor  *int64 `json:"minor,omitempty"`
+	Access string `json:"access,omitempty"`
+}
+
+// LinuxDevice represents the mknod information for a Linux special device file
+// github.com/opencontainers/runtime-spec/blob/v1.0.0/specs-go/config.go#L288-L304
+type LinuxDevice struct {
+	Path  string `json:"path"`
+	Type  string `json:"type"`
+	Major int64  `json:"major"`
+	Minor int64  `json:"minor"`
+}
+
+// LinuxResources has container runtime resource constraints
+type LinuxResources struct {
+	Devices []LinuxDeviceCgroup `json:"devices,omitempty"`
+}
+
+// Linux contains platform-specific configuration for Linux based containers
+type Linux struct {
+	Resources *LinuxResources `json:"resources,omitempty"`
+	Devices   []LinuxDevice   `json:"devices,omitempty"`
+}
+
 // Spec uses pointers to structs, similarly to the latest version of runtime-spec:
 // https://github.com/opencontainers/runtime-spec/blob/v1.0.0/specs-go/config.go#L5-L28
 type Spec struct {
 	Process *Process `json:"process,omitempty"`
 	Root    *Root    `json:"root,omitempty"`
+	Linux   *Linux   `json:"linux,omitempty"`
 }
 
 // HookState copied from opencontainers/runc
@@ -96,6 +128,54 @@ func loadSpec(path string) (spec *Spec) {
 	return
 }
 
+// Runtime devices cgroup rules, comma separated "[!]<type> <major>:<minor> <access>" ('!' for deny):
+// with cgroup v2, the runtime tool device filter replaces the runtime one and must keep its rules.
+// As runc, devices created in the container are allowed after the resources rules.
+func getDeviceRules(s *Spec) string {
+	if s.Linux == nil {
+		return ""
+	}
+	rules := []string{}
+	if s.Linux.Resources != nil {
+		rules = getResourcesDeviceRules(s.Linux.Resources, rules)
+	}
+	for _, d := range s.Linux.Devices {
+		devtype := d.Type
+		if devtype == "u" {
+			devtype = "c"
+		}
+		if (devtype != "c") && (devtype != "b") {
+			continue
+		}
+		rules = append(rules, fmt.Sprintf("%s %d:%d rwm", devtype, d.Major, d.Minor))
+	}
+	return strings.Join(rules, ",")
+}
+
+func getResourcesDeviceRules(r *LinuxResources, rules []string) []string {
+	for _, d := range r.Devices {
+		devtype, major, minor, access := d.Type, "*", "*", d.Access
+		if devtype == "" {
+			devtype = "a"
+		}
+		if d.Major != nil {
+			major = strconv.FormatInt(*d.Major, 10)
+		}
+		if d.Minor != nil {
+			minor = strconv.FormatInt(*d.Minor, 10)
+		}
+		if access == "" {
+			access = "rwm"
+		}
+		rule := fmt.Sprintf("%s %s:%s %s", devtype, major, minor, access)
+		if !d.Allow {
+			rule = "!" + rule
+		}
+		rules = append(rules, rule)
+	}
+	return rules
+}
+
 func getAcceleratorConfig(env map[string]string) *acceleratorConfig {
 	devices := env[envAccelDevices]
 	if (len(devices) == 0) || (devices == "void") || (devices == "none") {
@@ -129,6 +209,7 @@ func getContainerConfig() (config containerConfig) {
 		Pid:          h.Pid,
 		Rootfs:       s.Root.Path,
 		Env:          env,
+		DeviceRules:  getDeviceRules(s),
 		Accelerators: getAcceleratorConfig(env),
 	}
 }
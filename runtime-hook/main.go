@@ -1,19 +1,23 @@
 package main
 
 import (
+	"bufio"
 	"flag"
 	"fmt"
 	log "github.com/Sirupsen/logrus"
+	"net"
 	"os"
 	"os/exec"
 	"path/filepath"
 	"strconv"
+	"strings"
 	"syscall"
 )
 
 const (
-	acceleratorTool = "accelerator-container-runtime-tool"
-	syslogFile      = "/var/log/accelerator-runtime-hook.log"
+	acceleratorTool   = "accelerator-container-runtime-tool"
+	acceleratorSocket = "/run/accelerator-container/runtime-tool.sock"
+	syslogFile        = "/var/log/accelerator-runtime-hook.log"
 )
 
 var (
@@ -52,7 +56,7 @@ func usage() {
 	fmt.Fprintf(os.Stderr, "\nCommands:\n")
 	fmt.Fprintf(os.Stderr, "  prestart\n        run the prestart hook\n")
 	fmt.Fprintf(os.Stderr, "  poststart\n       nothing to do\n")
-	fmt.Fprintf(os.Stderr, "  poststop\n        nothing to do\n")
+	fmt.Fprintf(os.Stderr, "  poststop\n        release container accelerators\n")
 }
 
 // getRootfsPath returns an absolute path. We don't need to resolve symlinks for now.
@@ -64,6 +68,44 @@ func getRootfsPath(config containerConfig) string {
 	return rootfs
 }
 
+// requestServer sends the configure or release request to the runtime tool server if it is running.
+// It returns false if the server is not reachable, otherwise exits with the request exit code.
+func requestServer(command string, container containerConfig, loglevel int) bool {
+	conn, err := net.Dial("unix", acceleratorSocket)
+	if err != nil {
+		log.Debugf("server not reachable: %v", err)
+		return false
+	}
+	defer conn.Close()
+
+	rootfs := getRootfsPath(container)
+	if strings.ContainsAny(rootfs+container.Accelerators.Devices+container.Accelerators.Functions+container.DeviceRules, "\n") {
+		logfatal.Fatalln("invalid newline in container accelerator settings")
+	}
+	request := fmt.Sprintf("command=%s\npid=%d\nrootfs=%s\ndevices=%s\nfunctions=%s\ndevicerules=%s\nloglevel=%d\n\n",
+		command, container.Pid, rootfs, container.Accelerators.Devices, container.Accelerators.Functions, container.DeviceRules, loglevel)
+	log.Infof("server request: %q", request)
+	if _, err := conn.Write([]byte(request)); err != nil {
+		logfatal.Fatalln("server request failed:", err)
+	}
+
+	// server forwards tool error messages, then "exit <code>"
+	scanner := bufio.NewScanner(conn)
+	for scanner.Scan() {
+		line := scanner.Text()
+		if strings.HasPrefix(line, "exit ") {
+			code, err := strconv.Atoi(strings.TrimPrefix(line, "exit "))
+			if err != nil {
+				logfatal.Fatalln("server reply invalid:", line)
+			}
+			os.Exit(code)
+		}
+		fmt.Fprintln(os.Stderr, line)
+	}
+	logfatal.Fatalln("server connection closed before reply")
+	return true
+}
+
 func doPrestart() {
 
 	container := getContainerConfig()
@@ -74,6 +116,14 @@ func doPrestart() {
 		return
 	}
 
+	loglevel := 6 // info
+	if *debugflag {
+		loglevel = 7 // debug
+	}
+	if requestServer("configure", container, loglevel) {
+		return
+	}
+
 	path, err := exec.LookPath(acceleratorTool)
 	if err != nil {
 		logfatal.Fatalln("exec failed:", acceleratorTool, "not found")
@@ -84,14 +134,13 @@ func doPrestart() {
 	if len(container.Accelerators.Functions) > 0 {
 		args = append(args, fmt.Sprintf("--functions=%s", container.Accelerators.Functions))
 	}
+	if len(container.DeviceRules) > 0 {
+		args = append(args, fmt.Sprintf("--device-rules=%s", container.DeviceRules))
+	}
 	args = append(args, fmt.Sprintf("--pid=%s", strconv.FormatUint(uint64(container.Pid), 10)))
 	args = append(args, fmt.Sprintf("--rootfs=%s", getRootfsPath(container)))
 	args = append(args, fmt.Sprintf("--log=%s", syslogFile))
-	if *debugflag {
-		args = append(args, "--loglevel=7") // debug
-	} else {
-		args = append(args, "--loglevel=6") // info
-	}
+	args = append(args, fmt.Sprintf("--loglevel=%d", loglevel))
 
 	args = append(args, "configure")
 
@@ -105,6 +154,42 @@ func doPrestart() {
 	logfatal.Fatalln("exec failed:", err)
 }
 
+// doPoststop releases the devices of the stopped container: the runtime tool frees their leases
+// at once, and loads warm functions into them in the background.
+func doPoststop() {
+
+	container := getContainerConfig()
+
+	if container.Accelerators == nil {
+		// Not an accelerator container
+		return
+	}
+
+	loglevel := 6 // info
+	if *debugflag {
+		loglevel = 7 // debug
+	}
+	if requestServer("release", container, loglevel) {
+		return
+	}
+
+	path, err := exec.LookPath(acceleratorTool)
+	if err != nil {
+		logfatal.Fatalln("exec failed:", acceleratorTool, "not found")
+	}
+	// pid 0 (not given by runtime): release devices of any stopped container
+	args := []string{path,
+		fmt.Sprintf("--pid=%s", strconv.FormatUint(uint64(container.Pid), 10)),
+		fmt.Sprintf("--log=%s", syslogFile),
+		fmt.Sprintf("--loglevel=%d", loglevel),
+		"release"}
+
+	log.Infof("exec command: %v", args)
+
+	err = syscall.Exec(args[0], args, os.Environ())
+	logfatal.Fatalln("exec failed:", err)
+}
+
 func main() {
 	flag.Usage = usage
 	flag.Parse()
@@ -122,8 +207,9 @@ func main() {
 		doPrestart()
 		os.Exit(0)
 	case "poststart":
-		fallthrough
+		os.Exit(0)
 	case "poststop":
+		doPoststop()
 		os.Exit(0)
 	default:
 		flag.Usage()
@@ -0,0 +1,391 @@
+/*
+ * Engine bundles: read-only staging directory of an engine driver libraries and mount paths
+ *
+ * A bundle is built once on the host, under <run dir>/bundles/<engine>-<key>, key hashing the
+ * resolved libraries identity and the mount sources: a driver update gives a new bundle.
+ * Containers then get a single recursive bind of it, whatever the number of libraries.
+ *
+ * Layout:  lib/<library file>, lib/<ld cache name> symlinks | mnt/<index> engine mount paths binds
+ *          | ld.so.conf listing the container libraries directory
+ *
+ * Once a new bundle of an engine is staged, older ones have their mount paths binds detached,
+ * and are removed unless a container mount namespace still has them (left for the next new bundle).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <libgen.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <sys/sendfile.h>
+
+#include "accelerator.h"
+
+#define ACCEL_BUNDLE_DIR  "bundles"
+
+
+// Follow library symlinks chain to the library file, links are relative to library dir
+static int resolveLib(const char *libpath, char *srcpath)
+{
+   char lnkpath[FS_PATH_MAX];
+   struct stat stats;
+
+   strncpy(srcpath, libpath, FS_PATH_MAX-1);
+   srcpath[FS_PATH_MAX-1] = '\0';
+   while ((lstat(srcpath, &stats) == 0) && (S_ISLNK(stats.st_mode)))
+   {
+      memset(lnkpath, 0, FS_PATH_MAX);
+      if (readlink(srcpath, lnkpath, FS_PATH_MAX-1) < 0)
+      {
+         log_error("Library %s: failed to read symlink: %s", srcpath, strerror(errno));
+         return -1;
+      }
+      dirname(srcpath);
+      strcat(srcpath, "/");
+      strncat(srcpath, basename(lnkpath), FS_PATH_MAX-1-strlen(srcpath));
+   }
+   return 0;
+}
+
+// Bundle key: libraries files and mount sources identity
+static uint64_t bundleKey(t_accelEngine *engine)
+{
+   char srcpath[FS_PATH_MAX];
+   struct stat stats;
+   uint64_t hash = FNV_OFFSET_BASIS;
+   int ilib, imount;
+
+   hash = fnvHash(hash, engine->name, strlen(engine->name));
+   for (ilib = 0; ilib < engine->nblibs; ilib++)
+   {
+      if ((resolveLib(engine->libspaths[ilib], srcpath) < 0) || (stat(srcpath, &stats) != 0))
+         return 0;
+      hash = fnvHash(hash, engine->libspaths[ilib], strlen(engine->libspaths[ilib]));
+      hash = fnvHash(hash, srcpath, strlen(srcpath));
+      hash = fnvHash(hash, &stats.st_ino, sizeof stats.st_ino);
+      hash = fnvHash(hash, &stats.st_size, sizeof stats.st_size);
+      hash = fnvHash(hash, &stats.st_mtim, sizeof stats.st_mtim);
+   }
+   for (imount = 0; imount < engine->nbmount; imount++)
+   {
+      if (stat(engine->mountlist[imount].src, &stats) != 0)
+      {
+         log_error("Mount path %s not found", engine->mountlist[imount].src);
+         return 0;
+      }
+      hash = fnvHash(hash, engine->mountlist[imount].src, strlen(engine->mountlist[imount].src));
+      hash = fnvHash(hash, &stats.st_ino, sizeof stats.st_ino);
+   }
+   return hash;
+}
+
+// Hard link library file into bundle, or copy it when on another FS
+static int stageLib(const char *srcpath, const char *dstpath)
+{
+   struct stat stats;
+   int fdsrc, fddst;
+   off_t offset = 0;
+   ssize_t nsent;
+
+   if (link(srcpath, dstpath) == 0)
+      return 0;
+
+   fdsrc = open(srcpath, O_RDONLY | O_CLOEXEC);
+   if ((fdsrc < 0) || (fstat(fdsrc, &stats) != 0))
+   {
+      log_error("Library %s: failed to open: %s", srcpath, strerror(errno));
+      if (fdsrc >= 0)
+         close(fdsrc);
+      return -1;
+   }
+   fddst = open(dstpath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, stats.st_mode & 0555);
+   if (fddst < 0)
+   {
+      log_error("Library %s: failed to create: %s", dstpath, strerror(errno));
+      close(fdsrc);
+      return -1;
+   }
+   while (offset < stats.st_size)
+   {
+      nsent = sendfile(fddst, fdsrc, &offset, stats.st_size - offset);
+      if (nsent <= 0)
+      {
+         log_error("Library %s: failed to copy: %s", srcpath, (nsent < 0) ? strerror(errno) : "truncated");
+         break;
+      }
+   }
+   close(fdsrc);
+   close(fddst);
+   return (offset < stats.st_size) ? -1 : 0;
+}
+
+// Bind engine mount path into bundle, unless already there (bundles outlive mount namespaces).
+// The bind is remounted without devices nor setuid, read-only if requested: containers get it with these flags,
+// even when the bundle tree is attached by path (a remount there only applies to the bundle mount itself).
+static int stageMount(t_mountpath *mountpath, const char *dstpath)
+{
+   struct stat srcstats, dststats;
+   struct statvfs vfsstats;
+   unsigned long flags = MS_NODEV | MS_NOSUID | (mountpath->rdonly ? MS_RDONLY : 0);
+   unsigned long vfsflags = ST_NODEV | ST_NOSUID | (mountpath->rdonly ? ST_RDONLY : 0);
+
+   if ((stat(mountpath->src, &srcstats) != 0) || (stat(dstpath, &dststats) != 0))
+   {
+      log_error("Mount path %s: not found", mountpath->src);
+      return -1;
+   }
+   if ((srcstats.st_dev == dststats.st_dev) && (srcstats.st_ino == dststats.st_ino))
+   {
+      if ((statvfs(dstpath, &vfsstats) == 0) && ((vfsstats.f_flag & vfsflags) == vfsflags))
+         return 0;
+   }
+   else if (mount(mountpath->src, dstpath, NULL, MS_BIND | MS_REC, NULL) < 0)
+   {
+      log_error("Mount path %s: mount bind to bundle failed: %s", mountpath->src, strerror(errno));
+      return -1;
+   }
+
+   if (mount(NULL, dstpath, NULL, MS_BIND | MS_REMOUNT | flags, NULL) < 0)
+   {
+      log_error("Mount path %s: remount in bundle failed: %s", mountpath->src, strerror(errno));
+      umount2(dstpath, MNT_DETACH);
+      return -1;
+   }
+   return 0;
+}
+
+static int removeEntry(const char *path, const struct stat *stats, int type, struct FTW *ftw)
+{
+   return remove(path);
+}
+
+// Path of a directory relative to its filesystem root, the mountinfo root field of binds of it
+static int fsRootPath(const char *path, dev_t dev, char *relpath, int pathlen)
+{
+   char root[2*FS_PATH_MAX], mountpoint[2*FS_PATH_MAX];
+   unsigned int devmajor, devminor;
+   char *line = NULL;
+   size_t linelen = 0;
+   size_t bestlen = 0;
+   size_t len;
+   FILE *file;
+
+   file = fopen("/proc/self/mountinfo", "re");
+   if (file == NULL)
+      return -1;
+   relpath[0] = '\0';
+   while (getline(&line, &linelen, file) > 0)
+   {
+      if ( (sscanf(line, "%*s %*s %u:%u %511s %511s", &devmajor, &devminor, root, mountpoint) != 4)
+        || (makedev(devmajor, devminor) != dev))
+         continue;
+      len = (strcmp(mountpoint, "/") == 0) ? 0 : strlen(mountpoint);
+      if ((strncmp(path, mountpoint, len) != 0) || ((path[len] != '/') && (path[len] != '\0')) || (len < bestlen))
+         continue;
+      bestlen = len;
+      snprintf(relpath, pathlen, "%s%s", (strcmp(root, "/") == 0) ? "" : root, path + len);
+   }
+   free(line);
+   fclose(file);
+   return (relpath[0] != '\0') ? 0 : -1;
+}
+
+typedef struct {
+   dev_t dev;
+   const char *relpath;
+   bool used;
+} t_bundleUse;
+
+// Check if process mount namespace has a mount of bundle tree
+static int checkBundleUse(const char *dirpath, const char *name, unsigned char type, void *ctx)
+{
+   t_bundleUse *use = ctx;
+   char path[FS_PATH_MAX];
+   char root[2*FS_PATH_MAX];
+   unsigned int devmajor, devminor;
+   size_t len = strlen(use->relpath);
+   char *line = NULL;
+   size_t linelen = 0;
+   FILE *file;
+
+   snprintf(path, sizeof path, "%s/%s/mountinfo", dirpath, name);
+   file = fopen(path, "re");
+   if (file == NULL)
+      return 0;
+   while ((! use->used) && (getline(&line, &linelen, file) > 0))
+   {
+      if ( (sscanf(line, "%*s %*s %u:%u %511s", &devmajor, &devminor, root) == 3)
+        && (makedev(devmajor, devminor) == use->dev)
+        && (strncmp(root, use->relpath, len) == 0) && ((root[len] == '/') || (root[len] == '\0')))
+         use->used = true;
+   }
+   free(line);
+   fclose(file);
+   return use->used ? -1 : 0;
+}
+
+// Detach mount paths binds of an older bundle of the engine, remove it once no container uses it
+static int dropOldBundle(const char *dirpath, const char *name, unsigned char type, void *ctx)
+{
+   const char *current = ctx;
+   char bundlepath[FS_PATH_MAX];
+   char mntpath[2*FS_PATH_MAX];
+   char relpath[3*FS_PATH_MAX];
+   t_bundleUse use = { 0 };
+   struct stat stats;
+   int imount;
+
+   if (strcmp(name, current) == 0)
+      return 0;
+   snprintf(bundlepath, sizeof bundlepath, "%s/%s", dirpath, name);
+   for (imount = 0; ; imount++)
+   {
+      snprintf(mntpath, sizeof mntpath, "%s/mnt/%d", bundlepath, imount);
+      if (lstat(mntpath, &stats) != 0)
+         break;
+      if ((umount2(mntpath, MNT_DETACH) < 0) && (errno != EINVAL))
+         log_warn("Bundle %s: failed to detach %s: %s", bundlepath, mntpath, strerror(errno));
+   }
+
+   if ((stat(bundlepath, &stats) != 0) || (fsRootPath(bundlepath, stats.st_dev, relpath, sizeof relpath) < 0))
+      return 0;
+   use.dev = stats.st_dev;
+   use.relpath = relpath;
+   fsdirScan("/proc", "[0-9]*", checkBundleUse, &use);
+   if (use.used)
+   {
+      log_debug("Bundle %s superseded, still used by containers", bundlepath);
+      return 0;
+   }
+   if (nftw(bundlepath, removeEntry, 16, FTW_DEPTH | FTW_PHYS) < 0)
+      log_warn("Bundle %s: failed to remove: %s", bundlepath, strerror(errno));
+   else
+      log_info("Bundle %s superseded, removed", bundlepath);
+   return 0;
+}
+
+// Fill a new bundle directory, not yet visible under its final name
+static int fillBundle(t_accelEngine *engine, const char *tmppath)
+{
+   char srcpath[FS_PATH_MAX];
+   char dstpath[2*FS_PATH_MAX];
+   char *libname;
+   struct stat stats;
+   FILE *conf;
+   int ilib, imount;
+
+   snprintf(dstpath, sizeof dstpath, "%s/lib", tmppath);
+   if ((engine->nblibs > 0) && (mkdir(dstpath, 0755) < 0))
+      return -1;
+   for (ilib = 0; ilib < engine->nblibs; ilib++)
+   {
+      if (resolveLib(engine->libspaths[ilib], srcpath) < 0)
+         return -1;
+      snprintf(dstpath, sizeof dstpath, "%s/lib/%s", tmppath, basename(srcpath));
+      if ((lstat(dstpath, &stats) < 0) && (stageLib(srcpath, dstpath) < 0))
+         return -1;
+
+      // ld cache name (usually the soname) links to library file
+      libname = basename(engine->libspaths[ilib]);
+      if (strcmp(libname, basename(srcpath)) != 0)
+      {
+         snprintf(dstpath, sizeof dstpath, "%s/lib/%s", tmppath, libname);
+         if ((symlink(basename(srcpath), dstpath) < 0) && (errno != EEXIST))
+         {
+            log_error("Library %s: failed to create symlink: %s", dstpath, strerror(errno));
+            return -1;
+         }
+      }
+   }
+
+   snprintf(dstpath, sizeof dstpath, "%s/mnt", tmppath);
+   if ((engine->nbmount > 0) && (mkdir(dstpath, 0755) < 0))
+      return -1;
+   for (imount = 0; imount < engine->nbmount; imount++)
+   {
+      snprintf(dstpath, sizeof dstpath, "%s/mnt/%d", tmppath, imount);
+      if (stat(engine->mountlist[imount].src, &stats) != 0)
+         return -1;
+      if (file_create(dstpath, NULL, 0/*uid*/, 0/*gid*/, stats.st_mode) < 0)
+         return -1;
+   }
+
+   snprintf(dstpath, sizeof dstpath, "%s/ld.so.conf", tmppath);
+   conf = fopen(dstpath, "we");
+   if (conf == NULL)
+      return -1;
+   fprintf(conf, "%s/%s/lib\n", ACCEL_BUNDLE_MOUNT, engine->name);
+   fclose(conf);
+
+   return 0;
+}
+
+// Stage engine bundle if not done yet, and return its host path.
+// Concurrent runs build their own copy: first renamed wins, others are dropped.
+int accelBundleStage(t_accelEngine *engine, char *bundlepath, int pathlen)
+{
+   char tmppath[FS_PATH_MAX + 16];
+   char dstpath[2*FS_PATH_MAX];
+   char pattern[ENGINE_NAME_LEN + 20];
+   struct stat stats;
+   uint64_t key;
+   int64_t span = traceBegin();
+   int imount;
+
+   key = bundleKey(engine);
+   if (key == 0)
+      return -1;
+   snprintf(bundlepath, pathlen, "%s/%s/%s-%016llx", hostPath(HOST_PATH_RUN), ACCEL_BUNDLE_DIR,
+         engine->name, (unsigned long long) key);
+
+   if (stat(bundlepath, &stats) != 0)
+   {
+      snprintf(dstpath, sizeof dstpath, "%s/%s", hostPath(HOST_PATH_RUN), ACCEL_BUNDLE_DIR);
+      snprintf(tmppath, sizeof tmppath, "%s.%d", bundlepath, getpid());
+      if ( (file_create(dstpath, NULL, 0/*uid*/, 0/*gid*/, S_IFDIR | 0755) < 0)
+        || (mkdir(tmppath, 0755) < 0))
+      {
+         log_error("Engine %s: failed to create bundle %s: %s", engine->name, tmppath, strerror(errno));
+         return -1;
+      }
+      if (fillBundle(engine, tmppath) < 0)
+      {
+         log_error("Engine %s: failed to fill bundle %s", engine->name, tmppath);
+         nftw(tmppath, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+         return -1;
+      }
+      if (rename(tmppath, bundlepath) < 0)
+      {
+         if ((errno != EEXIST) && (errno != ENOTEMPTY))
+            log_error("Engine %s: failed to rename bundle %s: %s", engine->name, tmppath, strerror(errno));
+         nftw(tmppath, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+      }
+      else
+      {
+         chmod(bundlepath, 0555);
+         log_info("Engine %s: bundle %s staged", engine->name, bundlepath);
+
+         // older bundles of the engine (not temporary ones, named with a pid)
+         snprintf(pattern, sizeof pattern, "%s-%s", engine->name, "????????????????");
+         fsdirScan(dstpath, pattern, dropOldBundle, strrchr(bundlepath, '/') + 1);
+      }
+   }
+
+   for (imount = 0; imount < engine->nbmount; imount++)
+   {
+      snprintf(dstpath, sizeof dstpath, "%s/mnt/%d", bundlepath, imount);
+      if (stageMount(&engine->mountlist[imount], dstpath) < 0)
+         return -1;
+   }
+
+   traceEnd(span, "bundle stage", "%s", engine->name);
+   return 0;
+}
@@ -0,0 +1,352 @@
+/*
+ * Persistent accelerator devices inventory cache
+ *
+ * The inventory built by the engines enumeration is saved to a versioned file under /run, so that
+ * next runs only need to check the cache is still valid and re-read the function loaded into each device.
+ *
+ * File layout:  header | t_acceldev[nbdev] | int64 privdata index[nbdev] | foreach engine: t_acceldev[nbengdev]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "accelerator.h"
+
+#define ACCEL_CACHE_NAME     "inventory.cache"
+#define ACCEL_CACHE_MAGIC    0x49434341  // "ACCI"
+#define ACCEL_CACHE_VERSION  3
+
+
+typedef struct {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t devsize;                      // sizeof(t_acceldev), protects against layout changes
+   uint32_t nbdev;
+   uint32_t nbengdev[ACCEL_ENGINE_MAX];
+   uint64_t fingerprint;
+} t_accelCacheHeader;
+
+static char cachePath[FS_PATH_MAX];
+
+
+// Cache file lives in host run dir
+static const char *cacheFile()
+{
+   snprintf(cachePath, sizeof cachePath, "%s/%s", hostPath(HOST_PATH_RUN), ACCEL_CACHE_NAME);
+   return cachePath;
+}
+
+// Compute inventory fingerprint: config file identity and entries (name, inode) of all engines watched sysfs dirs.
+// sysfs entries get new inodes when a device is removed and added again, even with the same name.
+uint64_t accelCacheFingerprint(t_accelEngine *accelEngineList[], char *conffile)
+{
+   uint64_t hash = FNV_OFFSET_BASIS;
+   uint32_t version = ACCEL_CACHE_VERSION;
+   struct stat stats;
+   struct dirent *dirent;
+   DIR *sysdir;
+   int iengine;
+   int iwatch;
+
+   hash = fnvHash(hash, &version, sizeof version);
+   if (stat(conffile, &stats) == 0)
+   {
+      hash = fnvHash(hash, &stats.st_ino, sizeof stats.st_ino);
+      hash = fnvHash(hash, &stats.st_size, sizeof stats.st_size);
+      hash = fnvHash(hash, &stats.st_mtim, sizeof stats.st_mtim);
+   }
+
+   for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
+   {
+      if (accelEngineList[iengine] == NULL)
+         continue;
+
+      hash = fnvHash(hash, &iengine, sizeof iengine);
+
+      for (iwatch = 0; iwatch < accelEngineList[iengine]->nbsyswatch; iwatch++)
+      {
+         hash = fnvHash(hash, accelEngineList[iengine]->syswatch[iwatch], strlen(accelEngineList[iengine]->syswatch[iwatch]));
+
+         sysdir = opendir(accelEngineList[iengine]->syswatch[iwatch]);
+         if (sysdir == NULL)
+            continue;
+         while ((dirent = readdir(sysdir)) != NULL)
+         {
+            hash = fnvHash(hash, dirent->d_name, strlen(dirent->d_name));
+            hash = fnvHash(hash, &dirent->d_ino, sizeof dirent->d_ino);
+         }
+         closedir(sysdir);
+      }
+   }
+
+   return hash;
+}
+
+
+// Reset engines private devices lists
+static void resetEngineDevices(t_accelEngine *accelEngineList[])
+{
+   t_acceldev *engdevList;
+   int *nbEngdev;
+   int iengine;
+
+   for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
+   {
+      if ((accelEngineList[iengine] != NULL) && (accelEngineList[iengine]->accelops->engineDevices != NULL))
+      {
+         accelEngineList[iengine]->accelops->engineDevices(&engdevList, &nbEngdev);
+         *nbEngdev = 0;
+      }
+   }
+}
+
+// Load devices inventory from cache if its fingerprint matches, then refresh function loaded into each device
+int accelCacheLoad(t_accelEngine *accelEngineList[], uint64_t fingerprint, t_acceldev acceldevList[], int *nbAcceldev)
+{
+   t_accelCacheHeader *header;
+   t_acceldev *engdevList;
+   t_acceldev *cachedevList;
+   int64_t *privIndex;
+   int *nbEngdev;
+   struct stat stats;
+   size_t expsize;
+   char *data;
+   char *ptr;
+   int fd;
+   int iengine;
+   int idev;
+   int ret = -1;
+
+   // engines private devices are either restored from cache or enumerated again
+   resetEngineDevices(accelEngineList);
+
+   fd = open(cacheFile(), O_RDONLY|O_CLOEXEC);
+   if (fd < 0)
+   {
+      log_debug("Inventory cache %s not found", cacheFile());
+      return -1;
+   }
+   if ((fstat(fd, &stats) < 0) || (stats.st_size < sizeof(t_accelCacheHeader)))
+   {
+      close(fd);
+      return -1;
+   }
+   data = mmap(NULL, stats.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (data == MAP_FAILED)
+   {
+      log_warn("Inventory cache %s: mmap failed: %s", cacheFile(), strerror(errno));
+      return -1;
+   }
+
+   header = (t_accelCacheHeader *) data;
+   if ((header->magic != ACCEL_CACHE_MAGIC) || (header->version != ACCEL_CACHE_VERSION)
+    || (header->devsize != sizeof(t_acceldev)) || (header->nbdev > ACCEL_DEVICE_MAX))
+   {
+      log_info("Inventory cache %s: wrong format: ignore", cacheFile());
+      goto out;
+   }
+   if (header->fingerprint != fingerprint)
+   {
+      log_info("Inventory cache %s: devices changed since last enumeration", cacheFile());
+      goto out;
+   }
+
+   expsize = sizeof(t_accelCacheHeader) + header->nbdev * (sizeof(t_acceldev) + sizeof(int64_t));
+   for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
+   {
+      if (header->nbengdev[iengine] > ACCEL_DEVICE_ENGINE_MAX)
+         goto out;
+      expsize += header->nbengdev[iengine] * sizeof(t_acceldev);
+   }
+   if (expsize != stats.st_size)
+   {
+      log_info("Inventory cache %s: truncated: ignore", cacheFile());
+      goto out;
+   }
+
+   ptr = data + sizeof(t_accelCacheHeader);
+   cachedevList = (t_acceldev *) ptr;
+   ptr += header->nbdev * sizeof(t_acceldev);
+   privIndex = (int64_t *) ptr;
+   ptr += header->nbdev * sizeof(int64_t);
+
+   // Restore engines private devices first, as accelerator devices refer to them
+   for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
+   {
+      if (header->nbengdev[iengine] == 0)
+         continue;
+      if ((accelEngineList[iengine] == NULL) || (accelEngineList[iengine]->accelops->engineDevices == NULL))
+         goto out;
+
+      accelEngineList[iengine]->accelops->engineDevices(&engdevList, &nbEngdev);
+      memcpy(engdevList, ptr, header->nbengdev[iengine] * sizeof(t_acceldev));
+      *nbEngdev = header->nbengdev[iengine];
+      ptr += header->nbengdev[iengine] * sizeof(t_acceldev);
+   }
+
+   for (idev = 0; idev < header->nbdev; idev++)
+   {
+      acceldevList[idev] = cachedevList[idev];
+      acceldevList[idev].privdata = NULL;
+
+      iengine = acceldevList[idev].enginetype;
+      if ((iengine < 0) || (iengine >= ACCEL_ENGINE_MAX) || (accelEngineList[iengine] == NULL))
+         goto out;
+
+      if (privIndex[idev] >= 0)
+      {
+         if (privIndex[idev] >= header->nbengdev[iengine])
+            goto out;
+         accelEngineList[iengine]->accelops->engineDevices(&engdevList, &nbEngdev);
+         acceldevList[idev].privdata = & engdevList[privIndex[idev]];
+      }
+
+      // Function may have been changed by another tool since last enumeration
+      if (accelEngineList[iengine]->accelops->refresh(& acceldevList[idev]) < 0)
+      {
+         log_info("Inventory cache: device %s: failed to refresh: ignore cache", acceldevList[idev].bdf.str);
+         goto out;
+      }
+   }
+   *nbAcceldev = header->nbdev;
+
+   log_info("Inventory cache: %d device(s) loaded", *nbAcceldev);
+   ret = 0;
+
+out:
+   if (ret < 0)
+      resetEngineDevices(accelEngineList);
+   munmap(data, stats.st_size);
+   return ret;
+}
+
+
+static int writeAll(int fd, const void *data, size_t len)
+{
+   const char *ptr = data;
+   ssize_t nbwrite;
+
+   while (len > 0)
+   {
+      nbwrite = write(fd, ptr, len);
+      if (nbwrite < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         return -1;
+      }
+      ptr += nbwrite;
+      len -= nbwrite;
+   }
+   return 0;
+}
+
+// Save devices inventory to cache (write to a temp file then rename, so readers never see a partial file)
+int accelCacheSave(t_accelEngine *accelEngineList[], uint64_t fingerprint, t_acceldev acceldevList[], int nbAcceldev)
+{
+   t_accelCacheHeader header;
+   t_acceldev *engdevList[ACCEL_ENGINE_MAX] = { NULL };
+   t_acceldev acceldev;
+   char tmppath[FS_PATH_MAX + 16];
+   int64_t privIndex;
+   int *nbEngdev;
+   int fd;
+   int iengine;
+   int idev;
+
+   memset(&header, 0, sizeof header);
+   header.magic = ACCEL_CACHE_MAGIC;
+   header.version = ACCEL_CACHE_VERSION;
+   header.devsize = sizeof(t_acceldev);
+   header.nbdev = nbAcceldev;
+   header.fingerprint = fingerprint;
+   for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
+   {
+      if ((accelEngineList[iengine] != NULL) && (accelEngineList[iengine]->accelops->engineDevices != NULL))
+      {
+         accelEngineList[iengine]->accelops->engineDevices(&engdevList[iengine], &nbEngdev);
+         header.nbengdev[iengine] = *nbEngdev;
+      }
+   }
+
+   if ((mkdir(hostPath(HOST_PATH_RUN), 0755) < 0) && (errno != EEXIST))
+   {
+      log_warn("Inventory cache: failed to create %s: %s", hostPath(HOST_PATH_RUN), strerror(errno));
+      return -1;
+   }
+   snprintf(tmppath, sizeof tmppath, "%s.%d", cacheFile(), getpid());
+   fd = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+   if (fd < 0)
+   {
+      log_warn("Inventory cache: failed to create %s: %s", tmppath, strerror(errno));
+      return -1;
+   }
+
+   if (writeAll(fd, &header, sizeof header) < 0)
+      goto fail;
+
+   for (idev = 0; idev < nbAcceldev; idev++)
+   {
+      acceldev = acceldevList[idev];
+      acceldev.privdata = NULL;
+      if (writeAll(fd, &acceldev, sizeof acceldev) < 0)
+         goto fail;
+   }
+   for (idev = 0; idev < nbAcceldev; idev++)
+   {
+      privIndex = -1;
+      iengine = acceldevList[idev].enginetype;
+      if ((acceldevList[idev].privdata != NULL) && (engdevList[iengine] != NULL))
+         privIndex = (t_acceldev *) acceldevList[idev].privdata - engdevList[iengine];
+      if (writeAll(fd, &privIndex, sizeof privIndex) < 0)
+         goto fail;
+   }
+   for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
+   {
+      for (idev = 0; idev < header.nbengdev[iengine]; idev++)
+      {
+         acceldev = engdevList[iengine][idev];
+         acceldev.privdata = NULL;
+         if (writeAll(fd, &acceldev, sizeof acceldev) < 0)
+            goto fail;
+      }
+   }
+
+   if (close(fd) < 0)
+   {
+      fd = -1;
+      goto fail;
+   }
+   if (rename(tmppath, cacheFile()) < 0)
+   {
+      log_warn("Inventory cache: failed to rename %s: %s", tmppath, strerror(errno));
+      unlink(tmppath);
+      return -1;
+   }
+
+   log_debug("Inventory cache: %d device(s) saved to %s", nbAcceldev, cacheFile());
+   return 0;
+
+fail:
+   log_warn("Inventory cache: failed to write %s: %s", tmppath, strerror(errno));
+   if (fd >= 0)
+      close(fd);
+   unlink(tmppath);
+   return -1;
+}
+
+// Drop cache, eg when devices are about to be reconfigured (AWS reload may rescan PCI devices)
+void accelCacheInvalidate()
+{
+   if ((unlink(cacheFile()) < 0) && (errno != ENOENT))
+      log_warn("Inventory cache: failed to remove %s: %s", cacheFile(), strerror(errno));
+}
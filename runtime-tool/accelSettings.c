@@ -1,7 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/syslog.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <json-c/json.h>
 
@@ -9,6 +14,9 @@
 
 #define ACCEL_JSON_GLOBAL         "global"
 #define ACCEL_JSON_LOG_LEVEL          "loglevel"
+#define ACCEL_JSON_LOG_FORMAT         "logformat"
+#define ACCEL_JSON_HUGEPAGE2M_MAX     "hugepage2MMax"
+#define ACCEL_JSON_HUGEPAGE1G_MAX     "hugepage1GMax"
 #define ACCEL_JSON_FUNCTIONS      "accelerationFunctions"
 #define ACCEL_JSON_FUNCTION_NAME      "name"
 #define ACCEL_JSON_FUNCTION_DESC      "description"
@@ -18,6 +26,11 @@
 #define ACCEL_JSON_ENGINE_RECONFIG_PHYSFN "partialConfigPhysfn"
 #define ACCEL_JSON_ENGINE_RECONFIG_VIRTFN "partialConfigVirtfn"
 #define ACCEL_JSON_ENGINE_ACTIVATE_SRIOV  "activateSriov"
+#define ACCEL_JSON_ENGINE_SRIOV_POOL      "sriovPool"
+#define ACCEL_JSON_ENGINE_WARM_FUNCTION   "warmFunction"
+#define ACCEL_JSON_ENGINE_RELEASE_RESET   "resetOnRelease"
+#define ACCEL_JSON_ENGINE_LOAD_TIMEOUT    "loadTimeoutMs"
+#define ACCEL_JSON_ENGINE_LOAD_POLL       "loadPollMs"
 #define ACCEL_JSON_ENGINE_FUNCTIONS       "functions"
 #define ACCEL_JSON_ENGINE_FUNC_NAME       "name"
 #define ACCEL_JSON_ENGINE_FUNC_HWID       "hwID"
@@ -25,8 +38,22 @@
 #define ACCEL_JSON_ENGINE_FUNC_HUGEPAGE1G "hugepage1G"
 #define ACCEL_JSON_ENGINE_FUNC_BS_FILE    "bistreamFile"
 #define ACCEL_JSON_ENGINE_XILINX_SDX_RTE  "xilinxSdxRTE"
+#define ACCEL_JSON_ENGINE_SIM_DEVICES     "simDevices"
+#define ACCEL_JSON_ENGINE_SIM_SLOTS       "simSlots"
+#define ACCEL_JSON_ENGINE_SIM_FAILURE     "simFailureRate"
+#define ACCEL_JSON_ENGINE_SIM_TIMEOUT     "simTimeoutRate"
+#define ACCEL_JSON_ENGINE_SIM_SEED        "simSeed"
+#define ACCEL_JSON_ENGINE_SIM_STATE       "simStateFile"
+#define ACCEL_JSON_ENGINE_FUNC_SIM_LOAD   "simLoadMs"
+#define ACCEL_JSON_LATENCY_DISTRIB            "distribution"
+#define ACCEL_JSON_LATENCY_MEAN               "mean"
+#define ACCEL_JSON_LATENCY_STDDEV             "stddev"
+#define ACCEL_JSON_LATENCY_MIN                "min"
+#define ACCEL_JSON_LATENCY_MAX                "max"
 
 #define ACCEL_ENGINE_XILINX_SDX_RTE_PATH  "/opt/Xilinx/SDx/rte"
+#define ACCEL_ENGINE_SIM_SLOTS_MAX        8   // slots are PCI functions of a simulated device
+#define ACCEL_WARM_MOST_REQUESTED         "most-requested"
 
 #define FUNCTION_NAME_LEN  32
 #define FUNCTION_DESC_LEN 256
@@ -38,6 +65,91 @@ typedef struct {
 static t_accelfunction *accelfuncList = NULL;
 static int accelfuncNb = 0;
 
+static const char * const latencyDistribNames[] = {
+   [LATENCY_FIXED]     = "fixed",
+   [LATENCY_UNIFORM]   = "uniform",
+   [LATENCY_NORMAL]    = "normal",
+   [LATENCY_LOGNORMAL] = "lognormal"
+};
+
+
+//--------------------
+// Compiled config image
+//--------------------
+// Binary form of the JSon config, mmapped read-only by all tool processes:
+//    header | functions | name hash | foreach engine: mounts, functions conf, hwID hash, function index
+// Hash tables are perfect hashes (seed chosen so that no two keys collide), slots hold entry index or -1.
+
+#define ACCEL_IMAGE_MAGIC   0x43434341  // "ACCC"
+#define ACCEL_IMAGE_VERSION 7
+#define ACCEL_IMAGE_ALIGN   8
+#define ACCEL_IMAGE_SEED_MAX 4096
+
+typedef struct {
+   uint32_t offset;  // from image start
+   uint32_t count;
+} t_imageArray;
+
+typedef struct {
+   uint32_t seed;
+   uint32_t size;    // power of 2, 0 if no key
+   uint32_t offset;  // int32_t slots[size]
+} t_imageHash;
+
+typedef struct {
+   char     bistreamPath[FS_PATH_MAX];
+   int32_t  reconfigPhysfn;
+   int32_t  reconfigVirtfn;
+   int32_t  sriovMode;
+   int32_t  sriovPool;
+   int32_t  warmFunction;
+   int32_t  releaseReset;
+   int32_t  loadTimeoutMs;
+   int32_t  loadPollMs;
+   t_simConf sim;
+   t_imageArray mounts;     // t_mountpath
+   t_imageArray funcs;      // t_accelfuncConf
+   t_imageHash  hwidHash;   // hwID -> funcs index
+   t_imageArray funcIndex;  // int32_t: function index -> funcs index or -1
+} t_imageEngine;
+
+typedef struct {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t size;
+   uint32_t nbengines;
+   uint32_t funcsize;       // sizeof(t_accelfuncConf)
+   uint32_t mountsize;      // sizeof(t_mountpath)
+   int64_t  srcMtimeSec;    // JSon config mtime at compilation
+   int64_t  srcMtimeNsec;
+   int32_t  loglevel;       // -1 if not set
+   int32_t  logformat;      // e_logFormat
+   int32_t  hugepageMax[HUGEPAGE_SIZE_MAX];  // NUMA node pools ceilings
+   t_imageArray functions;  // t_accelfunction
+   t_imageHash  nameHash;   // function name -> functions index
+   t_imageEngine engines[ACCEL_ENGINE_MAX];
+} t_imageHeader;
+
+typedef struct {
+   char  *data;
+   size_t len;
+   size_t cap;
+   bool   failed;  // memory allocation failed
+} t_imageBuilder;
+
+static char  *confImage = NULL;
+static size_t confImageSize = 0;
+static bool   confImageMapped = false;
+static int    confLoglevel = -1;
+static e_logFormat confLogformat = LOG_FORMAT_TEXT;
+static int32_t confHugepageMax[HUGEPAGE_SIZE_MAX] = { 0, 0 };
+
+static const char * const logFormatNames[] = {
+   [LOG_FORMAT_TEXT] = "text",
+   [LOG_FORMAT_KV]   = "kv",
+   [LOG_FORMAT_JSON] = "json"
+};
+
 
 static int readConffile(char *filename, char **jsonData)
 {
@@ -69,9 +181,9 @@ static int readConffile(char *filename, char **jsonData)
       return -1;
    }
 
-   // allocate memory
-   *jsonData = (char *)malloc(fileLen);
-   if (! jsonData)
+   // allocate memory (+1 for string terminator expected by json parser)
+   *jsonData = (char *)malloc(fileLen + 1);
+   if (! *jsonData)
    {
       log_error("Memory allocation failed");
       fclose(pFd);
@@ -90,6 +202,10 @@ static int readConffile(char *filename, char **jsonData)
       log_error("Read config file %s: Filesize %d and number of bytes read %d don't match", filename, fileLen, readLen);
       ret = -1;
    }
+   else
+   {
+      (*jsonData)[fileLen] = '\0';
+   }
    fclose(pFd);
 
    if (ret < 0)
@@ -110,10 +226,18 @@ static void dumpEnginesConf(t_accelEngine * accelEngineList[])
    {
       if (accelEngineList[i])
       {
-         log_debug("   Engine %s: installed %d, physfn %d, virtfn %d, sriov %d, path %s", accelEngineList[i]->name,
+         log_debug("   Engine %s: installed %d, physfn %d, virtfn %d, sriov %d (pool %d), load timeout %d ms, path %s", accelEngineList[i]->name,
                accelEngineList[i]->installed, accelEngineList[i]->reconfigPhysfn,
-               accelEngineList[i]->reconfigVirtfn, accelEngineList[i]->sriovMode,
-               accelEngineList[i]->bistreamPath);
+               accelEngineList[i]->reconfigVirtfn, accelEngineList[i]->sriovMode, accelEngineList[i]->sriovPool,
+               accelEngineList[i]->loadTimeoutMs, accelEngineList[i]->bistreamPath);
+         log_debug("     warm function %d, reset on release %d", accelEngineList[i]->warmFunction, accelEngineList[i]->releaseReset);
+
+         if (i == ACCEL_ENGINE_SIM)
+         {
+            log_debug("     devices %d, slots %d, failure rate %g, timeout rate %g, seed %u, state %s",
+                  accelEngineList[i]->sim.nbDevices, accelEngineList[i]->sim.nbSlots, accelEngineList[i]->sim.failureRate,
+                  accelEngineList[i]->sim.timeoutRate, accelEngineList[i]->sim.seed, accelEngineList[i]->sim.stateFile);
+         }
 
          for (j = 0; j < accelEngineList[i]->nbfunc; j++)
          {
@@ -127,7 +251,93 @@ static void dumpEnginesConf(t_accelEngine * accelEngineList[])
    log_debug("END DUMP CONFIG");
 }
 
-int accelSettingsReadConf(char *conffile, t_accelEngine * accelEngineList[])
+// Parse simulated engine devices layout and injected faults
+static int parseSimConf(char *conffile, json_object *jsonEngine, t_simConf *sim, bool strict)
+{
+   json_object *object = NULL;
+
+   memset(sim, 0, sizeof *sim);
+   sim->nbSlots = 1;
+   if (json_object_object_get_ex(jsonEngine, ACCEL_JSON_ENGINE_SIM_DEVICES, &object))
+      sim->nbDevices = json_object_get_int(object);
+   if (json_object_object_get_ex(jsonEngine, ACCEL_JSON_ENGINE_SIM_SLOTS, &object))
+      sim->nbSlots = json_object_get_int(object);
+   if (json_object_object_get_ex(jsonEngine, ACCEL_JSON_ENGINE_SIM_FAILURE, &object))
+      sim->failureRate = json_object_get_double(object);
+   if (json_object_object_get_ex(jsonEngine, ACCEL_JSON_ENGINE_SIM_TIMEOUT, &object))
+      sim->timeoutRate = json_object_get_double(object);
+   if (json_object_object_get_ex(jsonEngine, ACCEL_JSON_ENGINE_SIM_SEED, &object))
+      sim->seed = (uint32_t) json_object_get_int(object);
+   if (json_object_object_get_ex(jsonEngine, ACCEL_JSON_ENGINE_SIM_STATE, &object))
+      strncpy(sim->stateFile, json_object_get_string(object), FS_PATH_MAX-1);
+
+   if ((sim->nbDevices < 0) || (sim->nbSlots < 1) || (sim->nbSlots > ACCEL_ENGINE_SIM_SLOTS_MAX)
+    || (sim->nbDevices * sim->nbSlots > ACCEL_DEVICE_MAX))
+   {
+      log_error("config file %s: simulated engine: %d devices of %d slots not supported (max %d slots, %d accelerators)",
+            conffile, sim->nbDevices, sim->nbSlots, ACCEL_ENGINE_SIM_SLOTS_MAX, ACCEL_DEVICE_MAX);
+      if (strict)
+         return -1;
+      sim->nbDevices = 0;
+   }
+   if ((sim->failureRate < 0) || (sim->timeoutRate < 0) || (sim->failureRate + sim->timeoutRate > 1))
+   {
+      log_error("config file %s: simulated engine: failure and timeout rates must be probabilities", conffile);
+      if (strict)
+         return -1;
+   }
+   return 0;
+}
+
+// Parse simulated load latency distribution of a function
+static int parseLatency(char *conffile, char *funcName, json_object *jsonLatency, t_latencyConf *latency, bool strict)
+{
+   json_object *object = NULL;
+   const char *jsonString;
+   int idistrib;
+
+   memset(latency, 0, sizeof *latency);
+   latency->distrib = LATENCY_FIXED;
+   if (json_object_object_get_ex(jsonLatency, ACCEL_JSON_LATENCY_DISTRIB, &object))
+   {
+      jsonString = json_object_get_string(object);
+      for (idistrib = 0; idistrib < nitems(latencyDistribNames); idistrib++)
+      {
+         if (! strcasecmp(latencyDistribNames[idistrib], jsonString))
+            break;
+      }
+      if (idistrib == nitems(latencyDistribNames))
+      {
+         log_error("config file %s: function %s: unknown latency distribution %s", conffile, funcName, jsonString);
+         if (strict)
+            return -1;
+         idistrib = LATENCY_FIXED;
+      }
+      latency->distrib = idistrib;
+   }
+   if (json_object_object_get_ex(jsonLatency, ACCEL_JSON_LATENCY_MEAN, &object))
+      latency->meanMs = json_object_get_int(object);
+   if (json_object_object_get_ex(jsonLatency, ACCEL_JSON_LATENCY_STDDEV, &object))
+      latency->stddevMs = json_object_get_int(object);
+   latency->minMs = 0;
+   latency->maxMs = INT32_MAX;
+   if (json_object_object_get_ex(jsonLatency, ACCEL_JSON_LATENCY_MIN, &object))
+      latency->minMs = json_object_get_int(object);
+   if (json_object_object_get_ex(jsonLatency, ACCEL_JSON_LATENCY_MAX, &object))
+      latency->maxMs = json_object_get_int(object);
+
+   if ((latency->meanMs < 0) || (latency->stddevMs < 0) || (latency->minMs < 0) || (latency->minMs > latency->maxMs)
+    || ((latency->distrib == LATENCY_UNIFORM) && (latency->maxMs == INT32_MAX)))
+   {
+      log_error("config file %s: function %s: inconsistent load latency", conffile, funcName);
+      if (strict)
+         return -1;
+   }
+   return 0;
+}
+
+// Parse JSon config file. In strict mode (config compilation), any inconsistency is an error.
+static int parseConf(char *conffile, t_accelEngine * accelEngineList[], bool strict)
 {
    char *jsonData;
    const char *jsonString;
@@ -140,18 +350,21 @@ int accelSettingsReadConf(char *conffile, t_accelEngine * accelEngineList[])
    json_object *object        = NULL;
    int nbEngine;
    int ifunc, iengine=0, iconf;
+   int iformat;
    bool bret;
 
    if (readConffile(conffile, & jsonData))
    {
       return -1;
    }
+   confHugepageMax[HUGEPAGE_2M] = 0;
+   confHugepageMax[HUGEPAGE_1G] = 0;
 
    jsonRoot = json_tokener_parse(jsonData);
+   free(jsonData);
    if (jsonRoot == NULL)
    {
       log_error("Json failed to parse config file %s", conffile);
-      free(jsonData);
       return -1;
    }
 
@@ -162,15 +375,53 @@ int accelSettingsReadConf(char *conffile, t_accelEngine * accelEngineList[])
       {
          jsonString = json_object_get_string(object);
          if (! strcmp(jsonString, "error"))
-            logSetLevel(LOG_ERR);
+            confLoglevel = LOG_ERR;
          else if (! strcmp(jsonString, "info"))
-            logSetLevel(LOG_INFO);
+            confLoglevel = LOG_INFO;
          else if (! strcmp(jsonString, "debug"))
-            logSetLevel(LOG_DEBUG);
+            confLoglevel = LOG_DEBUG;
+         else if (strict)
+         {
+            log_fatal("config file %s: log level %s unknown", conffile, jsonString);
+            goto fail;
+         }
          else
             log_warn("log level %s unknown", jsonString);
+         if (confLoglevel >= 0)
+            logSetLevel(confLoglevel);
+      }
+      if (json_object_object_get_ex(jsonGlobal, ACCEL_JSON_LOG_FORMAT, &object))
+      {
+         jsonString = json_object_get_string(object);
+         for (iformat = 0; iformat < (int) nitems(logFormatNames); iformat++)
+         {
+            if (! strcmp(jsonString, logFormatNames[iformat]))
+               break;
+         }
+         if (iformat < (int) nitems(logFormatNames))
+         {
+            confLogformat = iformat;
+            logSetFormat(confLogformat);
+         }
+         else if (strict)
+         {
+            log_fatal("config file %s: log format %s unknown", conffile, jsonString);
+            goto fail;
+         }
+         else
+            log_warn("log format %s unknown", jsonString);
+      }
+      if (json_object_object_get_ex(jsonGlobal, ACCEL_JSON_HUGEPAGE2M_MAX, &object))
+         confHugepageMax[HUGEPAGE_2M] = json_object_get_int(object);
+      if (json_object_object_get_ex(jsonGlobal, ACCEL_JSON_HUGEPAGE1G_MAX, &object))
+         confHugepageMax[HUGEPAGE_1G] = json_object_get_int(object);
+      if ((strict) && ((confHugepageMax[HUGEPAGE_2M] < 0) || (confHugepageMax[HUGEPAGE_1G] < 0)))
+      {
+         log_fatal("config file %s: negative hugepages pool ceiling", conffile);
+         goto fail;
       }
    }
+   hugepageSetMax(confHugepageMax[HUGEPAGE_2M], confHugepageMax[HUGEPAGE_1G]);
 
    // Get list of acceleration functions
    bret = json_object_object_get_ex(jsonRoot, ACCEL_JSON_FUNCTIONS, & jsonFuncList);
@@ -179,16 +430,14 @@ int accelSettingsReadConf(char *conffile, t_accelEngine * accelEngineList[])
    if ((! bret) || (accelfuncNb == 0))
    {
       log_error("config file %s: no acceleration function found", conffile);
-      free(jsonData);
-      return -1;
+      goto fail;
    }
 
    accelfuncList = (t_accelfunction *) calloc(accelfuncNb, sizeof(t_accelfunction));
    if (! accelfuncList)
    {
       log_error("Memory allocation failed");
-      free(jsonData);
-      return -1;
+      goto fail;
    }
    for (ifunc = 0; ifunc < accelfuncNb; ifunc++)
    {
@@ -198,7 +447,18 @@ int accelSettingsReadConf(char *conffile, t_accelEngine * accelEngineList[])
 
       if (json_object_object_get_ex(jsonFunc, ACCEL_JSON_FUNCTION_NAME, &object))
       {
-         strncpy(accelfuncList[ifunc].name, json_object_get_string(object), FUNCTION_NAME_LEN-1);
+         jsonString = json_object_get_string(object);
+         if ((strict) && (accelfuncNameToIndex((char *)jsonString) != ACCELFUNC_UNKNOWN))
+         {
+            log_fatal("config file %s: function %s defined twice", conffile, jsonString);
+            goto fail;
+         }
+         strncpy(accelfuncList[ifunc].name, jsonString, FUNCTION_NAME_LEN-1);
+      }
+      if ((strict) && (strlen(accelfuncList[ifunc].name) == 0))
+      {
+         log_fatal("config file %s: function #%d has no name", conffile, ifunc);
+         goto fail;
       }
       if (json_object_object_get_ex(jsonFunc, ACCEL_JSON_FUNCTION_DESC, &object))
       {
@@ -213,8 +473,7 @@ int accelSettingsReadConf(char *conffile, t_accelEngine * accelEngineList[])
    if ((! bret) || (nbEngine == 0))
    {
       log_error("config file %s: no accelerator engine found", conffile);
-      free(jsonData);
-      return -1;
+      goto fail;
    }
    for (iconf = 0; iconf < nbEngine; iconf++)
    {
@@ -234,10 +493,20 @@ int accelSettingsReadConf(char *conffile, t_accelEngine * accelEngineList[])
          }
          if (iengine == ACCEL_ENGINE_MAX)
          {
+            if (strict)
+            {
+               log_fatal("config file %s: unknown engine %s", conffile, jsonString);
+               goto fail;
+            }
             log_warn("config file %s: unknown engine %s: ignore", conffile, jsonString);
             continue;
          }
       }
+      else
+      {
+         log_warn("config file %s: engine #%d has no name: ignore", conffile, iconf);
+         continue;
+      }
       if (json_object_object_get_ex(jsonEngine, ACCEL_JSON_ENGINE_BS_LOCATION, &object))
       {
          strncpy(accelEngineList[iengine]->bistreamPath, json_object_get_string(object), FS_PATH_MAX-1);
@@ -254,6 +523,33 @@ int accelSettingsReadConf(char *conffile, t_accelEngine * accelEngineList[])
       {
          accelEngineList[iengine]->sriovMode = json_object_get_boolean(object);
       }
+      if (json_object_object_get_ex(jsonEngine, ACCEL_JSON_ENGINE_SRIOV_POOL, &object))
+      {
+         accelEngineList[iengine]->sriovPool = json_object_get_int(object);
+      }
+      if ((strict) && ((accelEngineList[iengine]->sriovPool < 0)
+                    || ((accelEngineList[iengine]->sriovPool > 0) && (! accelEngineList[iengine]->sriovMode))))
+      {
+         log_error("config file %s: engine %s: sriovPool must be positive, with activateSriov", conffile, accelEngineList[iengine]->name);
+         goto fail;
+      }
+      if (json_object_object_get_ex(jsonEngine, ACCEL_JSON_ENGINE_RELEASE_RESET, &object))
+      {
+         accelEngineList[iengine]->releaseReset = json_object_get_boolean(object);
+      }
+      if (json_object_object_get_ex(jsonEngine, ACCEL_JSON_ENGINE_LOAD_TIMEOUT, &object))
+      {
+         accelEngineList[iengine]->loadTimeoutMs = json_object_get_int(object);
+      }
+      if (json_object_object_get_ex(jsonEngine, ACCEL_JSON_ENGINE_LOAD_POLL, &object))
+      {
+         accelEngineList[iengine]->loadPollMs = json_object_get_int(object);
+      }
+      if ((strict) && ((accelEngineList[iengine]->loadTimeoutMs < 0) || (accelEngineList[iengine]->loadPollMs < 0)))
+      {
+         log_error("config file %s: engine %s: negative load timeout or poll interval", conffile, accelEngineList[iengine]->name);
+         goto fail;
+      }
 
       // Xilinx: expect SDx realtime kernel path in config
       if (iengine == ACCEL_ENGINE_XILINX)
@@ -263,8 +559,7 @@ int accelSettingsReadConf(char *conffile, t_accelEngine * accelEngineList[])
          if (! accelEngineList[iengine]->mountlist)
          {
             log_error("Memory allocation failed");
-            free(jsonData);
-            return -1;
+            goto fail;
          }
          if (json_object_object_get_ex(jsonEngine, ACCEL_JSON_ENGINE_XILINX_SDX_RTE, &object))
          {
@@ -276,6 +571,10 @@ int accelSettingsReadConf(char *conffile, t_accelEngine * accelEngineList[])
          accelEngineList[iengine]->mountlist[0].rdonly = true;
       }
 
+      // Simulated engine: devices layout and faults
+      if ((iengine == ACCEL_ENGINE_SIM) && (parseSimConf(conffile, jsonEngine, &accelEngineList[iengine]->sim, strict) < 0))
+         goto fail;
+
       bret = json_object_object_get_ex(jsonEngine, ACCEL_JSON_ENGINE_FUNCTIONS, & jsonFuncList);
       if (bret)
          accelEngineList[iengine]->nbfunc = json_object_array_length(jsonFuncList);
@@ -286,11 +585,10 @@ int accelSettingsReadConf(char *conffile, t_accelEngine * accelEngineList[])
       else
       {
          accelEngineList[iengine]->funclist = (t_accelfuncConf *) calloc(accelEngineList[iengine]->nbfunc, sizeof(t_accelfuncConf));
-         if (! accelfuncList)
+         if (! accelEngineList[iengine]->funclist)
          {
             log_error("Memory allocation failed");
-            free(jsonData);
-            return -1;
+            goto fail;
          }
          for (ifunc = 0; ifunc < accelEngineList[iengine]->nbfunc; ifunc++)
          {
@@ -303,6 +601,11 @@ int accelSettingsReadConf(char *conffile, t_accelEngine * accelEngineList[])
             {
                jsonString = json_object_get_string(object);
                accelEngineList[iengine]->funclist[ifunc].funcID = accelfuncNameToIndex((char *)jsonString);
+               if ((accelEngineList[iengine]->funclist[ifunc].funcID == ACCELFUNC_UNKNOWN) && (strict))
+               {
+                  log_fatal("config file %s: engine %s: unknown function %s", conffile, accelEngineList[iengine]->name, jsonString);
+                  goto fail;
+               }
                if (accelEngineList[iengine]->funclist[ifunc].funcID == ACCELFUNC_UNKNOWN)
                {
                   log_warn("config file %s: engine %s: unknown function %s: ignore", conffile, accelEngineList[iengine]->name, jsonString);
@@ -313,6 +616,12 @@ int accelSettingsReadConf(char *conffile, t_accelEngine * accelEngineList[])
             {
               strncpy(accelEngineList[iengine]->funclist[ifunc].accelID, json_object_get_string(object), FUNCTION_HWID_LEN-1);
             }
+            else if (strict)
+            {
+               log_fatal("config file %s: engine %s: function %s has no %s", conffile, accelEngineList[iengine]->name,
+                     accelfuncIndexToName(accelEngineList[iengine]->funclist[ifunc].funcID), ACCEL_JSON_ENGINE_FUNC_HWID);
+               goto fail;
+            }
             if (json_object_object_get_ex(jsonFunc, ACCEL_JSON_ENGINE_FUNC_HUGEPAGE2M, &object))
             {
                accelEngineList[iengine]->funclist[ifunc].nbHugepage2M = json_object_get_int(object);
@@ -325,20 +634,602 @@ int accelSettingsReadConf(char *conffile, t_accelEngine * accelEngineList[])
             {
               strncpy(accelEngineList[iengine]->funclist[ifunc].bistreamFile, json_object_get_string(object), FILE_NAME_MAX-1);
             }
+            if ((iengine == ACCEL_ENGINE_SIM) && (json_object_object_get_ex(jsonFunc, ACCEL_JSON_ENGINE_FUNC_SIM_LOAD, &object)))
+            {
+               if (parseLatency(conffile, accelfuncIndexToName(accelEngineList[iengine]->funclist[ifunc].funcID), object,
+                        &accelEngineList[iengine]->funclist[ifunc].simLoad, strict) < 0)
+                  goto fail;
+            }
+         }
+      }
+
+      // Warm function, after engine functions: must be one of them
+      if (json_object_object_get_ex(jsonEngine, ACCEL_JSON_ENGINE_WARM_FUNCTION, &object))
+      {
+         jsonString = json_object_get_string(object);
+         if (! strcmp(jsonString, ACCEL_WARM_MOST_REQUESTED))
+            accelEngineList[iengine]->warmFunction = ACCELFUNC_MOST_REQUESTED;
+         else
+         {
+            accelEngineList[iengine]->warmFunction = accelfuncNameToIndex((char *)jsonString);
+            for (ifunc = 0; ifunc < accelEngineList[iengine]->nbfunc; ifunc++)
+            {
+               if (accelEngineList[iengine]->funclist[ifunc].funcID == accelEngineList[iengine]->warmFunction)
+                  break;
+            }
+            if ((accelEngineList[iengine]->warmFunction == ACCELFUNC_UNKNOWN) || (ifunc == accelEngineList[iengine]->nbfunc))
+            {
+               if (strict)
+               {
+                  log_fatal("config file %s: engine %s: warm function %s is not an engine function", conffile, accelEngineList[iengine]->name, jsonString);
+                  goto fail;
+               }
+               log_warn("config file %s: engine %s: unknown warm function %s: ignore", conffile, accelEngineList[iengine]->name, jsonString);
+               accelEngineList[iengine]->warmFunction = ACCELFUNC_UNKNOWN;
+            }
          }
       }
    } // for engine
 
+   json_object_put(jsonRoot);
+   return 0;
+
+fail:
+   json_object_put(jsonRoot);
+   return -1;
+}
+
+
+
+// Case insensitive FNV-1a hash, as names and hwIDs are compared case insensitive
+static uint32_t confHash(uint32_t seed, const char *key)
+{
+   uint32_t hash = 2166136261u ^ seed;
+
+   while (*key)
+   {
+      hash ^= (unsigned char) tolower((unsigned char) *key++);
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+static int32_t *imageHashSlots(t_imageHash *hash)
+{
+   return (int32_t *) (confImage + hash->offset);
+}
+
+// Return index of key in hash table, or -1
+static int imageHashLookup(t_imageHash *hash, const char *key)
+{
+   if ((confImage == NULL) || (hash->size == 0))
+      return -1;
+   return imageHashSlots(hash)[confHash(hash->seed, key) & (hash->size - 1)];
+}
+
+
+// Append data to image being built, return its offset
+static uint32_t imageAppend(t_imageBuilder *builder, const void *data, size_t len)
+{
+   size_t offset = (builder->len + ACCEL_IMAGE_ALIGN - 1) & ~(size_t)(ACCEL_IMAGE_ALIGN - 1);
+   char *newdata;
+
+   if (builder->failed)
+      return 0;
+   if (offset + len > builder->cap)
+   {
+      newdata = realloc(builder->data, (offset + len) * 2);
+      if (newdata == NULL)
+      {
+         builder->failed = true;
+         return 0;
+      }
+      builder->data = newdata;
+      builder->cap = (offset + len) * 2;
+   }
+   memset(builder->data + builder->len, 0, offset - builder->len);
+   if (data != NULL)
+      memcpy(builder->data + offset, data, len);
+   else
+      memset(builder->data + offset, 0, len);
+   builder->len = offset + len;
+   return offset;
+}
+
+// Build perfect hash table of keys (NULL or empty keys are skipped, duplicated keys map to first entry)
+static int imageAppendHash(t_imageBuilder *builder, char *keys[], int nbkeys, t_imageHash *hash)
+{
+   int32_t *slots;
+   uint32_t slot;
+   uint32_t size = 0;
+   uint32_t seed;
+   int ikey, jkey;
+   bool collision;
+
+   memset(hash, 0, sizeof *hash);
+   if (nbkeys == 0)
+      return 0;
+
+   for (size = 2; size < 2 * nbkeys; size *= 2);
+
+   for (;;)
+   {
+      slots = (int32_t *) malloc(size * sizeof(int32_t));
+      if (slots == NULL)
+      {
+         log_error("Memory allocation failed");
+         return -1;
+      }
+
+      for (seed = 0; seed < ACCEL_IMAGE_SEED_MAX; seed++)
+      {
+         memset(slots, 0xFF, size * sizeof(int32_t));
+         collision = false;
+         for (ikey = 0; (ikey < nbkeys) && (! collision); ikey++)
+         {
+            if ((keys[ikey] == NULL) || (keys[ikey][0] == '\0'))
+               continue;
+            for (jkey = 0; jkey < ikey; jkey++)
+            {
+               if ((keys[jkey] != NULL) && (! strcasecmp(keys[jkey], keys[ikey])))
+                  break;
+            }
+            if (jkey < ikey)
+               continue;  // duplicated key
+
+            slot = confHash(seed, keys[ikey]) & (size - 1);
+            if (slots[slot] >= 0)
+               collision = true;
+            else
+               slots[slot] = ikey;
+         }
+         if (! collision)
+            break;
+      }
+      if (seed < ACCEL_IMAGE_SEED_MAX)
+         break;
+
+      // no seed found: retry with a sparser table
+      free(slots);
+      size *= 2;
+   }
+
+   hash->seed = seed;
+   hash->size = size;
+   hash->offset = imageAppend(builder, slots, size * sizeof(int32_t));
+   free(slots);
+   return 0;
+}
+
+// Build config image from parsed config
+static int buildImage(t_accelEngine * accelEngineList[], struct timespec *srcMtime, t_imageBuilder *builder)
+{
+   t_imageHeader header;
+   t_imageEngine *imgEngine;
+   char **keys;
+   int32_t *funcIndex;
+   int iengine, ifunc;
+   int nbkeys;
+   int ret = -1;
+
+   memset(builder, 0, sizeof *builder);
+   memset(&header, 0, sizeof header);
+   header.magic = ACCEL_IMAGE_MAGIC;
+   header.version = ACCEL_IMAGE_VERSION;
+   header.nbengines = ACCEL_ENGINE_MAX;
+   header.funcsize = sizeof(t_accelfuncConf);
+   header.mountsize = sizeof(t_mountpath);
+   header.srcMtimeSec = srcMtime->tv_sec;
+   header.srcMtimeNsec = srcMtime->tv_nsec;
+   header.loglevel = confLoglevel;
+   header.logformat = confLogformat;
+   header.hugepageMax[HUGEPAGE_2M] = confHugepageMax[HUGEPAGE_2M];
+   header.hugepageMax[HUGEPAGE_1G] = confHugepageMax[HUGEPAGE_1G];
+
+   nbkeys = accelfuncNb;
+   for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
+   {
+      if ((accelEngineList[iengine] != NULL) && (accelEngineList[iengine]->nbfunc > nbkeys))
+         nbkeys = accelEngineList[iengine]->nbfunc;
+   }
+   keys = (char **) calloc(nbkeys + 1, sizeof(char *));
+   funcIndex = (int32_t *) malloc((accelfuncNb + 1) * sizeof(int32_t));
+   if ((keys == NULL) || (funcIndex == NULL))
+   {
+      log_error("Memory allocation failed");
+      goto out;
+   }
+
+   imageAppend(builder, &header, sizeof header);
+   header.functions.count = accelfuncNb;
+   header.functions.offset = imageAppend(builder, accelfuncList, accelfuncNb * sizeof(t_accelfunction));
+   for (ifunc = 0; ifunc < accelfuncNb; ifunc++)
+      keys[ifunc] = accelfuncList[ifunc].name;
+   if (imageAppendHash(builder, keys, accelfuncNb, &header.nameHash) < 0)
+      goto out;
+
+   for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
+   {
+      if (accelEngineList[iengine] == NULL)
+         continue;
+      imgEngine = & header.engines[iengine];
+
+      snprintf(imgEngine->bistreamPath, sizeof imgEngine->bistreamPath, "%s", accelEngineList[iengine]->bistreamPath);
+      imgEngine->reconfigPhysfn = accelEngineList[iengine]->reconfigPhysfn;
+      imgEngine->reconfigVirtfn = accelEngineList[iengine]->reconfigVirtfn;
+      imgEngine->sriovMode = accelEngineList[iengine]->sriovMode;
+      imgEngine->sriovPool = accelEngineList[iengine]->sriovPool;
+      imgEngine->warmFunction = accelEngineList[iengine]->warmFunction;
+      imgEngine->releaseReset = accelEngineList[iengine]->releaseReset;
+      imgEngine->loadTimeoutMs = accelEngineList[iengine]->loadTimeoutMs;
+      imgEngine->loadPollMs = accelEngineList[iengine]->loadPollMs;
+      imgEngine->sim = accelEngineList[iengine]->sim;
+
+      imgEngine->mounts.count = accelEngineList[iengine]->nbmount;
+      imgEngine->mounts.offset = imageAppend(builder, accelEngineList[iengine]->mountlist,
+            accelEngineList[iengine]->nbmount * sizeof(t_mountpath));
+      imgEngine->funcs.count = accelEngineList[iengine]->nbfunc;
+      imgEngine->funcs.offset = imageAppend(builder, accelEngineList[iengine]->funclist,
+            accelEngineList[iengine]->nbfunc * sizeof(t_accelfuncConf));
+
+      memset(funcIndex, 0xFF, (accelfuncNb + 1) * sizeof(int32_t));
+      for (ifunc = 0; ifunc < accelEngineList[iengine]->nbfunc; ifunc++)
+      {
+         keys[ifunc] = NULL;
+         if (accelEngineList[iengine]->funclist[ifunc].funcID == ACCELFUNC_UNKNOWN)
+            continue;
+         keys[ifunc] = accelEngineList[iengine]->funclist[ifunc].accelID;
+         if (funcIndex[accelEngineList[iengine]->funclist[ifunc].funcID] < 0)
+            funcIndex[accelEngineList[iengine]->funclist[ifunc].funcID] = ifunc;
+      }
+      if (imageAppendHash(builder, keys, accelEngineList[iengine]->nbfunc, &imgEngine->hwidHash) < 0)
+         goto out;
+      imgEngine->funcIndex.count = accelfuncNb;
+      imgEngine->funcIndex.offset = imageAppend(builder, funcIndex, accelfuncNb * sizeof(int32_t));
+   }
+
+   if (builder->failed)
+   {
+      log_error("Memory allocation failed");
+      goto out;
+   }
+   header.size = builder->len;
+   memcpy(builder->data, &header, sizeof header);
+   ret = 0;
+
+out:
+   if (ret < 0)
+   {
+      free(builder->data);
+      builder->data = NULL;
+   }
+   free(keys);
+   free(funcIndex);
+   return ret;
+}
+
+
+static bool imageArrayValid(t_imageArray *array, size_t elemsize)
+{
+   return ((array->offset <= confImageSize) && (array->count <= (confImageSize - array->offset) / elemsize));
+}
+
+static bool imageHashValid(t_imageHash *hash, uint32_t nbentries)
+{
+   t_imageArray array = { hash->offset, hash->size };
+   int32_t *slots;
+   uint32_t islot;
+
+   if (hash->size == 0)
+      return true;
+   if (((hash->size & (hash->size - 1)) != 0) || (! imageArrayValid(&array, sizeof(int32_t))))
+      return false;
+   slots = imageHashSlots(hash);
+   for (islot = 0; islot < hash->size; islot++)
+   {
+      if ((slots[islot] < -1) || (slots[islot] >= (int32_t) nbentries))
+         return false;
+   }
+   return true;
+}
+
+// Check mapped image consistency, so that lookups never read out of image
+static bool imageValid()
+{
+   t_imageHeader *header = (t_imageHeader *) confImage;
+   t_accelfunction *functions;
+   t_accelfuncConf *funcs;
+   t_mountpath *mounts;
+   int32_t *funcIndex;
+   int iengine;
+   int i;
+
+   if ((confImageSize < sizeof(t_imageHeader))
+    || (header->magic != ACCEL_IMAGE_MAGIC) || (header->version != ACCEL_IMAGE_VERSION)
+    || (header->size != confImageSize) || (header->nbengines != ACCEL_ENGINE_MAX)
+    || (header->funcsize != sizeof(t_accelfuncConf)) || (header->mountsize != sizeof(t_mountpath))
+    || (header->logformat < 0) || (header->logformat >= (int32_t) nitems(logFormatNames))
+    || (header->hugepageMax[HUGEPAGE_2M] < 0) || (header->hugepageMax[HUGEPAGE_1G] < 0))
+      return false;
+
+   if ((! imageArrayValid(&header->functions, sizeof(t_accelfunction)))
+    || (! imageHashValid(&header->nameHash, header->functions.count)))
+      return false;
+   functions = (t_accelfunction *) (confImage + header->functions.offset);
+   for (i = 0; i < header->functions.count; i++)
+   {
+      if ((functions[i].name[FUNCTION_NAME_LEN-1] != '\0') || (functions[i].desc[FUNCTION_DESC_LEN-1] != '\0'))
+         return false;
+   }
+
+   for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
+   {
+      t_imageEngine *imgEngine = & header->engines[iengine];
+
+      if ((imgEngine->bistreamPath[FS_PATH_MAX-1] != '\0') || (imgEngine->sim.stateFile[FS_PATH_MAX-1] != '\0')
+       || (! imageArrayValid(&imgEngine->mounts, sizeof(t_mountpath)))
+       || (! imageArrayValid(&imgEngine->funcs, sizeof(t_accelfuncConf)))
+       || (! imageArrayValid(&imgEngine->funcIndex, sizeof(int32_t)))
+       || ((imgEngine->funcIndex.count != 0) && (imgEngine->funcIndex.count != header->functions.count))
+       || (imgEngine->warmFunction < ACCELFUNC_MOST_REQUESTED) || (imgEngine->warmFunction >= (int32_t) header->functions.count)
+       || (! imageHashValid(&imgEngine->hwidHash, imgEngine->funcs.count)))
+         return false;
+
+      mounts = (t_mountpath *) (confImage + imgEngine->mounts.offset);
+      for (i = 0; i < imgEngine->mounts.count; i++)
+      {
+         if ((mounts[i].src[FS_PATH_MAX-1] != '\0') || (mounts[i].dst[FS_PATH_MAX-1] != '\0'))
+            return false;
+      }
+      funcs = (t_accelfuncConf *) (confImage + imgEngine->funcs.offset);
+      for (i = 0; i < imgEngine->funcs.count; i++)
+      {
+         if ((funcs[i].funcID < ACCELFUNC_UNKNOWN) || (funcs[i].funcID >= (int) header->functions.count)
+          || (funcs[i].accelID[FUNCTION_HWID_LEN-1] != '\0') || (funcs[i].bistreamFile[FILE_NAME_MAX-1] != '\0'))
+            return false;
+      }
+      funcIndex = (int32_t *) (confImage + imgEngine->funcIndex.offset);
+      for (i = 0; i < imgEngine->funcIndex.count; i++)
+      {
+         if ((funcIndex[i] < -1) || (funcIndex[i] >= (int32_t) imgEngine->funcs.count))
+            return false;
+      }
+   }
+   return true;
+}
+
+// Map compiled config image if it has been compiled from current JSon config
+static int mapImage(char *imagefile, struct timespec *srcMtime)
+{
+   t_imageHeader *header;
+   struct stat stats;
+   char *data;
+   int fd;
+
+   fd = open(imagefile, O_RDONLY|O_CLOEXEC);
+   if (fd < 0)
+      return -1;
+   if ((fstat(fd, &stats) < 0) || (stats.st_size < sizeof(t_imageHeader)))
+   {
+      close(fd);
+      return -1;
+   }
+   data = mmap(NULL, stats.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (data == MAP_FAILED)
+   {
+      log_warn("Config image %s: mmap failed: %s", imagefile, strerror(errno));
+      return -1;
+   }
+
+   confImage = data;
+   confImageSize = stats.st_size;
+   confImageMapped = true;
+
+   header = (t_imageHeader *) data;
+   if (! imageValid())
+   {
+      log_warn("Config image %s: invalid format: ignore", imagefile);
+   }
+   else if ((header->srcMtimeSec != srcMtime->tv_sec) || (header->srcMtimeNsec != srcMtime->tv_nsec))
+   {
+      log_info("Config image %s: config file changed since compilation: ignore", imagefile);
+   }
+   else
+   {
+      return 0;
+   }
+
+   munmap(confImage, confImageSize);
+   confImage = NULL;
+   confImageSize = 0;
+   confImageMapped = false;
+   return -1;
+}
+
+// Set functions and engines config from image: lists point directly to image memory
+static void applyImage(t_accelEngine * accelEngineList[])
+{
+   t_imageHeader *header = (t_imageHeader *) confImage;
+   t_imageEngine *imgEngine;
+   int iengine;
+
+   accelfuncList = (t_accelfunction *) (confImage + header->functions.offset);
+   accelfuncNb = header->functions.count;
+
+   confLoglevel = header->loglevel;
+   if (confLoglevel >= 0)
+      logSetLevel(confLoglevel);
+   confLogformat = header->logformat;
+   logSetFormat(confLogformat);
+   confHugepageMax[HUGEPAGE_2M] = header->hugepageMax[HUGEPAGE_2M];
+   confHugepageMax[HUGEPAGE_1G] = header->hugepageMax[HUGEPAGE_1G];
+   hugepageSetMax(confHugepageMax[HUGEPAGE_2M], confHugepageMax[HUGEPAGE_1G]);
+
+   for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
+   {
+      if (accelEngineList[iengine] == NULL)
+         continue;
+      imgEngine = & header->engines[iengine];
+
+      strcpy(accelEngineList[iengine]->bistreamPath, imgEngine->bistreamPath);
+      accelEngineList[iengine]->reconfigPhysfn = imgEngine->reconfigPhysfn;
+      accelEngineList[iengine]->reconfigVirtfn = imgEngine->reconfigVirtfn;
+      accelEngineList[iengine]->sriovMode = imgEngine->sriovMode;
+      accelEngineList[iengine]->sriovPool = imgEngine->sriovPool;
+      accelEngineList[iengine]->warmFunction = imgEngine->warmFunction;
+      accelEngineList[iengine]->releaseReset = imgEngine->releaseReset;
+      accelEngineList[iengine]->loadTimeoutMs = imgEngine->loadTimeoutMs;
+      accelEngineList[iengine]->loadPollMs = imgEngine->loadPollMs;
+      accelEngineList[iengine]->sim = imgEngine->sim;
+      accelEngineList[iengine]->mountlist = (t_mountpath *) (confImage + imgEngine->mounts.offset);
+      accelEngineList[iengine]->nbmount = imgEngine->mounts.count;
+      accelEngineList[iengine]->funclist = (t_accelfuncConf *) (confImage + imgEngine->funcs.offset);
+      accelEngineList[iengine]->nbfunc = imgEngine->funcs.count;
+   }
+}
+
+
+// Read config: from compiled image if up to date, otherwise from JSon config file
+int accelSettingsReadConf(char *conffile, char *imagefile, t_accelEngine * accelEngineList[])
+{
+   t_imageBuilder builder;
+   struct stat stats;
+
+   if (stat(conffile, &stats) < 0)
+   {
+      log_error("Failed to open config file %s: %s", conffile, strerror(errno));
+      return -1;
+   }
+
+   if ((imagefile != NULL) && (mapImage(imagefile, &stats.st_mtim) == 0))
+   {
+      applyImage(accelEngineList);
+      log_debug("Config read from image %s", imagefile);
+   }
+   else
+   {
+      if (parseConf(conffile, accelEngineList, false) < 0)
+         return -1;
+
+      // build image in memory for constant time lookups
+      if (buildImage(accelEngineList, &stats.st_mtim, &builder) < 0)
+         return -1;
+      confImage = builder.data;
+      confImageSize = builder.len;
+   }
+
    dumpEnginesConf(accelEngineList);
+   return 0;
+}
 
-   free(jsonData);
+// Validate JSon config file and write its compiled image
+int accelSettingsCompile(char *conffile, char *imagefile, t_accelEngine * accelEngineList[])
+{
+   t_imageBuilder builder;
+   char tmpfile[FS_PATH_MAX];
+   struct stat stats;
+   size_t written = 0;
+   ssize_t len;
+   int fd;
+
+   if (stat(conffile, &stats) < 0)
+   {
+      log_fatal("Failed to open config file %s: %s", conffile, strerror(errno));
+      return -1;
+   }
+   if (parseConf(conffile, accelEngineList, true) < 0)
+      return -1;
+   if (buildImage(accelEngineList, &stats.st_mtim, &builder) < 0)
+      return -1;
+
+   snprintf(tmpfile, sizeof tmpfile, "%s.%d", imagefile, getpid());
+   fd = open(tmpfile, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+   if (fd < 0)
+   {
+      log_fatal("Failed to create %s: %s", tmpfile, strerror(errno));
+      free(builder.data);
+      return -1;
+   }
+   while (written < builder.len)
+   {
+      len = write(fd, builder.data + written, builder.len - written);
+      if ((len < 0) && (errno == EINTR))
+         continue;
+      if (len < 0)
+         break;
+      written += len;
+   }
+   free(builder.data);
+
+   if ((written != builder.len) || (close(fd) < 0) || (rename(tmpfile, imagefile) < 0))
+   {
+      log_fatal("Failed to write config image %s: %s", imagefile, strerror(errno));
+      unlink(tmpfile);
+      return -1;
+   }
+
+   log_info("Config file %s compiled to %s (%zu bytes)", conffile, imagefile, written);
    return 0;
 }
 
+// Free config resources
+void accelSettingsEnd(t_accelEngine * accelEngineList[])
+{
+   int iengine;
+
+   if (! confImageMapped)
+   {
+      for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
+      {
+         if (accelEngineList[iengine] != NULL)
+         {
+            if (accelEngineList[iengine]->nbfunc > 0)
+               free(accelEngineList[iengine]->funclist);
+            if (accelEngineList[iengine]->nbmount > 0)
+               free(accelEngineList[iengine]->mountlist);
+         }
+      }
+      free(accelfuncList);
+      free(confImage);
+   }
+   else
+   {
+      munmap(confImage, confImageSize);
+   }
+   for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
+   {
+      if (accelEngineList[iengine] != NULL)
+      {
+         accelEngineList[iengine]->funclist = NULL;
+         accelEngineList[iengine]->nbfunc = 0;
+         accelEngineList[iengine]->mountlist = NULL;
+         accelEngineList[iengine]->nbmount = 0;
+         memset(&accelEngineList[iengine]->sim, 0, sizeof(t_simConf));
+      }
+   }
+   accelfuncList = NULL;
+   accelfuncNb = 0;
+   confImage = NULL;
+   confImageSize = 0;
+   confImageMapped = false;
+}
+
 
 int accelfuncNameToIndex(char *funcName)
 {
+   t_imageHeader *header = (t_imageHeader *) confImage;
    int ifunc;
+
+   if (confImage != NULL)
+   {
+      ifunc = imageHashLookup(&header->nameHash, funcName);
+      if ((ifunc >= 0) && (! strcasecmp(accelfuncList[ifunc].name, funcName)))
+         return ifunc;
+      return ACCELFUNC_UNKNOWN;
+   }
+
+   // config being parsed
    for (ifunc = 0; ifunc < accelfuncNb; ifunc++)
    {
       if (! strcasecmp(accelfuncList[ifunc].name, funcName))
@@ -354,3 +1245,35 @@ char *accelfuncIndexToName(int accelfunc)
    else
       return "";
 }
+
+// Return function index based on accelerator engine function hardware ID
+int accelSettingsHwidToIndex(e_accelengine enginetype, char *hwid)
+{
+   t_imageHeader *header = (t_imageHeader *) confImage;
+   t_accelfuncConf *funclist;
+   int ifunc;
+
+   if ((confImage == NULL) || (enginetype >= ACCEL_ENGINE_MAX))
+      return ACCELFUNC_UNKNOWN;
+
+   funclist = (t_accelfuncConf *) (confImage + header->engines[enginetype].funcs.offset);
+   ifunc = imageHashLookup(&header->engines[enginetype].hwidHash, hwid);
+   if ((ifunc >= 0) && (! strcasecmp(funclist[ifunc].accelID, hwid)))
+      return funclist[ifunc].funcID;
+   return ACCELFUNC_UNKNOWN;
+}
+
+// Return index of function config into engine functions list, or -1
+int accelSettingsFuncConfIndex(e_accelengine enginetype, int accelfunc)
+{
+   t_imageHeader *header = (t_imageHeader *) confImage;
+   t_imageEngine *imgEngine;
+
+   if ((confImage == NULL) || (enginetype >= ACCEL_ENGINE_MAX) || (accelfunc < 0))
+      return -1;
+
+   imgEngine = & header->engines[enginetype];
+   if (accelfunc >= imgEngine->funcIndex.count)
+      return -1;
+   return ((int32_t *) (confImage + imgEngine->funcIndex.offset))[accelfunc];
+}
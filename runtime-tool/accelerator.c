@@ -5,13 +5,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <libgen.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "accelerator.h"
 
@@ -20,117 +20,152 @@ static t_accelEngine * accelEngineList[ACCEL_ENGINE_MAX];
 static t_acceldev acceldevList[ACCEL_DEVICE_MAX];
 static int nbAcceldev = 0;
 
-#define CMD_LDCACHE_PRINT "ldconfig -p"
+static char *accelConffile = "";
+static uint64_t inventoryFingerprint = 0;
 
+static t_ldcache ldcache;
+#define LDCACHE_LIBS_MAX 32
 
-// foreach registered accelerator engine, look for its driver libraries
-static int findInstalledEngines()
+
+// Look for engine driver libraries in the dynamic linker cache, on first use only:
+// engines without requested devices never need their libraries.
+// Accelerator engine is installed if all its libraries have been resolved.
+int accelengineResolveLibs(e_accelengine enginetype)
 {
-   char line[1024];
-   char *libpath;
-   char *libname;
-   char *ptr;
-   FILE *pfd;
-   int iengine, ilib;
+   t_accelEngine *engine;
+   char libpath[FS_PATH_MAX];
+   int64_t span;
+   int ilib;
 
-   for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
-   {
-      if ((accelEngineList[iengine] != NULL) && (accelEngineList[iengine]->nblibs > 0))
-      {
-         accelEngineList[iengine]->libspaths = (char **) calloc(accelEngineList[iengine]->nblibs, sizeof(char*));
-      }
-   }
+   if ((enginetype >= ACCEL_ENGINE_MAX) || (accelEngineList[enginetype] == NULL))
+      return -1;
+   engine = accelEngineList[enginetype];
 
-   if (( pfd = popen(CMD_LDCACHE_PRINT, "r")) == NULL)
-   {
-      log_error("popen \"%s\" failed: %s", CMD_LDCACHE_PRINT, strerror(errno));
-      return (-1);
-   }
+   if (engine->installed)
+      return 0;
+   if (engine->libspaths != NULL)
+      return -1;  // already tried
 
-   while (fgets(line, sizeof line, pfd))
+   span = traceBegin();
+   engine->libspaths = (char **) calloc(engine->nblibs + 1, sizeof(char*));
+   if (engine->libspaths == NULL)
    {
-      line[strcspn(line, "\n")] = '\0';
-      libname = line;
-      while (isspace((unsigned char)*libname)) libname++;
-      if ((ptr = strchr(libname, ' ')) != NULL)
-      {
-         *ptr = 0;
-         libpath = strrchr(ptr+1, ' ');
-         if (libpath != NULL)
-         {
-            libpath++;
-            for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
-            {
-               if (accelEngineList[iengine] != NULL)
-               {
-                  for (ilib = 0; ilib < accelEngineList[iengine]->nblibs; ilib++)
-                  {
-                     if ((accelEngineList[iengine]->libspaths[ilib] == NULL)
-                      && (! strcmp(libname, accelEngineList[iengine]->libsnames[ilib])))
-                     {
-                        accelEngineList[iengine]->libspaths[ilib] = strdup(libpath);
-                        log_debug("Lib [%s] found in LD cache: %s", libname, libpath);
-                        //TODO check lib version matches driver version
-                     }
-                  }
-               }
-            }
-         }
-      }
+      log_error("Memory allocation failed");
+      return -1;
    }
-   pclose(pfd);
 
-   // Accelerator engine is installed if all its libraries have been resolved
-   for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
+   if ((engine->nblibs > 0) && (ldcache.data == NULL) && (ldcacheOpen(hostPath(HOST_PATH_LDCACHE), &ldcache) < 0))
+      return -1;
+
+   for (ilib = 0; ilib < engine->nblibs; ilib++)
    {
-      if (accelEngineList[iengine] != NULL)
+      if (ldcacheLookup(&ldcache, engine->libsnames[ilib], libpath, sizeof libpath, NULL) < 0)
       {
-         accelEngineList[iengine]->installed = true;
-         for (ilib = 0; ilib < accelEngineList[iengine]->nblibs; ilib++)
-         {
-            if (accelEngineList[iengine]->libspaths[ilib] == NULL)
-            {
-               accelEngineList[iengine]->installed = false;
-               log_info("Engine %s not installed (library %s missing)",
-                     accelEngineList[iengine]->name, accelEngineList[iengine]->libsnames[ilib]);
-               break;
-            }
-         }
+         log_info("Engine %s not installed (library %s missing)", engine->name, engine->libsnames[ilib]);
+         return -1;
       }
+      engine->libspaths[ilib] = strdup(libpath);
+      log_debug("Lib [%s] found in LD cache: %s", engine->libsnames[ilib], libpath);
+      //TODO check lib version matches driver version
    }
 
+   engine->installed = true;
+   traceEnd(span, "library probe", "%s", engine->name);
    return 0;
 }
 
 
-int acceleratorReadConf(char *conffile)
+static void registerEngines()
 {
    accelEngineList[ACCEL_ENGINE_INTEL] = intelOpaeRegister();
    accelEngineList[ACCEL_ENGINE_XILINX]= xilinxAwsRegister();
+   accelEngineList[ACCEL_ENGINE_SIM]   = simRegister();
+}
+
+int acceleratorReadConf(char *conffile, char *imagefile)
+{
+   int64_t bench = benchStart();
+
+   accelConffile = conffile;
+   registerEngines();
 
-   if (accelSettingsReadConf(conffile, accelEngineList) < 0)
+   if (accelSettingsReadConf(conffile, imagefile, accelEngineList) < 0)
       return (-1);
 
-   return findInstalledEngines();
+   benchStop(BENCH_CONFIG, bench, "%s", conffile);
+   return 0;
 }
 
+// Compile config file to binary image
+int acceleratorCompileConf(char *conffile, char *imagefile)
+{
+   registerEngines();
 
-// Enumerate all accelerators of all installed engines
+   return accelSettingsCompile(conffile, imagefile, accelEngineList);
+}
+
+
+// Enumerate all accelerators of all engines, unless inventory cache is still valid
 int acceleratorEnumerate()
 {
+   uint64_t fingerprint;
+   int64_t bench = benchStart();
    int iengine;
 
+   fingerprint = accelCacheFingerprint(accelEngineList, accelConffile);
+   if (accelCacheLoad(accelEngineList, fingerprint, acceldevList, &nbAcceldev) == 0)
+   {
+      inventoryFingerprint = fingerprint;
+      benchStop(BENCH_ENUMERATE, bench, "inventory cache");
+      return 0;
+   }
+
+   nbAcceldev = 0;
    for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
    {
-      if ((accelEngineList[iengine] != NULL) && (accelEngineList[iengine]->installed))
+      if (accelEngineList[iengine] != NULL)
       {
+         int64_t span = traceBegin();
+
          if (accelEngineList[iengine]->accelops->enumerate(acceldevList, &nbAcceldev) < 0)
          {
             return -1;
          }
+         traceEnd(span, "enumerate engine", "%s", accelEngineList[iengine]->name);
+      }
+   }
+
+   inventoryFingerprint = fingerprint;
+   accelCacheSave(accelEngineList, fingerprint, acceldevList, nbAcceldev);
+   benchStop(BENCH_ENUMERATE, bench, NULL);
+   return 0;
+}
+
+// Refresh inventory of a long running process: enumerate again if devices were added or removed,
+// otherwise only re-read the function loaded into each device
+int acceleratorRefresh()
+{
+   uint64_t fingerprint;
+   int idev;
+
+   fingerprint = accelCacheFingerprint(accelEngineList, accelConffile);
+   if (fingerprint != inventoryFingerprint)
+   {
+      log_info("Devices changed: enumerate again");
+      return acceleratorEnumerate();
+   }
+
+   for (idev = 0; idev < nbAcceldev; idev++)
+   {
+      if (accelEngineList[acceldevList[idev].enginetype]->accelops->refresh(& acceldevList[idev]) < 0)
+      {
+         log_info("Device %s: failed to refresh: enumerate again", acceldevList[idev].bdf.str);
+         accelCacheInvalidate();
+         return acceleratorEnumerate();
       }
    }
 
+   accelCacheSave(accelEngineList, fingerprint, acceldevList, nbAcceldev);
    return 0;
 }
 
@@ -142,12 +177,10 @@ static t_accelfuncConf *acceleratorFuncConf(e_accelengine enginetype, int accelf
 
    if ((enginetype < ACCEL_ENGINE_MAX) && (accelEngineList[enginetype] != NULL))
    {
-      for (ifct = 0; ifct < accelEngineList[enginetype]->nbfunc; ifct++)
+      ifct = accelSettingsFuncConfIndex(enginetype, accelfunc);
+      if ((ifct >= 0) && (ifct < accelEngineList[enginetype]->nbfunc))
       {
-         if (accelEngineList[enginetype]->funclist[ifct].funcID == accelfunc)
-         {
-            return & accelEngineList[enginetype]->funclist[ifct];
-         }
+         return & accelEngineList[enginetype]->funclist[ifct];
       }
    }
    return NULL;
@@ -156,28 +189,38 @@ static t_accelfuncConf *acceleratorFuncConf(e_accelengine enginetype, int accelf
 // Return function index based on accelerator engine function hardware ID
 int acceleratorFuncHwidToIndex(e_accelengine enginetype, char *hwid)
 {
-   int ifct;
-
    if ((enginetype < ACCEL_ENGINE_MAX) && (accelEngineList[enginetype] != NULL))
    {
-      for (ifct = 0; ifct < accelEngineList[enginetype]->nbfunc; ifct++)
-      {
-         if (! strcasecmp(accelEngineList[enginetype]->funclist[ifct].accelID, hwid))
-         {
-            return accelEngineList[enginetype]->funclist[ifct].funcID;
-         }
-      }
+      return accelSettingsHwidToIndex(enginetype, hwid);
    }
    return ACCELFUNC_UNKNOWN;
 }
 
-// Return all available accelerator devices
-int acceleratorAddAlldev(t_acceldev **attachdevList, int *nbAttachdev)
+// Return all available accelerator devices, not leased to another container
+int acceleratorAddAlldev(pid_t pid, t_acceldev **attachdevList, int *nbAttachdev)
 {
+   pid_t holder;
    int idev;
 
    for (idev = 0; idev < nbAcceldev; idev++ )
    {
+      if (accelengineResolveLibs(acceldevList[idev].enginetype) < 0)
+      {
+         log_info("Device %s: engine %s not installed: ignore", acceldevList[idev].bdf.str,
+               accelEngineList[acceldevList[idev].enginetype]->name);
+         continue;
+      }
+      holder = deviceLeaseAcquire(& acceldevList[idev], pid);
+      if (holder < 0)
+      {
+         log_error("Device %s: lease failed", acceldevList[idev].bdf.str);
+         return -1;
+      }
+      if (holder != 0)
+      {
+         log_info("Device %s: in use by container pid %d: ignore", acceldevList[idev].bdf.str, holder);
+         continue;
+      }
       attachdevList[(*nbAttachdev)++] = & acceldevList[idev];
 
       log_info("Device %s: engine %s, devpath %s, syspath %s", acceldevList[idev].bdf.str,
@@ -189,15 +232,220 @@ int acceleratorAddAlldev(t_acceldev **attachdevList, int *nbAttachdev)
    return 0;
 }
 
-// Try to find (bus:dev:fn) or (slot index) in accelerator devices list
-int acceleratorAddDev(char *device, t_acceldev **attachdevList, int *nbAttachdev)
+typedef struct {
+   int idev;
+   int locality;
+   int loadMs;    // recorded reconfiguration time, estimated if never measured
+   bool chosen;
+} t_devCandidate;
+
+// Locality of a device to container CPUs: number of container CPUs on device NUMA node,
+// 0 if device has no NUMA affinity or container CPUs are unknown, -1 if all container CPUs are remote
+static int deviceLocality(t_acceldev *acceldev, cpu_set_t *containerCpus)
+{
+   cpu_set_t cpus;
+
+   if ((containerCpus == NULL) || (acceldev->numaNode < 0) || (nodeCpus(acceldev->numaNode, &cpus) < 0))
+      return 0;
+   CPU_AND(&cpus, &cpus, containerCpus);
+   return (CPU_COUNT(&cpus) > 0) ? CPU_COUNT(&cpus) : -1;
+}
+
+// Most local first, then enumeration order
+static int compareLocality(const void *dev1, const void *dev2)
+{
+   const t_devCandidate *cand1 = dev1;
+   const t_devCandidate *cand2 = dev2;
+
+   if (cand1->locality != cand2->locality)
+      return cand2->locality - cand1->locality;
+   return cand1->idev - cand2->idev;
+}
+
+// Fastest to reconfigure first, then most local
+static int compareReconfig(const void *dev1, const void *dev2)
+{
+   const t_devCandidate *cand1 = dev1;
+   const t_devCandidate *cand2 = dev2;
+
+   if (cand1->loadMs != cand2->loadMs)
+      return cand1->loadMs - cand2->loadMs;
+   return compareLocality(dev1, dev2);
+}
+
+static int compareInt(const void *p1, const void *p2)
+{
+   return *(const int *) p1 - *(const int *) p2;
+}
+
+// Estimate reconfiguration time of candidates never measured (loadMs < 0), so that they are neither
+// favoured nor last: median time measured on devices of the same engine, else half the engine load timeout
+static void estimateLoadMs(t_devCandidate candidates[], int nbCandidates)
+{
+   int measured[ACCEL_DEVICE_MAX];
+   int estimate[ACCEL_ENGINE_MAX];
+   int nbMeasured;
+   int icand, iengine;
+
+   for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
+   {
+      nbMeasured = 0;
+      for (icand = 0; icand < nbCandidates; icand++)
+      {
+         if ((candidates[icand].loadMs >= 0) && (acceldevList[candidates[icand].idev].enginetype == (e_accelengine) iengine))
+            measured[nbMeasured++] = candidates[icand].loadMs;
+      }
+      if (nbMeasured > 0)
+      {
+         qsort(measured, nbMeasured, sizeof(int), compareInt);
+         estimate[iengine] = measured[nbMeasured / 2];
+      }
+      else
+         estimate[iengine] = (accelEngineList[iengine] != NULL) ? accelEngineList[iengine]->loadTimeoutMs / 2 : 0;
+   }
+   for (icand = 0; icand < nbCandidates; icand++)
+   {
+      if (candidates[icand].loadMs < 0)
+         candidates[icand].loadMs = estimate[acceldevList[candidates[icand].idev].enginetype];
+   }
+}
+
+// Lease candidate device to container pid, candidate no more considered whether leased or not
+static t_acceldev *chooseCandidate(t_devCandidate *candidate, pid_t pid)
+{
+   pid_t holder;
+
+   candidate->chosen = true;
+   holder = deviceLeaseAcquire(& acceldevList[candidate->idev], pid);
+   if (holder < 0)
+   {
+      log_error("Device %s: lease failed", acceldevList[candidate->idev].bdf.str);
+      return NULL;
+   }
+   if (holder != 0)
+   {
+      log_debug("Device %s: in use by container pid %d: ignore", acceldevList[candidate->idev].bdf.str, holder);
+      return NULL;
+   }
+   return & acceldevList[candidate->idev];
+}
+
+// Add count free devices, not already attached, local to the CPUs the container pid may run on, and lease them.
+// Devices without NUMA affinity fit any container, devices remote to all its CPUs are never chosen.
+// With accelfuncList (function of each added device, ACCELFUNC_UNKNOWN for any), devices already
+// loaded with their function are chosen first, then reconfigurable devices, fastest to reconfigure first.
+int acceleratorAddAnydev(pid_t pid, int count, int *accelfuncList, t_acceldev **attachdevList, int *nbAttachdev)
+{
+   t_devCandidate candidates[ACCEL_DEVICE_MAX];
+   t_acceldev *chosenList[ACCEL_DEVICE_MAX];
+   t_acceldev *acceldev;
+   cpu_set_t containerCpus;
+   bool cpusKnown;
+   int nbCandidates = 0;
+   int nbChosen = 0;
+   int idev, iattach, icand, accelfunc;
+
+   if (*nbAttachdev + count > ACCEL_DEVICE_MAX)
+   {
+      log_error("any:%d: more than %d devices requested", count, ACCEL_DEVICE_MAX);
+      return -1;
+   }
+   cpusKnown = (processCpus(pid, &containerCpus) == 0);
+   if (! cpusKnown)
+      log_warn("Container pid %d: CPUs unknown, devices locality ignored", pid);
+
+   for (idev = 0; idev < nbAcceldev; idev++)
+   {
+      for (iattach = 0; (iattach < *nbAttachdev) && (attachdevList[iattach] != & acceldevList[idev]); iattach++);
+      if ((iattach < *nbAttachdev) || (accelengineResolveLibs(acceldevList[idev].enginetype) < 0))
+         continue;
+
+      candidates[nbCandidates].idev = idev;
+      candidates[nbCandidates].locality = deviceLocality(& acceldevList[idev], cpusKnown ? & containerCpus : NULL);
+      if (candidates[nbCandidates].locality < 0)
+      {
+         log_debug("Device %s: NUMA node %d remote to container CPUs: ignore", acceldevList[idev].bdf.str,
+               acceldevList[idev].numaNode);
+         continue;
+      }
+      candidates[nbCandidates].loadMs = reconfigTimeGet(& acceldevList[idev]);
+      candidates[nbCandidates].chosen = false;
+      nbCandidates++;
+   }
+   if (nbCandidates < count)
+   {
+      log_error("any:%d: only %d device(s) available local to container pid %d CPUs", count, nbCandidates, pid);
+      return -1;
+   }
+
+   // First devices already loaded with requested function: no reconfiguration
+   qsort(candidates, nbCandidates, sizeof(t_devCandidate), compareLocality);
+   for (idev = 0; idev < count; idev++)
+   {
+      accelfunc = (accelfuncList != NULL) ? accelfuncList[idev] : ACCELFUNC_UNKNOWN;
+      chosenList[idev] = NULL;
+      for (icand = 0; (icand < nbCandidates) && (chosenList[idev] == NULL); icand++)
+      {
+         acceldev = & acceldevList[candidates[icand].idev];
+         if ((! candidates[icand].chosen) && ((accelfunc == ACCELFUNC_UNKNOWN) || (acceldev->accelfunc == accelfunc)))
+            chosenList[idev] = chooseCandidate(& candidates[icand], pid);
+      }
+      if (chosenList[idev] != NULL)
+         nbChosen++;
+   }
+
+   // Then devices to reconfigure, cheapest first
+   estimateLoadMs(candidates, nbCandidates);
+   qsort(candidates, nbCandidates, sizeof(t_devCandidate), compareReconfig);
+   for (idev = 0; (idev < count) && (nbChosen < count); idev++)
+   {
+      if (chosenList[idev] != NULL)
+         continue;
+      accelfunc = (accelfuncList != NULL) ? accelfuncList[idev] : ACCELFUNC_UNKNOWN;
+      for (icand = 0; (icand < nbCandidates) && (chosenList[idev] == NULL); icand++)
+      {
+         acceldev = & acceldevList[candidates[icand].idev];
+         if ((! candidates[icand].chosen)
+           && ( (accelfunc == ACCELFUNC_UNKNOWN)
+             || ( (acceleratorReconfigSupport(acceldev, acceldev->pcifnType))
+               && (acceleratorFuncConf(acceldev->enginetype, accelfunc) != NULL))))
+            chosenList[idev] = chooseCandidate(& candidates[icand], pid);
+      }
+      if (chosenList[idev] == NULL)
+      {
+         log_error("any:%d: no free device with function %s or reconfigurable to it", count, accelfuncIndexToName(accelfunc));
+         for (icand = 0; icand < count; icand++)
+         {
+            if (chosenList[icand] != NULL)
+               deviceLeaseRelease(chosenList[icand], pid);
+         }
+         return -1;
+      }
+      nbChosen++;
+   }
+
+   for (idev = 0; idev < count; idev++)
+   {
+      acceldev = chosenList[idev];
+      attachdevList[(*nbAttachdev)++] = acceldev;
+
+      log_info("Device %s: engine %s, NUMA node %d, function %s, devpath %s, syspath %s", acceldev->bdf.str,
+            accelEngineList[acceldev->enginetype]->name, acceldev->numaNode, accelfuncIndexToName(acceldev->accelfunc),
+            acceldev->devpath[0], acceldev->syspathAccel);
+   }
+   return 0;
+}
+
+// Try to find (bus:dev:fn) or (slot index) in accelerator devices list, and lease it to container pid
+int acceleratorAddDev(pid_t pid, char *device, t_acceldev **attachdevList, int *nbAttachdev)
 {
+   pid_t holder;
    int bus, dev, fn;
    int idev, slotid;
    char *ptr;
    bool found = false;
 
-   if (sscanf(device, "%d:%d.%d", &bus, &dev, &fn) == 3)
+   if (sscanf(device, "%x:%x.%x", &bus, &dev, &fn) == 3)
    {
       for (idev = 0; idev < nbAcceldev; idev++ )
       {
@@ -224,8 +472,26 @@ int acceleratorAddDev(char *device, t_acceldev **attachdevList, int *nbAttachdev
       }
    }
 
+   if ((found) && (accelengineResolveLibs(acceldevList[idev].enginetype) < 0))
+   {
+      log_error("Device %s: engine %s not installed", acceldevList[idev].bdf.str,
+            accelEngineList[acceldevList[idev].enginetype]->name);
+      return -1;
+   }
+
    if (found)
    {
+      holder = deviceLeaseAcquire(& acceldevList[idev], pid);
+      if (holder < 0)
+      {
+         log_error("Device %s: lease failed", acceldevList[idev].bdf.str);
+         return -1;
+      }
+      if (holder != 0)
+      {
+         log_error("Device %s: in use by container pid %d", acceldevList[idev].bdf.str, holder);
+         return -1;
+      }
       attachdevList[(*nbAttachdev)++] = & acceldevList[idev];
 
       log_info("Device %s: engine %s, devpath %s, syspath %s", acceldevList[idev].bdf.str,
@@ -252,21 +518,343 @@ bool acceleratorReconfigSupport(t_acceldev *acceldev, e_pciFunction pcifnType)
    return false;
 }
 
-// Load a new bitstream to an accelerator
-int acceleratorLoadBitstream(t_acceldev *acceldev, int accelfunc)
+// Check if the nodes of the device major are fixed: no device may get a new minor of it later
+bool acceleratorDevnodesFixed(t_acceldev *acceldev)
+{
+   t_accelEngine *engine = accelEngineList[acceldev->enginetype];
+
+   // new virtual functions get new port nodes
+   if ((engine->sriovMode) || (engine->sriovPool > 0))
+      return false;
+   // application PFs rescanned after an image load get their nodes again
+   if (acceldev->enginetype == ACCEL_ENGINE_XILINX)
+      return false;
+   return true;
+}
+
+// Load a new bitstream to an accelerator, after loads of other processes to its reconfiguration domain.
+// A load of the same function by another process is joined rather than done again.
+int acceleratorLoadBitstream(t_acceldev *acceldev, int accelfunc, e_loadPriority priority)
 {
    t_accelfuncConf *accelfuncConf;
+   t_accelOps *accelops;
+   uint32_t ticket;
+   int64_t start;
+   int queued;
+   int ret;
 
    accelfuncConf = acceleratorFuncConf(acceldev->enginetype, accelfunc);
-   if (accelfuncConf != NULL)
-   {
-      return accelEngineList[acceldev->enginetype]->accelops->loadBitstream(acceldev, accelfuncConf);
-   }
-   else
+   if (accelfuncConf == NULL)
    {
       log_error("Device %s: function %s not supported", acceldev->bdf.str, accelfuncIndexToName(accelfunc));
       return -1;
    }
+   accelops = accelEngineList[acceldev->enginetype]->accelops;
+
+   // device state (and for AWS, PCI ids and device nodes) may change: force next enumeration
+   accelCacheInvalidate();
+
+   do
+   {
+      queued = loadQueueEnter(acceldev, accelfunc, priority, &ticket);
+      if ((queued < 0) && (priority == LOAD_PRIORITY_BACKGROUND))
+      {
+         log_info("Device %s: loads pending, background load of function %s dropped", acceldev->bdf.str,
+               accelfuncIndexToName(accelfunc));
+         return -1;
+      }
+      if (queued < 0)
+      {
+         log_error("Device %s: load of function %s lost its turn", acceldev->bdf.str, accelfuncIndexToName(accelfunc));
+         return -1;
+      }
+      // a load ahead of ours may have loaded function
+      if ((accelops->refresh(acceldev) == 0) && (acceldev->accelfunc == accelfunc))
+      {
+         if (queued == 0)
+            loadQueueLeave(acceldev, accelfunc, ticket, 0);
+         log_info("Device %s: function %s loaded by another request", acceldev->bdf.str, accelfuncIndexToName(accelfunc));
+         return 0;
+      }
+   } while (queued != 0);
+
+   start = traceNow();
+   ret = accelops->loadBitstream(acceldev, accelfuncConf);
+   traceEnd(start, "load bitstream", "%s %s", acceldev->bdf.str, accelfuncIndexToName(accelfunc));
+   loadQueueLeave(acceldev, accelfunc, ticket, ret);
+   if (ret == 0)
+      reconfigTimeRecord(acceldev, (traceNow() - start) / 1000000);
+   return ret;
+}
+
+#define LOAD_WORKERS_MAX 8
+
+// Devices sharing a reconfiguration engine (Intel FME, AWS management PF), loaded one after another
+typedef struct {
+   int devIndex[ACCEL_DEVICE_MAX];
+   int nbdev;
+} t_loadGroup;
+
+typedef struct {
+   t_acceldev **acceldevList;
+   int *accelfuncList;
+   int *statusList;
+   t_loadGroup *groupList;
+   int nbgroup;
+   int nextgroup;
+   pthread_mutex_t lock;
+} t_loadPool;
+
+static bool sameReconfigDomain(t_acceldev *acceldev1, t_acceldev *acceldev2)
+{
+   if (acceldev1 == acceldev2)
+      return true;
+   if (acceldev1->enginetype != acceldev2->enginetype)
+      return false;
+   if ((acceldev1->privdata != NULL) && (acceldev1->privdata == acceldev2->privdata))
+      return true;
+   return ((acceldev1->syspathEngine[0] != '\0') && (! strcmp(acceldev1->syspathEngine, acceldev2->syspathEngine)));
+}
+
+static void *loadWorker(void *arg)
+{
+   t_loadPool *pool = arg;
+   t_loadGroup *group;
+   int igroup;
+   int i, idev;
+
+   for (;;)
+   {
+      pthread_mutex_lock(&pool->lock);
+      igroup = pool->nextgroup++;
+      pthread_mutex_unlock(&pool->lock);
+      if (igroup >= pool->nbgroup)
+         break;
+
+      group = &pool->groupList[igroup];
+      for (i = 0; i < group->nbdev; i++)
+      {
+         idev = group->devIndex[i];
+         pool->statusList[idev] = acceleratorLoadBitstream(pool->acceldevList[idev], pool->accelfuncList[idev], LOAD_PRIORITY_NORMAL);
+      }
+   }
+   return NULL;
+}
+
+// Load function bitstreams to several devices concurrently, devices of a same reconfiguration domain in sequence.
+// Each device load result is returned into statusList. Return -1 if any load failed.
+int acceleratorLoadBitstreams(t_acceldev **acceldevList, int *accelfuncList, int *statusList, int nbAcceldev)
+{
+   static t_loadGroup groupList[ACCEL_DEVICE_MAX];
+   pthread_t workers[LOAD_WORKERS_MAX];
+   t_loadPool pool;
+   int nbworker = 0;
+   int igroup, idev, iworker;
+   int err;
+   int ret = 0;
+
+   memset(&pool, 0, sizeof pool);
+   pool.acceldevList = acceldevList;
+   pool.accelfuncList = accelfuncList;
+   pool.statusList = statusList;
+   pool.groupList = groupList;
+   pthread_mutex_init(&pool.lock, NULL);
+
+   for (idev = 0; idev < nbAcceldev; idev++)
+   {
+      statusList[idev] = -1;
+      for (igroup = 0; igroup < pool.nbgroup; igroup++)
+      {
+         if (sameReconfigDomain(acceldevList[groupList[igroup].devIndex[0]], acceldevList[idev]))
+            break;
+      }
+      if (igroup == pool.nbgroup)
+         groupList[pool.nbgroup++].nbdev = 0;
+      groupList[igroup].devIndex[groupList[igroup].nbdev++] = idev;
+   }
+
+   // first group is loaded by current thread
+   for (iworker = 0; (iworker < LOAD_WORKERS_MAX) && (iworker < pool.nbgroup - 1); iworker++)
+   {
+      if ((err = pthread_create(&workers[iworker], NULL, loadWorker, &pool)) != 0)
+      {
+         log_warn("Failed to start bitstream load worker: %s", strerror(err));
+         break;
+      }
+      nbworker++;
+   }
+   if (pool.nbgroup > 1)
+      log_debug("Load %d device(s) bitstreams with %d worker(s)", nbAcceldev, nbworker + 1);
+
+   loadWorker(&pool);
+   for (iworker = 0; iworker < nbworker; iworker++)
+      pthread_join(workers[iworker], NULL);
+   pthread_mutex_destroy(&pool.lock);
+
+   for (idev = 0; idev < nbAcceldev; idev++)
+   {
+      if (statusList[idev] < 0)
+         ret = -1;
+   }
+   return ret;
+}
+
+// Virtual functions missing to engine pool: free ones are those not leased
+static int sriovMissing(e_accelengine enginetype)
+{
+   t_accelEngine *engine = accelEngineList[enginetype];
+   int nbfree = 0;
+   int idev;
+
+   if ((engine == NULL) || (! engine->sriovMode) || (engine->sriovPool <= 0) || (engine->accelops->sriovEnable == NULL))
+      return 0;
+   for (idev = 0; idev < nbAcceldev; idev++)
+   {
+      if ( (acceldevList[idev].enginetype == enginetype) && (acceldevList[idev].pcifnType == PCIFUNC_VIRTUAL)
+        && (deviceLeaseHolder(& acceldevList[idev]) == 0))
+         nbfree++;
+   }
+   return (nbfree < engine->sriovPool) ? engine->sriovPool - nbfree : 0;
+}
+
+// Virtual functions missing to all engines pools
+int acceleratorSriovMissing()
+{
+   int iengine;
+   int missing = 0;
+
+   for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
+      missing += sriovMissing(iengine);
+   return missing;
+}
+
+// Refill virtual functions pools: move ports of free physical devices to new virtual functions.
+// Devices are leased while switched, so that no container gets a port being moved.
+int acceleratorSriovRefill()
+{
+   t_acceldev *portList[ACCEL_DEVICE_MAX];
+   bool visited[ACCEL_DEVICE_MAX] = { false };
+   int64_t span = traceBegin();
+   bool changed = false;
+   bool busy;
+   int iengine, idev, jdev, iport, nbport, nbphysport;
+   int missing;
+   int ret = 0;
+
+   for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
+   {
+      missing = sriovMissing(iengine);
+      for (idev = 0; (idev < nbAcceldev) && (missing > 0); idev++)
+      {
+         if ( (visited[idev]) || (acceldevList[idev].enginetype != (e_accelengine) iengine)
+           || (acceldevList[idev].pcifnType != PCIFUNC_PHYSICAL))
+            continue;
+
+         // all ports of a device move together; virtual functions are created again with its ports
+         // already on virtual functions, so these are leased as well
+         nbport = 0;
+         nbphysport = 0;
+         for (jdev = 0; jdev < nbAcceldev; jdev++)
+         {
+            if (sameReconfigDomain(& acceldevList[idev], & acceldevList[jdev]))
+            {
+               visited[jdev] = true;
+               portList[nbport++] = & acceldevList[jdev];
+               if (acceldevList[jdev].pcifnType == PCIFUNC_PHYSICAL)
+                  nbphysport++;
+            }
+         }
+         busy = false;
+         for (iport = 0; iport < nbport; iport++)
+            busy |= (deviceLeaseAcquire(portList[iport], getpid()) != 0);
+
+         if (busy)
+            log_debug("Device %s: in use: not moved to virtual functions", acceldevList[idev].bdf.str);
+         else if (accelEngineList[iengine]->accelops->sriovEnable(portList, nbport) < 0)
+         {
+            changed = true;   // virtual functions may have been removed
+            ret = -1;
+         }
+         else
+         {
+            missing -= nbphysport;
+            changed = true;
+         }
+         for (iport = 0; iport < nbport; iport++)
+            deviceLeaseRelease(portList[iport], getpid());
+      }
+      if (missing > 0)
+         log_warn("Engine %s: %d virtual function(s) missing to pool of %d, no free physical device left",
+               accelEngineList[iengine]->name, missing, accelEngineList[iengine]->sriovPool);
+   }
+
+   if (changed)
+   {
+      // new virtual functions ports are new devices
+      accelCacheInvalidate();
+      if (acceleratorEnumerate() < 0)
+         ret = -1;
+   }
+   traceEnd(span, "sriov refill", NULL);
+   return ret;
+}
+
+// Release devices leased to stopped container pid (to any stopped container if pid is 0):
+// free their lease, then clear the state the container left.
+int acceleratorReleaseDevices(pid_t pid, t_acceldev **releaseList, int *nbRelease)
+{
+   t_accelEngine *engine;
+   int64_t span;
+   int idev;
+   int ret = 0;
+
+   for (idev = 0; idev < nbAcceldev; idev++)
+   {
+      if (! deviceLeaseReclaim(& acceldevList[idev], pid))
+         continue;
+      releaseList[(*nbRelease)++] = & acceldevList[idev];
+
+      engine = accelEngineList[acceldevList[idev].enginetype];
+      if (engine->accelops->release != NULL)
+      {
+         span = traceBegin();
+         if (engine->accelops->release(& acceldevList[idev], engine->releaseReset) < 0)
+            ret = -1;
+         traceEnd(span, "device release", "%s", acceldevList[idev].bdf.str);
+      }
+      log_info("Device %s: released", acceldevList[idev].bdf.str);
+   }
+   return ret;
+}
+
+// Function to load into a released device for next containers, ACCELFUNC_UNKNOWN if none
+int acceleratorWarmFunction(t_acceldev *acceldev)
+{
+   t_accelEngine *engine = accelEngineList[acceldev->enginetype];
+   uint64_t count, maxcount = 0;
+   int accelfunc = ACCELFUNC_UNKNOWN;
+   size_t ifunc;
+
+   if (engine->warmFunction != ACCELFUNC_MOST_REQUESTED)
+      return engine->warmFunction;
+
+   for (ifunc = 0; ifunc < engine->nbfunc; ifunc++)
+   {
+      count = functionRequestCount(engine->funclist[ifunc].funcID);
+      if (count > maxcount)
+      {
+         maxcount = count;
+         accelfunc = engine->funclist[ifunc].funcID;
+      }
+   }
+   return accelfunc;
+}
+
+// Load warm function into a released device, unless a container got it meanwhile.
+// Device is not leased: a container leasing it during the load queues behind it (see loadQueueBusy).
+int acceleratorWarmLoad(t_acceldev *acceldev, int accelfunc)
+{
+   return acceleratorLoadBitstream(acceldev, accelfunc, LOAD_PRIORITY_BACKGROUND);
 }
 
 // Get number of hugepages 2MB required by the current accelerator function
@@ -296,8 +884,9 @@ int acceleratorHugepage1G(t_acceldev *acceldev)
 // Set user read/write access to some host sysfs device entries
 int accelengineHostDeviceSetup(e_accelengine enginetype, t_acceldev *acceldev)
 {
-   char  syspath[FS_PATH_MAX];
+   char  syspath[2*FS_PATH_MAX];
    char *syspathdev;
+   int64_t span;
    int ientry;
    int i;
 
@@ -316,98 +905,106 @@ int accelengineHostDeviceSetup(e_accelengine enginetype, t_acceldev *acceldev)
 
       for (ientry = 0; ientry < accelEngineList[enginetype]->nbsysentries ; ientry++)
       {
-         snprintf(syspath, FS_PATH_MAX, "%s/%s", syspathdev, accelEngineList[enginetype]->sysentriesRW[ientry]);
+         snprintf(syspath, sizeof syspath, "%s/%s", syspathdev, accelEngineList[enginetype]->sysentriesRW[ientry]);
+         span = traceBegin();
          if (chmod(syspath, 0666) < 0)
          {
             log_error("Device %s: failed to chmod %s: %s", acceldev->bdf.str, syspath, strerror(errno));
             return -1;
          }
+         traceEnd(span, "chmod", "%s", syspath);
          log_debug("Device %s: chmod %s done", acceldev->bdf.str, syspath);
       }
    }
    return 0;
 }
 
-// Attach engine mount paths to container
-int accelengineMountPaths(char *rootfs, e_accelengine enginetype)
+// Add engine bundle to container mount plan: one read-only tree with driver libraries and mount paths,
+// mount paths destinations link to their bundle entry, and an ld.so.conf.d entry to its libraries directory
+// keeps them in the cache when ldconfig runs in the container
+int accelengineAttachBundle(t_mountPlan *plan, e_accelengine enginetype)
 {
+   t_accelEngine *engine;
+   char bundlepath[FS_PATH_MAX];
+   char mountpath[FS_PATH_MAX];
+   char linkpath[2*FS_PATH_MAX];
+   char confpath[2*FS_PATH_MAX];
    int imount;
 
    if ((enginetype >= ACCEL_ENGINE_MAX) || (accelEngineList[enginetype] == NULL))
       return -1;
+   engine = accelEngineList[enginetype];
+   if ((engine->nblibs == 0) && (engine->nbmount == 0))
+      return 0;
+
+   if (accelBundleStage(engine, bundlepath, sizeof bundlepath) < 0)
+      return -1;
 
-   for (imount = 0; imount < accelEngineList[enginetype]->nbmount; imount ++)
+   snprintf(mountpath, sizeof mountpath, "%s/%s", ACCEL_BUNDLE_MOUNT, engine->name);
+   if (mountPlanAddTree(plan, bundlepath, mountpath, true) < 0)
+      return -1;
+   for (imount = 0; imount < engine->nbmount; imount ++)
    {
-      if (mountFile(rootfs, accelEngineList[enginetype]->mountlist[imount].src,
-            accelEngineList[enginetype]->mountlist[imount].dst, false,
-            accelEngineList[enginetype]->mountlist[imount].rdonly, false) < 0)
-      {
-         log_error("Mount path %s: failed to mount: %s", accelEngineList[enginetype]->mountlist[imount].src, strerror(errno));
+      snprintf(linkpath, sizeof linkpath, "%s/mnt/%d", mountpath, imount);
+      if (mountPlanAddLink(plan, engine->mountlist[imount].dst, linkpath) < 0)
+         return -1;
+   }
+   if (engine->nblibs > 0)
+   {
+      snprintf(linkpath, sizeof linkpath, "%s/accelerator-%s.conf", LDCONF_DIR_PATH, engine->name);
+      snprintf(confpath, sizeof confpath, "%s/ld.so.conf", mountpath);
+      if (mountPlanAddLink(plan, linkpath, confpath) < 0)
          return -1;
-      }
    }
-   if (accelEngineList[enginetype]->nbmount > 0)
-      log_info("Engine %s: mount paths attached to container", accelEngineList[enginetype]->name);
 
    return 0;
 }
 
-// Attach engine driver libraries to container
-int accelengineAttachLibs(char *rootfs, e_accelengine enginetype)
-{
-   char srcpath[FS_PATH_MAX];
-   char lnkpath[FS_PATH_MAX];
-   char dstpath[2*FS_PATH_MAX];
-   struct stat stats;
-   int ilib;
 
-   if ((enginetype >= ACCEL_ENGINE_MAX) || (accelEngineList[enginetype] == NULL))
-      return -1;
+// Add attached engines driver libraries to container dynamic linker cache.
+// Libraries are in engines bundles, under the ld cache name of the host.
+int accelengineUpdateLdcache(char *rootfs, bool attachEngine[])
+{
+   t_ldcacheLib libs[LDCACHE_LIBS_MAX];
+   char bundlelibs[LDCACHE_LIBS_MAX][FS_PATH_MAX];
+   char libdirs[ACCEL_ENGINE_MAX * FS_PATH_MAX] = "";
+   char libpath[FS_PATH_MAX];
+   int nblibs = 0;
+   int iengine, ilib;
 
-   for (ilib = 0; ilib < accelEngineList[enginetype]->nblibs; ilib++)
+   for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
    {
-      if (accelEngineList[enginetype]->libspaths[ilib] != NULL)
-      {
-         // follow symlink
-         strncpy(srcpath, accelEngineList[enginetype]->libspaths[ilib], FS_PATH_MAX);
-         while ((lstat(srcpath, &stats) == 0) && (S_ISLNK(stats.st_mode)))
-         {
-            memset(lnkpath, 0, FS_PATH_MAX);
-            if (readlink(srcpath, lnkpath, FS_PATH_MAX) < 0)
-            {
-               log_error("Library %s: failed to read symlink: %s", srcpath, strerror(errno));
-               return -1;
-            }
-            dirname(srcpath);
-            strcat(srcpath, "/");
-            strncat(srcpath, basename(lnkpath), FS_PATH_MAX-strlen(srcpath));
-         }
+      if ((! attachEngine[iengine]) || (accelEngineList[iengine] == NULL) || (! accelEngineList[iengine]->installed))
+         continue;
 
-         if (mountFile(rootfs, srcpath, NULL, false, true, false) < 0)
-         {
-            log_error("Library %s: failed to mount: %s", srcpath, strerror(errno));
-            return -1;
-         }
-         if (strcmp(srcpath, accelEngineList[enginetype]->libspaths[ilib]))
-         {
-            snprintf(dstpath, sizeof(dstpath), "%s/%s", rootfs, accelEngineList[enginetype]->libspaths[ilib]);
-            if (file_create(dstpath, basename(srcpath), 0/*uid*/, 0/*gid*/, 0777 | S_IFLNK) < 0)
-            {
-               log_error("Library %s: failed to create symlink: %s", dstpath, strerror(errno));
-               return -1;
-            }
-            log_debug("Library %s: symlink created", accelEngineList[enginetype]->libspaths[ilib]);
-         }
+      if (accelEngineList[iengine]->nblibs > 0)
+         snprintf(libdirs + strlen(libdirs), sizeof libdirs - strlen(libdirs), " %s/%s/lib",
+               ACCEL_BUNDLE_MOUNT, accelEngineList[iengine]->name);
+      for (ilib = 0; ilib < accelEngineList[iengine]->nblibs && nblibs < nitems(libs); ilib++)
+      {
+         snprintf(bundlelibs[nblibs], FS_PATH_MAX, "%s/%s/lib/%s", ACCEL_BUNDLE_MOUNT,
+               accelEngineList[iengine]->name, basename(accelEngineList[iengine]->libspaths[ilib]));
+         libs[nblibs].soname = accelEngineList[iengine]->libsnames[ilib];
+         libs[nblibs].path = bundlelibs[nblibs];
+         if (ldcacheLookup(&ldcache, libs[nblibs].soname, libpath, sizeof libpath, &libs[nblibs].flags) == 0)
+            nblibs++;
       }
    }
-   if (accelEngineList[enginetype]->nblibs > 0)
-      log_info("Engine %s: driver libraries attached to container", accelEngineList[enginetype]->name);
+   if (nblibs == 0)
+      return 0;
+
+   if (ldcacheUpdate(rootfs, libs, nblibs) == 0)
+   {
+      log_debug("Dest root FS LD config cache updated: %d libraries", nblibs);
+      return 0;
+   }
 
-   return 0 ;
+   // fallback: full rebuild, bundles libraries directories are not in container ld.so.conf
+   return ldconfigCacheUpdate(rootfs, libdirs);
 }
 
 
-// Free all engine and accelerator resources
+// Free all engine and accelerator resources, config may then be read again
 void acceleratorEnd()
 {
    int iengine, ilib;
@@ -416,14 +1013,6 @@ void acceleratorEnd()
    {
       if (accelEngineList[iengine] != NULL)
       {
-         if (accelEngineList[iengine]->nbfunc > 0)
-         {
-            free(accelEngineList[iengine]->funclist);
-         }
-         if (accelEngineList[iengine]->nbmount > 0)
-         {
-            free(accelEngineList[iengine]->mountlist);
-         }
          if (accelEngineList[iengine]->libspaths != NULL)
          {
             for (ilib = 0; ilib < accelEngineList[iengine]->nblibs; ilib++)
@@ -434,7 +1023,13 @@ void acceleratorEnd()
                }
             }
             free(accelEngineList[iengine]->libspaths);
+            accelEngineList[iengine]->libspaths = NULL;
          }
+         accelEngineList[iengine]->installed = false;
       }
    }
+   ldcacheClose(&ldcache);
+   nbAcceldev = 0;
+
+   accelSettingsEnd(accelEngineList);
 }
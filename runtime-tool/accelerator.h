@@ -1,15 +1,15 @@
 #ifndef __INCLUDE_ACCELERATOR_DEVICE_H__
 #define __INCLUDE_ACCELERATOR_DEVICE_H__
 
+#include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 
 #include "utils.h"
 
-#define LINUX_DEV_PATH  "/dev"
 #define PCI_BDF_FMT "%02x:%02x.%x"
 
-#define ACCEL_DEVICE_ENGINE_MAX 64
+#define ACCEL_DEVICE_ENGINE_MAX 256    // one engine device per accelerator at most
 #define ACCEL_DEVICE_MAX       256
 #define PCI_BDF_LEN        10
 #define FUNCTION_HWID_LEN 128
@@ -21,13 +21,31 @@
 //-----------------------
 
 #define ACCELFUNC_UNKNOWN (-1)
+#define ACCELFUNC_MOST_REQUESTED (-2)  // warm function: the one most requested since boot
+
+// Simulated engine: function load latency distribution, bounded by [minMs, maxMs]
+typedef enum {
+   LATENCY_FIXED,      // meanMs
+   LATENCY_UNIFORM,    // between minMs and maxMs
+   LATENCY_NORMAL,     // meanMs, stddevMs
+   LATENCY_LOGNORMAL   // meanMs, stddevMs of the distribution itself (long tail)
+} e_latencyDistrib;
+
+typedef struct {
+   int32_t distrib;   // e_latencyDistrib
+   int32_t meanMs;
+   int32_t stddevMs;
+   int32_t minMs;
+   int32_t maxMs;
+} t_latencyConf;
 
 typedef struct {
    int  funcID;
-   char accelID[FUNCTION_HWID_LEN];  // intel: AFU UUID, aws: AGFI id
+   char accelID[FUNCTION_HWID_LEN];  // intel: AFU UUID, aws: AGFI id, sim: any id
    int  nbHugepage2M;
    int  nbHugepage1G;
    char bistreamFile[FILE_NAME_MAX];
+   t_latencyConf simLoad;            // sim only
 } t_accelfuncConf;
 
 
@@ -38,6 +56,7 @@ typedef struct {
 typedef enum {
    ACCEL_ENGINE_INTEL = 0,
    ACCEL_ENGINE_XILINX,
+   ACCEL_ENGINE_SIM,
    ACCEL_ENGINE_MAX
 } e_accelengine;
 
@@ -68,6 +87,7 @@ typedef struct {
    int      deviceId;
    t_pcibdf bdf;
    e_pciFunction pcifnType;
+   int      numaNode;  // NUMA node of PCI device, -1 if unknown
    void    *privdata;
 } t_acceldev;
 
@@ -79,6 +99,10 @@ typedef struct {
 typedef struct {
   int (*enumerate)(t_acceldev acceldevList[], int *nbAcceldev);
   int (*loadBitstream)(t_acceldev *acceldev, t_accelfuncConf *accelfuncConf);
+  int (*refresh)(t_acceldev *acceldev);  // re-read function currently loaded into device
+  void (*engineDevices)(t_acceldev **engdevList, int **nbEngdev);  // engine private devices referred by privdata (optional)
+  int (*sriovEnable)(t_acceldev **portList, int nbport);  // hand all ports of a device, leased, to new virtual functions (optional)
+  int (*release)(t_acceldev *acceldev, bool reset);  // clear device state left by a container (optional)
 } t_accelOps;
 
 typedef struct {
@@ -87,6 +111,16 @@ typedef struct {
    bool rdonly;
 } t_mountpath;
 
+// Simulated engine devices layout and injected faults
+typedef struct {
+   int32_t nbDevices;
+   int32_t nbSlots;           // accelerators per device, sharing its reconfiguration engine
+   double  failureRate;       // probability of a load error
+   double  timeoutRate;       // probability of a load never completing
+   uint32_t seed;             // latencies and faults random seed, 0 for a time based seed
+   char    stateFile[FS_PATH_MAX];  // functions loaded into slots, kept across runs
+} t_simConf;
+
 typedef struct {
    bool installed;
    char name[ENGINE_NAME_LEN];
@@ -94,6 +128,12 @@ typedef struct {
    bool reconfigPhysfn;
    bool reconfigVirtfn;
    bool sriovMode;
+   int  sriovPool;        // free virtual functions kept ready, 0 for none
+   int  warmFunction;     // function loaded into released devices, ACCELFUNC_UNKNOWN for none
+   bool releaseReset;     // reset released devices
+   int  loadTimeoutMs;    // bitstream load completion timeout
+   int  loadPollMs;       // first load completion poll interval, doubled up to 1s
+   t_simConf sim;         // sim engine only
 
    t_mountpath *mountlist;
    size_t nbmount;
@@ -104,6 +144,9 @@ typedef struct {
    char **sysentriesRW;
    size_t nbsysentries;
 
+   char **syswatch;   // sysfs dirs whose entries change when devices are added/removed
+   size_t nbsyswatch;
+
    char **libsnames;
    char **libspaths;
    size_t nblibs;
@@ -113,31 +156,110 @@ typedef struct {
 
 
 
-int acceleratorReadConf(char *conffile);
+int acceleratorReadConf(char *conffile, char *imagefile);
+int acceleratorCompileConf(char *conffile, char *imagefile);
 int acceleratorEnumerate();
+int acceleratorRefresh();
 void acceleratorEnd();
 
-int acceleratorAddAlldev(t_acceldev **attachdevList, int *nbAttachdev);
-int acceleratorAddDev(char *device, t_acceldev **attachdevList, int *nbAttachdev);
+int acceleratorAddAlldev(pid_t pid, t_acceldev **attachdevList, int *nbAttachdev);
+int acceleratorAddDev(pid_t pid, char *device, t_acceldev **attachdevList, int *nbAttachdev);
+#define ACCEL_DEVICES_ANY "any:"  // any:N, N devices local to container CPUs
+int acceleratorAddAnydev(pid_t pid, int count, int *accelfuncList, t_acceldev **attachdevList, int *nbAttachdev);
 bool acceleratorReconfigSupport(t_acceldev *acceldev, e_pciFunction pcifnType);
-int acceleratorLoadBitstream(t_acceldev *acceldev, int accelfunc);
+bool acceleratorDevnodesFixed(t_acceldev *acceldev);
+typedef enum {
+   LOAD_PRIORITY_NORMAL,      // container start: queued after device pending loads
+   LOAD_PRIORITY_BACKGROUND,  // runs only if device has no pending load, else dropped
+} e_loadPriority;
+
+int acceleratorLoadBitstream(t_acceldev *acceldev, int accelfunc, e_loadPriority priority);
+int acceleratorLoadBitstreams(t_acceldev **acceldevList, int *accelfuncList, int *statusList, int nbAcceldev);
 int acceleratorHugepage2M(t_acceldev *acceldev);
 int acceleratorHugepage1G(t_acceldev *acceldev);
 int acceleratorFuncHwidToIndex(e_accelengine enginetype, char *hwid);
+int acceleratorSriovMissing();
+int acceleratorSriovRefill();
+int acceleratorReleaseDevices(pid_t pid, t_acceldev **releaseList, int *nbRelease);
+int acceleratorWarmFunction(t_acceldev *acceldev);
+int acceleratorWarmLoad(t_acceldev *acceldev, int accelfunc);
 
+int accelengineResolveLibs(e_accelengine enginetype);
 int accelengineHostDeviceSetup(e_accelengine enginetype, t_acceldev *acceldev);
-int accelengineMountPaths(char *rootfs, e_accelengine enginetype);
-int accelengineAttachLibs(char *rootfs, e_accelengine enginetype);
+int accelengineAttachBundle(t_mountPlan *plan, e_accelengine enginetype);
+int accelengineUpdateLdcache(char *rootfs, bool attachEngine[]);
 
 t_accelEngine * intelOpaeRegister();
+void intelOpaeSetIoctl(int (*ioctlfn)(int fd, unsigned long request, ...));
 t_accelEngine * xilinxAwsRegister();
+t_accelEngine * simRegister();
+
+int containerSetup(pid_t pid, char *rootfs, char *deviceRules, t_acceldev **acceldevList, int nbAcceldev);
+
+#define ACCEL_BUNDLE_MOUNT "/opt/accelerator-container"  // container dir of engines bundles
 
-int containerSetup(pid_t pid, char *rootfs, t_acceldev **acceldevList, int nbAcceldev);
+int accelBundleStage(t_accelEngine *engine, char *bundlepath, int pathlen);
 
-int accelSettingsReadConf(char *conffile, t_accelEngine * accelEngineList[]);
+pid_t deviceLeaseAcquire(t_acceldev *acceldev, pid_t pid);
+void deviceLeaseRelease(t_acceldev *acceldev, pid_t pid);
+pid_t deviceLeaseHolder(t_acceldev *acceldev);
+bool deviceLeaseReclaim(t_acceldev *acceldev, pid_t pid);
+void functionRequested(int accelfunc);
+uint64_t functionRequestCount(int accelfunc);
+int loadQueueEnter(t_acceldev *acceldev, int accelfunc, e_loadPriority priority, uint32_t *ticket);
+void loadQueueLeave(t_acceldev *acceldev, int accelfunc, uint32_t ticket, int status);
+bool loadQueueBusy(t_acceldev *acceldev);
+
+int reconfigTimeGet(t_acceldev *acceldev);
+void reconfigTimeRecord(t_acceldev *acceldev, int loadMs);
+
+uint64_t accelCacheFingerprint(t_accelEngine *accelEngineList[], char *conffile);
+int accelCacheLoad(t_accelEngine *accelEngineList[], uint64_t fingerprint, t_acceldev acceldevList[], int *nbAcceldev);
+int accelCacheSave(t_accelEngine *accelEngineList[], uint64_t fingerprint, t_acceldev acceldevList[], int nbAcceldev);
+void accelCacheInvalidate();
+
+int accelSettingsReadConf(char *conffile, char *imagefile, t_accelEngine * accelEngineList[]);
+int accelSettingsCompile(char *conffile, char *imagefile, t_accelEngine * accelEngineList[]);
+void accelSettingsEnd(t_accelEngine * accelEngineList[]);
+int accelSettingsHwidToIndex(e_accelengine enginetype, char *hwid);
+int accelSettingsFuncConfIndex(e_accelengine enginetype, int accelfunc);
 int accelfuncNameToIndex(char *funcName);
 char *accelfuncIndexToName(int accelfunc);
 
+#define ACCEL_SERVE_SOCKET "/run/accelerator-container/runtime-tool.sock"
+
+typedef struct {
+   char  command[32];
+   pid_t pid;
+   char  rootfs[FS_PATH_MAX];
+   char  devices[1024];
+   char  functions[1024];
+   char  deviceRules[4096];  // runtime devices cgroup rules, comma separated
+   int   loglevel;     // -1 to keep server log level
+} t_serveRequest;
+
+typedef int (*t_serveHandler)(t_serveRequest *request);
+
+int serverRun(const char *sockpath, char *conffile, char *imagefile, t_serveHandler handler);
+
+// Configure phases timed by bench command
+typedef enum {
+   BENCH_CONFIG,
+   BENCH_ENUMERATE,
+   BENCH_LOOKUP,
+   BENCH_LOAD,
+   BENCH_HOSTSETUP,
+   BENCH_MOUNTS,
+   BENCH_LDCACHE,
+   BENCH_CGROUP,
+   BENCH_PHASE_MAX
+} e_benchPhase;
+
+void benchEnable();
+int64_t benchStart();
+void benchStop(e_benchPhase phase, int64_t start, const char *fmt, ...) __attribute__ ((format (printf, 3, 4)));
+void benchReport(FILE *out, int nbAcceldev);
+
 
 #endif // __INCLUDE_ACCELERATOR_DEVICE_H__
 
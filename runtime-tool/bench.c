@@ -0,0 +1,81 @@
+/*
+ * Configure phases timing, for latency benchmarks on synthetic sysfs/devfs trees.
+ * Phases may be entered several times (eg once per device): their times are summed.
+ * Phases are also traced as spans when tracing is enabled.
+ * Disabled by default: start and stop then cost no clock read.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+
+#include "accelerator.h"
+
+typedef struct {
+   const char *name;
+   int64_t     totalNs;
+   int         count;
+} t_benchPhase;
+
+static bool benchEnabled = false;
+static int64_t benchOrigin;
+
+static t_benchPhase benchPhases[BENCH_PHASE_MAX] = {
+   [BENCH_CONFIG]    = { "config" },
+   [BENCH_ENUMERATE] = { "enumerate" },
+   [BENCH_LOOKUP]    = { "lookup" },
+   [BENCH_LOAD]      = { "load" },
+   [BENCH_HOSTSETUP] = { "host setup" },
+   [BENCH_MOUNTS]    = { "mounts" },
+   [BENCH_LDCACHE]   = { "ld cache" },
+   [BENCH_CGROUP]    = { "cgroup writes" },
+};
+
+
+void benchEnable()
+{
+   benchEnabled = true;
+   benchOrigin = traceNow();
+}
+
+int64_t benchStart()
+{
+   if (! benchEnabled)
+      return traceBegin();
+   return traceNow();
+}
+
+// End phase, traced with an optional printf like detail
+void benchStop(e_benchPhase phase, int64_t start, const char *fmt, ...)
+{
+   va_list args;
+
+   if (start == 0)
+      return;
+   if (benchEnabled)
+   {
+      benchPhases[phase].totalNs += traceNow() - start;
+      benchPhases[phase].count ++;
+   }
+   va_start(args, fmt);
+   traceEndv(start, benchPhases[phase].name, fmt, args);
+   va_end(args);
+}
+
+// Print phases times in microseconds, phases never entered are skipped
+void benchReport(FILE *out, int nbAcceldev)
+{
+   int iphase;
+
+   fprintf(out, "devices %d\n", nbAcceldev);
+   fprintf(out, "%-14s %6s %10s\n", "phase", "calls", "time_us");
+   for (iphase = 0; iphase < BENCH_PHASE_MAX; iphase++)
+   {
+      if (benchPhases[iphase].count == 0)
+         continue;
+      fprintf(out, "%-14s %6d %10lld\n", benchPhases[iphase].name, benchPhases[iphase].count,
+            (long long) benchPhases[iphase].totalNs / 1000);
+   }
+   fprintf(out, "%-14s %6d %10lld\n", "total", 1, (long long) (traceNow() - benchOrigin) / 1000);
+}
@@ -0,0 +1,125 @@
+#!/bin/sh
+#
+# Fabricate a synthetic host tree with Intel FPGA devices, for configure benchmarks:
+#   sys/class/fpga/intel-fpga-dev.<n>  FME and port entries, afu_id, device symlink
+#   sys/devices/pci0000:00/...         PCI vendor/device, NUMA node, physfn of virtual functions, SR-IOV of physical ones
+#   sys/devices/system/node            2 NUMA nodes of 4 CPUs, 2MB hugepages pools
+#   dev/intel-fpga-{fme,port}.<n>      device nodes (regular files, no mknod needed)
+#   sys/dev/char                       host char devices by major:minor (empty: nodes are regular files)
+#   usr/lib, etc/ld.so.cache           Intel OPAE libraries stubs and their ld cache
+#   etc/acceleration.json              config with a function matching devices AFU id
+#   cgroup/{devices,hugetlb}/bench     cgroup v1 controllers files
+#   rootfs                             container root filesystem
+#
+# Usage: mkfakeintel.sh ROOT NBDEV [NBVF]
+#   NBDEV physical devices, each with NBVF virtual functions ports (default 0)
+
+set -e
+
+if [ $# -lt 2 ]; then
+   echo "Usage: $0 ROOT NBDEV [NBVF]" >&2
+   exit 1
+fi
+ROOT=$(realpath -m "$1")
+NBDEV=$2
+NBVF=${3:-0}
+
+AFU_ID="d8424dc4a4a3c413f89e433683f9040b"
+AFU_HWID="d8424dc4-a4a3-c413-f89e-433683f9040b"
+
+mkdir -p "$ROOT/sys/class/fpga" "$ROOT/sys/devices/pci0000:00" "$ROOT/sys/dev/char" "$ROOT/dev" \
+         "$ROOT/usr/lib" "$ROOT/etc" "$ROOT/run" "$ROOT/rootfs/etc" \
+         "$ROOT/cgroup/devices/bench" "$ROOT/cgroup/hugetlb/bench"
+
+# PCI function: vendor, device, optional physfn, NUMA node
+pcifn() {
+   mkdir -p "$ROOT/sys/devices/pci0000:00/$1"
+   echo 0x8086 > "$ROOT/sys/devices/pci0000:00/$1/vendor"
+   echo "$2" > "$ROOT/sys/devices/pci0000:00/$1/device"
+   echo "$4" > "$ROOT/sys/devices/pci0000:00/$1/numa_node"
+   if [ -n "$3" ]; then
+      ln -sfn "../$3" "$ROOT/sys/devices/pci0000:00/$1/physfn"
+   fi
+}
+
+# FPGA class entry: device symlink, FME if physical function, AFU port
+fpgadev() {
+   entry="$ROOT/sys/class/fpga/intel-fpga-dev.$1"
+   mkdir -p "$entry"
+   ln -sfn "../../../devices/pci0000:00/$2" "$entry/device"
+   if [ "$3" = "pf" ]; then
+      mkdir -p "$entry/intel-fpga-fme.$1"
+      : > "$ROOT/dev/intel-fpga-fme.$1"
+   fi
+   mkdir -p "$entry/intel-fpga-port.$1/errors"
+   echo "$AFU_ID" > "$entry/intel-fpga-port.$1/afu_id"
+   : > "$entry/intel-fpga-port.$1/userclk_freqcmd"
+   : > "$entry/intel-fpga-port.$1/userclk_freqcntrcmd"
+   : > "$entry/intel-fpga-port.$1/errors/clear"
+   : > "$ROOT/dev/intel-fpga-port.$1"
+}
+
+# bus and device numbers use decimal digits only: bdf is parsed in decimal from sysfs links
+instance=0
+idev=0
+while [ $idev -lt "$NBDEV" ]; do
+   pf=$(printf "0000:%02d:%02d.0" $((idev / 32 + 1)) $((idev % 32)))
+   pcifn "$pf" 0x09c4 "" $((idev % 2))
+   echo 1 > "$ROOT/sys/devices/pci0000:00/$pf/sriov_totalvfs"
+   echo "$NBVF" > "$ROOT/sys/devices/pci0000:00/$pf/sriov_numvfs"
+   fpgadev $instance "$pf" pf
+   instance=$((instance + 1))
+
+   ivf=1
+   while [ $ivf -le "$NBVF" ]; do
+      vf=$(printf "0000:%02d:%02d.%d" $((idev / 32 + 1)) $((idev % 32)) $ivf)
+      pcifn "$vf" 0x09c5 "$pf" $((idev % 2))
+      fpgadev $instance "$vf" vf
+      instance=$((instance + 1))
+      ivf=$((ivf + 1))
+   done
+   idev=$((idev + 1))
+done
+
+# NUMA nodes hugepages pools (functions need none: memlock limit can not be raised unprivileged)
+for node in 0 1; do
+   pool="$ROOT/sys/devices/system/node/node$node/hugepages/hugepages-2048kB"
+   mkdir -p "$pool"
+   echo 4096 > "$pool/nr_hugepages"
+   echo 4096 > "$pool/free_hugepages"
+   echo "$((node * 4))-$((node * 4 + 3))" > "$ROOT/sys/devices/system/node/node$node/cpulist"
+done
+
+# OPAE libraries stubs, found through the synthetic host ld cache
+echo "int opae_stub;" > "$ROOT/usr/lib/opae.c"
+for lib in libopae-c.so libopae-c++.so; do
+   ${CC:-cc} -shared -o "$ROOT/usr/lib/$lib" -Wl,-soname,$lib "$ROOT/usr/lib/opae.c"
+done
+echo "$ROOT/usr/lib" > "$ROOT/etc/ld.so.conf"
+ldconfig -X -C "$ROOT/etc/ld.so.cache" -f "$ROOT/etc/ld.so.conf"
+cp /etc/ld.so.cache "$ROOT/rootfs/etc/ld.so.cache"
+
+cat > "$ROOT/etc/acceleration.json" <<EOCONF
+{
+  "global": { "loglevel": "info" },
+  "accelerationFunctions" : [
+    { "name": "nlb0", "description": "Intel Loopback Adapter" }
+  ],
+  "acceleratorEngines": [
+    {
+      "name": "IntelOPAE",
+      "bitstreamLocation": "$ROOT/usr/lib/bitstream",
+      "partialConfigPhysfn": true,
+      "partialConfigVirtfn": false,
+      "activateSriov": false,
+      "functions": [
+        { "name": "nlb0", "hwID": "$AFU_HWID", "hugepage2M": 0, "hugepage1G": 0, "bistreamFile": "nlb_mode_0.gbs" }
+      ]
+    }
+  ]
+}
+EOCONF
+
+: > "$ROOT/cgroup/devices/bench/devices.allow"
+: > "$ROOT/cgroup/hugetlb/bench/hugetlb.2MB.limit_in_bytes"
+: > "$ROOT/cgroup/hugetlb/bench/hugetlb.1GB.limit_in_bytes"
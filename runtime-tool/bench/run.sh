@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Time each configure phase on synthetic Intel trees of increasing size.
+# Runs unprivileged: a user+mount namespace owns the bind mounts, and a sleeping
+# process of this namespace plays the container.
+#
+# Usage: run.sh TOOL [NBDEV...]   (default 1 16 64 256)
+
+set -e
+
+if [ $# -lt 1 ]; then
+   echo "Usage: $0 TOOL [NBDEV...]" >&2
+   exit 1
+fi
+TOOL=$(realpath "$1")
+shift
+BENCHDIR=$(dirname "$(realpath "$0")")
+[ $# -gt 0 ] || set -- 1 16 64 256
+
+for nbdev in "$@"; do
+   root=$(mktemp -d /tmp/accel-bench.XXXXXX)
+   "$BENCHDIR/mkfakeintel.sh" "$root" "$nbdev"
+
+   ACCEL_SYSFS_FPGA_PATH="$root/sys/class/fpga" \
+   ACCEL_DEV_PATH="$root/dev" \
+   ACCEL_CGROUP_PATH="$root/cgroup" \
+   ACCEL_LDCACHE_PATH="$root/etc/ld.so.cache" \
+   ACCEL_RUN_PATH="$root/run" \
+   ACCEL_CONF_PATH="$root/etc/acceleration.json" \
+   ACCEL_IMAGE_PATH="$root/etc/acceleration.img" \
+   ACCEL_PROC_PATH="$root/proc" \
+   ACCEL_DEV_CHAR_PATH="$root/sys/dev/char" \
+   ACCEL_SYSFS_NODE_PATH="$root/sys/devices/system/node" \
+   unshare -rm --propagation private sh -e -c '
+      root=$1; tool=$2
+      sleep 600 &
+      pid=$!
+      trap "kill $pid" EXIT
+      mkdir -p "$root/proc/$pid"
+      printf "2:hugetlb:/bench\n1:devices:/bench\n" > "$root/proc/$pid/cgroup"
+      for run in cold warm; do
+         echo "== $run"
+         "$tool" --pid $pid --rootfs "$root/rootfs" --devices all bench
+      done
+   ' bench "$root" "$TOOL"
+
+   rm -rf "$root"
+done
@@ -0,0 +1,509 @@
+/*
+ * Devices cgroup rules: cgroup v1 devices.allow writer and cgroup v2 eBPF device filter
+ *
+ * cgroup v2 has no devices.allow file: access is checked by BPF_PROG_TYPE_CGROUP_DEVICE programs
+ * attached to the container cgroup, all of them having to allow it. The filter built here holds
+ * the runtime rules (from the OCI spec, or runc default ones) followed by the accelerators rules,
+ * and replaces the runtime program with a single attach.
+ * devFilterBuild() is a pure function: programs may be built and checked without any privilege.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+
+#include "utils.h"
+
+#ifndef BPF_F_REPLACE
+#define BPF_F_REPLACE (1U << 2)
+#endif
+
+#define SYSFS_CGROUP_DEV_ALLOW  "devices.allow"
+#define DEV_FILTER_LICENSE      "Apache"
+#define DEV_FILTER_LOG_SIZE     65536
+#define DEV_FILTER_PROGS_MAX    64
+
+// runc default rules, appended after the runtime ones as runc does
+static const char * const runtimeDefaultRules[] = {
+   "c *:* m", "b *:* m",
+   "c 1:3 rwm", "c 1:5 rwm", "c 1:7 rwm", "c 1:8 rwm", "c 1:9 rwm",   // null zero full random urandom
+   "c 5:0 rwm", "c 5:1 rwm", "c 5:2 rwm", "c 136:* rwm",              // tty console ptmx pts
+   "c 10:200 rwm",                                                    // tun
+};
+
+typedef struct {
+   t_devRule *ruleList;
+   int        nbrule;
+   int       *hostMinors;  // per rule: nb host char devices with the same major
+} t_devMajors;
+
+
+static int compareDevRules(const void *p1, const void *p2)
+{
+   const t_devRule *rule1 = p1;
+   const t_devRule *rule2 = p2;
+
+   if (rule1->type != rule2->type)
+      return rule1->type - rule2->type;
+   if (rule1->major != rule2->major)
+      return (rule1->major < rule2->major) ? -1 : 1;
+   if (rule1->minor != rule2->minor)
+      return (rule1->minor < rule2->minor) ? -1 : 1;
+   return 0;
+}
+
+static int compareDevMajors(const void *p1, const void *p2)
+{
+   const t_devRule *rule1 = p1;
+   const t_devRule *rule2 = p2;
+
+   if (rule1->type != rule2->type)
+      return rule1->type - rule2->type;
+   if (rule1->major != rule2->major)
+      return (rule1->major < rule2->major) ? -1 : 1;
+   return 0;
+}
+
+// Count host char devices of each requested major (entries "<major>:<minor>" of /sys/dev/char)
+static int countHostMinors(const char *dirpath, const char *name, unsigned char type, void *ctx)
+{
+   t_devMajors *majors = ctx;
+   t_devRule key = { 'c', 0, 0, 0, true };
+   t_devRule *rule;
+
+   if (sscanf(name, "%d:%d", &key.major, &key.minor) != 2)
+      return 0;
+   rule = bsearch(&key, majors->ruleList, majors->nbrule, sizeof(t_devRule), compareDevMajors);
+   if (rule != NULL)
+   {
+      // count on the first rule of this major
+      while ((rule > majors->ruleList) && (compareDevMajors(&rule[-1], &key) == 0))
+         rule--;
+      majors->hostMinors[rule - majors->ruleList]++;
+   }
+   return 0;
+}
+
+// Sort allow rules of devices nodes and remove duplicates (nodes shared by devices), then
+// coalesce them: a major whose host char devices are all requested gets one "c <major>:* rwm" rule,
+// unless one of its rules is exact (a device created later would be allowed too).
+// Return new number of rules.
+int devRulesCoalesce(t_devRule ruleList[], int nbrule)
+{
+   t_devMajors majors = { ruleList, 0, NULL };
+   int irule, jrule, krule;
+   bool exact;
+
+   qsort(ruleList, nbrule, sizeof(t_devRule), compareDevRules);
+   for (irule = 0, jrule = 0; irule < nbrule; irule++)
+   {
+      if ((jrule == 0) || (compareDevRules(&ruleList[irule], &ruleList[jrule - 1]) != 0))
+         ruleList[jrule++] = ruleList[irule];
+      else
+         ruleList[jrule - 1].exact |= ruleList[irule].exact;
+   }
+   nbrule = jrule;
+   majors.nbrule = nbrule;
+
+   majors.hostMinors = calloc(nbrule + 1, sizeof(int));
+   if (majors.hostMinors == NULL)
+      return nbrule;
+   if (fsdirScan(hostPath(HOST_PATH_DEV_CHAR), "*:*", countHostMinors, &majors) <= 0)
+   {
+      free(majors.hostMinors);
+      return nbrule;
+   }
+
+   for (irule = 0, krule = 0; irule < nbrule; irule = jrule)
+   {
+      exact = ruleList[irule].exact;
+      for (jrule = irule + 1; jrule < nbrule; jrule++)
+      {
+         if (compareDevMajors(&ruleList[jrule], &ruleList[irule]) != 0)
+            break;
+         exact |= ruleList[jrule].exact;
+      }
+      if ((ruleList[irule].type == 'c') && (! exact) && (majors.hostMinors[irule] == jrule - irule))
+      {
+         ruleList[krule] = ruleList[irule];
+         ruleList[krule++].minor = DEV_RULE_ANY;
+      }
+      else
+      {
+         memmove(&ruleList[krule], &ruleList[irule], (jrule - irule) * sizeof(t_devRule));
+         krule += jrule - irule;
+      }
+   }
+   free(majors.hostMinors);
+   return krule;
+}
+
+// Parse devices cgroup rule "[!]<a|b|c> <major|*>:<minor|*> <access>", '!' for a deny rule
+int devRuleParse(const char *str, t_devRule *rule)
+{
+   char majorStr[16], minorStr[16], access[8];
+   char *ptr;
+
+   memset(rule, 0, sizeof *rule);
+   rule->allow = true;
+   if (*str == '!')
+   {
+      rule->allow = false;
+      str++;
+   }
+   if ((sscanf(str, " %c %15[0-9*]:%15[0-9*] %7s", &rule->type, majorStr, minorStr, access) != 4)
+    || (strchr("abc", rule->type) == NULL))
+   {
+      log_error("Devices rule [%s] invalid", str);
+      return -1;
+   }
+   rule->major = (! strcmp(majorStr, "*")) ? DEV_RULE_ANY : atoi(majorStr);
+   rule->minor = (! strcmp(minorStr, "*")) ? DEV_RULE_ANY : atoi(minorStr);
+   for (ptr = access; *ptr != '\0'; ptr++)
+   {
+      if (*ptr == 'r')
+         rule->access |= DEV_ACCESS_READ;
+      else if (*ptr == 'w')
+         rule->access |= DEV_ACCESS_WRITE;
+      else if (*ptr == 'm')
+         rule->access |= DEV_ACCESS_MKNOD;
+      else
+      {
+         log_error("Devices rule [%s]: access %s invalid", str, access);
+         return -1;
+      }
+   }
+   return 0;
+}
+
+// Format rule as written to devices.allow: "<type> <major|*>:<minor|*> <access>"
+int devRuleFormat(const t_devRule *rule, char *str, int len)
+{
+   char majorStr[16] = "*", minorStr[16] = "*";
+
+   if (rule->major != DEV_RULE_ANY)
+      snprintf(majorStr, sizeof majorStr, "%d", rule->major);
+   if (rule->minor != DEV_RULE_ANY)
+      snprintf(minorStr, sizeof minorStr, "%d", rule->minor);
+   return snprintf(str, len, "%c %s:%s %s%s%s", rule->type, majorStr, minorStr,
+         (rule->access & DEV_ACCESS_READ) ? "r" : "", (rule->access & DEV_ACCESS_WRITE) ? "w" : "",
+         (rule->access & DEV_ACCESS_MKNOD) ? "m" : "");
+}
+
+
+// cgroup v1: write each allow rule to devices.allow of container cgroup, with a single open
+// and one rule per write (kernel parses one rule per write)
+int cgroup1AllowDevices(pid_t pid, t_devRule ruleList[], int nbrule)
+{
+   char cgpath[FS_PATH_MAX];
+   char pathallow[2*FS_PATH_MAX];
+   char devallow[32];
+   int64_t span;
+   int irule;
+   int fd;
+   int len;
+   int ret = -1;
+
+   if (findCgroupPath(pid, SYSFS_CGROUP_DEV, cgpath, sizeof cgpath) < 0)
+      return -1;
+   snprintf(pathallow, sizeof(pathallow), "%s/%s", cgpath, SYSFS_CGROUP_DEV_ALLOW);
+
+   span = traceBegin();
+   fd = open(pathallow, O_WRONLY|O_CLOEXEC);
+   if (fd < 0)
+   {
+      log_error("Failed to open %s: %s", pathallow, strerror(errno));
+      return -1;
+   }
+   traceEnd(span, "devices.allow open", "%s", pathallow);
+
+   for (irule = 0; irule < nbrule; irule++)
+   {
+      len = devRuleFormat(&ruleList[irule], devallow, sizeof devallow);
+      span = traceBegin();
+      if (write(fd, devallow, len) != len)
+      {
+         log_error("Failed to write [%s] to devices.allow: %s", devallow, strerror(errno));
+         goto out;
+      }
+      traceEnd(span, "devices.allow write", "%s", devallow);
+      log_info("Container pid %d: devices %s whitelisted", pid, devallow);
+   }
+   ret = 0;
+
+out:
+   close(fd);
+   return ret;
+}
+
+
+static struct bpf_insn bpfInsn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+   struct bpf_insn insn = { .code = code, .dst_reg = dst, .src_reg = src, .off = off, .imm = imm };
+
+   return insn;
+}
+
+// Build device filter program: last matching rule decides (as rules applied in order to devices.allow
+// and devices.deny), no matching rule denies.
+//    r2 = device type, r3 = requested access, r4 = major, r5 = minor
+//    foreach rule, last first: if all rule conditions match, return rule allow
+// Return number of instructions, or -1 if insnList is too small.
+int devFilterBuild(const t_devRule ruleList[], int nbrule, struct bpf_insn *insnList, int maxInsn)
+{
+   const t_devRule *rule;
+   int jumpList[4];
+   int nbjump;
+   int ninsn = 0;
+   int irule, ijump;
+   bool catchAll = false;
+
+   if (maxInsn < 8)
+      return -1;
+   insnList[ninsn++] = bpfInsn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, 0, 0);   // access_type
+   insnList[ninsn++] = bpfInsn(BPF_ALU | BPF_AND | BPF_K, BPF_REG_2, 0, 0, 0xFFFF);
+   insnList[ninsn++] = bpfInsn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1, 0, 0);
+   insnList[ninsn++] = bpfInsn(BPF_ALU | BPF_RSH | BPF_K, BPF_REG_3, 0, 0, 16);
+   insnList[ninsn++] = bpfInsn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_4, BPF_REG_1, 4, 0);   // major
+   insnList[ninsn++] = bpfInsn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_5, BPF_REG_1, 8, 0);   // minor
+
+   for (irule = nbrule - 1; (irule >= 0) && (! catchAll); irule--)
+   {
+      rule = &ruleList[irule];
+      if (ninsn + 9 > maxInsn)
+         return -1;
+
+      nbjump = 0;
+      if (rule->type != 'a')
+      {
+         jumpList[nbjump++] = ninsn;
+         insnList[ninsn++] = bpfInsn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_2, 0, 0,
+               (rule->type == 'b') ? BPF_DEVCG_DEV_BLOCK : BPF_DEVCG_DEV_CHAR);
+      }
+      if ((rule->access & DEV_ACCESS_ALL) != DEV_ACCESS_ALL)
+      {
+         // allow: requested access must be a subset of rule access, deny: any requested access denied
+         insnList[ninsn++] = bpfInsn(BPF_ALU | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_3, 0, 0);
+         insnList[ninsn++] = bpfInsn(BPF_ALU | BPF_AND | BPF_K, BPF_REG_1, 0, 0, rule->access);
+         jumpList[nbjump++] = ninsn;
+         if (rule->allow)
+            insnList[ninsn++] = bpfInsn(BPF_JMP | BPF_JNE | BPF_X, BPF_REG_1, BPF_REG_3, 0, 0);
+         else
+            insnList[ninsn++] = bpfInsn(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_1, 0, 0, 0);
+      }
+      if (rule->major != DEV_RULE_ANY)
+      {
+         jumpList[nbjump++] = ninsn;
+         insnList[ninsn++] = bpfInsn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 0, rule->major);
+      }
+      if (rule->minor != DEV_RULE_ANY)
+      {
+         jumpList[nbjump++] = ninsn;
+         insnList[ninsn++] = bpfInsn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, rule->minor);
+      }
+      insnList[ninsn++] = bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, rule->allow ? 1 : 0);
+      insnList[ninsn++] = bpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+      // mismatch: jump to next rule
+      for (ijump = 0; ijump < nbjump; ijump++)
+         insnList[jumpList[ijump]].off = ninsn - (jumpList[ijump] + 1);
+      // rules before a rule matching any access are unreachable, the verifier rejects them
+      catchAll = (nbjump == 0);
+   }
+
+   if (! catchAll)
+   {
+      insnList[ninsn++] = bpfInsn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0);
+      insnList[ninsn++] = bpfInsn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+   }
+   return ninsn;
+}
+
+static int bpfCall(int cmd, union bpf_attr *attr)
+{
+   return syscall(__NR_bpf, cmd, attr, sizeof *attr);
+}
+
+static int devFilterLoad(struct bpf_insn insnList[], int ninsn)
+{
+   union bpf_attr attr;
+   char *verifierLog;
+   int fd;
+
+   memset(&attr, 0, sizeof attr);
+   attr.prog_type = BPF_PROG_TYPE_CGROUP_DEVICE;
+   attr.insns = (uintptr_t) insnList;
+   attr.insn_cnt = ninsn;
+   attr.license = (uintptr_t) DEV_FILTER_LICENSE;
+   fd = bpfCall(BPF_PROG_LOAD, &attr);
+   if (fd >= 0)
+      return fd;
+
+   // load again to get verifier messages
+   log_error("Devices filter program load failed: %s", strerror(errno));
+   verifierLog = calloc(1, DEV_FILTER_LOG_SIZE);
+   if (verifierLog != NULL)
+   {
+      attr.log_level = 1;
+      attr.log_buf = (uintptr_t) verifierLog;
+      attr.log_size = DEV_FILTER_LOG_SIZE;
+      if (bpfCall(BPF_PROG_LOAD, &attr) < 0)
+         log_debug("Devices filter verifier: %s", verifierLog);
+      free(verifierLog);
+   }
+   return -1;
+}
+
+// cgroup v2: attach filter of runtime rules (comma separated, may be NULL), runc default rules and accelerators rules
+// to container cgroup, in place of the runtime device program
+int cgroup2AllowDevices(pid_t pid, const char *runtimeRules, t_devRule ruleList[], int nbrule)
+{
+   char cgpath[FS_PATH_MAX];
+   char devallow[32];
+   t_devRule *filterRules = NULL;
+   struct bpf_insn *insnList = NULL;
+   union bpf_attr attr;
+   uint32_t progIds[DEV_FILTER_PROGS_MAX];
+   uint32_t progCount, attachFlags;
+   char *rules = NULL;
+   char *rule;
+   char *next;
+   int nbfilterRules = 0;
+   int maxfilterRules;
+   int ninsn;
+   int cgfd = -1, progfd = -1, oldfd = -1;
+   int64_t span;
+   int irule;
+   int ret = -1;
+
+   if (findCgroupPath(pid, SYSFS_CGROUP_UNIFIED, cgpath, sizeof cgpath) < 0)
+      return -1;
+
+   maxfilterRules = nitems(runtimeDefaultRules) + nbrule;
+   if ((runtimeRules != NULL) && (*runtimeRules != '\0'))
+   {
+      rules = strdup(runtimeRules);
+      for (rule = rules; rule != NULL; rule = strchr(rule + 1, ','))
+         maxfilterRules++;
+   }
+   filterRules = calloc(maxfilterRules, sizeof(t_devRule));
+   insnList = calloc(maxfilterRules * 9 + 8, sizeof(struct bpf_insn));
+   if ((filterRules == NULL) || (insnList == NULL) || ((runtimeRules != NULL) && (*runtimeRules != '\0') && (rules == NULL)))
+   {
+      log_error("Memory allocation failed");
+      goto out;
+   }
+
+   // runtime rules first, then runc defaults the runtime program also had (a spec "!a *:* rwm" does not remove them),
+   // accelerators rules last take precedence
+   if (rules != NULL)
+   {
+      for (next = rules; (rule = strsep(&next, ",")) != NULL; )
+      {
+         if (*rule == '\0')
+            continue;
+         if (devRuleParse(rule, &filterRules[nbfilterRules]) < 0)
+            goto out;
+         nbfilterRules++;
+      }
+   }
+   for (irule = 0; irule < (int) nitems(runtimeDefaultRules); irule++)
+      devRuleParse(runtimeDefaultRules[irule], &filterRules[nbfilterRules++]);
+   for (irule = 0; irule < nbrule; irule++)
+   {
+      filterRules[nbfilterRules++] = ruleList[irule];
+      devRuleFormat(&ruleList[irule], devallow, sizeof devallow);
+      log_info("Container pid %d: devices %s whitelisted", pid, devallow);
+   }
+
+   span = traceBegin();
+   ninsn = devFilterBuild(filterRules, nbfilterRules, insnList, maxfilterRules * 9 + 8);
+   if (ninsn < 0)
+   {
+      log_error("Devices filter program too large");
+      goto out;
+   }
+   progfd = devFilterLoad(insnList, ninsn);
+   if (progfd < 0)
+      goto out;
+   traceEnd(span, "devices filter load", "%d rules, %d instructions", nbfilterRules, ninsn);
+
+   cgfd = open(cgpath, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+   if (cgfd < 0)
+   {
+      log_error("Failed to open cgroup %s: %s", cgpath, strerror(errno));
+      goto out;
+   }
+
+   // runtime program to be replaced
+   memset(&attr, 0, sizeof attr);
+   attr.query.target_fd = cgfd;
+   attr.query.attach_type = BPF_CGROUP_DEVICE;
+   attr.query.prog_ids = (uintptr_t) progIds;
+   attr.query.prog_cnt = DEV_FILTER_PROGS_MAX;
+   if (bpfCall(BPF_PROG_QUERY, &attr) < 0)
+   {
+      log_error("Failed to query cgroup %s device programs: %s", cgpath, strerror(errno));
+      goto out;
+   }
+   // every attached program must allow an access: another one added next to the runtime ones could not widen them
+   if (attr.query.prog_cnt > 1)
+   {
+      log_error("Cgroup %s: %u device programs attached, can not replace them", cgpath, attr.query.prog_cnt);
+      goto out;
+   }
+
+   progCount = attr.query.prog_cnt;
+   attachFlags = attr.query.attach_flags;
+
+   span = traceBegin();
+   if ((progCount == 1) && (attachFlags & BPF_F_ALLOW_MULTI))
+   {
+      memset(&attr, 0, sizeof attr);
+      attr.prog_id = progIds[0];
+      oldfd = bpfCall(BPF_PROG_GET_FD_BY_ID, &attr);
+      if (oldfd < 0)
+      {
+         log_error("Cgroup %s: failed to get runtime device program: %s", cgpath, strerror(errno));
+         goto out;
+      }
+   }
+   memset(&attr, 0, sizeof attr);
+   if (progCount == 0)
+      attr.attach_flags = BPF_F_ALLOW_MULTI;
+   else if (! (attachFlags & BPF_F_ALLOW_MULTI))
+      attr.attach_flags = attachFlags;   // attaching with same flags replaces single program
+   else
+   {
+      attr.attach_flags = BPF_F_ALLOW_MULTI | BPF_F_REPLACE;
+      attr.replace_bpf_fd = oldfd;
+   }
+   attr.target_fd = cgfd;
+   attr.attach_bpf_fd = progfd;
+   attr.attach_type = BPF_CGROUP_DEVICE;
+   if (bpfCall(BPF_PROG_ATTACH, &attr) < 0)
+   {
+      log_error("Failed to attach devices filter to cgroup %s: %s", cgpath, strerror(errno));
+      goto out;
+   }
+   traceEnd(span, "devices filter attach", "%s", cgpath);
+   log_debug("Container pid %d: devices filter of %d rules attached to %s", pid, nbfilterRules, cgpath);
+   ret = 0;
+
+out:
+   if (oldfd >= 0)
+      close(oldfd);
+   if (progfd >= 0)
+      close(progfd);
+   if (cgfd >= 0)
+      close(cgfd);
+   free(insnList);
+   free(filterRules);
+   free(rules);
+   return ret;
+}
@@ -12,20 +12,20 @@
 #include <sys/mount.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <libgen.h>
 #include <dirent.h>
 
 #include "accelerator.h"
 
 #define NS_MOUNT_PROC_PATH      "/proc/%d/ns/mnt"
-#define SYSFS_CGROUP_DEV_PATH   SYSFS_CGROUP_PATH "/devices"
-#define SYSFS_CGROUP_DEV_ALLOW  "devices.allow"
 
 
 // Enter mount namespace of container PID
 int enterNamespace(pid_t pid)
 {
    char path[FS_PATH_MAX];
+   int64_t span = traceBegin();
    int fdnsDefault;
    int fdnsProc;
 
@@ -56,6 +56,7 @@ int enterNamespace(pid_t pid)
      return -1;
    }
    log_info("Switched to mount namespace of pid %d", pid);
+   traceEnd(span, "namespace enter", "pid %d", pid);
 
    close(fdnsProc);
    return(fdnsDefault);
@@ -64,6 +65,8 @@ int enterNamespace(pid_t pid)
 // Leave mount namespace of container PID
 int leaveNamespace(int fdnsDefault)
 {
+   int64_t span = traceBegin();
+
    if (fdnsDefault < 0)
       return(-1);
 
@@ -74,6 +77,7 @@ int leaveNamespace(int fdnsDefault)
      return -1;
    }
    log_info("Switched back to default mount namespace");
+   traceEnd(span, "namespace leave", NULL);
 
    close(fdnsDefault);
 
@@ -81,35 +85,24 @@ int leaveNamespace(int fdnsDefault)
 }
 
 
-// Add devices nodes to dest FS /sys/fs/cgroup/devices/devices.allow
-int allowDevices(char *rootfs, t_acceldev **acceldevList, int nbAcceldev)
+// Allow devices nodes to container, from host side: coalesced rules are written to its devices cgroup,
+// or with cgroup v2 set in a device filter program along with runtime rules
+int allowDevices(pid_t pid, char *runtimeRules, t_acceldev **acceldevList, int nbAcceldev)
 {
-   char sysCgroupPath[2*FS_PATH_MAX]; // *2 for nested FS
-   char pathallow[2*FS_PATH_MAX];
    char *devpath;
-   char devallow[32];
    struct stat stats;
-   FILE *pfd=NULL;
+   t_devRule *ruleList;
+   int nbrule = 0;
    int idev;
    int idevpath;
    int ret = -1;
 
-   snprintf(sysCgroupPath, sizeof(sysCgroupPath), "%s/%s", rootfs, SYSFS_CGROUP_DEV_PATH);
-   if (mount (NULL, sysCgroupPath, "cgroup", MS_BIND | MS_REMOUNT, NULL) < 0)
+   ruleList = calloc(nbAcceldev * NB_DEVPATH_MAX + 1, sizeof(t_devRule));
+   if (ruleList == NULL)
    {
-      log_error("Failed to remount sysfs cgroup devices read/write (path %s): %s", sysCgroupPath, strerror(errno));
-      return(-1);
+      log_error("Memory allocation failed");
+      return -1;
    }
-   log_debug("sysfs cgroup devices remounted read/write (path %s)", sysCgroupPath);
-
-   snprintf(pathallow, sizeof(pathallow), "%s/%s", sysCgroupPath, SYSFS_CGROUP_DEV_ALLOW);
-   pfd = fopen ( pathallow, "w" );
-   if ( pfd == NULL )
-   {
-      log_error("Failed to open %s in read/write mode", SYSFS_CGROUP_DEV_ALLOW);
-      goto out;
-   }
-
    for (idev = 0; idev < nbAcceldev; idev++)
    {
       for (idevpath = 0; idevpath < NB_DEVPATH_MAX; idevpath++)
@@ -123,68 +116,88 @@ int allowDevices(char *rootfs, t_acceldev **acceldevList, int nbAcceldev)
             log_error("Device node %s: stat failed: %s", devpath, strerror(errno));
             goto out;
          }
-         snprintf(devallow, sizeof(devallow), "c %d:%d rwm", major(stats.st_rdev), minor(stats.st_rdev));
-         log_debug("Device %s: devallow %s", acceldevList[idev]->bdf.str, devallow);
-         if (fputs(devallow, pfd ) <= 0)
-         {
-            log_error("Failed to write [%s] to devices.allow: %s", devallow, strerror(errno));
-            goto out;
-         }
-         fflush(pfd);
+         ruleList[nbrule].type = S_ISBLK(stats.st_mode) ? 'b' : 'c';
+         ruleList[nbrule].major = major(stats.st_rdev);
+         ruleList[nbrule].minor = minor(stats.st_rdev);
+         ruleList[nbrule].access = DEV_ACCESS_ALL;
+         ruleList[nbrule].allow = true;
+         ruleList[nbrule].exact = ! acceleratorDevnodesFixed(acceldevList[idev]);
+         nbrule++;
+         log_debug("Device %s: node %s %u:%u", acceldevList[idev]->bdf.str, devpath,
+               major(stats.st_rdev), minor(stats.st_rdev));
+      }
+   }
+   nbrule = devRulesCoalesce(ruleList, nbrule);
+
+   if (cgroupUnified())
+      ret = cgroup2AllowDevices(pid, runtimeRules, ruleList, nbrule);
+   else
+      ret = cgroup1AllowDevices(pid, ruleList, nbrule);
+
+out:
+   free(ruleList);
+   return ret;
+}
+
+// Add devices nodes and sysfs entries to container mount plan
+int attachDevices(t_mountPlan *plan, t_acceldev **acceldevList, int nbAcceldev)
+{
+   char *devpath;
+   int idev;
+   int idevpath;
+
+   for (idev = 0; idev < nbAcceldev; idev++)
+   {
+      for (idevpath = 0; idevpath < NB_DEVPATH_MAX; idevpath++)
+      {
+         devpath = acceldevList[idev]->devpath[idevpath];
+         if (strlen(devpath) == 0)
+            continue;
 
          // Attach host /dev/<devnode> to dest FS /dev/<devnode>
          // Note: runc uses mknod by default or mount bind if (RunningInUserNS() || config.Namespaces.Contains(configs.NEWUSER))
          //       libnvidia always mounts bind devnodes
          //   => use mount bind as it works in all situations
-         if (mountFile(rootfs, devpath, NULL, true, false, true) < 0)
-            goto out;
-
-         log_info("Device %s: device node %u:%u whitelisted",
-               acceldevList[idev]->bdf.str, major(stats.st_rdev), minor(stats.st_rdev));
+         if (mountPlanAdd(plan, devpath, NULL, true, false, true) < 0)
+            return -1;
       }
 
       // Mount accel and/or engine sysfs path if not empty
       if (strlen(acceldevList[idev]->syspathAccel) > 0)
       {
-         if (mountFile(rootfs, acceldevList[idev]->syspathAccel, NULL, false, false, true) < 0)
-            goto out;
+         if (mountPlanAdd(plan, acceldevList[idev]->syspathAccel, NULL, false, false, true) < 0)
+            return -1;
       }
       if (strlen(acceldevList[idev]->syspathEngine) > 0)
       {
-         if (mountFile(rootfs, acceldevList[idev]->syspathEngine, NULL, false, false, true) < 0)
-            goto out;
+         if (mountPlanAdd(plan, acceldevList[idev]->syspathEngine, NULL, false, false, true) < 0)
+            return -1;
       }
    }
 
-   ret = 0;
-
-out:
-   if (pfd != NULL)
-      fclose(pfd);
-   mount (NULL, sysCgroupPath, "cgroup", MS_BIND | MS_REMOUNT | MS_RDONLY | MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL);
-   log_debug("sysfs cgroup devices remounted read only");
-   return ret;
+   return 0;
 }
 
 
 // Set up container to be ready for accelerators access
-int containerSetup(pid_t pid, char *rootfs, t_acceldev **acceldevList, int nbAcceldev)
+int containerSetup(pid_t pid, char *rootfs, char *deviceRules, t_acceldev **acceldevList, int nbAcceldev)
 {
    const uint64_t MB = (1024 *1024);
    const uint64_t GB = MB * 1024;
    bool attachEngine[ACCEL_ENGINE_MAX] = { false };
+   t_mountPlan mountPlan = { 0 };
    int fdnsDefault = -1;  // file descriptor of default namespace
    int iengine;
    int idev;
    int  totHugepage2M = 0;
    int  totHugepage1G = 0;
+   int  nodeHugepage2M[NUMA_NODE_MAX] = { 0 };
+   int  nodeHugepage1G[NUMA_NODE_MAX] = { 0 };
+   int  node;
    rlim_t memHugepage;
+   int64_t bench;
    int ret = -1;
 
-   fdnsDefault = enterNamespace(pid);
-   if (fdnsDefault < 0)
-      return(-1);
-
    // Compute nb hugepages required for all attached devices
    for (idev = 0; idev < nbAcceldev; idev++)
    {
@@ -194,43 +207,78 @@ int containerSetup(pid_t pid, char *rootfs, t_acceldev **acceldevList, int nbAcc
 
          totHugepage2M += acceleratorHugepage2M(acceldevList[idev]);
          totHugepage1G += acceleratorHugepage1G(acceldevList[idev]);
+
+         // devices without NUMA affinity use node 0 pools
+         node = ((acceldevList[idev]->numaNode > 0) && (acceldevList[idev]->numaNode < NUMA_NODE_MAX)) ? acceldevList[idev]->numaNode : 0;
+         nodeHugepage2M[node] += acceleratorHugepage2M(acceldevList[idev]);
+         nodeHugepage1G[node] += acceleratorHugepage1G(acceldevList[idev]);
       }
    }
 
-   for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
+   // Fail fast if hugepages are missing on devices nodes, rather than later in the application
+   bench = benchStart();
+   for (node = 0; node < NUMA_NODE_MAX; node++)
    {
-      if (attachEngine[iengine])
+      if (((nodeHugepage2M[node] > 0) || (nodeHugepage1G[node] > 0))
+       && (hugepageReserve(node, nodeHugepage2M[node], nodeHugepage1G[node]) < 0))
       {
-         // mount binds engine generic paths
-         if (accelengineMountPaths(rootfs, iengine) < 0)
-            goto out;
-
-         // mount bind engine driver libraries
-         if (accelengineAttachLibs(rootfs, iengine) < 0)
-            goto out;
+         log_error("Container pid %d: not enough hugepages on NUMA node %d", pid, node);
+         return(-1);
       }
    }
-   ldconfigCacheUpdate(rootfs);
+   benchStop(BENCH_HOSTSETUP, bench, "hugepages");
 
-   // Configure device access inside container
-   if (allowDevices(rootfs, acceldevList, nbAcceldev) < 0)
-      goto out;
+   // Configure device access and memory resources from host side, before entering container mount namespace
+   bench = benchStart();
+   if (allowDevices(pid, deviceRules, acceldevList, nbAcceldev) < 0)
+      return(-1);
+   benchStop(BENCH_CGROUP, bench, "devices");
 
-   // Configure memory resources of container
    memHugepage = (totHugepage2M * MB * 2) + (totHugepage1G * GB);
+   bench = benchStart();
    if ( (rlimitConfig(pid, RLIMIT_MEMLOCK, memHugepage, memHugepage) != 0)
      || (limitHugetlb(pid, totHugepage2M, totHugepage1G) != 0))
    {
       log_error("Container pid %d: failed to set memory limits", pid);
-      goto out;
+      return(-1);
    }
+   benchStop(BENCH_CGROUP, bench, "memory limits");
    log_info("Container pid %d: memlock %llu, hugepages 2MB %d, hugepages 1GB %d", pid, memHugepage, totHugepage2M, totHugepage1G);
 
+   // Clone mount sources from host side too, only attach is left inside container mount namespace
+   bench = benchStart();
+   for (iengine = 0; iengine < ACCEL_ENGINE_MAX; iengine++)
+   {
+      // mount bind engine bundle: driver libraries and generic paths
+      if ((attachEngine[iengine]) && (accelengineAttachBundle(&mountPlan, iengine) < 0))
+         goto out;
+   }
+   if ( (attachDevices(&mountPlan, acceldevList, nbAcceldev) < 0)
+     || (mountPlanPrepare(&mountPlan) < 0))
+      goto out;
+   benchStop(BENCH_MOUNTS, bench, "prepare %d mounts", mountPlan.nbmount);
+
+   fdnsDefault = enterNamespace(pid);
+   if (fdnsDefault < 0)
+      goto out;
+
+   bench = benchStart();
+   if (mountPlanAttach(&mountPlan, rootfs) < 0)
+      goto out;
+   benchStop(BENCH_MOUNTS, bench, "attach %d mounts%s", mountPlan.nbmount, mountPlan.fdMounts ? "" : " by path");
+   for (idev = 0; idev < nbAcceldev; idev++)
+      log_info("Device %s: attached", acceldevList[idev]->bdf.str);
+
+   bench = benchStart();
+   accelengineUpdateLdcache(rootfs, attachEngine);
+   benchStop(BENCH_LDCACHE, bench, NULL);
+
    ret = 0;
 
 out:
    if (fdnsDefault != -1)
        leaveNamespace(fdnsDefault);
+   mountPlanFree(&mountPlan);
 
    return ret;
 }
@@ -0,0 +1,111 @@
+/*
+ * NUMA node hugepages pools
+ *
+ * Accelerator functions DMA buffers are hugepages, best allocated on the NUMA node of the device.
+ * Before a container is configured, each node pool is checked for enough free pages, and grown
+ * within configured ceilings (nr_hugepages of the node) if needed.
+ * Free pages are not reserved: containers started at the same time may still compete for them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "utils.h"
+
+#define HUGEPAGE_POOL_FMT  "%s/node%d/hugepages/hugepages-%s/%s"
+
+static const struct {
+   const char *name;     // log name
+   const char *dirsize;  // sysfs pool dir size
+} hugepageSizes[HUGEPAGE_SIZE_MAX] = {
+   [HUGEPAGE_2M] = { "2MB", "2048kB" },
+   [HUGEPAGE_1G] = { "1GB", "1048576kB" },
+};
+
+static int hugepageMax[HUGEPAGE_SIZE_MAX] = { 0, 0 };
+
+
+// Set per node pool ceilings the runtime may grow nr_hugepages to, 0 to never grow pools
+void hugepageSetMax(int max2M, int max1G)
+{
+   hugepageMax[HUGEPAGE_2M] = max2M;
+   hugepageMax[HUGEPAGE_1G] = max1G;
+}
+
+static int poolRead(int node, e_hugepageSize size, const char *entry, int *value)
+{
+   char syspath[FS_PATH_MAX];
+   char valuestr[32] = "";
+
+   snprintf(syspath, sizeof syspath, HUGEPAGE_POOL_FMT, hostPath(HOST_PATH_SYSFS_NODE), node, hugepageSizes[size].dirsize, entry);
+   if ((access(syspath, F_OK) != 0) || (sysfsReadString(syspath, valuestr, sizeof valuestr - 1) < 0))
+      return -1;
+   *value = atoi(valuestr);
+   return 0;
+}
+
+static int poolWrite(int node, e_hugepageSize size, const char *entry, int value)
+{
+   char syspath[FS_PATH_MAX];
+
+   snprintf(syspath, sizeof syspath, HUGEPAGE_POOL_FMT, hostPath(HOST_PATH_SYSFS_NODE), node, hugepageSizes[size].dirsize, entry);
+   return sysfsWriteUint64(syspath, value);
+}
+
+// Make sure node pool has nbHugepage free pages, growing it if allowed
+static int poolReserve(int node, e_hugepageSize size, int nbHugepage)
+{
+   const char *name = hugepageSizes[size].name;
+   int nbFree, nbPool, nbTarget;
+
+   if (poolRead(node, size, "free_hugepages", &nbFree) < 0)
+   {
+      log_error("NUMA node %d: no %s hugepages pool, %d pages required", node, name, nbHugepage);
+      return -1;
+   }
+   if (nbFree >= nbHugepage)
+   {
+      log_debug("NUMA node %d: %d %s hugepages free, %d required", node, nbFree, name, nbHugepage);
+      return 0;
+   }
+
+   if (poolRead(node, size, "nr_hugepages", &nbPool) < 0)
+      return -1;
+   nbTarget = nbPool + (nbHugepage - nbFree);
+   if (nbTarget > hugepageMax[size])
+   {
+      log_error("NUMA node %d: %d %s hugepages free, %d required: pool of %d pages can't grow to %d (max %d)",
+            node, nbFree, name, nbHugepage, nbPool, nbTarget, hugepageMax[size]);
+      return -1;
+   }
+
+   // The kernel allocates what it can, pages may be missing when node memory is fragmented
+   if ( (poolWrite(node, size, "nr_hugepages", nbTarget) < 0)
+     || (poolRead(node, size, "free_hugepages", &nbFree) < 0))
+      return -1;
+   if (nbFree < nbHugepage)
+   {
+      log_error("NUMA node %d: %s hugepages pool grown to %d pages, only %d free of %d required (memory fragmented?)",
+            node, name, nbTarget, nbFree, nbHugepage);
+      poolWrite(node, size, "nr_hugepages", nbPool);
+      return -1;
+   }
+   log_info("NUMA node %d: %s hugepages pool grown from %d to %d pages", node, name, nbPool, nbTarget);
+   return 0;
+}
+
+// Check node pools have enough free hugepages for devices functions
+int hugepageReserve(int node, int nbHugepage2M, int nbHugepage1G)
+{
+   int64_t span = traceBegin();
+
+   if ( ((nbHugepage2M > 0) && (poolReserve(node, HUGEPAGE_2M, nbHugepage2M) < 0))
+     || ((nbHugepage1G > 0) && (poolReserve(node, HUGEPAGE_1G, nbHugepage1G) < 0)))
+      return -1;
+
+   traceEnd(span, "hugepages reserve", "node %d", node);
+   return 0;
+}
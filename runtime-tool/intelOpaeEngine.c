@@ -7,25 +7,74 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <dirent.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <json-c/json.h>
 
 #include "accelerator.h"
 
-#define SYS_FPGA_CLASS_PATH "/sys/class/fpga"
 #define SYS_PORT_NAME_FMT   "intel-fpga-port.%d"
 #define SYS_FME_NAME_FMT    "intel-fpga-fme.%d"
 
 #define UUID_LEN_MAX 32
 
+// Intel FPGA driver FME partial reconfiguration (same ioctl number and leading fields for the upstream DFL driver)
+#define FPGA_MAGIC           0xB6
+#define FPGA_FME_BASE        0x80
+#define FPGA_FME_PORT_PR     _IO(FPGA_MAGIC, FPGA_FME_BASE + 0)
+#define FPGA_FME_PORT_RELEASE  _IO(FPGA_MAGIC, FPGA_FME_BASE + 1)
+#define FPGA_FME_PORT_ASSIGN   _IO(FPGA_MAGIC, FPGA_FME_BASE + 2)
+// upstream DFL driver takes the port id itself
+#define DFL_FME_PORT_RELEASE   _IOW(FPGA_MAGIC, FPGA_FME_BASE + 1, int)
+#define DFL_FME_PORT_ASSIGN    _IOW(FPGA_MAGIC, FPGA_FME_BASE + 2, int)
+
+// Port reset ioctl (same number for the upstream DFL driver)
+#define FPGA_PORT_BASE       0x40
+#define FPGA_PORT_RESET      _IO(FPGA_MAGIC, FPGA_PORT_BASE + 0)
+
+struct fpga_fme_port_pr {
+   uint32_t argsz;
+   uint32_t flags;
+   uint32_t port_id;
+   uint32_t buffer_size;
+   uint64_t buffer_address;
+   uint64_t status;           // HW error code if ioctl returns EIO
+};
+
+struct fpga_fme_port {
+   uint32_t argsz;
+   uint32_t flags;
+   uint32_t port_id;
+};
+
+// GBS file: GUID (bytes reversed) | metadata length | JSON metadata | raw bitstream
+#define GBS_GUID             "\x31\x30\x30\x76\x53\x42\x47\xB7\x41\x47\x50\x46\x6E\x6F\x65\x58"
+#define GBS_GUID_LEN         16
+#define GBS_HEADER_LEN       (GBS_GUID_LEN + sizeof(uint32_t))
+#define GBS_JSON_IMAGE       "afu-image"
+#define GBS_JSON_INTERFACE   "interface-uuid"
+#define GBS_JSON_CLUSTERS    "accelerator-clusters"
+#define GBS_JSON_AFU_UUID    "accelerator-type-uuid"
+#define GBS_JSON_CLOCK_HIGH  "clock-frequency-high"
+#define GBS_JSON_CLOCK_LOW   "clock-frequency-low"
+
+#define CMD_FPGACONF "fpgaconf"
+
 static t_accelEngine intelOpaeEngine = {
    .name = "IntelOPAE",
    .bistreamPath = "/usr/lib/bitstream/intel",
    .reconfigPhysfn = true,
    .reconfigVirtfn = false,
-   .sriovMode = false
+   .sriovMode = false,
+   .warmFunction = ACCELFUNC_UNKNOWN
 };
 
 static char *logtag = intelOpaeEngine.name;
@@ -43,6 +92,9 @@ static const char * const intelSysentriesRW[] = {
    "errors/clear"
 };
 
+// sysfs dirs changing when FPGA devices are added/removed, set at registration
+static const char * intelSyswatch[1];
+
 
 static t_acceldev fmeDevice[ACCEL_DEVICE_ENGINE_MAX];
 static int nbFmeDevices = 0;
@@ -118,13 +170,31 @@ static int readAfuId(t_acceldev *acceldev)
    return 0;
 }
 
-// Read AFU port info: afu id, attached fme
-static int readPortInfo(t_acceldev *acceldev, char *sysentry)
+// FME device of the physical function of a virtual function entry, NULL if not enumerated (yet)
+static t_acceldev *physfnFme(char *sysentry)
 {
    char syspath[FS_PATH_MAX];
    t_pcibdf  bdf;
    int ifme;
 
+   snprintf(syspath, FS_PATH_MAX, "%s/%s/%s", sysentry, "device", "physfn");
+   if (busdevfnFromSymlink(syspath, & bdf) < 0)
+      return NULL;
+
+   for (ifme = 0; ifme < nbFmeDevices; ifme++)
+   {
+      if (! strcmp(fmeDevice[ifme].bdf.str, bdf.str))
+         return & fmeDevice[ifme];
+   }
+   return NULL;
+}
+
+// Read AFU port info: afu id, attached fme.
+// The FME of a virtual function may be enumerated after it: left NULL then.
+static int readPortInfo(t_acceldev *acceldev, char *sysentry)
+{
+   char syspath[FS_PATH_MAX];
+
    if (readAfuId(acceldev) < 0)
       return -1;
 
@@ -134,28 +204,13 @@ static int readPortInfo(t_acceldev *acceldev, char *sysentry)
    if (acceldev->privdata == NULL)
    {
       snprintf(syspath, FS_PATH_MAX, "%s/%s/%s", sysentry, "device", "physfn");
-      if (busdevfnFromSymlink(syspath, & bdf) < 0)
+      if (access(syspath, F_OK) != 0)
       {
          log_error("%s: Entry %s: failed to get physfn", logtag, sysentry);
          return -1;
       }
-
       acceldev->pcifnType = PCIFUNC_VIRTUAL;
-
-      for (ifme = 0; ifme < nbFmeDevices; ifme++)
-      {
-         if (! strcmp(fmeDevice[ifme].bdf.str, bdf.str))
-         {
-            acceldev->privdata = & fmeDevice[ifme];
-            break;
-         }
-      }
-   }
-
-   if (acceldev->privdata == NULL)
-   {
-      log_error("%s: Port %s: failed to get attached FME", logtag, acceldev->bdf.str);
-      return -1;
+      acceldev->privdata = physfnFme(sysentry);
    }
    return 0;
 }
@@ -173,15 +228,17 @@ static int enumerate(t_acceldev acceldevList[], int *nbAcceldev)
    t_acceldev acceldev;
    t_acceldev *fmeptr;
    char *ptr;
-   int ifme, iport;
+   int ifme, iport, firstport;
    int ret = -1;
 
-   sysdir = opendir(SYS_FPGA_CLASS_PATH);
+   nbFmeDevices = 0;  // enumerated again after ports were moved to virtual functions
+   sysdir = opendir(hostPath(HOST_PATH_SYSFS_FPGA));
    if (sysdir == NULL)
    {
       log_warn("%s: sysfs FPGA class not found: check FPGA driver inserted", logtag);
       return 0; // not an error, only xilinx fpga may be present
    }
+   firstport = *nbAcceldev;
 
    while ( ((*nbAcceldev) < ACCEL_DEVICE_MAX)
         && ((dirent = readdir(sysdir)) != NULL) )
@@ -200,7 +257,7 @@ static int enumerate(t_acceldev acceldevList[], int *nbAcceldev)
          continue;
       }
       acceldev.slotId = atoi(ptr+1);
-      snprintf(sysentry, FS_PATH_MAX, "%s/%s", SYS_FPGA_CLASS_PATH, dirent->d_name);
+      snprintf(sysentry, FS_PATH_MAX, "%s/%s", hostPath(HOST_PATH_SYSFS_FPGA), dirent->d_name);
 
       // Get bdf (bus, device, function) from symlink "device -> ../../../0000:06:00.0"
       snprintf(syspath, FS_PATH_MAX, "%s/%s", sysentry, "device");
@@ -219,13 +276,15 @@ static int enumerate(t_acceldev acceldevList[], int *nbAcceldev)
       acceldev.deviceId = (int) sysfsReadUint64(syspath);
       if (acceldev.deviceId < 0)
          continue;
+      snprintf(syspath, FS_PATH_MAX, "%s/%s", sysentry, "device");
+      acceldev.numaNode = pciNumaNode(syspath);
 
       // Create FME object if found
       snprintf(devname, FILE_NAME_MAX, SYS_FME_NAME_FMT, acceldev.slotId);
       snprintf(acceldev.syspathAccel, FS_PATH_MAX, "%s/%s", sysentry, devname);
-      if (stat(acceldev.syspathAccel, &stats) == 0)
+      if ((stat(acceldev.syspathAccel, &stats) == 0) && (nbFmeDevices < ACCEL_DEVICE_ENGINE_MAX))
       {
-         snprintf(acceldev.devpath[0], FS_PATH_MAX, "%s/%s", LINUX_DEV_PATH, devname);
+         snprintf(acceldev.devpath[0], FS_PATH_MAX, "%s/%s", hostPath(HOST_PATH_DEV), devname);
 
          ifme = nbFmeDevices ++;
          fmeDevice[ifme] = acceldev;
@@ -241,7 +300,7 @@ static int enumerate(t_acceldev acceldevList[], int *nbAcceldev)
       snprintf(acceldev.syspathAccel, FS_PATH_MAX, "%s/%s", sysentry, devname);
       if (stat(acceldev.syspathAccel, &stats) == 0)
       {
-         snprintf(acceldev.devpath[0], FS_PATH_MAX, "%s/%s", LINUX_DEV_PATH, devname);
+         snprintf(acceldev.devpath[0], FS_PATH_MAX, "%s/%s", hostPath(HOST_PATH_DEV), devname);
 
          iport = *nbAcceldev;
          acceldevList[iport] = acceldev;
@@ -259,6 +318,23 @@ static int enumerate(t_acceldev acceldevList[], int *nbAcceldev)
       }
    }
 
+   // Attach FMEs listed after their virtual functions
+   for (iport = firstport; iport < *nbAcceldev; )
+   {
+      if (acceldevList[iport].privdata == NULL)
+      {
+         strcpy(syspath, acceldevList[iport].syspathAccel);
+         acceldevList[iport].privdata = physfnFme(dirname(syspath));
+         if (acceldevList[iport].privdata == NULL)
+         {
+            log_error("%s: Port %s: failed to get attached FME", logtag, acceldevList[iport].bdf.str);
+            memmove(& acceldevList[iport], & acceldevList[iport+1], (*nbAcceldev - iport - 1) * sizeof(t_acceldev));
+            (*nbAcceldev) --;
+            continue;
+         }
+      }
+      iport++;
+   }
    ret = 0;
 
    if (sysdir != NULL)
@@ -267,26 +343,280 @@ static int enumerate(t_acceldev acceldevList[], int *nbAcceldev)
 }
 
 
+// FME and port ioctls entry point, may be replaced by a shim for tests
+static int (*fmeIoctl)(int fd, unsigned long request, ...) = ioctl;
+
+void intelOpaeSetIoctl(int (*ioctlfn)(int fd, unsigned long request, ...))
+{
+   fmeIoctl = (ioctlfn != NULL) ? ioctlfn : ioctl;
+}
+
+
+// Compare UUIDs ignoring dashes and case
+static bool uuidEqual(const char *uuid1, const char *uuid2)
+{
+   while ((*uuid1 != '\0') || (*uuid2 != '\0'))
+   {
+      if (*uuid1 == '-') { uuid1++; continue; }
+      if (*uuid2 == '-') { uuid2++; continue; }
+      if ((*uuid1 == '\0') || (*uuid2 == '\0') || (tolower((unsigned char) *uuid1) != tolower((unsigned char) *uuid2)))
+         return false;
+      uuid1++;
+      uuid2++;
+   }
+   return true;
+}
+
+// AFU user clock frequency set by GBS metadata (not absent nor 0)
+static bool gbsUserClock(json_object *jsonImage, const char *key)
+{
+   json_object *object;
+
+   if (! json_object_object_get_ex(jsonImage, key, &object))
+      return false;
+   return ! ( ((json_object_get_type(object) == json_type_int) || (json_object_get_type(object) == json_type_double))
+           && (json_object_get_double(object) == 0));
+}
+
+// Check GBS metadata matches expected AFU and FME PR interface, tell if it sets AFU user clocks
+static int checkGbsMetadata(t_acceldev *acceldev, t_accelfuncConf *accelfuncConf, const char *gbsfile,
+      const char *metadata, uint32_t metalen, bool *userClock)
+{
+   json_tokener *tokener;
+   json_object *jsonRoot;
+   json_object *jsonImage, *jsonClusters, *object;
+   t_acceldev *fme = acceldev->privdata;
+   char syspath[2*FS_PATH_MAX];
+   char interfaceId[UUID_LEN_MAX+8] = { 0 };
+   const char *afuId = NULL;
+   int ret = -1;
+
+   tokener = json_tokener_new();
+   if (tokener == NULL)
+      return -1;
+   jsonRoot = json_tokener_parse_ex(tokener, metadata, metalen);
+   json_tokener_free(tokener);
+   if ((jsonRoot == NULL) || (! json_object_object_get_ex(jsonRoot, GBS_JSON_IMAGE, &jsonImage)))
+   {
+      log_error("%s: %s: malformed metadata", logtag, gbsfile);
+      goto out;
+   }
+
+   if ((json_object_object_get_ex(jsonImage, GBS_JSON_CLUSTERS, &jsonClusters))
+    && (json_object_get_type(jsonClusters) == json_type_array) && (json_object_array_length(jsonClusters) > 0)
+    && (json_object_object_get_ex(json_object_array_get_idx(jsonClusters, 0), GBS_JSON_AFU_UUID, &object)))
+      afuId = json_object_get_string(object);
+   if ((afuId == NULL) || (! uuidEqual(afuId, accelfuncConf->accelID)))
+   {
+      log_error("%s: %s: AFU id %s, expected %s", logtag, gbsfile, afuId ? afuId : "missing", accelfuncConf->accelID);
+      goto out;
+   }
+
+   // FME interface id is only available with recent drivers
+   snprintf(syspath, sizeof syspath, "%s/%s", fme->syspathAccel, "pr/interface_id");
+   if ((json_object_object_get_ex(jsonImage, GBS_JSON_INTERFACE, &object))
+    && (access(syspath, F_OK) == 0) && (sysfsReadString(syspath, interfaceId, sizeof interfaceId) == 0))
+   {
+      interfaceId[strcspn(interfaceId, "\n")] = '\0';
+      if (! uuidEqual(json_object_get_string(object), interfaceId))
+      {
+         log_error("%s: Device %s: %s built for PR interface %s, FME has %s", logtag, acceldev->bdf.str,
+               gbsfile, json_object_get_string(object), interfaceId);
+         goto out;
+      }
+   }
+   *userClock = gbsUserClock(jsonImage, GBS_JSON_CLOCK_HIGH) || gbsUserClock(jsonImage, GBS_JSON_CLOCK_LOW);
+   ret = 0;
+
+out:
+   if (jsonRoot != NULL)
+      json_object_put(jsonRoot);
+   return ret;
+}
+
+// Port id within its FME, default to first port
+static uint32_t portId(t_acceldev *acceldev)
+{
+   char syspath[2*FS_PATH_MAX];
+
+   snprintf(syspath, sizeof syspath, "%s/%s", acceldev->syspathAccel, "id");
+   return (access(syspath, F_OK) == 0) ? (uint32_t) sysfsReadUint64(syspath) : 0;
+}
+
+// Release port from its physical function (assign false) or give it back (assign true)
+static int fmePortMove(int fmefd, uint32_t port, bool assign)
+{
+   struct fpga_fme_port fmePort = { sizeof fmePort, 0, port };
+   int dflPort = port;
+
+   if (fmeIoctl(fmefd, assign ? FPGA_FME_PORT_ASSIGN : FPGA_FME_PORT_RELEASE, &fmePort) == 0)
+      return 0;
+   if (errno != ENOTTY)
+      return -1;
+   return fmeIoctl(fmefd, assign ? DFL_FME_PORT_ASSIGN : DFL_FME_PORT_RELEASE, &dflPort);
+}
+
+// Program GBS file to AFU port through its FME partial reconfiguration ioctl.
+// A port of a virtual function is assigned back to the physical function while programmed.
+// Return -2 if the driver does not support this ioctl, or if the GBS sets AFU user clocks: only fpgaconf programs them.
+static int loadGbs(t_acceldev *acceldev, t_accelfuncConf *accelfuncConf, const char *gbsfile)
+{
+   struct fpga_fme_port_pr portPr;
+   t_acceldev *fme = acceldev->privdata;
+   struct stat stats;
+   uint32_t metalen;
+   bool virtfn = (acceldev->pcifnType == PCIFUNC_VIRTUAL);
+   bool userClock = false;
+   int64_t assignNs = 0, prNs, releaseNs = 0;
+   int64_t span;
+   char *gbs;
+   int fd, fmefd;
+   int ret = -1;
+
+   if (fme == NULL)
+   {
+      log_error("%s: Device %s: no FME attached", logtag, acceldev->bdf.str);
+      return -1;
+   }
+
+   fd = open(gbsfile, O_RDONLY|O_CLOEXEC);
+   if (fd < 0)
+   {
+      log_error("%s: %s: open failed: %s", logtag, gbsfile, strerror(errno));
+      return -1;
+   }
+   if ((fstat(fd, &stats) < 0) || (stats.st_size < GBS_HEADER_LEN))
+   {
+      log_error("%s: %s: not a GBS file", logtag, gbsfile);
+      close(fd);
+      return -1;
+   }
+   gbs = mmap(NULL, stats.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (gbs == MAP_FAILED)
+   {
+      log_error("%s: %s: mmap failed: %s", logtag, gbsfile, strerror(errno));
+      return -1;
+   }
+
+   memcpy(&metalen, gbs + GBS_GUID_LEN, sizeof metalen);
+   if ((memcmp(gbs, GBS_GUID, GBS_GUID_LEN) != 0) || (metalen > stats.st_size - GBS_HEADER_LEN))
+   {
+      log_error("%s: %s: not a GBS file", logtag, gbsfile);
+      goto out;
+   }
+   if (checkGbsMetadata(acceldev, accelfuncConf, gbsfile, gbs + GBS_HEADER_LEN, metalen, &userClock) < 0)
+      goto out;
+   if (userClock && virtfn)
+   {
+      log_error("%s: Device %s: %s sets AFU user clocks, not supported on a virtual function port", logtag,
+            acceldev->bdf.str, gbsfile);
+      goto out;
+   }
+   if (userClock)
+   {
+      log_info("%s: Device %s: %s sets AFU user clocks", logtag, acceldev->bdf.str, gbsfile);
+      ret = -2;
+      goto out;
+   }
+
+   memset(&portPr, 0, sizeof portPr);
+   portPr.argsz = sizeof portPr;
+   portPr.port_id = portId(acceldev);
+   portPr.buffer_address = (uint64_t) (uintptr_t) (gbs + GBS_HEADER_LEN + metalen);
+   portPr.buffer_size = stats.st_size - GBS_HEADER_LEN - metalen;
+
+   fmefd = open(fme->devpath[0], O_RDWR|O_CLOEXEC);
+   if (fmefd < 0)
+   {
+      log_error("%s: Device %s: open %s failed: %s", logtag, acceldev->bdf.str, fme->devpath[0], strerror(errno));
+      goto out;
+   }
+   if (virtfn)
+   {
+      span = traceNow();
+      if (fmePortMove(fmefd, portPr.port_id, true) < 0)
+      {
+         log_error("%s: Device %s: failed to assign port %u to physical function: %s", logtag, acceldev->bdf.str,
+               portPr.port_id, strerror(errno));
+         close(fmefd);
+         goto out;
+      }
+      traceEnd(span, "port assign", "%s port %u", acceldev->bdf.str, portPr.port_id);
+      assignNs = traceNow() - span;
+   }
+
+   span = traceNow();
+   if (fmeIoctl(fmefd, FPGA_FME_PORT_PR, &portPr) == 0)
+      ret = 0;
+   else if ((errno == ENOTTY) && (! virtfn))
+   {
+      log_info("%s: Device %s: FME PR ioctl not supported", logtag, acceldev->bdf.str);
+      ret = -2;
+   }
+   else if (errno == EIO)
+      log_error("%s: Device %s: partial reconfiguration failed: HW status 0x%" PRIx64, logtag, acceldev->bdf.str, portPr.status);
+   else
+      log_error("%s: Device %s: partial reconfiguration failed: %s", logtag, acceldev->bdf.str, strerror(errno));
+   traceEnd(span, "partial reconfiguration", "%s port %u", acceldev->bdf.str, portPr.port_id);
+   prNs = traceNow() - span;
+
+   if (virtfn)
+   {
+      // give port back to its virtual function, even if not programmed
+      span = traceNow();
+      if (fmePortMove(fmefd, portPr.port_id, false) < 0)
+      {
+         log_error("%s: Device %s: failed to release port %u to virtual function: %s", logtag, acceldev->bdf.str,
+               portPr.port_id, strerror(errno));
+         ret = -1;
+      }
+      traceEnd(span, "port release", "%s port %u", acceldev->bdf.str, portPr.port_id);
+      releaseNs = traceNow() - span;
+   }
+   close(fmefd);
+
+   if (virtfn)
+      log_info("%s: Device %s: port assign %d ms, partial reconfiguration %d ms, port release %d ms", logtag,
+            acceldev->bdf.str, (int) (assignNs / 1000000), (int) (prNs / 1000000), (int) (releaseNs / 1000000));
+
+out:
+   munmap(gbs, stats.st_size);
+   return ret;
+}
+
 // Load green bitstream to an Intel AFU
 static int loadBitstream(t_acceldev *acceldev, t_accelfuncConf *accelfuncConf)
 {
-   char cmd[FS_PATH_MAX];
-
-   sprintf(cmd, "fpgaconf -b %d -d %d -f %d %s/%s",
-         acceldev->bdf.bus, acceldev->bdf.device, acceldev->bdf.function,
-         intelOpaeEngine.bistreamPath, accelfuncConf->bistreamFile);
-   if (system(cmd) != 0)
+   char gbsfile[2*FS_PATH_MAX];
+   char cmd[3*FS_PATH_MAX];
+   int64_t span;
+   int ret;
+
+   snprintf(gbsfile, sizeof gbsfile, "%s/%s", intelOpaeEngine.bistreamPath, accelfuncConf->bistreamFile);
+   ret = loadGbs(acceldev, accelfuncConf, gbsfile);
+   if (ret == -2)
+   {
+      // driver without FME PR ioctl or user clocks to set: let OPAE tool do it
+      log_info("%s: Device %s: load through %s", logtag, acceldev->bdf.str, CMD_FPGACONF);
+      snprintf(cmd, sizeof cmd, CMD_FPGACONF " -b %d -d %d -f %d %s",
+            acceldev->bdf.bus, acceldev->bdf.device, acceldev->bdf.function, gbsfile);
+      ret = (system(cmd) == 0) ? 0 : -1;
+   }
+   if (ret < 0)
    {
       log_error("%s: Device %s: engine failed to load function %s", logtag, acceldev->bdf.str, accelfuncIndexToName(accelfuncConf->funcID));
       return -1;
    }
 
    // Update AFU UUID
+   span = traceBegin();
    if (readAfuId(acceldev) < 0)
    {
       log_error("%s: Device %s: failed to read AFU id after reconfig", logtag, acceldev->bdf.str);
       return -1;
    }
+   traceEnd(span, "afu_id check", "%s", acceldev->bdf.str);
 
    if (strcmp(acceldev->funcHwid, accelfuncConf->accelID) != 0)
    {
@@ -302,9 +632,179 @@ static int loadBitstream(t_acceldev *acceldev, t_accelfuncConf *accelfuncConf)
 
 
 
+// Release ports of an FPGA from its physical function, then create one virtual function per port:
+// each virtual function gets its own port device. Port list holds all ports of the FPGA, leased by caller,
+// ports already on virtual functions included: these are removed and created again with the new ones.
+static int sriovEnable(t_acceldev **portList, int nbport)
+{
+   t_acceldev *fme = portList[0]->privdata;
+   char pcisyspath[FS_PATH_MAX];
+   char syspath[2*FS_PATH_MAX];
+   bool released[ACCEL_DEVICE_MAX] = { false };
+   char *sep;
+   int64_t span;
+   uint64_t nbvfs, nbports;
+   int nbvirtport = 0;
+   int fmefd;
+   int iport;
+
+   if ((fme == NULL) || (nbport > ACCEL_DEVICE_MAX))
+      return -1;
+   for (iport = 0; iport < nbport; iport++)
+   {
+      if (portList[iport]->pcifnType == PCIFUNC_VIRTUAL)
+         nbvirtport++;
+   }
+
+   // FPGA device entry, parent of FME entry
+   snprintf(pcisyspath, sizeof pcisyspath, "%s", fme->syspathAccel);
+   if ((sep = strrchr(pcisyspath, '/')) != NULL)
+      *sep = '\0';
+
+   // every port must be known (and leased): a port missing from the list may be in use
+   snprintf(syspath, sizeof syspath, "%s/%s", fme->syspathAccel, "ports_num");
+   nbports = (access(syspath, F_OK) == 0) ? sysfsReadUint64(syspath) : (uint64_t) nbport;
+   snprintf(syspath, sizeof syspath, "%s/device/sriov_numvfs", pcisyspath);
+   nbvfs = sysfsReadUint64(syspath);
+   if ((nbports != (uint64_t) nbport) || (nbvfs != (uint64_t) nbvirtport))
+   {
+      log_error("%s: Device %s: %d port(s) and %d virtual function(s), %d port(s) and %d virtual function port(s) found",
+            logtag, fme->bdf.str, (int) nbports, (int) nbvfs, nbport, nbvirtport);
+      return -1;
+   }
+   snprintf(syspath, sizeof syspath, "%s/device/sriov_totalvfs", pcisyspath);
+   nbvfs = (access(syspath, F_OK) == 0) ? sysfsReadUint64(syspath) : 0;
+   if (nbvfs < (uint64_t) nbport)
+   {
+      log_error("%s: Device %s: %d port(s), but %d virtual function(s) supported", logtag, fme->bdf.str, nbport, (int) nbvfs);
+      return -1;
+   }
+
+   fmefd = open(fme->devpath[0], O_RDWR|O_CLOEXEC);
+   if (fmefd < 0)
+   {
+      log_error("%s: Device %s: open %s failed: %s", logtag, fme->bdf.str, fme->devpath[0], strerror(errno));
+      return -1;
+   }
+
+   // a new count is refused (EBUSY) while virtual functions exist: remove them first, their ports are leased
+   snprintf(syspath, sizeof syspath, "%s/device/sriov_numvfs", pcisyspath);
+   if (nbvirtport > 0)
+   {
+      span = traceBegin();
+      log_debug("%s: Device %s: remove %d virtual function(s) to create %d", logtag, fme->bdf.str, nbvirtport, nbport);
+      if (sysfsWriteUint64(syspath, 0) < 0)
+      {
+         log_error("%s: Device %s: failed to remove %d virtual function(s)", logtag, fme->bdf.str, nbvirtport);
+         close(fmefd);
+         return -1;
+      }
+      traceEnd(span, "sriov_numvfs", "%s 0", fme->bdf.str);
+   }
+
+   for (iport = 0; iport < nbport; iport++)
+   {
+      span = traceBegin();
+      if (fmePortMove(fmefd, portId(portList[iport]), false) == 0)
+         released[iport] = true;
+      else if (portList[iport]->pcifnType == PCIFUNC_VIRTUAL)
+      {
+         // drivers not giving ports of removed virtual functions back to the physical function
+         log_debug("%s: Device %s: port of removed virtual function still released: %s", logtag,
+               portList[iport]->bdf.str, strerror(errno));
+      }
+      else
+      {
+         log_error("%s: Device %s: failed to release port from physical function: %s", logtag, portList[iport]->bdf.str, strerror(errno));
+         goto rollback;
+      }
+      traceEnd(span, "port release", "%s", portList[iport]->bdf.str);
+   }
+
+   span = traceBegin();
+   if (sysfsWriteUint64(syspath, nbport) < 0)
+   {
+      log_error("%s: Device %s: failed to create %d virtual function(s)", logtag, fme->bdf.str, nbport);
+      goto rollback;
+   }
+   traceEnd(span, "sriov_numvfs", "%s %d", fme->bdf.str, nbport);
+   close(fmefd);
+
+   log_info("%s: Device %s: %d port(s) moved to virtual functions, %d already were", logtag, fme->bdf.str,
+         nbport - nbvirtport, nbvirtport);
+   return 0;
+
+rollback:
+   // ports of removed virtual functions stay on the physical function
+   for (iport = 0; iport < nbport; iport++)
+   {
+      if (released[iport])
+         fmePortMove(fmefd, portId(portList[iport]), true);
+   }
+   close(fmefd);
+   return -1;
+}
+
+// Clear port errors left by the container, and reset its AFU if asked
+static int release(t_acceldev *acceldev, bool reset)
+{
+   char syspath[2*FS_PATH_MAX];
+   char errorstr[32] = "";
+   uint64_t errors = 0;
+   int fd;
+   int ret = 0;
+
+   // errors are cleared by writing them back (64 bits hex mask, too long for sysfsReadUint64)
+   snprintf(syspath, sizeof syspath, "%s/%s", acceldev->syspathAccel, "errors/errors");
+   if ((access(syspath, F_OK) == 0) && (sysfsReadString(syspath, errorstr, sizeof errorstr - 1) == 0))
+      errors = strtoull(errorstr, NULL, 0);
+   if (errors != 0)
+   {
+      snprintf(syspath, sizeof syspath, "%s/%s", acceldev->syspathAccel, "errors/clear");
+      if (sysfsWriteUint64(syspath, errors) < 0)
+      {
+         log_error("%s: Device %s: failed to clear port errors 0x%" PRIx64, logtag, acceldev->bdf.str, errors);
+         ret = -1;
+      }
+      else
+         log_info("%s: Device %s: port errors 0x%" PRIx64 " cleared", logtag, acceldev->bdf.str, errors);
+   }
+
+   if (reset)
+   {
+      fd = open(acceldev->devpath[0], O_RDWR|O_CLOEXEC);
+      if ((fd < 0) || (fmeIoctl(fd, FPGA_PORT_RESET) < 0))
+      {
+         log_error("%s: Device %s: port reset failed: %s", logtag, acceldev->bdf.str, strerror(errno));
+         ret = -1;
+      }
+      if (fd >= 0)
+         close(fd);
+   }
+   return ret;
+}
+
+// Re-read AFU currently loaded into port
+static int refresh(t_acceldev *acceldev)
+{
+   return readAfuId(acceldev);
+}
+
+// FME devices referred by ports privdata
+static void engineDevices(t_acceldev **engdevList, int **nbEngdev)
+{
+   *engdevList = fmeDevice;
+   *nbEngdev = & nbFmeDevices;
+}
+
+
 static t_accelOps intelOpaeOps = {
    .enumerate = enumerate,
-   .loadBitstream = loadBitstream
+   .loadBitstream = loadBitstream,
+   .refresh = refresh,
+   .engineDevices = engineDevices,
+   .sriovEnable = sriovEnable,
+   .release = release
 };
 
 t_accelEngine * intelOpaeRegister()
@@ -312,6 +812,10 @@ t_accelEngine * intelOpaeRegister()
    intelOpaeEngine.sysentriesRW = (char **) intelSysentriesRW;
    intelOpaeEngine.nbsysentries = nitems(intelSysentriesRW);
 
+   intelSyswatch[0] = hostPath(HOST_PATH_SYSFS_FPGA);
+   intelOpaeEngine.syswatch = (char **) intelSyswatch;
+   intelOpaeEngine.nbsyswatch = nitems(intelSyswatch);
+
    intelOpaeEngine.libsnames = (char **) intelAccelLibs;
    intelOpaeEngine.nblibs = nitems(intelAccelLibs);
 
@@ -0,0 +1,609 @@
+/*
+ * Dynamic linker cache (ld.so.cache) reader and incremental writer
+ *
+ * Supports the old "ld.so-1.7.0" format, the new "glibc-ld.so.cache1.1" format,
+ * and the compat format made of an old cache followed by a new one.
+ * Entries are sorted by ldconfig in decreasing _dl_cache_libcmp() order, so look them up
+ * by binary search the way ld.so does.
+ *
+ * The writer only inserts or replaces a few entries of an existing cache and always writes the new format:
+ *    header | entries | original strings and extensions, shifted | added strings
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+
+#include "utils.h"
+
+#define LDCACHE_MAGIC_OLD      "ld.so-1.7.0"
+#define LDCACHE_MAGIC_NEW      "glibc-ld.so.cache"
+#define LDCACHE_VERSION_NEW    "1.1"
+#define LDCACHE_ALIGN_NEW      8
+
+#define LDCACHE_EXTENSION_MAGIC         0xeaa42174
+#define LDCACHE_EXTENSION_TAG_GENERATOR 0
+#define LDCACHE_EXTENSION_TAG_HWCAPS    1
+
+#define LDCACHE_FLAG_TYPE_MASK 0x00ff
+#define LDCACHE_FLAG_ELF_LIBC6 0x0003
+#define LDCACHE_FLAG_ARCH_MASK 0xff00
+#if defined(__x86_64__)
+#define LDCACHE_FLAG_ARCH      0x0300
+#elif defined(__aarch64__)
+#define LDCACHE_FLAG_ARCH      0x0a00
+#elif defined(__powerpc64__)
+#define LDCACHE_FLAG_ARCH      0x0500
+#else
+#define LDCACHE_FLAG_ARCH      0x0000
+#endif
+
+typedef struct {
+   int32_t  flags;
+   uint32_t key;
+   uint32_t value;
+} t_ldcacheEntryOld;
+
+typedef struct {
+   char     magic[sizeof LDCACHE_MAGIC_OLD - 1];
+   uint32_t nlibs;
+} t_ldcacheHeaderOld;
+
+typedef struct {
+   int32_t  flags;
+   uint32_t key;
+   uint32_t value;
+   uint32_t osversion;
+   uint64_t hwcap;
+} t_ldcacheEntryNew;
+
+typedef struct {
+   char     magic[sizeof LDCACHE_MAGIC_NEW - 1];
+   char     version[sizeof LDCACHE_VERSION_NEW - 1];
+   uint32_t nlibs;
+   uint32_t len_strings;
+   uint8_t  flags;
+   uint8_t  padding[3];
+   uint32_t extension_offset;
+   uint32_t unused[3];
+} t_ldcacheHeaderNew;
+
+typedef struct {
+   uint32_t tag;
+   uint32_t flags;
+   uint32_t offset;
+   uint32_t size;
+} t_ldcacheExtensionSection;
+
+typedef struct {
+   uint32_t magic;
+   uint32_t count;
+   t_ldcacheExtensionSection sections[];
+} t_ldcacheExtension;
+
+
+// Same ordering as glibc _dl_cache_libcmp(): digits sequences are compared numerically
+static int ldcacheLibcmp(const char *p1, const char *p2)
+{
+   while (*p1 != '\0')
+   {
+      if (*p1 >= '0' && *p1 <= '9')
+      {
+         if (*p2 >= '0' && *p2 <= '9')
+         {
+            int val1;
+            int val2;
+
+            val1 = *p1++ - '0';
+            val2 = *p2++ - '0';
+            while (*p1 >= '0' && *p1 <= '9')
+               val1 = val1 * 10 + *p1++ - '0';
+            while (*p2 >= '0' && *p2 <= '9')
+               val2 = val2 * 10 + *p2++ - '0';
+            if (val1 != val2)
+               return val1 - val2;
+         }
+         else
+            return 1;
+      }
+      else if (*p2 >= '0' && *p2 <= '9')
+         return -1;
+      else if (*p1 != *p2)
+         return *p1 - *p2;
+      else
+      {
+         ++p1;
+         ++p2;
+      }
+   }
+   return *p1 - *p2;
+}
+
+
+// Map opened cache file (closed here) and locate its entries table
+static int ldcacheMap(int fd, const char *path, t_ldcache *cache)
+{
+   t_ldcacheHeaderOld *headerOld;
+   t_ldcacheHeaderNew *headerNew;
+   struct stat stats;
+   size_t offset;
+
+   memset(cache, 0, sizeof *cache);
+
+   if ((fstat(fd, &stats) < 0) || (! S_ISREG(stats.st_mode)) || (stats.st_size < sizeof(t_ldcacheHeaderOld)))
+   {
+      log_error("LD cache %s: empty or unreadable", path);
+      close(fd);
+      return -1;
+   }
+   cache->data = mmap(NULL, stats.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (cache->data == MAP_FAILED)
+   {
+      log_error("LD cache %s: mmap failed: %s", path, strerror(errno));
+      cache->data = NULL;
+      return -1;
+   }
+   cache->size = stats.st_size;
+
+   headerNew = NULL;
+   if (! memcmp(cache->data, LDCACHE_MAGIC_OLD, sizeof LDCACHE_MAGIC_OLD - 1))
+   {
+      headerOld = (t_ldcacheHeaderOld *) cache->data;
+      offset = sizeof(t_ldcacheHeaderOld) + (size_t) headerOld->nlibs * sizeof(t_ldcacheEntryOld);
+      if (offset > cache->size)
+         goto invalid;
+
+      // old format entries: strings offsets relative to end of entries table
+      cache->format = LDCACHE_FORMAT_OLD;
+      cache->nlibs = headerOld->nlibs;
+      cache->entries = cache->data + sizeof(t_ldcacheHeaderOld);
+      cache->strings = cache->data + offset;
+
+      // compat format: new format cache follows
+      offset = (offset + LDCACHE_ALIGN_NEW - 1) & ~(size_t)(LDCACHE_ALIGN_NEW - 1);
+      if ((offset + sizeof(t_ldcacheHeaderNew) <= cache->size)
+       && (! memcmp(cache->data + offset, LDCACHE_MAGIC_NEW LDCACHE_VERSION_NEW, sizeof LDCACHE_MAGIC_NEW LDCACHE_VERSION_NEW - 1)))
+         headerNew = (t_ldcacheHeaderNew *) (cache->data + offset);
+   }
+   else if ((cache->size >= sizeof(t_ldcacheHeaderNew))
+         && (! memcmp(cache->data, LDCACHE_MAGIC_NEW LDCACHE_VERSION_NEW, sizeof LDCACHE_MAGIC_NEW LDCACHE_VERSION_NEW - 1)))
+   {
+      headerNew = (t_ldcacheHeaderNew *) cache->data;
+   }
+   else
+      goto invalid;
+
+   if (headerNew != NULL)
+   {
+      // new format entries: strings offsets relative to new header
+      offset = (char *) headerNew - cache->data;
+      if (offset + sizeof(t_ldcacheHeaderNew) + (size_t) headerNew->nlibs * sizeof(t_ldcacheEntryNew) > cache->size)
+         goto invalid;
+      cache->format = LDCACHE_FORMAT_NEW;
+      cache->nlibs = headerNew->nlibs;
+      cache->entries = (char *) headerNew + sizeof(t_ldcacheHeaderNew);
+      cache->strings = (char *) headerNew;
+   }
+
+   return 0;
+
+invalid:
+   log_error("LD cache %s: unknown format", path);
+   ldcacheClose(cache);
+   return -1;
+}
+
+
+// Map cache file and locate its entries table
+int ldcacheOpen(const char *path, t_ldcache *cache)
+{
+   int fd;
+
+   memset(cache, 0, sizeof *cache);
+   fd = open(path, O_RDONLY|O_CLOEXEC);
+   if (fd < 0)
+   {
+      log_error("LD cache %s: open failed: %s", path, strerror(errno));
+      return -1;
+   }
+   return ldcacheMap(fd, path, cache);
+}
+
+void ldcacheClose(t_ldcache *cache)
+{
+   if (cache->data != NULL)
+      munmap(cache->data, cache->size);
+   memset(cache, 0, sizeof *cache);
+}
+
+// Get entry idx fields, return -1 if strings out of cache
+int ldcacheEntry(t_ldcache *cache, uint32_t idx, int32_t *flags, const char **key, const char **value, uint64_t *hwcap)
+{
+   size_t maxoffset = cache->data + cache->size - cache->strings;
+   uint32_t keyoff, valueoff;
+
+   if (cache->format == LDCACHE_FORMAT_NEW)
+   {
+      t_ldcacheEntryNew *entry = (t_ldcacheEntryNew *) cache->entries + idx;
+      *flags = entry->flags;
+      keyoff = entry->key;
+      valueoff = entry->value;
+      *hwcap = entry->hwcap;
+   }
+   else
+   {
+      t_ldcacheEntryOld *entry = (t_ldcacheEntryOld *) cache->entries + idx;
+      *flags = entry->flags;
+      keyoff = entry->key;
+      valueoff = entry->value;
+      *hwcap = 0;
+   }
+   if ((keyoff >= maxoffset) || (valueoff >= maxoffset)
+    || (memchr(cache->strings + keyoff, 0, maxoffset - keyoff) == NULL)
+    || (memchr(cache->strings + valueoff, 0, maxoffset - valueoff) == NULL))
+      return -1;
+
+   *key = cache->strings + keyoff;
+   *value = cache->strings + valueoff;
+   return 0;
+}
+
+// Check entry is a library loadable by the current process architecture
+bool ldcacheNativeFlags(int32_t flags)
+{
+   return (((flags & LDCACHE_FLAG_TYPE_MASK) == LDCACHE_FLAG_ELF_LIBC6)
+        && ((flags & LDCACHE_FLAG_ARCH_MASK) == LDCACHE_FLAG_ARCH));
+}
+
+// Find library path of a soname for the current architecture
+int ldcacheLookup(t_ldcache *cache, const char *soname, char *path, int pathlen, int32_t *libflags)
+{
+   const char *key, *value;
+   int32_t flags;
+   uint64_t hwcap;
+   int64_t left, right, middle;
+   int64_t found;
+   int cmp;
+
+   if (cache->data == NULL)
+      return -1;
+
+   left = 0;
+   right = (int64_t) cache->nlibs - 1;
+   while (left <= right)
+   {
+      middle = (left + right) / 2;
+      if (ldcacheEntry(cache, middle, &flags, &key, &value, &hwcap) < 0)
+         return -1;
+
+      cmp = ldcacheLibcmp(soname, key);
+      if (cmp == 0)
+      {
+         // several entries may have the same key (arch, hwcap): go to first one
+         while ((middle > 0) && (ldcacheEntry(cache, middle - 1, &flags, &key, &value, &hwcap) == 0)
+             && (ldcacheLibcmp(soname, key) == 0))
+            middle--;
+
+         // prefer the generic library to hwcap specific ones
+         found = -1;
+         for ( ; (middle < cache->nlibs) && (ldcacheEntry(cache, middle, &flags, &key, &value, &hwcap) == 0)
+               && (ldcacheLibcmp(soname, key) == 0); middle++)
+         {
+            if ((ldcacheNativeFlags(flags)) && ((found < 0) || (hwcap == 0)))
+            {
+               found = middle;
+               if (hwcap == 0)
+                  break;
+            }
+         }
+         if ((found < 0) || (ldcacheEntry(cache, found, &flags, &key, &value, &hwcap) < 0))
+            return -1;
+
+         snprintf(path, pathlen, "%s", value);
+         if (libflags != NULL)
+            *libflags = flags;
+         return 0;
+      }
+      else if (cmp < 0)
+         left = middle + 1;
+      else
+         right = middle - 1;
+   }
+   return -1;
+}
+
+
+// Check whether cache already maps each library soname to its path, and only to it, for current architecture
+static bool ldcacheUptodate(t_ldcache *cache, t_ldcacheLib libs[], int nblibs)
+{
+   char path[FS_PATH_MAX];
+   int32_t flags;
+   const char *key, *value;
+   uint64_t hwcap;
+   uint32_t idx;
+   int nbnative;
+   int ilib;
+
+   for (ilib = 0; ilib < nblibs; ilib++)
+   {
+      if ((ldcacheLookup(cache, libs[ilib].soname, path, sizeof path, &flags) < 0)
+       || (strcmp(path, libs[ilib].path)) || (flags != libs[ilib].flags))
+         return false;
+
+      nbnative = 0;
+      for (idx = 0; idx < cache->nlibs; idx++)
+      {
+         if ((ldcacheEntry(cache, idx, &flags, &key, &value, &hwcap) == 0)
+          && (ldcacheNativeFlags(flags)) && (! strcmp(key, libs[ilib].soname)))
+            nbnative++;
+      }
+      if (nbnative != 1)
+         return false;
+   }
+   return true;
+}
+
+static const char *ldcacheSortStrings;
+
+// Decreasing _dl_cache_libcmp() order, as expected by ld.so binary search
+static int ldcacheCompareEntries(const void *p1, const void *p2)
+{
+   const t_ldcacheEntryNew *entry1 = p1;
+   const t_ldcacheEntryNew *entry2 = p2;
+   int cmp;
+
+   cmp = ldcacheLibcmp(ldcacheSortStrings + entry2->key, ldcacheSortStrings + entry1->key);
+   if (cmp == 0)
+      cmp = entry2->flags - entry1->flags;
+   if (cmp == 0)
+      cmp = (entry2->hwcap > entry1->hwcap) - (entry2->hwcap < entry1->hwcap);
+   return cmp;
+}
+
+// Shift all offsets of the extensions directory, strings offsets of the hwcaps extension included
+static int ldcacheShiftExtensions(char *cache, size_t size, int64_t delta)
+{
+   t_ldcacheHeaderNew *header = (t_ldcacheHeaderNew *) cache;
+   t_ldcacheExtension *extension;
+   uint32_t *hwcaps;
+   uint32_t isection, icap;
+
+   if (header->extension_offset == 0)
+      return 0;
+
+   header->extension_offset += delta;
+   if ((header->extension_offset % sizeof(uint32_t))
+    || (header->extension_offset + sizeof(t_ldcacheExtension) > size))
+      return -1;
+   extension = (t_ldcacheExtension *) (cache + header->extension_offset);
+   if ((extension->magic != LDCACHE_EXTENSION_MAGIC)
+    || (header->extension_offset + sizeof(t_ldcacheExtension) + (size_t) extension->count * sizeof(t_ldcacheExtensionSection) > size))
+      return -1;
+
+   for (isection = 0; isection < extension->count; isection++)
+   {
+      extension->sections[isection].offset += delta;
+      if ((extension->sections[isection].offset % sizeof(uint32_t))
+       || ((size_t) extension->sections[isection].offset + extension->sections[isection].size > size))
+         return -1;
+
+      switch (extension->sections[isection].tag)
+      {
+         case LDCACHE_EXTENSION_TAG_GENERATOR:
+            break;
+         case LDCACHE_EXTENSION_TAG_HWCAPS:
+            hwcaps = (uint32_t *) (cache + extension->sections[isection].offset);
+            for (icap = 0; icap < extension->sections[isection].size / sizeof(uint32_t); icap++)
+               hwcaps[icap] += delta;
+            break;
+         default:
+            return -1;
+      }
+   }
+   return 0;
+}
+
+static int writeAll(int fd, const void *data, size_t len)
+{
+   const char *ptr = data;
+   ssize_t ret;
+
+   while (len > 0)
+   {
+      ret = write(fd, ptr, len);
+      if (ret < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         return -1;
+      }
+      ptr += ret;
+      len -= ret;
+   }
+   return 0;
+}
+
+// Insert or replace libraries entries into an existing root FS cache file, without rescanning libraries directories.
+// Current architecture entries with same soname are replaced, file is left untouched if already up to date.
+// Root FS is untrusted: cache directory resolved beneath it without symlinks, written through a fresh temporary file.
+// Return -1 if cache can not be updated this way (missing, symlink, old format only, unknown extension).
+int ldcacheUpdate(const char *rootfs, t_ldcacheLib libs[], int nblibs)
+{
+   t_ldcache cache = { 0 };
+   t_ldcacheHeaderNew *header;
+   t_ldcacheEntryNew *entries;
+   t_ldcacheEntryNew *entry;
+   char path[2*FS_PATH_MAX];
+   char tmpname[FILE_NAME_MAX];
+   char *blob;
+   char *out = NULL;
+   size_t blobsize, strsize, outsize;
+   size_t blobstart, stroffset;
+   int64_t delta;
+   uint32_t idx, nbentries;
+   int32_t flags;
+   const char *key, *value;
+   uint64_t hwcap;
+   uint32_t rnd;
+   int ilib, itry;
+   int rootfd, dirfd = -1;
+   int fd;
+   int ret = -1;
+
+   snprintf(path, sizeof path, "%s%s", rootfs, LDCACHE_PATH);
+   rootfd = open(rootfs, O_PATH|O_DIRECTORY|O_CLOEXEC);
+   if (rootfd < 0)
+   {
+      log_error("Root FS %s: open failed: %s", rootfs, strerror(errno));
+      return -1;
+   }
+   dirfd = openBeneath(rootfd, LDCACHE_DIR, O_PATH|O_DIRECTORY);
+   close(rootfd);
+   if (dirfd < 0)
+   {
+      log_info("LD cache %s: directory not usable: %s", path, strerror(errno));
+      return -1;
+   }
+   fd = openat(dirfd, LDCACHE_NAME, O_RDONLY|O_NOFOLLOW|O_NONBLOCK|O_CLOEXEC);
+   if (fd < 0)
+   {
+      log_info("LD cache %s not usable: %s", path, strerror(errno));
+      goto out;
+   }
+   if (ldcacheMap(fd, path, &cache) < 0)
+      goto out;
+
+   if (cache.format != LDCACHE_FORMAT_NEW)
+   {
+      log_info("LD cache %s: old format only", path);
+      goto out;
+   }
+   if (ldcacheUptodate(&cache, libs, nblibs))
+   {
+      log_debug("LD cache %s already up to date", path);
+      ret = 0;
+      goto out;
+   }
+
+   // new cache part (compat format: skip old part), and original strings and extensions following its entries
+   header = (t_ldcacheHeaderNew *) cache.strings;
+   blobstart = sizeof(t_ldcacheHeaderNew) + (size_t) cache.nlibs * sizeof(t_ldcacheEntryNew);
+   blob = cache.strings + blobstart;
+   blobsize = cache.data + cache.size - blob;
+   strsize = 0;
+   for (ilib = 0; ilib < nblibs; ilib++)
+      strsize += strlen(libs[ilib].soname) + 1 + strlen(libs[ilib].path) + 1;
+
+   outsize = sizeof(t_ldcacheHeaderNew) + ((size_t) cache.nlibs + nblibs) * sizeof(t_ldcacheEntryNew) + blobsize + strsize;
+   out = calloc(1, outsize);
+   if (out == NULL)
+   {
+      log_error("Memory allocation failed");
+      goto out;
+   }
+   entries = (t_ldcacheEntryNew *) (out + sizeof(t_ldcacheHeaderNew));
+
+   // keep all entries but current architecture ones of updated libraries
+   nbentries = 0;
+   for (idx = 0; idx < cache.nlibs; idx++)
+   {
+      if (ldcacheEntry(&cache, idx, &flags, &key, &value, &hwcap) < 0)
+      {
+         log_error("LD cache %s: corrupted entry %u", path, idx);
+         goto out;
+      }
+      if (ldcacheNativeFlags(flags))
+      {
+         for (ilib = 0; ilib < nblibs; ilib++)
+         {
+            if (! strcmp(key, libs[ilib].soname))
+               break;
+         }
+         if (ilib < nblibs)
+            continue;
+      }
+      entries[nbentries++] = ((t_ldcacheEntryNew *) cache.entries)[idx];
+   }
+   delta = ((int64_t) nbentries + nblibs - cache.nlibs) * (int64_t) sizeof(t_ldcacheEntryNew);
+   for (idx = 0; idx < nbentries; idx++)
+   {
+      entries[idx].key += delta;
+      entries[idx].value += delta;
+   }
+
+   stroffset = blobstart + delta;
+   memcpy(out + stroffset, blob, blobsize);
+   stroffset += blobsize;
+   for (ilib = 0; ilib < nblibs; ilib++)
+   {
+      entry = &entries[nbentries++];
+      entry->flags = libs[ilib].flags;
+      entry->key = stroffset;
+      strcpy(out + stroffset, libs[ilib].soname);
+      stroffset += strlen(libs[ilib].soname) + 1;
+      entry->value = stroffset;
+      strcpy(out + stroffset, libs[ilib].path);
+      stroffset += strlen(libs[ilib].path) + 1;
+   }
+   outsize = stroffset;
+
+   memcpy(out, header, sizeof(t_ldcacheHeaderNew));
+   ((t_ldcacheHeaderNew *) out)->nlibs = nbentries;
+   ((t_ldcacheHeaderNew *) out)->len_strings = header->len_strings + strsize;
+   if (ldcacheShiftExtensions(out, outsize, delta) < 0)
+   {
+      log_info("LD cache %s: unsupported extensions", path);
+      goto out;
+   }
+
+   ldcacheSortStrings = out;
+   qsort(entries, nbentries, sizeof(t_ldcacheEntryNew), ldcacheCompareEntries);
+
+   // Replace cache atomically, the way ldconfig does, from a new file nobody else could have prepared
+   fd = -1;
+   for (itry = 0; (fd < 0) && (itry < 8); itry++)
+   {
+      if (getrandom(&rnd, sizeof rnd, 0) != sizeof rnd)
+         rnd = (uint32_t) traceNow() ^ (uint32_t) getpid();
+      snprintf(tmpname, sizeof tmpname, "%s~%08x", LDCACHE_NAME, rnd);
+      fd = openat(dirfd, tmpname, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0644);
+      if ((fd < 0) && (errno != EEXIST))
+         break;
+   }
+   if (fd < 0)
+   {
+      log_error("LD cache %s: temporary file creation failed: %s", path, strerror(errno));
+      goto out;
+   }
+   if ((writeAll(fd, out, outsize) < 0) || (fchmod(fd, 0644) < 0))
+   {
+      log_error("LD cache %s: write failed: %s", path, strerror(errno));
+      close(fd);
+      unlinkat(dirfd, tmpname, 0);
+      goto out;
+   }
+   close(fd);
+   if (renameat(dirfd, tmpname, dirfd, LDCACHE_NAME) < 0)
+   {
+      log_error("LD cache %s: rename failed: %s", path, strerror(errno));
+      unlinkat(dirfd, tmpname, 0);
+      goto out;
+   }
+
+   log_debug("LD cache %s updated: %u entries", path, nbentries);
+   ret = 0;
+
+out:
+   free(out);
+   ldcacheClose(&cache);
+   close(dirfd);
+   return ret;
+}
@@ -0,0 +1,556 @@
+/*
+ * Devices leases and reconfiguration queues, shared by all runtime processes of the host
+ *
+ * Lease table is a fixed size file of the root only run directory (tmpfs) mapped by each process, without any lock
+ * (file name carries the layout version: a table left by an older version is never reused):
+ * a slot is bound to a device by a compare and swap of its key (zero slots are free),
+ * then owned by a compare and swap of its owner (container pid and start time, zero if free).
+ * A lease of a dead container is stale and taken over by the next claimer.
+ *
+ * Other slots, bound to reconfiguration domains (devices sharing an Intel FME, an AWS slot, a
+ * simulated device), order reconfigurations: loads take a ticket and run one after another
+ * in tickets order, waiters sleep on a futex of the slot. Queues do not depend on leases:
+ * containers loading ports of a same FME queue together. A request for the function being
+ * loaded into the same device joins that load instead of queueing. A process dying with its
+ * turn is skipped.
+ *
+ * Table header counts configure requests of each function (by name, config may change),
+ * to pick functions worth loading in advance.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "accelerator.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open  434
+#endif
+
+#define LEASE_TABLE_VERSION 4
+#define LEASE_TABLE_NAME   "leases.v%d"
+#define LEASE_TABLE_MAGIC  0x41434c00  // "ACL" | version
+#define LEASE_SLOTS        1024        // power of 2, > ACCEL_DEVICE_MAX
+#define REQUEST_COUNTERS   64          // power of 2, functions requests counted
+#define LOAD_QUEUE_MAX     16          // power of 2, pending loads of a device
+#define LOAD_WAIT_MS       100         // futex wait before checking the loader is alive
+#define LOAD_ORPHAN_WAITS  50          // waits before skipping a ticket never claimed by its taker
+
+typedef struct {
+   uint32_t ticket;  // ticket of owner, set once owner written
+   uint32_t pad;
+   uint64_t owner;   // process start time << 32 | pid
+} t_loadTicket;
+
+typedef struct {
+   uint64_t key;     // device key, 0 if slot free
+   uint64_t owner;   // start time << 32 | container pid, 0 if device free
+
+   // reconfiguration queue, in domain slots
+   uint32_t head;       // ticket whose load runs (futex)
+   uint32_t tail;       // next ticket
+   int32_t  inflight;   // function being loaded + 1, 0 if none
+   uint32_t doneSeq;    // bumped at each load end (futex)
+   int32_t  doneFunc;   // function of last load + 1, 0 if failed
+   uint32_t pad;
+   uint64_t inflightDev;  // key of device being loaded
+   uint64_t doneDev;      // key of device of last load
+   t_loadTicket tickets[LOAD_QUEUE_MAX];
+} t_leaseSlot;
+
+typedef struct {
+   uint64_t key;     // function name key, 0 if counter free
+   uint64_t count;
+} t_requestCounter;
+
+typedef struct {
+   uint32_t magic;
+   uint32_t pad[15];
+   t_requestCounter requests[REQUEST_COUNTERS];
+   t_leaseSlot slots[LEASE_SLOTS];
+} t_leaseTable;
+
+static t_leaseTable *leaseTable = NULL;
+static bool leaseTableFailed = false;
+
+
+// Map lease table, created zeroed (all devices free) by first process.
+// Anyone able to write the table could forge leases or stall queues: a table not created by us is refused.
+static t_leaseTable *leaseTableMap()
+{
+   char path[FS_PATH_MAX];
+   struct stat stats;
+   uint32_t magic = 0;
+   void *table;
+   int fd;
+
+   if ((leaseTable != NULL) || (leaseTableFailed))
+      return leaseTable;
+
+   snprintf(path, sizeof path, "%s/" LEASE_TABLE_NAME, hostPath(HOST_PATH_RUN), LEASE_TABLE_VERSION);
+   if ((mkdir(hostPath(HOST_PATH_RUN), 0755) < 0) && (errno != EEXIST))
+      log_warn("Lease table: failed to create %s: %s", hostPath(HOST_PATH_RUN), strerror(errno));
+   fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+   if (fd >= 0)
+      fchmod(fd, 0600);   // whatever umask
+   else if (errno == EEXIST)
+      fd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+   if ((fd >= 0) && ( (fstat(fd, &stats) < 0) || (! S_ISREG(stats.st_mode)) || (stats.st_uid != geteuid())
+                   || ((stats.st_mode & 07777) != 0600) || (stats.st_nlink != 1)))
+   {
+      log_error("Lease table %s: not a private file of ours (owner %d, mode %o): devices can not be leased", path,
+            (int) stats.st_uid, (unsigned int) stats.st_mode & 07777);
+      close(fd);
+      leaseTableFailed = true;
+      return NULL;
+   }
+   if ((fd < 0) || (ftruncate(fd, sizeof(t_leaseTable)) < 0))
+   {
+      log_error("Lease table %s: failed to open: %s: devices can not be leased", path, strerror(errno));
+      if (fd >= 0)
+         close(fd);
+      leaseTableFailed = true;
+      return NULL;
+   }
+   table = mmap(NULL, sizeof(t_leaseTable), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (table == MAP_FAILED)
+   {
+      log_error("Lease table %s: failed to map: %s: devices can not be leased", path, strerror(errno));
+      leaseTableFailed = true;
+      return NULL;
+   }
+
+   if ( (! __atomic_compare_exchange_n(& ((t_leaseTable *) table)->magic, &magic, LEASE_TABLE_MAGIC | LEASE_TABLE_VERSION, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+     && (magic != (LEASE_TABLE_MAGIC | LEASE_TABLE_VERSION)))
+   {
+      log_error("Lease table %s: corrupted (magic %08x): devices can not be leased", path, magic);
+      munmap(table, sizeof(t_leaseTable));
+      leaseTableFailed = true;
+      return NULL;
+   }
+   leaseTable = table;
+   return leaseTable;
+}
+
+static uint64_t deviceKey(t_acceldev *acceldev)
+{
+   uint64_t key = FNV_OFFSET_BASIS;
+
+   key = fnvHash(key, &acceldev->enginetype, sizeof acceldev->enginetype);
+   key = fnvHash(key, acceldev->bdf.str, strlen(acceldev->bdf.str));
+   return (key != 0) ? key : 1;
+}
+
+// Reconfiguration domain of device: its engine device (Intel FME, simulated device),
+// else its engine sysfs entry (AWS management PF), else the device itself
+static uint64_t domainKey(t_acceldev *acceldev)
+{
+   uint64_t key = fnvHash(FNV_OFFSET_BASIS, "domain", strlen("domain"));
+
+   key = fnvHash(key, &acceldev->enginetype, sizeof acceldev->enginetype);
+   if (acceldev->privdata != NULL)
+      key = fnvHash(key, ((t_acceldev *) acceldev->privdata)->bdf.str, strlen(((t_acceldev *) acceldev->privdata)->bdf.str));
+   else if (acceldev->syspathEngine[0] != '\0')
+      key = fnvHash(key, acceldev->syspathEngine, strlen(acceldev->syspathEngine));
+   else
+      key = fnvHash(key, acceldev->bdf.str, strlen(acceldev->bdf.str));
+   return (key != 0) ? key : 1;
+}
+
+// Slot bound to key (device or domain), bound on first use (open addressing)
+static t_leaseSlot *leaseSlot(t_leaseTable *table, uint64_t key, t_acceldev *acceldev)
+{
+   uint64_t slotkey;
+   int islot, iprobe;
+
+   for (iprobe = 0; iprobe < LEASE_SLOTS; iprobe++)
+   {
+      islot = (key + iprobe) & (LEASE_SLOTS - 1);
+      slotkey = __atomic_load_n(& table->slots[islot].key, __ATOMIC_ACQUIRE);
+      if ( (slotkey == key)
+        || ((slotkey == 0) && (__atomic_compare_exchange_n(& table->slots[islot].key, &slotkey, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)))
+        || (slotkey == key))  // bound meanwhile by another process
+         return & table->slots[islot];
+   }
+   log_warn("Device %s: lease table full", acceldev->bdf.str);
+   return NULL;
+}
+
+// Process start time (clock ticks since boot), 0 if unknown
+static uint32_t processStartTime(pid_t pid)
+{
+   char path[FS_PATH_MAX];
+   char stat[1024] = "";
+   unsigned long long starttime;
+   char *ptr;
+   FILE *file;
+
+   snprintf(path, sizeof path, "%s/%d/stat", hostPath(HOST_PATH_PROC), pid);
+   file = fopen(path, "re");
+   if (file == NULL)
+      return 0;
+   ptr = fgets(stat, sizeof stat, file);
+   fclose(file);
+
+   // starttime is 20th field after command name, which may contain spaces
+   ptr = (ptr != NULL) ? strrchr(stat, ')') : NULL;
+   if ((ptr == NULL) || (sscanf(ptr + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu", &starttime) != 1))
+      return 0;
+   return (uint32_t) starttime;
+}
+
+static uint64_t leaseOwner(pid_t pid)
+{
+   return ((uint64_t) processStartTime(pid) << 32) | (uint32_t) pid;
+}
+
+// Lease owner still running: its pid start time is the one it had when it took the lease.
+// The pidfd pins the pid during the check, a pid reused after start time was read is seen exited.
+static bool leaseOwnerAlive(uint64_t owner)
+{
+   pid_t pid = owner & 0xffffffff;
+   uint32_t starttime = owner >> 32;
+   uint32_t curtime;
+   struct pollfd pidpoll;
+   int pidfd;
+
+   pidfd = syscall(SYS_pidfd_open, pid, 0);
+   if (pidfd < 0)
+   {
+      if (errno == ESRCH)
+         return false;
+      // no pidfd (kernel < 5.3): signal 0 probe
+      if ((kill(pid, 0) < 0) && (errno == ESRCH))
+         return false;
+   }
+
+   curtime = processStartTime(pid);
+   if (pidfd >= 0)
+   {
+      pidpoll.fd = pidfd;
+      pidpoll.events = POLLIN;
+      if (poll(&pidpoll, 1, 0) > 0)
+         curtime = ~starttime;  // exited meanwhile
+      close(pidfd);
+   }
+   return ((starttime == 0) || (curtime == 0) || (curtime == starttime));
+}
+
+// Lease device to container pid, or take over a stale lease.
+// Return 0 if leased, -1 if leases are unavailable, else pid of the live container holding it.
+pid_t deviceLeaseAcquire(t_acceldev *acceldev, pid_t pid)
+{
+   t_leaseTable *table = leaseTableMap();
+   t_leaseSlot *slot;
+   uint64_t owner, curowner;
+
+   if ((table == NULL) || ((slot = leaseSlot(table, deviceKey(acceldev), acceldev)) == NULL))
+      return -1;
+
+   owner = leaseOwner(pid);
+   curowner = __atomic_load_n(& slot->owner, __ATOMIC_ACQUIRE);
+   while (true)
+   {
+      if ((curowner & 0xffffffff) == (uint32_t) pid)
+      {
+         if ((curowner == owner) || (leaseOwnerAlive(curowner)))
+            return 0;  // already ours (hook run again)
+      }
+      else if ((curowner != 0) && (leaseOwnerAlive(curowner)))
+      {
+         log_debug("Device %s: leased to container pid %d", acceldev->bdf.str, (pid_t) (curowner & 0xffffffff));
+         return (pid_t) (curowner & 0xffffffff);
+      }
+
+      // free or stale: fails if another process changed owner meanwhile, then check again.
+      // Sequentially consistent with background loads (see loadQueueEnter)
+      if (__atomic_compare_exchange_n(& slot->owner, &curowner, owner, false, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE))
+         break;
+   }
+
+   if (curowner != 0)
+      log_info("Device %s: stale lease of container pid %d taken over", acceldev->bdf.str, (pid_t) (curowner & 0xffffffff));
+   log_debug("Device %s: leased to container pid %d", acceldev->bdf.str, pid);
+   return 0;
+}
+
+// Release lease of device held by stopped container pid (any stopped container if pid is 0).
+// Return true if device was held by it.
+bool deviceLeaseReclaim(t_acceldev *acceldev, pid_t pid)
+{
+   t_leaseTable *table = leaseTableMap();
+   t_leaseSlot *slot;
+   uint64_t curowner;
+
+   if ((table == NULL) || ((slot = leaseSlot(table, deviceKey(acceldev), acceldev)) == NULL))
+      return false;
+
+   curowner = __atomic_load_n(& slot->owner, __ATOMIC_ACQUIRE);
+   if ( (curowner == 0)
+     || ((pid != 0) && ((curowner & 0xffffffff) != (uint32_t) pid))
+     || (leaseOwnerAlive(curowner)))  // pid reused by a running container
+      return false;
+   if (! __atomic_compare_exchange_n(& slot->owner, &curowner, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      return false;  // taken over meanwhile
+   log_debug("Device %s: lease of stopped container pid %d released", acceldev->bdf.str, (pid_t) (curowner & 0xffffffff));
+   return true;
+}
+
+// Pid of the live container holding device lease, 0 if device is free
+pid_t deviceLeaseHolder(t_acceldev *acceldev)
+{
+   t_leaseTable *table = leaseTableMap();
+   t_leaseSlot *slot;
+   uint64_t curowner;
+
+   if ((table == NULL) || ((slot = leaseSlot(table, deviceKey(acceldev), acceldev)) == NULL))
+      return 0;
+   curowner = __atomic_load_n(& slot->owner, __ATOMIC_SEQ_CST);
+   if ((curowner == 0) || (! leaseOwnerAlive(curowner)))
+      return 0;
+   return (pid_t) (curowner & 0xffffffff);
+}
+
+// Release lease of device, if held by container pid
+void deviceLeaseRelease(t_acceldev *acceldev, pid_t pid)
+{
+   t_leaseTable *table = leaseTableMap();
+   t_leaseSlot *slot;
+   uint64_t curowner;
+
+   if ((table == NULL) || ((slot = leaseSlot(table, deviceKey(acceldev), acceldev)) == NULL))
+      return;
+
+   curowner = __atomic_load_n(& slot->owner, __ATOMIC_ACQUIRE);
+   while ((curowner & 0xffffffff) == (uint32_t) pid)
+   {
+      if (__atomic_compare_exchange_n(& slot->owner, &curowner, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      {
+         log_debug("Device %s: lease of container pid %d released", acceldev->bdf.str, pid);
+         return;
+      }
+   }
+}
+
+
+static void futexWait(uint32_t *addr, uint32_t value, int ms)
+{
+   struct timespec timeout = { ms / 1000, (ms % 1000) * 1000000 };
+
+   syscall(SYS_futex, addr, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+static void futexWake(uint32_t *addr)
+{
+   syscall(SYS_futex, addr, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+// End turn of ticket: next ticket may load
+static void loadTurnEnd(t_leaseSlot *slot, uint32_t ticket, uint64_t doneDev, int doneFunc)
+{
+   __atomic_store_n(& slot->doneDev, doneDev, __ATOMIC_RELEASE);
+   __atomic_store_n(& slot->doneFunc, doneFunc, __ATOMIC_RELEASE);
+   __atomic_store_n(& slot->inflight, 0, __ATOMIC_RELEASE);
+   __atomic_add_fetch(& slot->doneSeq, 1, __ATOMIC_ACQ_REL);
+   futexWake(& slot->doneSeq);
+   if (__atomic_compare_exchange_n(& slot->head, &ticket, ticket + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      futexWake(& slot->head);
+}
+
+// Skip turn of a dead process, or of a ticket never claimed (taker died right after taking it)
+static void loadTurnCheck(t_acceldev *acceldev, t_leaseSlot *slot, int *nbOrphanWaits)
+{
+   uint32_t head = __atomic_load_n(& slot->head, __ATOMIC_ACQUIRE);
+   t_loadTicket *ticket = & slot->tickets[head & (LOAD_QUEUE_MAX - 1)];
+   uint64_t owner;
+
+   if (head == __atomic_load_n(& slot->tail, __ATOMIC_ACQUIRE))
+      return;
+   if (__atomic_load_n(& ticket->ticket, __ATOMIC_ACQUIRE) != head)
+   {
+      if (++(*nbOrphanWaits) < LOAD_ORPHAN_WAITS)
+         return;
+      log_warn("Device %s: load ticket %u never claimed: skip it", acceldev->bdf.str, head);
+   }
+   else
+   {
+      owner = __atomic_load_n(& ticket->owner, __ATOMIC_ACQUIRE);
+      if (leaseOwnerAlive(owner))
+         return;
+      log_warn("Device %s: load process %d died: skip its turn", acceldev->bdf.str, (pid_t) (owner & 0xffffffff));
+   }
+   *nbOrphanWaits = 0;
+   loadTurnEnd(slot, head, 0, 0);
+}
+
+// Wait turn to load accelfunc into device, after loads queued to its reconfiguration domain,
+// or a load of accelfunc into device by another process.
+// Return 0 when it is our turn (loadQueueLeave must follow), 1 if another process just loaded accelfunc,
+// -1 if our turn was skipped (taken for an orphan ticket), or if priority is background and domain
+// has loads pending or device is leased (background loads never wait, and only load free devices).
+int loadQueueEnter(t_acceldev *acceldev, int accelfunc, e_loadPriority priority, uint32_t *ticket)
+{
+   t_leaseTable *table = leaseTableMap();
+   uint64_t devkey = deviceKey(acceldev);
+   t_leaseSlot *slot;
+   uint32_t seq, endseq, head, tail;
+   uint64_t doneDev;
+   int32_t doneFunc;
+   int nbOrphanWaits = 0;
+   int64_t span = traceBegin();
+
+   *ticket = 0;
+   if ((table == NULL) || ((slot = leaseSlot(table, domainKey(acceldev), acceldev)) == NULL))
+      return 0;
+
+   // Join a load of the same function into the same device
+   seq = __atomic_load_n(& slot->doneSeq, __ATOMIC_ACQUIRE);
+   if ( (__atomic_load_n(& slot->inflight, __ATOMIC_ACQUIRE) == accelfunc + 1)
+     && (__atomic_load_n(& slot->inflightDev, __ATOMIC_ACQUIRE) == devkey))
+   {
+      log_info("Device %s: function %s being loaded by another process: wait for it", acceldev->bdf.str,
+            accelfuncIndexToName(accelfunc));
+      while ( (__atomic_load_n(& slot->doneSeq, __ATOMIC_ACQUIRE) == seq)
+           && (__atomic_load_n(& slot->inflight, __ATOMIC_ACQUIRE) == accelfunc + 1))
+      {
+         futexWait(& slot->doneSeq, seq, LOAD_WAIT_MS);
+         loadTurnCheck(acceldev, slot, &nbOrphanWaits);
+      }
+      // last load result, unless another load ended meanwhile
+      doneFunc = __atomic_load_n(& slot->doneFunc, __ATOMIC_ACQUIRE);
+      doneDev = __atomic_load_n(& slot->doneDev, __ATOMIC_ACQUIRE);
+      endseq = __atomic_load_n(& slot->doneSeq, __ATOMIC_ACQUIRE);
+      if ((endseq == seq + 1) && (doneFunc == accelfunc + 1) && (doneDev == devkey))
+      {
+         traceEnd(span, "load wait", "%s joined", acceldev->bdf.str);
+         return 1;
+      }
+   }
+
+   if (priority == LOAD_PRIORITY_BACKGROUND)
+   {
+      head = __atomic_load_n(& slot->head, __ATOMIC_ACQUIRE);
+      tail = head;
+      if (! __atomic_compare_exchange_n(& slot->tail, &tail, head + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE))
+         return -1;
+      *ticket = head;
+      __atomic_store_n(& slot->tickets[head & (LOAD_QUEUE_MAX - 1)].owner, leaseOwner(getpid()), __ATOMIC_RELEASE);
+      __atomic_store_n(& slot->tickets[head & (LOAD_QUEUE_MAX - 1)].ticket, head, __ATOMIC_RELEASE);
+
+      // Either a container leasing device now sees this load pending (loadQueueBusy), or it is seen here
+      if (deviceLeaseHolder(acceldev) != 0)
+      {
+         loadTurnEnd(slot, head, 0, 0);
+         return -1;
+      }
+   }
+   else
+   {
+      // bounded queue: a ticket slot is reused once its previous ticket was served
+      while (__atomic_load_n(& slot->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(& slot->head, __ATOMIC_ACQUIRE) >= LOAD_QUEUE_MAX)
+      {
+         head = __atomic_load_n(& slot->head, __ATOMIC_ACQUIRE);
+         futexWait(& slot->head, head, LOAD_WAIT_MS);
+         loadTurnCheck(acceldev, slot, &nbOrphanWaits);
+      }
+      *ticket = __atomic_fetch_add(& slot->tail, 1, __ATOMIC_ACQ_REL);
+      __atomic_store_n(& slot->tickets[*ticket & (LOAD_QUEUE_MAX - 1)].owner, leaseOwner(getpid()), __ATOMIC_RELEASE);
+      __atomic_store_n(& slot->tickets[*ticket & (LOAD_QUEUE_MAX - 1)].ticket, *ticket, __ATOMIC_RELEASE);
+   }
+
+   head = __atomic_load_n(& slot->head, __ATOMIC_ACQUIRE);
+   if (head != *ticket)
+      log_info("Device %s: %u load(s) queued before ours: wait", acceldev->bdf.str, *ticket - head);
+   // wrap-safe: head passes our ticket if it was skipped before we claimed it
+   while ((int32_t) ((head = __atomic_load_n(& slot->head, __ATOMIC_ACQUIRE)) - *ticket) < 0)
+   {
+      futexWait(& slot->head, head, LOAD_WAIT_MS);
+      loadTurnCheck(acceldev, slot, &nbOrphanWaits);
+   }
+   if (head != *ticket)
+   {
+      log_error("Device %s: load ticket %u skipped before claimed", acceldev->bdf.str, *ticket);
+      return -1;
+   }
+   __atomic_store_n(& slot->inflightDev, devkey, __ATOMIC_RELEASE);
+   __atomic_store_n(& slot->inflight, accelfunc + 1, __ATOMIC_RELEASE);
+   traceEnd(span, "load wait", "%s ticket %u", acceldev->bdf.str, *ticket);
+   return 0;
+}
+
+// End our load turn, telling waiters whether accelfunc is now loaded
+void loadQueueLeave(t_acceldev *acceldev, int accelfunc, uint32_t ticket, int status)
+{
+   t_leaseTable *table = leaseTableMap();
+   t_leaseSlot *slot;
+
+   if ((table == NULL) || ((slot = leaseSlot(table, domainKey(acceldev), acceldev)) == NULL))
+      return;
+   loadTurnEnd(slot, ticket, deviceKey(acceldev), (status == 0) ? accelfunc + 1 : 0);
+}
+
+// Loads pending or running in reconfiguration domain of device: its current function may change
+bool loadQueueBusy(t_acceldev *acceldev)
+{
+   t_leaseTable *table = leaseTableMap();
+   t_leaseSlot *slot;
+
+   if ((table == NULL) || ((slot = leaseSlot(table, domainKey(acceldev), acceldev)) == NULL))
+      return false;
+   return (__atomic_load_n(& slot->head, __ATOMIC_SEQ_CST) != __atomic_load_n(& slot->tail, __ATOMIC_SEQ_CST));
+}
+
+// Counter of function, bound on first use
+static t_requestCounter *requestCounter(t_leaseTable *table, int accelfunc)
+{
+   char *name = accelfuncIndexToName(accelfunc);
+   uint64_t key = fnvHash(FNV_OFFSET_BASIS, name, strlen(name));
+   uint64_t curkey;
+   int icounter, iprobe;
+
+   key = (key != 0) ? key : 1;
+   for (iprobe = 0; iprobe < REQUEST_COUNTERS; iprobe++)
+   {
+      icounter = (key + iprobe) & (REQUEST_COUNTERS - 1);
+      curkey = __atomic_load_n(& table->requests[icounter].key, __ATOMIC_ACQUIRE);
+      if ( (curkey == key)
+        || ((curkey == 0) && (__atomic_compare_exchange_n(& table->requests[icounter].key, &curkey, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)))
+        || (curkey == key))
+         return & table->requests[icounter];
+   }
+   return NULL;
+}
+
+// Count a configure request of function
+void functionRequested(int accelfunc)
+{
+   t_leaseTable *table = leaseTableMap();
+   t_requestCounter *counter;
+
+   if ((table == NULL) || (accelfunc == ACCELFUNC_UNKNOWN) || ((counter = requestCounter(table, accelfunc)) == NULL))
+      return;
+   __atomic_add_fetch(& counter->count, 1, __ATOMIC_RELAXED);
+}
+
+// Configure requests of function since boot
+uint64_t functionRequestCount(int accelfunc)
+{
+   t_leaseTable *table = leaseTableMap();
+   t_requestCounter *counter;
+
+   if ((table == NULL) || (accelfunc == ACCELFUNC_UNKNOWN) || ((counter = requestCounter(table, accelfunc)) == NULL))
+      return 0;
+   return __atomic_load_n(& counter->count, __ATOMIC_RELAXED);
+}
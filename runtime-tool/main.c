@@ -5,16 +5,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <argp.h>
 
 #include "accelerator.h"
 
-#define ACCEL_SETTINGS_CONFFILE "/etc/acceleration.json"
-
 
 static t_acceldev *attachDevList[ACCEL_DEVICE_MAX];
 static int nbAttachDev = 0;
+static int configAccelfunc[ACCEL_DEVICE_MAX];
+static int nbConfigAccelfunc = 0;
 
 
 static error_t commandParser(int, char *, struct argp_state *);
@@ -26,12 +28,19 @@ static struct argp usage = {
       {"rootfs", 'r', "ROOTFS", 0, "Container root filesystem", -1},
       {"devices", 'd', "DEV", 0, "List of requested accelerators", -1},
       {"functions", 'f', "FUNC", 0, "List of expected functions", -1},
+      {"device-rules", 'R', "RULES", 0, "Runtime devices cgroup rules, comma separated (cgroup v2 only, default runc ones)", -1},
       {"log", 'l', "FILE", 0, "Log file absolute path and name", -1},
       {"loglevel", 'L', "LEVEL", 0, "Log level (syslog facility)", -1},
+      {"trace", 't', "FILE", 0, "Write phases spans to FILE in Chrome trace event format (default: $" ACCEL_TRACE_ENV ")", -1},
       {"COMMAND:", 0, NULL, OPTION_DOC|OPTION_NO_USAGE, "", 0},
       //  {"info", 0, NULL, OPTION_DOC|OPTION_NO_USAGE, "Report information about the driver and devices", 0},
       //  {"list", 0, NULL, OPTION_DOC|OPTION_NO_USAGE, "List driver components", 0},
       {"  configure", 0, NULL, OPTION_DOC|OPTION_NO_USAGE, "Configure a container with accelerator support", 0},
+      {"  compile-config", 0, NULL, OPTION_DOC|OPTION_NO_USAGE, "Validate " ACCEL_SETTINGS_CONFFILE " and compile it to " ACCEL_SETTINGS_IMAGE, 0},
+      {"  serve", 0, NULL, OPTION_DOC|OPTION_NO_USAGE, "Keep devices in memory and configure containers requested on " ACCEL_SERVE_SOCKET, 0},
+      {"  bench", 0, NULL, OPTION_DOC|OPTION_NO_USAGE, "Configure a container and report time spent in each phase", 0},
+      {"  sriov-setup", 0, NULL, OPTION_DOC|OPTION_NO_USAGE, "Create virtual functions up to engines activateSriov pools", 0},
+      {"  release", 0, NULL, OPTION_DOC|OPTION_NO_USAGE, "Release devices of a stopped container, and load engines warm functions in background", 0},
       {0},
    },
    commandParser,
@@ -51,6 +60,8 @@ struct context
    char *devices;
    char *functions;
    char *command;
+   char *traceFile;
+   char *deviceRules;
 };
 static error_t commandParser(int key, char *arg, struct argp_state *state)
 {
@@ -74,6 +85,12 @@ static error_t commandParser(int key, char *arg, struct argp_state *state)
       case 'L':
          ctx->logLevel = atoi(arg);
          break;
+      case 't':
+         ctx->traceFile = arg;
+         break;
+      case 'R':
+         ctx->deviceRules = arg;
+         break;
       case ARGP_KEY_ARGS:
         state->argv += state->next;
          state->argc -= state->next;
@@ -86,11 +103,60 @@ static error_t commandParser(int key, char *arg, struct argp_state *state)
 }
 
 
+// Parse requested comma separated list of functions, in attached devices order
+static int parseConfiguredFunctions(char *functions)
+{
+   char *function;
+   char *end;
+   int accelfunc;
+
+   while ((function = strsep(&functions, ",")) != NULL)
+   {
+      // remove spaces
+      if (strlen(function) > 0)
+      {
+         while (isspace((unsigned char)*function)) function++;
+         end = function + strlen(function) - 1;
+         while (end > function && isspace((unsigned char)*end)) end--;
+         *(end+1) = 0;
+      }
+      if (strlen(function) == 0)
+         continue;
+
+      accelfunc = accelfuncNameToIndex(function);
+      if (accelfunc == ACCELFUNC_UNKNOWN)
+      {
+         log_fatal("Acceleration function %s not supported", function);
+         return -1;
+      }
+      if (nbConfigAccelfunc == ACCEL_DEVICE_MAX)
+      {
+         log_fatal("More than %d acceleration functions requested", ACCEL_DEVICE_MAX);
+         return -1;
+      }
+
+      configAccelfunc[nbConfigAccelfunc++] = accelfunc;
+   }
+   return 0;
+}
+
+// Requested function of idev-th attached device, ACCELFUNC_UNKNOWN if none.
+// If less functions configured than devices, all remaining devices will have same function
+// (alternative: if more than one function and less than devices, fatal error)
+static int configuredFunction(int idev)
+{
+   if (nbConfigAccelfunc == 0)
+      return ACCELFUNC_UNKNOWN;
+   return configAccelfunc[(idev < nbConfigAccelfunc) ? idev : nbConfigAccelfunc - 1];
+}
+
 // Parse requested comma separated list of devices and find associated accelerator devices
-static int getConfiguredDevices(char *devices)
+static int getConfiguredDevices(pid_t pid, char *devices)
 {
    char *device;
    char *end;
+   int accelfuncList[ACCEL_DEVICE_MAX];
+   int count, idev;
 
    while ((device = strsep(&devices, ",")) != NULL)
    {
@@ -108,14 +174,33 @@ static int getConfiguredDevices(char *devices)
       // if all devices requested, add all intel & xilinx accelerators to devices list
       if (strcasecmp(device, "all") == 0)
       {
-         acceleratorAddAlldev(attachDevList, & nbAttachDev);
+         if (acceleratorAddAlldev(pid, attachDevList, & nbAttachDev) < 0)
+         {
+            log_fatal("Accelerator devices %s not available", device);
+            return -1;
+         }
          break;
       }
+      // any:N, N devices local to container CPUs, preferably loaded with their requested functions
+      else if (strncasecmp(device, ACCEL_DEVICES_ANY, strlen(ACCEL_DEVICES_ANY)) == 0)
+      {
+         count = strtol(device + strlen(ACCEL_DEVICES_ANY), &end, 10);
+         if ((*end == '\0') && (count > 0) && (nbAttachDev + count <= ACCEL_DEVICE_MAX))
+         {
+            for (idev = 0; idev < count; idev++)
+               accelfuncList[idev] = configuredFunction(nbAttachDev + idev);
+         }
+         if ((*end != '\0') || (count <= 0) || (acceleratorAddAnydev(pid, count, accelfuncList, attachDevList, & nbAttachDev) < 0))
+         {
+            log_fatal("Accelerator devices %s not available", device);
+            return -1;
+         }
+      }
       else
       {
-         if (acceleratorAddDev(device, attachDevList, & nbAttachDev) < 0)
+         if (acceleratorAddDev(pid, device, attachDevList, & nbAttachDev) < 0)
          {
-            log_fatal("Accelerator device %s not found", device);
+            log_fatal("Accelerator device %s not available", device);
             return -1;
          }
       }
@@ -125,82 +210,65 @@ static int getConfiguredDevices(char *devices)
 }
 
 
-// Parse requested comma separated list of functions.
 // foreach (device, requested function)
 //      if device already loaded with function, ok
 //    elif device is a physical PCIe function and engine supports physical fn reconfig, load function
 //    elif device is a virtual PCIe function  and engine supports virtual fn reconfig, load function
-static int loadConfiguredFunctions(char *functions)
+// Bitstreams are loaded concurrently, except to devices sharing a same reconfiguration engine
+static int loadConfiguredFunctions()
 {
-   char *function;
-   char *end;
-   int idev = 0;
-   int accelfunc;
-   int devAccelfunc[ACCEL_DEVICE_MAX];
-
-   while ((function = strsep(&functions, ",")) != NULL)
-   {
-      // remove spaces
-      if (strlen(function) > 0)
-      {
-         while (isspace((unsigned char)*function)) function++;
-         end = function + strlen(function) - 1;
-         while (end > function && isspace((unsigned char)*end)) end--;
-         *(end+1) = 0;
-      }
-      if (strlen(function) == 0)
-         continue;
-
-      accelfunc = accelfuncNameToIndex(function);
-      if (accelfunc == ACCELFUNC_UNKNOWN)
-      {
-         log_fatal("Acceleration function %s not supported", function);
-         return -1;
-      }
-
-      devAccelfunc[idev++] = accelfunc;
-   }
+   int idev;
+   int devAccelfunc;
+   t_acceldev *loadDevList[ACCEL_DEVICE_MAX];
+   int loadAccelfunc[ACCEL_DEVICE_MAX];
+   int loadStatus[ACCEL_DEVICE_MAX];
+   int nbLoad;
 
-   if (idev == 0)
+   if (nbConfigAccelfunc == 0)
    {
       log_warn("Acceleration function(s) not provided: use accelerators current functions");
       return 0;
    }
 
-   // if less functions configured than devices, all remaining devices will have same function
-   // (alternative: if more than one function and less than devices, fatal error)
-   for ( ; idev < nbAttachDev; idev ++)
-   {
-      devAccelfunc[idev] = accelfunc;
-   }
-
-   // Load expected accelerator functions if possible
+   // Check all devices can get their expected function before loading any
+   nbLoad = 0;
    for (idev = 0 ; idev < nbAttachDev; idev ++)
    {
-      if (attachDevList[idev]->accelfunc == devAccelfunc[idev])
+      devAccelfunc = configuredFunction(idev);
+      // a pending load (e.g. a warm load) may change function: queue behind it, the load is skipped if not needed
+      if ( (attachDevList[idev]->accelfunc == devAccelfunc)
+        && ( (! loadQueueBusy(attachDevList[idev]))
+          || (! acceleratorReconfigSupport(attachDevList[idev], attachDevList[idev]->pcifnType))))
       {
-         log_info("Device %s: function %s already loaded", attachDevList[idev]->bdf.str, accelfuncIndexToName(accelfunc));
+         log_info("Device %s: function %s already loaded", attachDevList[idev]->bdf.str, accelfuncIndexToName(devAccelfunc));
       }
       else if (acceleratorReconfigSupport(attachDevList[idev], attachDevList[idev]->pcifnType))
       {
          log_info("Device %s: try to load function %s ...",
-               attachDevList[idev]->bdf.str, accelfuncIndexToName(devAccelfunc[idev]));
-
-         if (acceleratorLoadBitstream(attachDevList[idev], devAccelfunc[idev]) < 0)
-         {
-            log_fatal("Device %s: failed to load function %s",
-                  attachDevList[idev]->bdf.str, accelfuncIndexToName(devAccelfunc[idev]));
-            return -1;
-         }
+               attachDevList[idev]->bdf.str, accelfuncIndexToName(devAccelfunc));
+         loadDevList[nbLoad] = attachDevList[idev];
+         loadAccelfunc[nbLoad++] = devAccelfunc;
       }
       else
       {
          log_fatal("Device %s has not function %s and is not reconfigurable",
-               attachDevList[idev]->bdf.str, accelfuncIndexToName(devAccelfunc[idev]));
+               attachDevList[idev]->bdf.str, accelfuncIndexToName(devAccelfunc));
          return -1;
       }
    }
 
+   // Load expected accelerator functions, devices in parallel
+   if ((nbLoad > 0) && (acceleratorLoadBitstreams(loadDevList, loadAccelfunc, loadStatus, nbLoad) < 0))
+   {
+      for (idev = 0 ; idev < nbLoad; idev ++)
+      {
+         if (loadStatus[idev] < 0)
+            log_fatal("Device %s: failed to load function %s",
+                  loadDevList[idev]->bdf.str, accelfuncIndexToName(loadAccelfunc[idev]));
+      }
+      return -1;
+   }
+
    return 0;
 }
 
@@ -208,6 +276,7 @@ static int loadConfiguredFunctions(char *functions)
 // Adjust host device files permissions
 static int hostSetup(pid_t pid, t_acceldev **acceldevList, int nbAcceldev)
 {
+   int64_t span;
    int idev;
    int idevpath;
 
@@ -218,12 +287,14 @@ static int hostSetup(pid_t pid, t_acceldev **acceldevList, int nbAcceldev)
       {
          if (strlen(acceldevList[idev]->devpath[idevpath]) == 0)
             continue;
+         span = traceBegin();
          if (chmod(acceldevList[idev]->devpath[idevpath], 0666) < 0)
          {
             log_error("Device %s: failed to chmod %s: %s",
                   attachDevList[idev]->bdf.str, acceldevList[idev]->devpath[idevpath], strerror(errno));
             return -1;
          }
+         traceEnd(span, "chmod", "%s", acceldevList[idev]->devpath[idevpath]);
       }
 
       if (accelengineHostDeviceSetup(attachDevList[idev]->enginetype, attachDevList[idev]) < 0)
@@ -238,44 +309,156 @@ static int hostSetup(pid_t pid, t_acceldev **acceldevList, int nbAcceldev)
 // Do configure command
 static int doConfigure(struct context *ctx)
 {
+   int64_t bench;
+   int idev;
+
    log_info("Configure devices %s on root FS %s", ctx->devices, ctx->rootfs);
 
-   if (getConfiguredDevices(ctx->devices) < 0)
+   // functions first: devices selection depends on them
+   if (parseConfiguredFunctions(ctx->functions) < 0)
    {
       return EXIT_FAILURE;
    }
 
-   if (loadConfiguredFunctions(ctx->functions) < 0)
+   bench = benchStart();
+   if (getConfiguredDevices(ctx->pid, ctx->devices) < 0)
    {
-      return EXIT_FAILURE;
+      goto fail;
+   }
+   benchStop(BENCH_LOOKUP, bench, "%s", ctx->devices);
+
+   for (idev = 0; idev < nbAttachDev; idev++)
+      functionRequested(configuredFunction(idev));
+
+   bench = benchStart();
+   if (loadConfiguredFunctions() < 0)
+   {
+      goto fail;
    }
+   benchStop(BENCH_LOAD, bench, NULL);
 
+   bench = benchStart();
    if (hostSetup(ctx->pid, attachDevList, nbAttachDev) < 0)
    {
       log_fatal("Failed to setup host for accelerator(s) %s", ctx->devices);
-      return EXIT_FAILURE;
+      goto fail;
    }
+   benchStop(BENCH_HOSTSETUP, bench, NULL);
 
-   if (containerSetup(ctx->pid, ctx->rootfs, attachDevList, nbAttachDev) < 0)
+   if (containerSetup(ctx->pid, ctx->rootfs, ctx->deviceRules, attachDevList, nbAttachDev) < 0)
    {
       log_fatal("Failed to setup container for accelerator(s) %s", ctx->devices);
-      return EXIT_FAILURE;
+      goto fail;
    }
 
    return EXIT_SUCCESS;
+
+fail:
+   // container won't start: free its devices for others now rather than when its lease gets stale
+   for (idev = 0; idev < nbAttachDev; idev++)
+      deviceLeaseRelease(attachDevList[idev], ctx->pid);
+   return EXIT_FAILURE;
+}
+
+// Do release command: free devices of stopped container, then load warm functions into them
+// in a detached child, so that container runtime does not wait for loads.
+static int doRelease(struct context *ctx)
+{
+   t_acceldev *warmDevList[ACCEL_DEVICE_MAX];
+   int warmAccelfunc[ACCEL_DEVICE_MAX];
+   int nbWarm = 0;
+   int accelfunc;
+   int idev;
+   int fd;
+   pid_t pid;
+   int ret = EXIT_SUCCESS;
+
+   log_info("Release devices of container pid %d", ctx->pid);
+   if (acceleratorReleaseDevices(ctx->pid, attachDevList, & nbAttachDev) < 0)
+      ret = EXIT_FAILURE;
+
+   for (idev = 0; idev < nbAttachDev; idev++)
+   {
+      accelfunc = acceleratorWarmFunction(attachDevList[idev]);
+      if ( (accelfunc != ACCELFUNC_UNKNOWN) && (attachDevList[idev]->accelfunc != accelfunc)
+        && (acceleratorReconfigSupport(attachDevList[idev], attachDevList[idev]->pcifnType)))
+      {
+         warmDevList[nbWarm] = attachDevList[idev];
+         warmAccelfunc[nbWarm++] = accelfunc;
+      }
+   }
+   if (nbWarm == 0)
+      return ret;
+
+   pid = fork();
+   if (pid < 0)
+   {
+      log_warn("Warm functions not loaded: fork failed: %s", strerror(errno));
+      return ret;
+   }
+   if (pid > 0)
+   {
+      log_info("%d warm function(s) load started as pid %d", nbWarm, pid);
+      return ret;
+   }
+
+   // runtime waits for hook output to be closed
+   setsid();
+   fd = open("/dev/null", O_RDWR|O_CLOEXEC);
+   if (fd >= 0)
+   {
+      dup2(fd, STDIN_FILENO);
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+   }
+   for (idev = 0; idev < nbWarm; idev++)
+   {
+      if (acceleratorWarmLoad(warmDevList[idev], warmAccelfunc[idev]) < 0)
+         ret = EXIT_FAILURE;
+   }
+   return ret;
+}
+
+// Run configure or release request of a server client, in a child process
+static int serveRequest(t_serveRequest *request)
+{
+   struct context ctx = { -1, "", request->pid, request->rootfs, request->devices, request->functions, request->command,
+                          NULL, request->deviceRules };
+
+   if (! strcmp(request->command, "configure"))
+      return doConfigure(& ctx);
+   if (! strcmp(request->command, "release"))
+      return doRelease(& ctx);
+
+   log_fatal("Unknown command %s", request->command);
+   return EXIT_FAILURE;
 }
 
 
 int main(int argc, char *argv[])
 {
+   char conffile[FS_PATH_MAX];
+   char imagefile[FS_PATH_MAX];
    int ret = EXIT_FAILURE;
 
-   struct context ctx = { LOG_ERR, "", 0, "", "", "", "" };
+   struct context ctx = { LOG_ERR, "", 0, "", "", "", "", getenv(ACCEL_TRACE_ENV), NULL };
    argp_parse(&usage, argc, argv, ARGP_IN_ORDER, NULL, &ctx);
 
    logOpen(ctx.logFile, ctx.logLevel);
+   traceOpen(ctx.traceFile);
 
-   if (acceleratorReadConf(ACCEL_SETTINGS_CONFFILE) < 0)
+   snprintf(conffile, sizeof conffile, "%s", hostPath(HOST_PATH_CONF));
+   snprintf(imagefile, sizeof imagefile, "%s", hostPath(HOST_PATH_IMAGE));
+   if (!strcmp(ctx.command, "bench"))
+      benchEnable();
+
+   if (!strcmp(ctx.command, "compile-config"))
+   {
+      if (acceleratorCompileConf(conffile, imagefile) == 0)
+         ret = EXIT_SUCCESS;
+   }
+   else if (acceleratorReadConf(conffile, imagefile) < 0)
    {
       log_fatal("Failed to read acceleration config");
    }
@@ -289,6 +472,25 @@ int main(int argc, char *argv[])
       {
          ret = doConfigure(& ctx);
       }
+      else if (!strcmp(ctx.command, "bench"))
+      {
+         ret = doConfigure(& ctx);
+         benchReport(stdout, nbAttachDev);
+      }
+      else if (!strcmp(ctx.command, "release"))
+      {
+         ret = doRelease(& ctx);
+      }
+      else if (!strcmp(ctx.command, "sriov-setup"))
+      {
+         if (acceleratorSriovRefill() == 0)
+            ret = EXIT_SUCCESS;
+      }
+      else if (!strcmp(ctx.command, "serve"))
+      {
+         if (serverRun(ACCEL_SERVE_SOCKET, conffile, imagefile, serveRequest) == 0)
+            ret = EXIT_SUCCESS;
+      }
       else
       {
          log_fatal("Unknown command %s", ctx.command);
@@ -0,0 +1,362 @@
+/*
+ * Container mounts, prepared in host namespace then attached in container mount namespace
+ *
+ * With the new mount API, each source is cloned once as a detached mount (open_tree),
+ * its flags set in one call (mount_setattr), and attached relative to the rootfs
+ * directory (move_mount). Kernels without it (< 5.12) fall back to bind and remount by path.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "utils.h"
+
+#ifndef SYS_open_tree
+#define SYS_open_tree       428
+#endif
+#ifndef SYS_move_mount
+#define SYS_move_mount      429
+#endif
+#ifndef SYS_mount_setattr
+#define SYS_mount_setattr   442
+#endif
+
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE          1
+#define OPEN_TREE_CLOEXEC        O_CLOEXEC
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH  0x00000004
+#endif
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY        0x00000001
+#define MOUNT_ATTR_NOSUID        0x00000002
+#define MOUNT_ATTR_NODEV         0x00000004
+#define MOUNT_ATTR_NOEXEC        0x00000008
+#endif
+
+#define MOUNT_PLAN_MIN   32
+
+typedef struct {
+   uint64_t attr_set;
+   uint64_t attr_clr;
+   uint64_t propagation;
+   uint64_t userns_fd;
+} t_mountAttr;
+
+
+static int sysOpenTree(int dfd, const char *path, unsigned int flags)
+{
+   return syscall(SYS_open_tree, dfd, path, flags);
+}
+
+static int sysMountSetattr(int dfd, const char *path, unsigned int flags, t_mountAttr *attr)
+{
+   return syscall(SYS_mount_setattr, dfd, path, flags, attr, sizeof(t_mountAttr));
+}
+
+static int sysMoveMount(int fromdfd, const char *frompath, int todfd, const char *topath, unsigned int flags)
+{
+   return syscall(SYS_move_mount, fromdfd, frompath, todfd, topath, flags);
+}
+
+static t_mountEntry *mountPlanNew(t_mountPlan *plan)
+{
+   t_mountEntry *entry;
+
+   if (plan->nbmount == plan->maxmount)
+   {
+      int maxmount = (plan->maxmount > 0) ? plan->maxmount * 2 : MOUNT_PLAN_MIN;
+      t_mountEntry *list = realloc(plan->list, maxmount * sizeof(t_mountEntry));
+
+      if (list == NULL)
+      {
+         log_error("Mount plan: out of memory");
+         return NULL;
+      }
+      plan->list = list;
+      plan->maxmount = maxmount;
+   }
+   entry = & plan->list[plan->nbmount++];
+   memset(entry, 0, sizeof(t_mountEntry));
+   entry->fd = -1;
+   return entry;
+}
+
+// Add a mount bind of srcpath to container dstpath (srcpath if NULL)
+int mountPlanAdd(t_mountPlan *plan, const char *srcpath, const char *dstpath, bool device, bool rdonly, bool noexec)
+{
+   t_mountEntry *entry;
+
+   if ((strlen(srcpath) >= FS_PATH_MAX) || ((dstpath != NULL) && (strlen(dstpath) >= FS_PATH_MAX)))
+   {
+      log_error("Mount path %s too long", srcpath);
+      return -1;
+   }
+   entry = mountPlanNew(plan);
+   if (entry == NULL)
+      return -1;
+
+   strcpy(entry->src, srcpath);
+   strcpy(entry->dst, (dstpath != NULL) ? dstpath : srcpath);
+   entry->device = device;
+   entry->rdonly = rdonly;
+   entry->noexec = noexec;
+   return 0;
+}
+
+// Add a recursive mount bind of srcpath tree to container dstpath
+int mountPlanAddTree(t_mountPlan *plan, const char *srcpath, const char *dstpath, bool rdonly)
+{
+   if (mountPlanAdd(plan, srcpath, dstpath, false, rdonly, false) < 0)
+      return -1;
+   plan->list[plan->nbmount-1].recursive = true;
+   return 0;
+}
+
+// Add a container symlink path to target, created in order with mounts
+int mountPlanAddLink(t_mountPlan *plan, const char *path, const char *target)
+{
+   t_mountEntry *entry;
+
+   if ((strlen(path) >= FS_PATH_MAX) || (strlen(target) >= FS_PATH_MAX))
+   {
+      log_error("Symlink path %s too long", path);
+      return -1;
+   }
+   entry = mountPlanNew(plan);
+   if (entry == NULL)
+      return -1;
+
+   strcpy(entry->dst, path);
+   strcpy(entry->link, target);
+   return 0;
+}
+
+static void mountPlanCloseFds(t_mountPlan *plan)
+{
+   int imount;
+
+   for (imount = 0; imount < plan->nbmount; imount++)
+   {
+      if (plan->list[imount].fd >= 0)
+         close(plan->list[imount].fd);
+      plan->list[imount].fd = -1;
+   }
+}
+
+// Clone and configure all mount sources, from host mount namespace.
+// Falls back to path mounts at attach time if the kernel lacks the new mount API.
+int mountPlanPrepare(t_mountPlan *plan)
+{
+   t_mountEntry *entry;
+   t_mountAttr attr;
+   struct stat stats;
+   int imount;
+
+   plan->fdMounts = true;
+   for (imount = 0; imount < plan->nbmount; imount++)
+   {
+      int64_t span = traceBegin();
+
+      entry = & plan->list[imount];
+      if (entry->link[0] != '\0')
+         continue;
+
+      entry->fd = sysOpenTree(AT_FDCWD, entry->src,
+            OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | (entry->recursive ? AT_RECURSIVE : 0));
+      if ((entry->fd < 0) && (errno != ENOENT))
+         goto fallback;
+      if ((entry->fd < 0) || (fstat(entry->fd, &stats) != 0))
+      {
+         log_error("Mount src %s not found", entry->src);
+         goto error;
+      }
+      entry->mode = stats.st_mode;
+
+      memset(&attr, 0, sizeof attr);
+      if (! entry->device)
+         attr.attr_set |= MOUNT_ATTR_NODEV;
+      if (entry->rdonly)
+         attr.attr_set |= MOUNT_ATTR_RDONLY;
+      if (entry->noexec)
+         attr.attr_set |= MOUNT_ATTR_NOEXEC | MOUNT_ATTR_NOSUID;
+      if ((attr.attr_set != 0) && (sysMountSetattr(entry->fd, "", AT_EMPTY_PATH | (entry->recursive ? AT_RECURSIVE : 0), &attr) < 0))
+      {
+         if ((errno == ENOSYS) || (errno == EINVAL) || (errno == EPERM))
+            goto fallback;
+         log_error("Mount src %s: failed to set attributes: %s", entry->src, strerror(errno));
+         goto error;
+      }
+      traceEnd(span, "open_tree", "%s", entry->src);
+   }
+   return 0;
+
+fallback:
+   // ENOSYS: old kernel, EPERM: syscall filtered, EINVAL: attributes unsupported
+   log_debug("Mount src %s: new mount API unavailable (%s), fall back to path mounts", entry->src, strerror(errno));
+   mountPlanCloseFds(plan);
+   plan->fdMounts = false;
+   return 0;
+
+error:
+   mountPlanCloseFds(plan);
+   return -1;
+}
+
+// Create container symlink to entry link target, beneath rootfs directory.
+// Image entry already there: bound over with the link target instead, as mounts are; symlink to elsewhere refused.
+static int attachLink(int rootfd, char *rootfs, t_mountEntry *entry)
+{
+   char dstpathfull[2*FS_PATH_MAX];
+   char srcpathfull[2*FS_PATH_MAX];
+   char relpath[FS_PATH_MAX];
+   char target[FS_PATH_MAX];
+   char fdpath[FS_PATH_MAX + 32];
+   struct stat stats;
+   const char *parent;
+   char *name;
+   ssize_t len;
+   int dirfd;
+   int ret = -1;
+
+   snprintf(dstpathfull, sizeof dstpathfull, "%s/%s", rootfs, entry->dst);
+   snprintf(relpath, sizeof relpath, "%s", entry->dst + strspn(entry->dst, "/"));
+   name = strrchr(relpath, '/');
+   if (name == NULL)
+   {
+      parent = ".";
+      name = relpath;
+   }
+   else
+   {
+      *name++ = '\0';
+      parent = relpath;
+      snprintf(srcpathfull, sizeof srcpathfull, "%s/%s", rootfs, parent);
+      if (file_create(srcpathfull, NULL, 0/*uid*/, 0/*gid*/, S_IFDIR | 0755) < 0)
+      {
+         log_error("Symlink %s: failed to create parent directory", dstpathfull);
+         return -1;
+      }
+   }
+
+   dirfd = openBeneath(rootfd, parent, O_PATH | O_DIRECTORY);
+   if (dirfd < 0)
+   {
+      log_error("Symlink %s: parent directory not usable: %s", dstpathfull, strerror(errno));
+      return -1;
+   }
+   if (symlinkat(entry->link, dirfd, name) == 0)
+   {
+      log_debug("Symlink %s created to %s", dstpathfull, entry->link);
+      ret = 0;
+      goto out;
+   }
+   if ((errno != EEXIST) || (fstatat(dirfd, name, &stats, AT_SYMLINK_NOFOLLOW) < 0))
+   {
+      log_error("Symlink %s: failed to create: %s", dstpathfull, strerror(errno));
+      goto out;
+   }
+
+   if (S_ISLNK(stats.st_mode))
+   {
+      // left by a previous start of the container
+      len = readlinkat(dirfd, name, target, sizeof target - 1);
+      if (len >= 0)
+         target[len] = '\0';
+      if ((len >= 0) && (strcmp(target, entry->link) == 0))
+         ret = 0;
+      else
+         log_error("Symlink %s: path exists as another symlink", dstpathfull);
+      goto out;
+   }
+
+   snprintf(srcpathfull, sizeof srcpathfull, "%s/%s", rootfs, entry->link);
+   snprintf(fdpath, sizeof fdpath, "/proc/self/fd/%d/%s", dirfd, name);
+   if (mount(srcpathfull, fdpath, NULL, MS_BIND | MS_REC, NULL) < 0)
+   {
+      log_error("Symlink %s: path exists, mount bind of %s failed: %s", dstpathfull, entry->link, strerror(errno));
+      goto out;
+   }
+   log_debug("Symlink %s: path exists, %s mounted instead", dstpathfull, entry->link);
+   ret = 0;
+
+out:
+   close(dirfd);
+   return ret;
+}
+
+// Attach all planned mounts and symlinks under rootfs, from container mount namespace
+int mountPlanAttach(t_mountPlan *plan, char *rootfs)
+{
+   char dstpathfull[2*FS_PATH_MAX]; // *2 for nested FS
+   t_mountEntry *entry;
+   int rootfd = -1;
+   int imount;
+   int ret = -1;
+
+   rootfd = open(rootfs, O_PATH | O_DIRECTORY | O_CLOEXEC);
+   if (rootfd < 0)
+   {
+      log_error("Root FS %s: failed to open: %s", rootfs, strerror(errno));
+      goto out;
+   }
+
+   for (imount = 0; imount < plan->nbmount; imount++)
+   {
+      int64_t span = traceBegin();
+
+      entry = & plan->list[imount];
+      snprintf(dstpathfull, sizeof(dstpathfull), "%s/%s", rootfs, entry->dst);
+
+      if (entry->link[0] != '\0')
+      {
+         if (attachLink(rootfd, rootfs, entry) < 0)
+            goto out;
+         continue;
+      }
+
+      if (! plan->fdMounts)
+      {
+         if (mountFile(rootfs, entry->src, entry->dst, entry->device, entry->rdonly, entry->noexec, entry->recursive) < 0)
+            goto out;
+         continue;
+      }
+
+      if (file_create(dstpathfull, NULL, 0 /*uid*/, 0 /*gid*/, entry->mode) < 0)
+      {
+         log_error("Mount src path %s: failed to create dest", entry->src);
+         goto out;
+      }
+      // dest path is relative to rootfs directory
+      if (sysMoveMount(entry->fd, "", rootfd, entry->dst + strspn(entry->dst, "/"), MOVE_MOUNT_F_EMPTY_PATH) < 0)
+      {
+         log_error("Mount src path %s: move mount failed: %s", entry->src, strerror(errno));
+         goto out;
+      }
+      close(entry->fd);
+      entry->fd = -1;
+      log_debug("srcpath %s mounted to dstpath %s", entry->src, dstpathfull);
+      traceEnd(span, "move_mount", "%s", entry->src);
+   }
+   ret = 0;
+
+out:
+   if (rootfd >= 0)
+      close(rootfd);
+   return ret;
+}
+
+void mountPlanFree(t_mountPlan *plan)
+{
+   mountPlanCloseFds(plan);
+   free(plan->list);
+   memset(plan, 0, sizeof(t_mountPlan));
+}
@@ -0,0 +1,123 @@
+/*
+ * NUMA locality of devices and container processes
+ *
+ * A device is local to the CPUs of its NUMA node (the node cpulist is the device local_cpulist).
+ * Container CPUs are those the container process may run on: its cpuset, or its affinity if narrower.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+
+#include "utils.h"
+
+#define PROC_STATUS_CPUS  "Cpus_allowed_list:"
+#define CGROUP_CPUSET     "cpuset"
+#define CGROUP1_CPUS      "cpuset.effective_cpus"
+#define CGROUP2_CPUS      "cpuset.cpus.effective"
+#define CPULIST_LEN_MAX   4096
+
+
+// NUMA node of a PCI device, -1 if unknown
+int pciNumaNode(const char *pcisyspath)
+{
+   char syspath[FS_PATH_MAX];
+   char valuestr[16] = "";
+
+   snprintf(syspath, sizeof syspath, "%s/numa_node", pcisyspath);
+   if ((access(syspath, F_OK) != 0) || (sysfsReadString(syspath, valuestr, sizeof valuestr - 1) < 0))
+      return -1;
+   return atoi(valuestr);
+}
+
+// Parse a kernel CPU list, ex "0-3,8,10-11"
+int cpulistParse(const char *list, cpu_set_t *cpus)
+{
+   const char *ptr = list;
+   char *end;
+   long first, last, cpu;
+
+   CPU_ZERO(cpus);
+   while (*ptr != '\0')
+   {
+      first = strtol(ptr, &end, 10);
+      if (end == ptr)
+         break;
+      last = first;
+      if (*end == '-')
+      {
+         ptr = end + 1;
+         last = strtol(ptr, &end, 10);
+         if (end == ptr)
+            return -1;
+      }
+      if ((first < 0) || (last < first) || (last >= CPU_SETSIZE))
+         return -1;
+      for (cpu = first; cpu <= last; cpu++)
+         CPU_SET(cpu, cpus);
+
+      ptr = end + strspn(end, ", \t\n");
+   }
+   return (*ptr == '\0') ? 0 : -1;
+}
+
+static int cpulistRead(const char *path, cpu_set_t *cpus)
+{
+   char list[CPULIST_LEN_MAX] = "";
+
+   if ((access(path, F_OK) != 0) || (sysfsReadString((char *) path, list, sizeof list - 1) < 0))
+      return -1;
+   return cpulistParse(list, cpus);
+}
+
+// CPUs of a NUMA node
+int nodeCpus(int node, cpu_set_t *cpus)
+{
+   char syspath[FS_PATH_MAX];
+
+   snprintf(syspath, sizeof syspath, "%s/node%d/cpulist", hostPath(HOST_PATH_SYSFS_NODE), node);
+   return cpulistRead(syspath, cpus);
+}
+
+// CPUs a process may run on: allowed list of its status, else its cgroup cpuset
+int processCpus(pid_t pid, cpu_set_t *cpus)
+{
+   char path[FS_PATH_MAX];
+   char line[CPULIST_LEN_MAX];
+   FILE *status;
+   int ret = -1;
+
+   snprintf(path, sizeof path, "%s/%d/status", hostPath(HOST_PATH_PROC), pid);
+   status = fopen(path, "re");
+   if (status != NULL)
+   {
+      while (fgets(line, sizeof line, status) != NULL)
+      {
+         if (strncmp(line, PROC_STATUS_CPUS, strlen(PROC_STATUS_CPUS)) == 0)
+         {
+            ret = cpulistParse(line + strlen(PROC_STATUS_CPUS) + strspn(line + strlen(PROC_STATUS_CPUS), " \t"), cpus);
+            break;
+         }
+      }
+      fclose(status);
+      if (ret == 0)
+         return 0;
+   }
+
+   if (cgroupUnified())
+   {
+      if (findCgroupPath(pid, SYSFS_CGROUP_UNIFIED, path, sizeof path - strlen(CGROUP2_CPUS)) < 0)
+         return -1;
+      strcat(path, CGROUP2_CPUS);
+   }
+   else
+   {
+      if (findCgroupPath(pid, CGROUP_CPUSET, path, sizeof path - strlen(CGROUP1_CPUS)) < 0)
+         return -1;
+      strcat(path, CGROUP1_CPUS);
+   }
+   return cpulistRead(path, cpus);
+}
@@ -0,0 +1,135 @@
+/*
+ * Devices reconfiguration times, kept across runs to steer devices selection
+ *
+ * Text file under /run, one line per device: "<engine> <bdf> <ms>", ms smoothed over loads.
+ * The file is rewritten (temporary file renamed) after each successful load: concurrent runs
+ * may lose an update, never corrupt the file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "accelerator.h"
+
+#define RECONFIG_TIMES_NAME  "reconfig.times"
+
+typedef struct {
+   int  enginetype;
+   char bdf[PCI_BDF_LEN];
+   int  loadMs;
+} t_reconfigTime;
+
+static t_reconfigTime reconfigTimes[ACCEL_DEVICE_MAX];
+static int nbReconfigTimes = 0;
+static bool reconfigTimesRead = false;
+static pthread_mutex_t reconfigTimesLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void timesPath(char *path, int pathlen)
+{
+   snprintf(path, pathlen, "%s/%s", hostPath(HOST_PATH_RUN), RECONFIG_TIMES_NAME);
+}
+
+static void readTimes()
+{
+   char path[FS_PATH_MAX];
+   char bdf[PCI_BDF_LEN];
+   int enginetype, loadMs;
+   FILE *file;
+
+   reconfigTimesRead = true;
+   timesPath(path, sizeof path);
+   file = fopen(path, "re");
+   if (file == NULL)
+      return;
+   while ((nbReconfigTimes < ACCEL_DEVICE_MAX)
+       && (fscanf(file, "%d %9s %d", &enginetype, bdf, &loadMs) == 3))
+   {
+      reconfigTimes[nbReconfigTimes].enginetype = enginetype;
+      strcpy(reconfigTimes[nbReconfigTimes].bdf, bdf);
+      reconfigTimes[nbReconfigTimes].loadMs = loadMs;
+      nbReconfigTimes++;
+   }
+   fclose(file);
+}
+
+static void writeTimes()
+{
+   char path[FS_PATH_MAX];
+   char tmppath[FS_PATH_MAX + 16];
+   FILE *file;
+   int itime;
+
+   timesPath(path, sizeof path);
+   snprintf(tmppath, sizeof tmppath, "%s.%d", path, getpid());
+   if ((mkdir(hostPath(HOST_PATH_RUN), 0755) < 0) && (errno != EEXIST))
+      return;
+   file = fopen(tmppath, "we");
+   if (file == NULL)
+   {
+      log_warn("Reconfiguration times: failed to create %s: %s", tmppath, strerror(errno));
+      return;
+   }
+   for (itime = 0; itime < nbReconfigTimes; itime++)
+      fprintf(file, "%d %s %d\n", reconfigTimes[itime].enginetype, reconfigTimes[itime].bdf, reconfigTimes[itime].loadMs);
+   if ((fclose(file) != 0) || (rename(tmppath, path) < 0))
+   {
+      log_warn("Reconfiguration times: failed to write %s: %s", path, strerror(errno));
+      unlink(tmppath);
+   }
+}
+
+static t_reconfigTime *findTime(t_acceldev *acceldev)
+{
+   int itime;
+
+   if (! reconfigTimesRead)
+      readTimes();
+   for (itime = 0; itime < nbReconfigTimes; itime++)
+   {
+      if ((reconfigTimes[itime].enginetype == acceldev->enginetype) && (! strcmp(reconfigTimes[itime].bdf, acceldev->bdf.str)))
+         return & reconfigTimes[itime];
+   }
+   return NULL;
+}
+
+// Last reconfiguration time of device in ms, -1 if never measured
+int reconfigTimeGet(t_acceldev *acceldev)
+{
+   t_reconfigTime *reconfigTime;
+   int loadMs = -1;
+
+   pthread_mutex_lock(&reconfigTimesLock);
+   reconfigTime = findTime(acceldev);
+   if (reconfigTime != NULL)
+      loadMs = reconfigTime->loadMs;
+   pthread_mutex_unlock(&reconfigTimesLock);
+   return loadMs;
+}
+
+// Record a successful device reconfiguration, averaged with previous ones
+void reconfigTimeRecord(t_acceldev *acceldev, int loadMs)
+{
+   t_reconfigTime *reconfigTime;
+
+   pthread_mutex_lock(&reconfigTimesLock);
+   reconfigTime = findTime(acceldev);
+   if ((reconfigTime == NULL) && (nbReconfigTimes < ACCEL_DEVICE_MAX))
+   {
+      reconfigTime = & reconfigTimes[nbReconfigTimes++];
+      reconfigTime->enginetype = acceldev->enginetype;
+      strcpy(reconfigTime->bdf, acceldev->bdf.str);
+      reconfigTime->loadMs = loadMs;
+   }
+   if (reconfigTime != NULL)
+   {
+      reconfigTime->loadMs = (reconfigTime->loadMs + loadMs) / 2;
+      writeTimes();
+   }
+   pthread_mutex_unlock(&reconfigTimesLock);
+}
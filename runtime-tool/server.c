@@ -0,0 +1,379 @@
+/*
+ * Resident server mode: keep config and devices inventory in memory, and configure containers
+ * (and release their devices) on behalf of clients connected to a local Unix socket.
+ *
+ * Request: "key=value" lines (command, pid, rootfs, devices, functions, devicerules, loglevel) ended by an empty line.
+ * Each request is read and run by a forked child (a slow client never holds up others), whose stderr is
+ * the client socket: client gets the same messages as when running the tool itself, followed by a last line "exit <code>".
+ * Virtual functions pools are refilled by another child, once requests left them short.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <libgen.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+
+#include "accelerator.h"
+
+#define SERVE_CLIENTS_MAX    64
+#define SERVE_REQUEST_MAX    8192
+#define SERVE_RECV_TIMEOUT   5   // seconds
+
+typedef struct {
+   pid_t pid;
+   int   fd;
+} t_serveClient;
+
+static t_serveClient clientList[SERVE_CLIENTS_MAX];
+static pid_t refillPid = 0;
+
+
+static void clientReply(int fd, int code)
+{
+   char reply[32];
+   int len;
+
+   len = snprintf(reply, sizeof reply, "exit %d\n", code);
+   if (write(fd, reply, len) < 0)
+      log_debug("Server: failed to reply to client: %s", strerror(errno));
+}
+
+// Read request until empty line, and parse it
+static int readRequest(int fd, t_serveRequest *request)
+{
+   char buffer[SERVE_REQUEST_MAX];
+   size_t len = 0;
+   ssize_t ret;
+   char *line;
+   char *next;
+   char *value;
+
+   memset(request, 0, sizeof *request);
+   request->loglevel = -1;
+
+   while (len < sizeof buffer - 1)
+   {
+      ret = read(fd, buffer + len, sizeof buffer - 1 - len);
+      if ((ret < 0) && (errno == EINTR))
+         continue;
+      if (ret <= 0)
+         break;
+      len += ret;
+      buffer[len] = '\0';
+      if ((strstr(buffer, "\n\n") != NULL) || (! strcmp(buffer, "\n")))
+         break;
+   }
+   buffer[len] = '\0';
+   if (strstr(buffer, "\n\n") == NULL)
+   {
+      log_error("Server: truncated request");
+      return -1;
+   }
+
+   for (line = buffer; (line != NULL) && (*line != '\n'); line = next)
+   {
+      next = strchr(line, '\n');
+      *next++ = '\0';
+      value = strchr(line, '=');
+      if (value == NULL)
+         continue;
+      *value++ = '\0';
+
+      if (! strcmp(line, "command"))
+         snprintf(request->command, sizeof request->command, "%s", value);
+      else if (! strcmp(line, "pid"))
+         request->pid = atoi(value);
+      else if (! strcmp(line, "rootfs"))
+         snprintf(request->rootfs, sizeof request->rootfs, "%s", value);
+      else if (! strcmp(line, "devices"))
+         snprintf(request->devices, sizeof request->devices, "%s", value);
+      else if (! strcmp(line, "functions"))
+         snprintf(request->functions, sizeof request->functions, "%s", value);
+      else if (! strcmp(line, "devicerules"))
+         snprintf(request->deviceRules, sizeof request->deviceRules, "%s", value);
+      else if (! strcmp(line, "loglevel"))
+         request->loglevel = atoi(value);
+      else
+         log_warn("Server: unknown request field %s", line);
+   }
+   return 0;
+}
+
+// Only root may configure containers
+static bool clientAllowed(int fd)
+{
+   struct ucred cred;
+   socklen_t len = sizeof cred;
+
+   if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+   {
+      log_error("Server: failed to get client credentials: %s", strerror(errno));
+      return false;
+   }
+   if (cred.uid != 0)
+   {
+      log_error("Server: client pid %d uid %d not allowed", cred.pid, cred.uid);
+      return false;
+   }
+   return true;
+}
+
+static int serverSocket(const char *sockpath)
+{
+   struct sockaddr_un addr;
+   int fd;
+
+   if (strlen(sockpath) >= sizeof addr.sun_path)
+   {
+      log_error("Server: socket path %s too long", sockpath);
+      return -1;
+   }
+   memset(&addr, 0, sizeof addr);
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, sockpath);
+
+   fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+   if (fd < 0)
+   {
+      log_error("Server: socket failed: %s", strerror(errno));
+      return -1;
+   }
+
+   mkdir(dirname(strdupa(sockpath)), 0755);
+   unlink(sockpath);
+   if ((bind(fd, (struct sockaddr *) &addr, sizeof addr) < 0)
+    || (chmod(sockpath, 0600) < 0)
+    || (listen(fd, SERVE_CLIENTS_MAX) < 0))
+   {
+      log_error("Server: failed to listen on %s: %s", sockpath, strerror(errno));
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+// Config file changed since last read: read it again, with a full devices enumeration
+static int reloadIfChanged(char *conffile, char *imagefile, struct timespec *confMtime)
+{
+   struct stat stats;
+
+   if ((stat(conffile, &stats) < 0)
+    || ((stats.st_mtim.tv_sec == confMtime->tv_sec) && (stats.st_mtim.tv_nsec == confMtime->tv_nsec)))
+      return 0;
+
+   log_info("Server: config %s changed: reload", conffile);
+   *confMtime = stats.st_mtim;
+   acceleratorEnd();
+   if (acceleratorReadConf(conffile, imagefile) < 0)
+      return -1;
+   return acceleratorEnumerate();
+}
+
+// Fork a child to read and run the request, client gets child stderr
+static void startRequest(int fd, sigset_t *sigmask, t_serveHandler handler)
+{
+   struct timeval timeout = { SERVE_RECV_TIMEOUT, 0 };
+   t_serveRequest request;
+   int iclient;
+   pid_t pid;
+
+   for (iclient = 0; iclient < SERVE_CLIENTS_MAX; iclient++)
+   {
+      if (clientList[iclient].pid == 0)
+         break;
+   }
+   if (iclient == SERVE_CLIENTS_MAX)
+   {
+      log_error("Server: too many requests in progress");
+      clientReply(fd, EXIT_FAILURE);
+      close(fd);
+      return;
+   }
+
+   pid = fork();
+   if (pid < 0)
+   {
+      log_error("Server: fork failed: %s", strerror(errno));
+      clientReply(fd, EXIT_FAILURE);
+      close(fd);
+      return;
+   }
+   if (pid == 0)
+   {
+      sigprocmask(SIG_SETMASK, sigmask, NULL);
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+      if (readRequest(fd, &request) < 0)
+         exit(EXIT_FAILURE);
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+      if (request.loglevel >= 0)
+         logSetLevel(request.loglevel);
+      log_debug("Server: request %s pid %d run by child %d", request.command, request.pid, getpid());
+      exit(handler(&request));
+   }
+
+   clientList[iclient].pid = pid;
+   clientList[iclient].fd = fd;
+   log_debug("Server: request started as child %d", pid);
+}
+
+// Refill virtual functions pools in background: creating virtual functions is slow
+static void startRefill(sigset_t *sigmask)
+{
+   pid_t pid;
+
+   if ((refillPid != 0) || (acceleratorSriovMissing() == 0))
+      return;
+
+   pid = fork();
+   if (pid < 0)
+   {
+      log_error("Server: fork failed: %s", strerror(errno));
+      return;
+   }
+   if (pid == 0)
+   {
+      sigprocmask(SIG_SETMASK, sigmask, NULL);
+      exit((acceleratorSriovRefill() == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+   }
+   refillPid = pid;
+   log_debug("Server: virtual functions pools refill started as child %d", pid);
+}
+
+// Reply to clients of finished children, then refresh inventory: children may have loaded new functions
+static void endRequests()
+{
+   int status;
+   int iclient;
+   pid_t pid;
+   bool ended = false;
+
+   while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+   {
+      if (pid == refillPid)
+      {
+         refillPid = 0;
+         ended = true;
+         continue;
+      }
+      for (iclient = 0; iclient < SERVE_CLIENTS_MAX; iclient++)
+      {
+         if (clientList[iclient].pid == pid)
+         {
+            clientReply(clientList[iclient].fd, WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
+            close(clientList[iclient].fd);
+            clientList[iclient].pid = 0;
+            ended = true;
+            break;
+         }
+      }
+   }
+   if ((ended) && (acceleratorRefresh() < 0))
+      log_error("Server: failed to refresh devices");
+}
+
+// Serve requests until SIGTERM or SIGINT
+int serverRun(const char *sockpath, char *conffile, char *imagefile, t_serveHandler handler)
+{
+   struct pollfd pollfds[2];
+   struct signalfd_siginfo siginfo;
+   struct timespec confMtime = { 0, 0 };
+   struct stat stats;
+   sigset_t sigset, sigmask;
+   int listenfd, sigfd, fd;
+   int ret = -1;
+
+   if (stat(conffile, &stats) == 0)
+      confMtime = stats.st_mtim;
+
+   sigemptyset(&sigset);
+   sigaddset(&sigset, SIGCHLD);
+   sigaddset(&sigset, SIGTERM);
+   sigaddset(&sigset, SIGINT);
+   sigprocmask(SIG_BLOCK, &sigset, &sigmask);
+   sigfd = signalfd(-1, &sigset, SFD_CLOEXEC);
+   if (sigfd < 0)
+   {
+      log_error("Server: signalfd failed: %s", strerror(errno));
+      return -1;
+   }
+   listenfd = serverSocket(sockpath);
+   if (listenfd < 0)
+   {
+      close(sigfd);
+      return -1;
+   }
+   log_info("Server: listening on %s", sockpath);
+   startRefill(&sigmask);
+
+   pollfds[0].fd = listenfd;
+   pollfds[0].events = POLLIN;
+   pollfds[1].fd = sigfd;
+   pollfds[1].events = POLLIN;
+   for (;;)
+   {
+      logFlush();  // idle: nothing is kept buffered while waiting
+      if (poll(pollfds, 2, -1) < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         log_error("Server: poll failed: %s", strerror(errno));
+         break;
+      }
+
+      if (pollfds[1].revents & POLLIN)
+      {
+         if (read(sigfd, &siginfo, sizeof siginfo) != sizeof siginfo)
+            continue;
+         if (siginfo.ssi_signo == SIGCHLD)
+         {
+            endRequests();
+            startRefill(&sigmask);
+            continue;
+         }
+         log_info("Server: signal %d received: stop", siginfo.ssi_signo);
+         ret = 0;
+         break;
+      }
+
+      if (pollfds[0].revents & POLLIN)
+      {
+         fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+         if (fd < 0)
+            continue;
+
+         if (! clientAllowed(fd))
+         {
+            clientReply(fd, EXIT_FAILURE);
+            close(fd);
+            continue;
+         }
+
+         // take devices hotplug and config changes into account before serving request
+         if ((reloadIfChanged(conffile, imagefile, &confMtime) < 0) || (acceleratorRefresh() < 0))
+         {
+            log_error("Server: failed to refresh config and devices");
+            clientReply(fd, EXIT_FAILURE);
+            close(fd);
+            continue;
+         }
+         startRequest(fd, &sigmask, handler);
+      }
+   }
+
+   close(listenfd);
+   close(sigfd);
+   unlink(sockpath);
+   return ret;
+}
@@ -0,0 +1,354 @@
+/*
+ * Simulated FPGA engine and accelerators, for tests without FPGA hardware
+ *
+ * Devices layout, functions load latency distributions and load faults come from config.
+ * Functions loaded into slots are kept in a state file, so that consecutive runs see
+ * what previous runs loaded, as with real devices. Loads of different devices may run
+ * concurrently, from threads or processes: state file updates are serialized by flock.
+ *
+ * State file: one "<bdf> <hwID>" line per loaded slot.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "accelerator.h"
+
+#define SIM_STATE_NAME   "sim.state"
+#define SIM_STATE_MAX    (ACCEL_DEVICE_MAX * (PCI_BDF_LEN + FUNCTION_HWID_LEN + 2))
+#define SIM_VENDOR_ID    0xFFFF   // not a PCI vendor: never mistaken for a real device
+#define SIM_DEVICE_ID    0x5157
+#define SIM_BUS_BASE     0xE0     // up to 32 devices per bus
+
+static t_accelEngine simEngine = {
+   .name = "Simulated",
+   .bistreamPath = "",  // unused
+   .reconfigPhysfn = true,
+   .reconfigVirtfn = false,
+   .sriovMode = false,
+   .warmFunction = ACCELFUNC_UNKNOWN,
+   .loadTimeoutMs = 30000
+};
+
+static char *logtag = simEngine.name;
+
+// Simulated devices, each with its reconfiguration engine shared by its slots
+static t_acceldev simDevice[ACCEL_DEVICE_ENGINE_MAX];
+static int nbSimDevices = 0;
+
+
+static const char *stateFile(char *path, size_t len)
+{
+   if (simEngine.sim.stateFile[0] != '\0')
+      return simEngine.sim.stateFile;
+   snprintf(path, len, "%s/%s", hostPath(HOST_PATH_RUN), SIM_STATE_NAME);
+   return path;
+}
+
+// Open and lock state file, read its content
+static int stateOpen(int lockmode, char *state, size_t statelen)
+{
+   char path[FS_PATH_MAX];
+   ssize_t len;
+   int fd;
+
+   stateFile(path, sizeof path);
+   fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+   if (fd < 0)
+   {
+      log_error("%s: failed to open state file %s: %s", logtag, path, strerror(errno));
+      return -1;
+   }
+   if (flock(fd, lockmode) < 0)
+   {
+      log_error("%s: failed to lock state file %s: %s", logtag, path, strerror(errno));
+      close(fd);
+      return -1;
+   }
+   len = pread(fd, state, statelen - 1, 0);
+   if (len < 0)
+   {
+      log_error("%s: failed to read state file %s: %s", logtag, path, strerror(errno));
+      close(fd);
+      return -1;
+   }
+   state[len] = '\0';
+   return fd;
+}
+
+// Find hwID loaded into slot, empty if none
+static void stateGet(char *state, t_pcibdf *bdf, char *hwid, size_t hwidlen)
+{
+   char *line;
+   size_t bdflen = strlen(bdf->str);
+
+   hwid[0] = '\0';
+   for (line = state; *line != '\0'; line += strcspn(line, "\n") + (line[strcspn(line, "\n")] == '\n'))
+   {
+      if ((! strncmp(line, bdf->str, bdflen)) && (line[bdflen] == ' '))
+      {
+         snprintf(hwid, hwidlen, "%.*s", (int) strcspn(line + bdflen + 1, "\n"), line + bdflen + 1);
+         return;
+      }
+   }
+}
+
+// Replace slot line, or remove it if hwID is empty, then write state back
+static int stateSet(int fd, char *state, t_pcibdf *bdf, char *hwid)
+{
+   char newstate[SIM_STATE_MAX];
+   size_t len = 0;
+   size_t linelen;
+   size_t bdflen = strlen(bdf->str);
+   char *line;
+   char *next;
+
+   for (line = state; *line != '\0'; line = next)
+   {
+      next = line + strcspn(line, "\n");
+      if (*next == '\n')
+         next++;
+      linelen = next - line;
+      if (((! strncmp(line, bdf->str, bdflen)) && (line[bdflen] == ' ')) || (len + linelen >= sizeof newstate))
+         continue;
+      memcpy(newstate + len, line, linelen);
+      len += linelen;
+   }
+   if (hwid[0] != '\0')
+      len += snprintf(newstate + len, sizeof newstate - len, "%s %s\n", bdf->str, hwid);
+   if (len >= sizeof newstate)
+      len = sizeof newstate - 1;
+
+   if ((pwrite(fd, newstate, len, 0) != (ssize_t) len) || (ftruncate(fd, len) < 0))
+   {
+      log_error("%s: Device %s: failed to write state file: %s", logtag, bdf->str, strerror(errno));
+      return -1;
+   }
+   return 0;
+}
+
+// Read function loaded into slot from state file
+static int readSlot(t_acceldev *acceldev)
+{
+   char state[SIM_STATE_MAX];
+   int fd;
+
+   fd = stateOpen(LOCK_SH, state, sizeof state);
+   if (fd < 0)
+      return -1;
+   stateGet(state, &acceldev->bdf, acceldev->funcHwid, sizeof acceldev->funcHwid);
+   close(fd);
+
+   acceldev->accelfunc = acceleratorFuncHwidToIndex(ACCEL_ENGINE_SIM, acceldev->funcHwid);
+   return 0;
+}
+
+// Write function loaded into slot to state file
+static int writeSlot(t_acceldev *acceldev, char *hwid)
+{
+   char state[SIM_STATE_MAX];
+   int fd;
+   int ret;
+
+   fd = stateOpen(LOCK_EX, state, sizeof state);
+   if (fd < 0)
+      return -1;
+   ret = stateSet(fd, state, &acceldev->bdf, hwid);
+   close(fd);
+   return ret;
+}
+
+
+// Enumerate simulated devices and their slots
+static int enumerate(t_acceldev acceldevList[], int *nbAcceldev)
+{
+   t_acceldev *devptr;
+   int idev, islot;
+   int iacc;
+
+   for (idev = 0; (idev < simEngine.sim.nbDevices) && (nbSimDevices < ACCEL_DEVICE_ENGINE_MAX); idev++)
+   {
+      devptr = & simDevice[nbSimDevices++];
+      memset(devptr, 0, sizeof(t_acceldev));
+      devptr->enginetype = ACCEL_ENGINE_SIM;
+      devptr->slotId = idev;
+      devptr->vendorId = SIM_VENDOR_ID;
+      devptr->deviceId = SIM_DEVICE_ID;
+      devptr->numaNode = -1;
+      devptr->bdf.bus = SIM_BUS_BASE + idev / 32;
+      devptr->bdf.device = idev % 32;
+      devptr->bdf.function = 0;
+      snprintf(devptr->bdf.str, PCI_BDF_LEN, PCI_BDF_FMT,
+            (uint8_t) devptr->bdf.bus, (uint8_t) devptr->bdf.device, (uint8_t) devptr->bdf.function);
+
+      for (islot = 0; (islot < simEngine.sim.nbSlots) && (*nbAcceldev < ACCEL_DEVICE_MAX); islot++)
+      {
+         iacc = *nbAcceldev;
+         acceldevList[iacc] = *devptr;
+         acceldevList[iacc].slotId = idev * simEngine.sim.nbSlots + islot;
+         acceldevList[iacc].bdf.function = islot;
+         snprintf(acceldevList[iacc].bdf.str, PCI_BDF_LEN, PCI_BDF_FMT, (uint8_t) acceldevList[iacc].bdf.bus,
+               (uint8_t) acceldevList[iacc].bdf.device, (uint8_t) acceldevList[iacc].bdf.function);
+         acceldevList[iacc].pcifnType = PCIFUNC_PHYSICAL;
+         acceldevList[iacc].privdata = devptr;
+         if (readSlot(& acceldevList[iacc]) < 0)
+            return -1;
+
+         log_info("%s: New device: name %s, slot %d, function %s", logtag, acceldevList[iacc].bdf.str,
+               acceldevList[iacc].slotId, accelfuncIndexToName(acceldevList[iacc].accelfunc));
+         (*nbAcceldev) ++;
+      }
+   }
+   return 0;
+}
+
+
+// Draw a load latency from function distribution
+static int drawLatency(t_latencyConf *latency, unsigned short xsubi[3])
+{
+   double value;
+   double u1, u2, gauss;
+   double sigma2;
+
+   u1 = erand48(xsubi);
+   u2 = erand48(xsubi);
+   gauss = sqrt(-2.0 * log(1.0 - u1)) * cos(2.0 * M_PI * u2);  // Box-Muller
+
+   switch (latency->distrib)
+   {
+      case LATENCY_UNIFORM:
+         value = latency->minMs + u1 * (latency->maxMs - latency->minMs);
+         break;
+      case LATENCY_NORMAL:
+         value = latency->meanMs + gauss * latency->stddevMs;
+         break;
+      case LATENCY_LOGNORMAL:
+         if (latency->meanMs <= 0)
+         {
+            value = 0;
+            break;
+         }
+         sigma2 = log(1.0 + ((double) latency->stddevMs * latency->stddevMs) / ((double) latency->meanMs * latency->meanMs));
+         value = exp(log(latency->meanMs) - sigma2 / 2 + sqrt(sigma2) * gauss);
+         break;
+      case LATENCY_FIXED:
+      default:
+         value = latency->meanMs;
+         break;
+   }
+
+   if (value < latency->minMs)
+      value = latency->minMs;
+   if (value > latency->maxMs)
+      value = latency->maxMs;
+   return (int) value;
+}
+
+static void sleepMs(int ms)
+{
+   struct timespec delay;
+
+   delay.tv_sec = ms / 1000;
+   delay.tv_nsec = (ms % 1000) * 1000000L;
+   while ((nanosleep(&delay, &delay) < 0) && (errno == EINTR));
+}
+
+// Simulate function load: wait for drawn latency, then record function into slot unless a fault is injected.
+// A failed load leaves the slot empty, as a failed partial reconfiguration.
+static int loadBitstream(t_acceldev *acceldev, t_accelfuncConf *accelfuncConf)
+{
+   unsigned short xsubi[3];
+   struct timespec now;
+   uint64_t seed;
+   double draw;
+   int latencyMs;
+
+   // Fixed seed: same latency and fault for a given slot and function at each run
+   seed = simEngine.sim.seed;
+   if (seed == 0)
+   {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      seed = ((uint64_t) now.tv_nsec << 16) ^ now.tv_sec ^ getpid();
+   }
+   seed ^= ((uint64_t) acceldev->slotId << 32) ^ ((uint64_t) accelfuncConf->funcID << 24);
+   xsubi[0] = seed;
+   xsubi[1] = seed >> 16;
+   xsubi[2] = seed >> 32;
+
+   draw = erand48(xsubi);
+   latencyMs = drawLatency(& accelfuncConf->simLoad, xsubi);
+
+   log_debug("%s: Device %s: loading function %s for %d ms", logtag, acceldev->bdf.str,
+         accelfuncIndexToName(accelfuncConf->funcID), latencyMs);
+
+   if ((draw >= simEngine.sim.failureRate) && (draw < simEngine.sim.failureRate + simEngine.sim.timeoutRate))
+      latencyMs = INT32_MAX;  // injected hang
+   if (latencyMs > simEngine.loadTimeoutMs)
+   {
+      sleepMs(simEngine.loadTimeoutMs);
+      writeSlot(acceldev, "");
+      log_error("%s: Device %s: function %s not loaded after %d ms", logtag, acceldev->bdf.str,
+            accelfuncIndexToName(accelfuncConf->funcID), simEngine.loadTimeoutMs);
+      return -1;
+   }
+
+   sleepMs(latencyMs);
+   if (draw < simEngine.sim.failureRate)
+   {
+      writeSlot(acceldev, "");
+      log_error("%s: Device %s: engine failed to load function %s (injected)", logtag, acceldev->bdf.str,
+            accelfuncIndexToName(accelfuncConf->funcID));
+      return -1;
+   }
+
+   if (writeSlot(acceldev, accelfuncConf->accelID) < 0)
+      return -1;
+   snprintf(acceldev->funcHwid, sizeof acceldev->funcHwid, "%s", accelfuncConf->accelID);
+   acceldev->accelfunc = accelfuncConf->funcID;
+
+   log_info("%s: Device %s: function %s loaded in %d ms", logtag, acceldev->bdf.str,
+         accelfuncIndexToName(accelfuncConf->funcID), latencyMs);
+   return 0;
+}
+
+
+// Re-read function recorded into slot
+static int refresh(t_acceldev *acceldev)
+{
+   return readSlot(acceldev);
+}
+
+// Simulated devices referred by slots privdata
+static void engineDevices(t_acceldev **engdevList, int **nbEngdev)
+{
+   *engdevList = simDevice;
+   *nbEngdev = & nbSimDevices;
+}
+
+
+static t_accelOps simOps = {
+   .enumerate = enumerate,
+   .loadBitstream = loadBitstream,
+   .refresh = refresh,
+   .engineDevices = engineDevices
+};
+
+t_accelEngine * simRegister()
+{
+   simEngine.nbsysentries = 0;
+   simEngine.nbsyswatch = 0;
+   simEngine.nblibs = 0;
+
+   simEngine.accelops = & simOps;
+
+   return & simEngine;
+}
@@ -0,0 +1,181 @@
+/*
+ * Device filter program check: rules parsed as the runtime passes them are built into a program by
+ * devFilterBuild(), then run by a small interpreter of the instructions it emits, for a set of
+ * device accesses whose verdicts follow devices cgroup v1 semantics (last matching rule wins).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/bpf.h>
+
+#include "utils.h"
+
+#define INSN_MAX  512
+
+static int nbfailed = 0;
+
+#define CHECK(cond, ...) \
+   do { if (! (cond)) { nbfailed++; fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); } } while (0)
+
+// Run program on device access context, as the kernel would. Return program verdict, -1 if invalid.
+static int filterRun(const struct bpf_insn *insnList, int ninsn, const struct bpf_cgroup_dev_ctx *ctx)
+{
+   uint64_t reg[MAX_BPF_REG] = { 0 };
+   const struct bpf_insn *insn;
+   uint64_t src;
+   int pc = 0;
+   int steps;
+
+   for (steps = 0; (pc >= 0) && (pc < ninsn) && (steps < INSN_MAX); steps++)
+   {
+      insn = &insnList[pc++];
+      src = (BPF_SRC(insn->code) == BPF_X) ? reg[insn->src_reg] : (uint64_t) (int64_t) insn->imm;
+      switch (insn->code)
+      {
+         case BPF_LDX | BPF_MEM | BPF_W:
+            if (insn->src_reg != BPF_REG_1)
+               return -1;
+            reg[insn->dst_reg] = *(const uint32_t *) ((const char *) ctx + insn->off);
+            break;
+         case BPF_ALU | BPF_AND | BPF_K:
+         case BPF_ALU | BPF_AND | BPF_X:
+            reg[insn->dst_reg] = (uint32_t) (reg[insn->dst_reg] & src);
+            break;
+         case BPF_ALU | BPF_RSH | BPF_K:
+            reg[insn->dst_reg] = (uint32_t) reg[insn->dst_reg] >> insn->imm;
+            break;
+         case BPF_ALU | BPF_MOV | BPF_X:
+            reg[insn->dst_reg] = (uint32_t) src;
+            break;
+         case BPF_ALU64 | BPF_MOV | BPF_K:
+            reg[insn->dst_reg] = src;
+            break;
+         case BPF_JMP | BPF_JNE | BPF_K:
+         case BPF_JMP | BPF_JNE | BPF_X:
+            if (reg[insn->dst_reg] != src)
+               pc += insn->off;
+            break;
+         case BPF_JMP | BPF_JEQ | BPF_K:
+         case BPF_JMP | BPF_JEQ | BPF_X:
+            if (reg[insn->dst_reg] == src)
+               pc += insn->off;
+            break;
+         case BPF_JMP | BPF_EXIT:
+            return (int) reg[BPF_REG_0];
+         default:
+            fprintf(stderr, "instruction %d: code 0x%02x not expected\n", pc - 1, insn->code);
+            return -1;
+      }
+   }
+   return -1;
+}
+
+// Verdict of program for access ("r", "w", "m" or a combination) to device
+static int filterCheck(const struct bpf_insn *insnList, int ninsn, char type, int major, int minor, const char *access)
+{
+   struct bpf_cgroup_dev_ctx ctx = { 0 };
+
+   ctx.access_type = (type == 'b') ? BPF_DEVCG_DEV_BLOCK : BPF_DEVCG_DEV_CHAR;
+   if (strchr(access, 'r'))
+      ctx.access_type |= BPF_DEVCG_ACC_READ << 16;
+   if (strchr(access, 'w'))
+      ctx.access_type |= BPF_DEVCG_ACC_WRITE << 16;
+   if (strchr(access, 'm'))
+      ctx.access_type |= BPF_DEVCG_ACC_MKNOD << 16;
+   ctx.major = major;
+   ctx.minor = minor;
+   return filterRun(insnList, ninsn, &ctx);
+}
+
+static int filterBuild(const char * const ruleStrList[], int nbrule, struct bpf_insn *insnList)
+{
+   t_devRule ruleList[32];
+   int irule;
+
+   for (irule = 0; irule < nbrule; irule++)
+   {
+      if (devRuleParse(ruleStrList[irule], &ruleList[irule]) < 0)
+         return -1;
+   }
+   return devFilterBuild(ruleList, nbrule, insnList, INSN_MAX);
+}
+
+int main()
+{
+   // runtime defaults, then accelerator rules, then container rules overriding them
+   static const char * const rules[] = {
+      "c *:* m", "b *:* m",
+      "c 1:3 rwm", "c 136:* rwm",
+      "c 10:200 rw",       // partial access: no mknod from this rule
+      "c 240:* rwm",
+      "!c 240:1 w",        // later deny narrows the allow above
+      "!c 241:* rwm",
+      "c 241:7 r",         // later allow reopens part of the deny above
+   };
+   static const char * const catchAllRules[] = {
+      "c 1:3 rwm", "!b 8:0 rwm",
+      "a *:* rwm",         // matches everything: rules before it never apply
+   };
+   struct bpf_insn insnList[INSN_MAX];
+   int ninsn;
+
+   logOpen("/dev/stderr", 3);
+
+   ninsn = filterBuild(rules, nitems(rules), insnList);
+   CHECK(ninsn > 0, "program build failed");
+   if (ninsn > 0)
+   {
+      // default "c *:* m" rule: any char device node may be created, not opened
+      CHECK(filterCheck(insnList, ninsn, 'c', 99, 1, "m") == 1, "c 99:1 m allowed by c *:* m");
+      CHECK(filterCheck(insnList, ninsn, 'c', 99, 1, "r") == 0, "c 99:1 r denied");
+      CHECK(filterCheck(insnList, ninsn, 'c', 99, 1, "rm") == 0, "c 99:1 rm denied: r not allowed by c *:* m");
+      CHECK(filterCheck(insnList, ninsn, 'b', 8, 0, "m") == 1, "b 8:0 m allowed by b *:* m");
+      CHECK(filterCheck(insnList, ninsn, 'b', 8, 0, "rw") == 0, "b 8:0 rw denied");
+
+      CHECK(filterCheck(insnList, ninsn, 'c', 1, 3, "rw") == 1, "c 1:3 rw allowed");
+      CHECK(filterCheck(insnList, ninsn, 'c', 1, 4, "r") == 0, "c 1:4 r denied");
+      CHECK(filterCheck(insnList, ninsn, 'c', 136, 12, "rw") == 1, "c 136:12 rw allowed by c 136:* rwm");
+
+      // partial rule: its accesses only, mknod still from the default rule
+      CHECK(filterCheck(insnList, ninsn, 'c', 10, 200, "rw") == 1, "c 10:200 rw allowed");
+      CHECK(filterCheck(insnList, ninsn, 'c', 10, 200, "r") == 1, "c 10:200 r allowed");
+      CHECK(filterCheck(insnList, ninsn, 'c', 10, 200, "m") == 1, "c 10:200 m allowed by c *:* m");
+      CHECK(filterCheck(insnList, ninsn, 'c', 10, 200, "rwm") == 0, "c 10:200 rwm denied: no rule grants all");
+      CHECK(filterCheck(insnList, ninsn, 'b', 10, 200, "r") == 0, "b 10:200 r denied: rule is for char devices");
+
+      // last matching rule wins
+      CHECK(filterCheck(insnList, ninsn, 'c', 240, 0, "rw") == 1, "c 240:0 rw allowed");
+      CHECK(filterCheck(insnList, ninsn, 'c', 240, 1, "w") == 0, "c 240:1 w denied by later deny");
+      CHECK(filterCheck(insnList, ninsn, 'c', 240, 1, "rw") == 0, "c 240:1 rw denied: w part denied");
+      CHECK(filterCheck(insnList, ninsn, 'c', 240, 1, "r") == 1, "c 240:1 r allowed: deny is for w only");
+      CHECK(filterCheck(insnList, ninsn, 'c', 241, 0, "r") == 0, "c 241:0 r denied");
+      CHECK(filterCheck(insnList, ninsn, 'c', 241, 0, "m") == 0, "c 241:0 m denied over c *:* m");
+      CHECK(filterCheck(insnList, ninsn, 'c', 241, 7, "r") == 1, "c 241:7 r allowed by later allow");
+      CHECK(filterCheck(insnList, ninsn, 'c', 241, 7, "w") == 0, "c 241:7 w denied");
+   }
+
+   // a rule matching any device and access ends the program: rules before it are dropped
+   ninsn = filterBuild(catchAllRules, nitems(catchAllRules), insnList);
+   CHECK(ninsn == 6 + 2, "catch all rule: %d instructions, expected 8", ninsn);
+   if (ninsn > 0)
+      CHECK(filterCheck(insnList, ninsn, 'b', 8, 0, "rw") == 1, "b 8:0 rw allowed by later a *:* rwm");
+
+   // no rule: everything denied
+   ninsn = devFilterBuild(NULL, 0, insnList, INSN_MAX);
+   CHECK(ninsn > 0, "empty program build failed");
+   if (ninsn > 0)
+      CHECK(filterCheck(insnList, ninsn, 'c', 1, 3, "m") == 0, "c 1:3 m denied without rules");
+
+   // program not fitting: error, not truncated
+   CHECK(devFilterBuild(NULL, 0, insnList, 4) < 0, "build into 4 instructions should fail");
+
+   if (nbfailed > 0)
+   {
+      fprintf(stderr, "devFilterTest: %d check(s) failed\n", nbfailed);
+      return 1;
+   }
+   printf("devFilterTest: OK\n");
+   return 0;
+}
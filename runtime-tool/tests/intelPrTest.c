@@ -0,0 +1,243 @@
+/*
+ * Intel GBS programming check with an injected FME ioctl (intelOpaeSetIoctl), on a temporary tree:
+ * FME device node and sysfs entry, port sysfs entry and GBS files.
+ *    - PR ioctl success: port programmed, AFU id read back
+ *    - driver without PR ioctl (ENOTTY): fpgaconf run instead (a script first in PATH)
+ *    - GBS metadata mismatch (AFU id, PR interface id): nothing programmed
+ *    - GBS setting AFU user clocks: fpgaconf run instead, refused on a virtual function port
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "accelerator.h"
+
+#define FPGA_FME_PORT_PR  _IO(0xB6, 0x80)   // as intel-fpga driver
+
+#define AFU_ID        "11111111-2222-3333-4444-555555555555"
+#define AFU_ID_SYSFS  "11111111222233334444555555555555"
+#define OTHER_AFU_ID  "aaaaaaaa-2222-3333-4444-555555555555"
+#define INTERFACE_ID  "01234567-89ab-cdef-0123-456789abcdef"
+#define GBS_GUID      "\x31\x30\x30\x76\x53\x42\x47\xB7\x41\x47\x50\x46\x6E\x6F\x65\x58"
+
+static int nbfailed = 0;
+
+#define CHECK(cond, ...) \
+   do { if (! (cond)) { nbfailed++; fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); } } while (0)
+
+static char rootdir[64];
+static int nbPrCalls;
+static int prErrno;   // 0: PR ioctl programs port
+
+// Fake FME ioctl: PR writes the expected AFU id to port sysfs entry, other requests succeed
+static int fakeIoctl(int fd, unsigned long request, ...)
+{
+   char path[2*FS_PATH_MAX];
+   FILE *file;
+
+   if (request != FPGA_FME_PORT_PR)
+      return 0;
+   nbPrCalls++;
+   if (prErrno != 0)
+   {
+      errno = prErrno;
+      return -1;
+   }
+   snprintf(path, sizeof path, "%s/port/afu_id", rootdir);
+   file = fopen(path, "w");
+   if (file == NULL)
+      return -1;
+   fprintf(file, "%s\n", AFU_ID_SYSFS);
+   fclose(file);
+   return 0;
+}
+
+static void writeFile(const char *name, const char *content)
+{
+   char path[2*FS_PATH_MAX];
+   FILE *file;
+
+   snprintf(path, sizeof path, "%s/%s", rootdir, name);
+   file = fopen(path, "w");
+   if (file == NULL)
+   {
+      perror(path);
+      exit(1);
+   }
+   fputs(content, file);
+   fclose(file);
+}
+
+// GBS file: GUID, metadata length, JSON metadata (extra image keys, may be empty), bitstream
+static void writeGbs(const char *name, const char *afuId, const char *interfaceId, const char *extra)
+{
+   char path[2*FS_PATH_MAX];
+   char metadata[512];
+   uint32_t metalen;
+   FILE *file;
+
+   metalen = snprintf(metadata, sizeof metadata,
+         "{\"afu-image\": {%s\"interface-uuid\": \"%s\", \"accelerator-clusters\": [{\"accelerator-type-uuid\": \"%s\"}]}}",
+         extra, interfaceId, afuId);
+   snprintf(path, sizeof path, "%s/%s", rootdir, name);
+   file = fopen(path, "w");
+   if (file == NULL)
+   {
+      perror(path);
+      exit(1);
+   }
+   fwrite(GBS_GUID, 1, 16, file);
+   fwrite(&metalen, sizeof metalen, 1, file);
+   fwrite(metadata, 1, metalen, file);
+   fwrite("bitstream", 1, 9, file);
+   fclose(file);
+}
+
+static int loadGbsFile(t_accelEngine *engine, t_acceldev *port, const char *gbsname)
+{
+   t_accelfuncConf conf;
+
+   memset(&conf, 0, sizeof conf);
+   snprintf(conf.accelID, sizeof conf.accelID, "%s", AFU_ID);
+   snprintf(conf.bistreamFile, sizeof conf.bistreamFile, "%s", gbsname);
+   writeFile("port/afu_id", "00000000000000000000000000000000\n");
+   nbPrCalls = 0;
+   return engine->accelops->loadBitstream(port, &conf);
+}
+
+int main()
+{
+   char path[2*FS_PATH_MAX];
+   char fpgaconfArgs[2*FS_PATH_MAX] = "";
+   t_accelEngine *engine;
+   t_acceldev fme, port;
+   FILE *file;
+   int ret;
+
+   logOpen("/dev/stderr", 2);  // failing loads are expected: errors not shown
+   snprintf(rootdir, sizeof rootdir, "%s", "/tmp/accel-intelpr.XXXXXX");
+   if (mkdtemp(rootdir) == NULL)
+   {
+      perror("mkdtemp");
+      return 1;
+   }
+   snprintf(path, sizeof path, "%s/fme", rootdir);     mkdir(path, 0755);
+   snprintf(path, sizeof path, "%s/fme/pr", rootdir);  mkdir(path, 0755);
+   snprintf(path, sizeof path, "%s/port", rootdir);    mkdir(path, 0755);
+   snprintf(path, sizeof path, "%s/bin", rootdir);     mkdir(path, 0755);
+   writeFile("fme/pr/interface_id", INTERFACE_ID "\n");
+   writeFile("port/id", "0\n");
+   writeFile("fme.dev", "");
+   writeGbs("good.gbs", AFU_ID, INTERFACE_ID, "");
+   writeGbs("other_afu.gbs", OTHER_AFU_ID, INTERFACE_ID, "");
+   writeGbs("other_interface.gbs", AFU_ID, "fedcba98-7654-3210-fedc-ba9876543210", "");
+   writeGbs("userclk.gbs", AFU_ID, INTERFACE_ID, "\"clock-frequency-high\": 312, \"clock-frequency-low\": 156, ");
+   writeGbs("no_userclk.gbs", AFU_ID, INTERFACE_ID, "\"clock-frequency-high\": 0, \"clock-frequency-low\": 0, ");
+
+   // fpgaconf stand-in: record its arguments, program the port
+   snprintf(path, sizeof path, "#!/bin/sh\necho \"$@\" > %s/fpgaconf.args\necho %s > %s/port/afu_id\n",
+         rootdir, AFU_ID_SYSFS, rootdir);
+   writeFile("bin/fpgaconf", path);
+   snprintf(path, sizeof path, "%s/bin/fpgaconf", rootdir);
+   chmod(path, 0755);
+   snprintf(path, sizeof path, "%s/bin:%s", rootdir, getenv("PATH") ? getenv("PATH") : "/bin:/usr/bin");
+   setenv("PATH", path, 1);
+
+   memset(&fme, 0, sizeof fme);
+   snprintf(fme.bdf.str, PCI_BDF_LEN, "%s", "01:00.0");
+   snprintf(fme.syspathAccel, FS_PATH_MAX, "%s/fme", rootdir);
+   snprintf(fme.devpath[0], FS_PATH_MAX, "%s/fme.dev", rootdir);
+   memset(&port, 0, sizeof port);
+   port.bdf.bus = 1;
+   snprintf(port.bdf.str, PCI_BDF_LEN, "%s", "01:00.0");
+   snprintf(port.syspathAccel, FS_PATH_MAX, "%s/port", rootdir);
+   port.pcifnType = PCIFUNC_PHYSICAL;
+   port.privdata = &fme;
+
+   engine = intelOpaeRegister();
+   snprintf(engine->bistreamPath, FS_PATH_MAX, "%s", rootdir);
+   intelOpaeSetIoctl(fakeIoctl);
+
+   // FME PR ioctl programs the port
+   prErrno = 0;
+   ret = loadGbsFile(engine, &port, "good.gbs");
+   CHECK(ret == 0, "PR ioctl load: ret %d", ret);
+   CHECK(nbPrCalls == 1, "PR ioctl load: %d PR ioctl(s)", nbPrCalls);
+   CHECK(strcmp(port.funcHwid, AFU_ID) == 0, "PR ioctl load: AFU id %s", port.funcHwid);
+
+   // driver without PR ioctl: fpgaconf programs the port
+   prErrno = ENOTTY;
+   ret = loadGbsFile(engine, &port, "good.gbs");
+   CHECK(ret == 0, "fpgaconf fallback: ret %d", ret);
+   CHECK(nbPrCalls == 1, "fpgaconf fallback: %d PR ioctl(s)", nbPrCalls);
+   snprintf(path, sizeof path, "%s/fpgaconf.args", rootdir);
+   file = fopen(path, "r");
+   CHECK(file != NULL, "fpgaconf fallback: fpgaconf not run");
+   if (file != NULL)
+   {
+      if (fgets(fpgaconfArgs, sizeof fpgaconfArgs, file) == NULL)
+         fpgaconfArgs[0] = '\0';
+      fclose(file);
+   }
+   CHECK(strstr(fpgaconfArgs, "-b 1 -d 0 -f 0 ") == fpgaconfArgs, "fpgaconf fallback: arguments %s", fpgaconfArgs);
+   CHECK(strstr(fpgaconfArgs, "/good.gbs") != NULL, "fpgaconf fallback: arguments %s", fpgaconfArgs);
+   CHECK(strcmp(port.funcHwid, AFU_ID) == 0, "fpgaconf fallback: AFU id %s", port.funcHwid);
+
+   // PR ioctl failure other than ENOTTY: no fallback
+   prErrno = EIO;
+   unlink(path);
+   ret = loadGbsFile(engine, &port, "good.gbs");
+   CHECK(ret < 0, "PR ioctl failure: ret %d", ret);
+   CHECK(access(path, F_OK) != 0, "PR ioctl failure: fpgaconf run");
+
+   // GBS metadata mismatch: checked before any programming
+   prErrno = 0;
+   ret = loadGbsFile(engine, &port, "other_afu.gbs");
+   CHECK(ret < 0, "AFU id mismatch: ret %d", ret);
+   CHECK(nbPrCalls == 0, "AFU id mismatch: %d PR ioctl(s)", nbPrCalls);
+   ret = loadGbsFile(engine, &port, "other_interface.gbs");
+   CHECK(ret < 0, "PR interface mismatch: ret %d", ret);
+   CHECK(nbPrCalls == 0, "PR interface mismatch: %d PR ioctl(s)", nbPrCalls);
+
+   // user clocks only programmed by fpgaconf, not by the PR ioctl
+   prErrno = 0;
+   unlink(path);
+   ret = loadGbsFile(engine, &port, "userclk.gbs");
+   CHECK(ret == 0, "user clocks: ret %d", ret);
+   CHECK(nbPrCalls == 0, "user clocks: %d PR ioctl(s)", nbPrCalls);
+   CHECK(access(path, F_OK) == 0, "user clocks: fpgaconf not run");
+   unlink(path);
+   ret = loadGbsFile(engine, &port, "no_userclk.gbs");
+   CHECK(ret == 0, "user clocks 0: ret %d", ret);
+   CHECK(nbPrCalls == 1, "user clocks 0: %d PR ioctl(s)", nbPrCalls);
+   CHECK(access(path, F_OK) != 0, "user clocks 0: fpgaconf run");
+
+   // no fpgaconf for a port of a virtual function: user clocks can not be set
+   port.pcifnType = PCIFUNC_VIRTUAL;
+   ret = loadGbsFile(engine, &port, "userclk.gbs");
+   CHECK(ret < 0, "user clocks on virtual function: ret %d", ret);
+   CHECK(nbPrCalls == 0, "user clocks on virtual function: %d PR ioctl(s)", nbPrCalls);
+   CHECK(access(path, F_OK) != 0, "user clocks on virtual function: fpgaconf run");
+   port.pcifnType = PCIFUNC_PHYSICAL;
+
+   intelOpaeSetIoctl(NULL);
+   snprintf(path, sizeof path, "rm -rf %s", rootdir);
+   if (system(path) != 0)
+      fprintf(stderr, "%s failed\n", path);
+
+   if (nbfailed > 0)
+   {
+      fprintf(stderr, "intelPrTest: %d check(s) failed\n", nbfailed);
+      return 1;
+   }
+   printf("intelPrTest: OK\n");
+   return 0;
+}
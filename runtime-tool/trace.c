@@ -0,0 +1,197 @@
+/*
+ * Spans tracing, written as a Chrome trace event file (chrome://tracing, Perfetto)
+ *
+ * Spans are complete events ("ph":"X") with monotonic nanosecond timestamps, kept in memory
+ * and written at exit. Threads may record spans concurrently.
+ * Disabled unless a trace file is set: begin then costs no clock read, end does nothing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "utils.h"
+
+#define TRACE_NAME_LEN    48
+#define TRACE_DETAIL_LEN  FS_PATH_MAX
+#define TRACE_EVENTS_MIN  256
+
+typedef struct {
+   char    name[TRACE_NAME_LEN];
+   char    detail[TRACE_DETAIL_LEN];
+   int64_t start;
+   int64_t dur;
+   pid_t   tid;
+} t_traceEvent;
+
+static bool traceOn = false;
+static bool traceRegistered = false;
+static char tracePath[FS_PATH_MAX];
+static pid_t tracePid;
+static t_traceEvent *traceEvents = NULL;
+static int nbTraceEvents = 0;
+static int maxTraceEvents = 0;
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+int64_t traceNow()
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Forked child only writes its own spans
+static void traceForkChild()
+{
+   nbTraceEvents = 0;
+}
+
+// Enable tracing: spans are written to path at exit.
+// A forked child writes its own spans to <path>.<child pid>.
+int traceOpen(const char *path)
+{
+   if ((path == NULL) || (*path == '\0'))
+      return 0;
+   if (strlen(path) >= sizeof tracePath)
+   {
+      log_error("Trace file path %s too long", path);
+      return -1;
+   }
+   strcpy(tracePath, path);
+   tracePid = getpid();
+   traceOn = true;
+   if (! traceRegistered)
+   {
+      atexit(traceClose);
+      pthread_atfork(NULL, NULL, traceForkChild);
+      traceRegistered = true;
+   }
+   return 0;
+}
+
+bool traceEnabled()
+{
+   return traceOn;
+}
+
+int64_t traceBegin()
+{
+   if (! traceOn)
+      return 0;
+   return traceNow();
+}
+
+// Record span started at start, named name, with an optional printf like detail
+void traceEnd(int64_t start, const char *name, const char *fmt, ...)
+{
+   va_list args;
+
+   va_start(args, fmt);
+   traceEndv(start, name, fmt, args);
+   va_end(args);
+}
+
+void traceEndv(int64_t start, const char *name, const char *fmt, va_list args)
+{
+   t_traceEvent *event;
+   int64_t end;
+
+   if ((! traceOn) || (start == 0))
+      return;
+   end = traceNow();
+
+   pthread_mutex_lock(&traceLock);
+   if (nbTraceEvents == maxTraceEvents)
+   {
+      int maxEvents = (maxTraceEvents > 0) ? maxTraceEvents * 2 : TRACE_EVENTS_MIN;
+      t_traceEvent *events = realloc(traceEvents, maxEvents * sizeof(t_traceEvent));
+
+      if (events == NULL)
+      {
+         pthread_mutex_unlock(&traceLock);
+         return;
+      }
+      traceEvents = events;
+      maxTraceEvents = maxEvents;
+   }
+   event = & traceEvents[nbTraceEvents++];
+   snprintf(event->name, sizeof event->name, "%s", name);
+   event->detail[0] = '\0';
+   if (fmt != NULL)
+      vsnprintf(event->detail, sizeof event->detail, fmt, args);
+   event->start = start;
+   event->dur = end - start;
+   event->tid = syscall(SYS_gettid);
+   pthread_mutex_unlock(&traceLock);
+}
+
+static void writeJsonString(FILE *out, const char *str)
+{
+   fputc('"', out);
+   for ( ; *str; str++)
+   {
+      if ((*str == '"') || (*str == '\\'))
+         fprintf(out, "\\%c", *str);
+      else if ((unsigned char) *str < 0x20)
+         fprintf(out, "\\u%04x", (unsigned char) *str);
+      else
+         fputc(*str, out);
+   }
+   fputc('"', out);
+}
+
+// Write recorded spans, timestamps in microseconds with nanosecond precision
+void traceClose()
+{
+   char path[FS_PATH_MAX + 16];
+   FILE *out;
+   int ievent;
+
+   if (! traceOn)
+      return;
+   traceOn = false;
+
+   if (getpid() == tracePid)
+      snprintf(path, sizeof path, "%s", tracePath);
+   else
+      snprintf(path, sizeof path, "%s.%d", tracePath, getpid());
+
+   out = fopen(path, "we");
+   if (out == NULL)
+   {
+      log_error("Failed to open trace file %s", path);
+   }
+   else
+   {
+      fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+      for (ievent = 0; ievent < nbTraceEvents; ievent++)
+      {
+         fprintf(out, "%s{\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%lld.%03lld,\"dur\":%lld.%03lld,\"name\":",
+               (ievent > 0) ? ",\n" : "", getpid(), traceEvents[ievent].tid,
+               (long long) traceEvents[ievent].start / 1000, (long long) traceEvents[ievent].start % 1000,
+               (long long) traceEvents[ievent].dur / 1000, (long long) traceEvents[ievent].dur % 1000);
+         writeJsonString(out, traceEvents[ievent].name);
+         if (traceEvents[ievent].detail[0] != '\0')
+         {
+            fprintf(out, ",\"args\":{\"detail\":");
+            writeJsonString(out, traceEvents[ievent].detail);
+            fputc('}', out);
+         }
+         fputc('}', out);
+      }
+      fprintf(out, "\n]}\n");
+      fclose(out);
+   }
+
+   free(traceEvents);
+   traceEvents = NULL;
+   nbTraceEvents = 0;
+   maxTraceEvents = 0;
+}
@@ -14,37 +14,145 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/mount.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
 #include <sys/fsuid.h>
 #include <libgen.h>
+#include <fnmatch.h>
+#include <sys/syscall.h>
+#include <pthread.h>
 
 #include "utils.h"
 
-static FILE *logFd;
+#ifndef SYS_openat2
+#define SYS_openat2  437
+#endif
+#ifndef RESOLVE_NO_SYMLINKS
+#define RESOLVE_NO_MAGICLINKS  0x02
+#define RESOLVE_NO_SYMLINKS    0x04
+#define RESOLVE_IN_ROOT        0x10
+#endif
+
+#define LOG_MAX_LEN     512
+#define LOG_RECORD_MAX  (LOG_MAX_LEN + 128)
+#define LOG_BUFFER_SIZE (64 * 1024)
+
+static int logFd = -1;
 static int logLevel = LOG_INFO;
-#define LOG_MAX_LEN 512
+static e_logFormat logFormat = LOG_FORMAT_TEXT;
+static char logBuffer[LOG_BUFFER_SIZE];
+static size_t logBufferLen = 0;
+static time_t logStampTime = -1;
+static char logStamp[32];
+static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
 static char logPriority[LOG_DEBUG+1][10]={"","","","error","warn","","info","debug"};
-static char logStr[LOG_MAX_LEN];
 
-#define SYSFS_CGROUP_HUGETLB_PATH     SYSFS_CGROUP_PATH "/hugetlb"
+#define SYSFS_CGROUP_HUGETLB          "hugetlb"
 #define SYSFS_CGROUP_HUGETLB_2MB_LIMIT "hugetlb.2MB.limit_in_bytes"
 #define SYSFS_CGROUP_HUGETLB_1GB_LIMIT "hugetlb.1GB.limit_in_bytes"
+#define SYSFS_CGROUP2_HUGETLB_2MB_MAX  "hugetlb.2MB.max"
+#define SYSFS_CGROUP2_HUGETLB_1GB_MAX  "hugetlb.1GB.max"
+
+static const struct {
+   const char *env;
+   const char *path;
+} hostPaths[HOST_PATH_MAX] = {
+   [HOST_PATH_SYSFS_FPGA] = { "ACCEL_SYSFS_FPGA_PATH", "/sys/class/fpga" },
+   [HOST_PATH_DEV]        = { "ACCEL_DEV_PATH",        "/dev" },
+   [HOST_PATH_CGROUP]     = { "ACCEL_CGROUP_PATH",     "/sys/fs/cgroup" },
+   [HOST_PATH_LDCACHE]    = { "ACCEL_LDCACHE_PATH",    "/etc/ld.so.cache" },
+   [HOST_PATH_RUN]        = { "ACCEL_RUN_PATH",        "/run/accelerator-container" },
+   [HOST_PATH_CONF]       = { "ACCEL_CONF_PATH",       ACCEL_SETTINGS_CONFFILE },
+   [HOST_PATH_IMAGE]      = { "ACCEL_IMAGE_PATH",      ACCEL_SETTINGS_IMAGE },
+   [HOST_PATH_PROC]       = { "ACCEL_PROC_PATH",       "/proc" },
+   [HOST_PATH_DEV_CHAR]   = { "ACCEL_DEV_CHAR_PATH",   "/sys/dev/char" },
+   [HOST_PATH_SYSFS_NODE] = { "ACCEL_SYSFS_NODE_PATH", "/sys/devices/system/node" },
+};
+
+
+// Get host path, or its environment override if set
+const char *hostPath(e_hostPath id)
+{
+   const char *path = getenv(hostPaths[id].env);
+
+   if ((path == NULL) || (*path == '\0'))
+      return hostPaths[id].path;
+   return path;
+}
+
+
+// Log lines are formatted to a per process buffer, written in batches: when the buffer is full,
+// on error, before fork, when idle (server) and at exit.
+// Write of a batch is a single append: lines of several processes sharing the file never mix.
+static void logFlushLocked()
+{
+   size_t done = 0;
+   ssize_t ret;
+
+   while (done < logBufferLen)
+   {
+      ret = write(logFd, logBuffer + done, logBufferLen - done);
+      if ((ret < 0) && (errno == EINTR))
+         continue;
+      if (ret <= 0)
+         break;  // nowhere to report it: drop buffered lines
+      done += ret;
+   }
+   logBufferLen = 0;
+}
 
+void logFlush()
+{
+   if (logFd < 0)
+      return;
+   pthread_mutex_lock(&logLock);
+   logFlushLocked();
+   pthread_mutex_unlock(&logLock);
+}
+
+// Forked child must neither inherit a held lock nor write again lines of its parent
+static void logForkPrepare()
+{
+   pthread_mutex_lock(&logLock);
+   if (logFd >= 0)
+      logFlushLocked();
+}
+
+static void logForkParent()
+{
+   pthread_mutex_unlock(&logLock);
+}
+
+static void logForkChild()
+{
+   logStampTime = -1;
+   pthread_mutex_unlock(&logLock);
+}
 
 void logOpen(const char *path, int level)
 {
+   static bool registered = false;
+
    if (path != NULL)
    {
-      logFd = fopen(path, "ae");
+      logFd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0666);
       logLevel = level;
+      if ((logFd >= 0) && (! registered))
+      {
+         atexit(logFlush);
+         pthread_atfork(logForkPrepare, logForkParent, logForkChild);
+         registered = true;
+      }
    }
 }
 
 void logClose()
 {
-   if (logFd != NULL)
+   if (logFd >= 0)
    {
-      fclose(logFd);
-      logFd = NULL;
+      logFlush();
+      close(logFd);
+      logFd = -1;
    }
 }
 
@@ -53,25 +161,98 @@ void logSetLevel(int level)
    logLevel = level;
 }
 
+void logSetFormat(e_logFormat format)
+{
+   pthread_mutex_lock(&logLock);
+   logFormat = format;
+   logStampTime = -1;
+   pthread_mutex_unlock(&logLock);
+}
+
+// Formatted timestamp, computed once per second
+static const char *logTimestamp()
+{
+   time_t rawtime;
+   struct tm tm;
+
+   time(&rawtime);
+   if (rawtime != logStampTime)
+   {
+      localtime_r(&rawtime, &tm);
+      if (logFormat == LOG_FORMAT_TEXT)
+         strftime(logStamp, sizeof logStamp, "%d-%m-%y %H:%M:%S", &tm);
+      else
+         strftime(logStamp, sizeof logStamp, "%Y-%m-%dT%H:%M:%S%z", &tm);
+      logStampTime = rawtime;
+   }
+   return logStamp;
+}
+
+// Append message as a quoted string, escaped for JSon (also fine for key=value)
+static int logQuote(char *record, int len, int size, const char *msg)
+{
+   if (len < size)
+      record[len++] = '"';
+   for ( ; (*msg != '\0') && (len < size - 8); msg++)
+   {
+      if ((*msg == '"') || (*msg == '\\'))
+      {
+         record[len++] = '\\';
+         record[len++] = *msg;
+      }
+      else if ((unsigned char) *msg < 0x20)
+         len += sprintf(record + len, "\\u%04x", (unsigned char) *msg);
+      else
+         record[len++] = *msg;
+   }
+   if (len < size)
+      record[len++] = '"';
+   return len;
+}
+
+// Thread safe
 void logWrite(int level, const char *fmt, ...)
 {
-   if ((logFd != NULL) && (level <= logLevel))
+   if ((logFd >= 0) && (level <= logLevel))
    {
-      time_t    rawtime;
-      struct tm tm;
       va_list   args;
-
-      time(&rawtime);
-      localtime_r(&rawtime, &tm);
+      char      logStr[LOG_MAX_LEN];
+      char      record[LOG_RECORD_MAX];
+      int       len;
 
       va_start (args, fmt);
       vsnprintf(logStr, LOG_MAX_LEN, fmt, args);
       va_end (args);
 
-      fprintf(logFd, "%02d-%02d-%02d %02d:%02d:%02d [%s] %s\n",
-            tm.tm_mday, tm.tm_mon+1, tm.tm_year%100, tm.tm_hour, tm.tm_min, tm.tm_sec,
-            logPriority[level], logStr);
-      fflush(logFd);
+      pthread_mutex_lock(&logLock);
+      switch (logFormat)
+      {
+         case LOG_FORMAT_KV:
+            len = snprintf(record, LOG_RECORD_MAX, "time=%s level=%s pid=%d msg=",
+                  logTimestamp(), logPriority[level], getpid());
+            len = logQuote(record, len, LOG_RECORD_MAX - 1, logStr);
+            break;
+         case LOG_FORMAT_JSON:
+            len = snprintf(record, LOG_RECORD_MAX, "{\"time\":\"%s\",\"level\":\"%s\",\"pid\":%d,\"msg\":",
+                  logTimestamp(), logPriority[level], getpid());
+            len = logQuote(record, len, LOG_RECORD_MAX - 2, logStr);
+            record[len++] = '}';
+            break;
+         default:
+            len = snprintf(record, LOG_RECORD_MAX, "%s [%s] %s", logTimestamp(), logPriority[level], logStr);
+            if (len > LOG_RECORD_MAX - 1)
+               len = LOG_RECORD_MAX - 1;
+            break;
+      }
+      record[len++] = '\n';
+
+      if (logBufferLen + len > sizeof logBuffer)
+         logFlushLocked();
+      memcpy(logBuffer + logBufferLen, record, len);
+      logBufferLen += len;
+      if (level <= LOG_ERR)
+         logFlushLocked();
+      pthread_mutex_unlock(&logLock);
    }
 }
 
@@ -153,7 +334,15 @@ int rlimitConfig(pid_t pid, int resource, rlim_t rlim_soft, rlim_t rlim_hard)
 }
 
 
-// Find sysfs path of a cgroup
+// Host runs cgroup v2 unified hierarchy
+bool cgroupUnified()
+{
+   struct statfs stats;
+
+   return ((statfs(hostPath(HOST_PATH_CGROUP), &stats) == 0) && (stats.f_type == CGROUP2_SUPER_MAGIC));
+}
+
+// Find sysfs path of a cgroup (SYSFS_CGROUP_UNIFIED for cgroup v2)
 int findCgroupPath(pid_t pid, char *cgroupname, char *path, int pathlen)
 {
    char procpath[FS_PATH_MAX];
@@ -162,7 +351,7 @@ int findCgroupPath(pid_t pid, char *cgroupname, char *path, int pathlen)
    char *ptr;
    char *cgpath, *cgname;
 
-   snprintf(procpath, FS_PATH_MAX, "/proc/%d/cgroup", pid);
+   snprintf(procpath, FS_PATH_MAX, "%s/%d/cgroup", hostPath(HOST_PATH_PROC), pid);
    pFd = fopen(procpath, "r");
    if (pFd != NULL)
    {
@@ -178,8 +367,9 @@ int findCgroupPath(pid_t pid, char *cgroupname, char *path, int pathlen)
                cgname = ptr + 1;
                if (! strcmp(cgname, cgroupname))
                {
-                  snprintf(path, pathlen, "%s/%s/%s/", SYSFS_CGROUP_PATH, cgroupname, cgpath);
+                  snprintf(path, pathlen, "%s/%s/%s/", hostPath(HOST_PATH_CGROUP), cgroupname, cgpath);
                   log_debug("cgroup %s sysfs path %s", cgname, path);
+                  fclose(pFd);
                   return 0;
                }
             }
@@ -196,39 +386,50 @@ int findCgroupPath(pid_t pid, char *cgroupname, char *path, int pathlen)
    }
 }
 
-// Configure huge TLB memory limits
+// Configure huge TLB memory limits of container cgroup, from host side
 int limitHugetlb(pid_t pid, int  nbHugepage2M, int  nbHugepage1G)
 {
+   const uint64_t MB = (1024 *1024);
    char syspath[FS_PATH_MAX];
-   char cgLimitPath[FS_PATH_MAX];
+   char cgLimitPath[2*FS_PATH_MAX];
    char limitvalue[32];
+   int64_t span = traceBegin();
    int ret;
 
-   if (findCgroupPath(pid, "hugetlb", syspath, sizeof syspath) == 0)
+   if (cgroupUnified())
    {
-      if (mount (NULL, SYSFS_CGROUP_HUGETLB_PATH, "cgroup", MS_BIND | MS_REMOUNT, NULL) < 0)
+      // hugetlb controller may not be enabled for container cgroup
+      if (findCgroupPath(pid, SYSFS_CGROUP_UNIFIED, syspath, sizeof syspath) < 0)
+         return -1;
+      snprintf(cgLimitPath, sizeof cgLimitPath, "%s/%s", syspath, SYSFS_CGROUP2_HUGETLB_2MB_MAX);
+      if (access(cgLimitPath, F_OK) < 0)
       {
-         log_error("Failed to remount sysfs cgroup hugetlb read/write (path %s)", SYSFS_CGROUP_HUGETLB_PATH);
-         return(-1);
+         log_warn("Cgroup %s: no hugetlb controller, hugepages not limited", syspath);
+         return 0;
       }
-
-      snprintf(cgLimitPath, FS_PATH_MAX, "%s/%s", syspath, SYSFS_CGROUP_HUGETLB_2MB_LIMIT);
+      ret = sysfsWriteUint64(cgLimitPath, nbHugepage2M * 2 * MB);
+      if (ret == 0)
+      {
+         snprintf(cgLimitPath, sizeof cgLimitPath, "%s/%s", syspath, SYSFS_CGROUP2_HUGETLB_1GB_MAX);
+         ret = sysfsWriteUint64(cgLimitPath, nbHugepage1G * 1024 * MB);
+      }
+   }
+   else
+   {
+      if (findCgroupPath(pid, SYSFS_CGROUP_HUGETLB, syspath, sizeof syspath) < 0)
+         return -1;
+      snprintf(cgLimitPath, sizeof cgLimitPath, "%s/%s", syspath, SYSFS_CGROUP_HUGETLB_2MB_LIMIT);
       snprintf(limitvalue, sizeof limitvalue, "%dM", nbHugepage2M * 2);
       ret = sysfsWriteString(cgLimitPath, limitvalue);
       if (ret == 0)
       {
-         snprintf(cgLimitPath, FS_PATH_MAX, "%s/%s", syspath, SYSFS_CGROUP_HUGETLB_1GB_LIMIT);
+         snprintf(cgLimitPath, sizeof cgLimitPath, "%s/%s", syspath, SYSFS_CGROUP_HUGETLB_1GB_LIMIT);
          snprintf(limitvalue, sizeof limitvalue, "%dG", nbHugepage1G);
          ret = sysfsWriteString(cgLimitPath, limitvalue);
       }
-
-      mount(NULL, SYSFS_CGROUP_HUGETLB_PATH, "cgroup", MS_BIND | MS_REMOUNT | MS_RDONLY | MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL);
-      return ret;
-   }
-   else
-   {
-      return -1;
    }
+   traceEnd(span, "hugetlb limits", "%s", syspath);
+   return ret;
 }
 
 
@@ -310,6 +511,51 @@ static int make_ancestors(char *path, mode_t perm)
    return (mkdir(path, perm));
 }
 
+// Open path relative to directory rootfd, never leaving it nor following a symlink on the way.
+// Kernels without openat2 (< 5.6): each component opened with O_NOFOLLOW instead.
+int openBeneath(int rootfd, const char *path, int flags)
+{
+   struct {
+      uint64_t flags;
+      uint64_t mode;
+      uint64_t resolve;
+   } how = { .flags = flags|O_NOFOLLOW|O_CLOEXEC, .mode = 0,
+             .resolve = RESOLVE_IN_ROOT|RESOLVE_NO_SYMLINKS|RESOLVE_NO_MAGICLINKS };
+   char component[FS_PATH_MAX];
+   const char *p, *next;
+   int dirfd, fd;
+
+   fd = syscall(SYS_openat2, rootfd, path, &how, sizeof how);
+   if ((fd >= 0) || (errno != ENOSYS))
+      return fd;
+
+   dirfd = dup(rootfd);
+   for (p = path; (dirfd >= 0) && (*p != '\0'); p = next)
+   {
+      while (*p == '/')
+         p++;
+      next = p + strcspn(p, "/");
+      snprintf(component, sizeof component, "%.*s", (int) (next - p), p);
+      while (*next == '/')
+         next++;
+      if ((strcmp(component, "..") == 0) || (component[0] == '\0'))
+      {
+         close(dirfd);
+         errno = EXDEV;
+         return -1;
+      }
+      fd = openat(dirfd, component, (*next == '\0') ? flags|O_NOFOLLOW|O_CLOEXEC : O_PATH|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+      close(dirfd);
+      if (*next == '\0')
+         return fd;
+      dirfd = fd;
+   }
+   if (dirfd >= 0)
+      close(dirfd);
+   errno = EINVAL;
+   return -1;
+}
+
 int file_create(const char *path, const char *data, uid_t uid, gid_t gid, mode_t mode)
 {
    char *p;
@@ -389,11 +635,12 @@ fail:
 
 
 // Mount bind a file or directory to container FS
-int mountFile(char *rootfs, char *srcpath, char *dstpath, bool device, bool rdonly, bool noexec)
+int mountFile(char *rootfs, char *srcpath, char *dstpath, bool device, bool rdonly, bool noexec, bool recursive)
 {
    char dstpathfull[2*FS_PATH_MAX]; // *2 for nested FS
    struct stat stats;
    unsigned long int  options;
+   int64_t span = traceBegin();
 
    if (stat(srcpath, &stats) != 0)
    {
@@ -411,7 +658,7 @@ int mountFile(char *rootfs, char *srcpath, char *dstpath, bool device, bool rdon
       return -1;
    }
 
-   if (mount(srcpath, dstpathfull, NULL, MS_BIND, NULL) < 0)
+   if (mount(srcpath, dstpathfull, NULL, recursive ? MS_BIND | MS_REC : MS_BIND, NULL) < 0)
    {
       log_error("mountFile src path %s: mount bind failed: %s", srcpath, strerror(errno));
       return -1;
@@ -431,19 +678,23 @@ int mountFile(char *rootfs, char *srcpath, char *dstpath, bool device, bool rdon
    }
 
    log_debug("srcpath %s mounted to dstpath %s (opt %X)", srcpath, dstpathfull, options);
+   traceEnd(span, "mountFile", "%s", srcpath);
    return 0;
 }
 
 
 // Update dynamic linker cache
-int ldconfigCacheUpdate(char *rootfs)
+int ldconfigCacheUpdate(char *rootfs, const char *libdirs)
 {
-   char cmd[FS_PATH_MAX];
+   char cmd[3*FS_PATH_MAX];
+   int64_t span = traceBegin();
 
-   snprintf(cmd, FS_PATH_MAX, "ldconfig -r %s", rootfs);
+   // libdirs: extra container libraries directories, scanned as well as ld.so.conf ones
+   snprintf(cmd, sizeof cmd, "ldconfig -r %s %s", rootfs, libdirs);
    if (system(cmd) == 0)
    {
       log_debug("Dest root FS LD config cache updated");
+      traceEnd(span, "ldconfigCacheUpdate", "%s", rootfs);
       return 0;
    }
    else
@@ -453,29 +704,110 @@ int ldconfigCacheUpdate(char *rootfs)
    }
 }
 
-// Get all file/dir entries of FS path pattern
-int fspathGetEntries(char *fspathPattern, char entriesList[][FS_PATH_MAX], int maxEntries)
+struct linux_dirent64 {
+   ino64_t        d_ino;
+   off64_t        d_off;
+   unsigned short d_reclen;
+   unsigned char  d_type;
+   char           d_name[];
+};
+
+// Scan directory entries matching a fnmatch() pattern, with large getdents64 batches.
+// Callback may return -1 to stop the scan. Return number of matching entries.
+int fsdirScan(const char *dirpath, const char *pattern, t_fsdirCallback callback, void *ctx)
 {
-   FILE *pfd=NULL;
-   char cmd[FS_PATH_MAX];
-   char entry[FS_PATH_MAX];
-   int nbentries = 0;
+   char buffer[32768];
+   struct linux_dirent64 *dirent;
+   long nread;
+   long pos;
+   int nbmatch = 0;
+   int fd;
 
-   snprintf(cmd, sizeof cmd, "ls %s", fspathPattern);
-   if (( pfd = popen(cmd, "r")) == NULL)
+   fd = open(dirpath, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+   if (fd < 0)
    {
-      log_error("popen \"%s\" failed: %s", cmd, strerror(errno));
+      log_error("Directory %s: open failed: %s", dirpath, strerror(errno));
       return -1;
    }
 
-   while ((nbentries < maxEntries) && (fgets(entry, sizeof entry, pfd)))
+   while ((nread = syscall(SYS_getdents64, fd, buffer, sizeof buffer)) > 0)
    {
-      entry[strcspn(entry, "\n")] = '\0';
-      if (strlen(entry) > 0)
+      for (pos = 0; pos < nread; pos += dirent->d_reclen)
       {
-         strncpy(entriesList[nbentries++], entry, FS_PATH_MAX-1);
+         dirent = (struct linux_dirent64 *) (buffer + pos);
+         if (fnmatch(pattern, dirent->d_name, FNM_PERIOD) != 0)
+            continue;
+         nbmatch++;
+         if (callback(dirpath, dirent->d_name, dirent->d_type, ctx) < 0)
+         {
+            close(fd);
+            return nbmatch;
+         }
       }
    }
-   fclose(pfd);
+   if (nread < 0)
+      log_error("Directory %s: read failed: %s", dirpath, strerror(errno));
+   close(fd);
+
+   return (nread < 0) ? -1 : nbmatch;
+}
+
+static int compareEntries(const void *entry1, const void *entry2)
+{
+   return strcmp(entry1, entry2);
+}
+
+// Sort entries list the way ls does
+void fspathSortEntries(char entriesList[][FS_PATH_MAX], int nbentries)
+{
+   qsort(entriesList, nbentries, FS_PATH_MAX, compareEntries);
+}
+
+typedef struct {
+   char (*entriesList)[FS_PATH_MAX];
+   int nbentries;
+   int maxEntries;
+} t_entriesCtx;
+
+static int addEntry(const char *dirpath, const char *name, unsigned char type, void *ctx)
+{
+   t_entriesCtx *entries = ctx;
+
+   if (entries->nbentries >= entries->maxEntries)
+      return -1;
+   snprintf(entries->entriesList[entries->nbentries++], FS_PATH_MAX, "%s/%s", dirpath, name);
    return 0;
 }
+
+// Get all file/dir entries of FS path pattern (pattern in last path component only)
+int fspathGetEntries(char *fspathPattern, char entriesList[][FS_PATH_MAX], int maxEntries)
+{
+   t_entriesCtx entries = { .entriesList = entriesList, .nbentries = 0, .maxEntries = maxEntries };
+   char dirpath[FS_PATH_MAX];
+   char *pattern;
+
+   snprintf(dirpath, sizeof dirpath, "%s", fspathPattern);
+   pattern = strrchr(dirpath, '/');
+   if (pattern == NULL)
+      return -1;
+   *pattern++ = '\0';
+
+   if (fsdirScan((dirpath[0] != '\0') ? dirpath : "/", pattern, addEntry, &entries) < 0)
+      return -1;
+
+   fspathSortEntries(entriesList, entries.nbentries);
+   return entries.nbentries;
+}
+
+// FNV-1a hash of data, chained from hash (FNV_OFFSET_BASIS to start)
+uint64_t fnvHash(uint64_t hash, const void *data, size_t len)
+{
+   const unsigned char *ptr = data;
+
+   while (len--)
+   {
+      hash ^= *ptr++;
+      hash *= FNV_PRIME;
+   }
+   return hash;
+}
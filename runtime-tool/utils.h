@@ -3,15 +3,35 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <sys/syslog.h>
 #include <sys/resource.h>
 #include <sys/types.h>
+#include <sched.h>
 
 
 #define FS_PATH_MAX  256
 #define FILE_NAME_MAX 64
 
-#define SYSFS_CGROUP_PATH "/sys/fs/cgroup/"
+#define ACCEL_SETTINGS_CONFFILE "/etc/acceleration.json"
+#define ACCEL_SETTINGS_IMAGE    "/etc/acceleration.img"
+
+// Host paths, overridable by environment to run on a synthetic sysfs/devfs tree (tests, benchmarks)
+typedef enum {
+   HOST_PATH_SYSFS_FPGA,   // ACCEL_SYSFS_FPGA_PATH, default /sys/class/fpga
+   HOST_PATH_DEV,          // ACCEL_DEV_PATH, default /dev
+   HOST_PATH_CGROUP,       // ACCEL_CGROUP_PATH, default /sys/fs/cgroup
+   HOST_PATH_LDCACHE,      // ACCEL_LDCACHE_PATH, default /etc/ld.so.cache
+   HOST_PATH_RUN,          // ACCEL_RUN_PATH, default /run/accelerator-container: also devices lease table
+   HOST_PATH_CONF,         // ACCEL_CONF_PATH, default ACCEL_SETTINGS_CONFFILE
+   HOST_PATH_IMAGE,        // ACCEL_IMAGE_PATH, default ACCEL_SETTINGS_IMAGE
+   HOST_PATH_PROC,         // ACCEL_PROC_PATH, default /proc: only for processes cgroup membership and CPUs
+   HOST_PATH_DEV_CHAR,     // ACCEL_DEV_CHAR_PATH, default /sys/dev/char: char devices of each major
+   HOST_PATH_SYSFS_NODE,   // ACCEL_SYSFS_NODE_PATH, default /sys/devices/system/node
+   HOST_PATH_MAX
+} e_hostPath;
+
+const char *hostPath(e_hostPath id);
 
 #define nitems(x) (sizeof(x) / sizeof(*x))
 
@@ -21,23 +41,155 @@
 #define log_info(fmt, args...)  logWrite(LOG_INFO, fmt, ##args )
 #define log_debug(fmt, args...) logWrite(LOG_DEBUG, fmt, ##args )
 
+typedef enum {
+   LOG_FORMAT_TEXT,   // "dd-mm-yy HH:MM:SS [level] message"
+   LOG_FORMAT_KV,     // time=... level=... pid=... msg="..."
+   LOG_FORMAT_JSON,   // one JSon object per line
+} e_logFormat;
+
 void logOpen(const char *path, int level);
 void logClose();
 void logSetLevel(int level);
+void logSetFormat(e_logFormat format);
+void logFlush();
 void logWrite(int level, const char *fmt, ...);
 
+#define ACCEL_TRACE_ENV "ACCEL_TRACE"
+int traceOpen(const char *path);
+void traceClose();
+bool traceEnabled();
+int64_t traceNow();
+int64_t traceBegin();
+void traceEnd(int64_t start, const char *name, const char *fmt, ...) __attribute__ ((format (printf, 3, 4)));
+void traceEndv(int64_t start, const char *name, const char *fmt, va_list args);
+
 int sysfsReadString(char *syspath, char *value, int valuelen);
 int sysfsWriteString(char *syspath, char *value);
 uint64_t sysfsReadUint64(char *syspath);
 int sysfsWriteUint64(char *syspath, uint64_t value);
 
 int rlimitConfig(pid_t pid, int resource, rlim_t rlim_soft, rlim_t rlim_hard);
+#define SYSFS_CGROUP_DEV      "devices"
+#define SYSFS_CGROUP_UNIFIED  ""         // cgroup v2 entry of /proc/<pid>/cgroup: "0::<path>"
+
+bool cgroupUnified();
+int findCgroupPath(pid_t pid, char *cgroupname, char *path, int pathlen);
 int limitHugetlb(pid_t pid, int  nbHugepage2M, int  nbHugepage1G);
 
+typedef enum {
+   HUGEPAGE_2M,
+   HUGEPAGE_1G,
+   HUGEPAGE_SIZE_MAX
+} e_hugepageSize;
+
+#define NUMA_NODE_MAX  64
+
+void hugepageSetMax(int max2M, int max1G);
+int hugepageReserve(int node, int nbHugepage2M, int nbHugepage1G);
+
+int pciNumaNode(const char *pcisyspath);
+int cpulistParse(const char *list, cpu_set_t *cpus);
+int nodeCpus(int node, cpu_set_t *cpus);
+int processCpus(pid_t pid, cpu_set_t *cpus);
+
+int openBeneath(int rootfd, const char *path, int flags);
 int file_create(const char *path, const char *data, uid_t uid, gid_t gid, mode_t mode);
-int mountFile(char *rootfs, char *srcpath, char *dstpath, bool device, bool rdonly, bool noexec);
-int ldconfigCacheUpdate(char *rootfs);
+int mountFile(char *rootfs, char *srcpath, char *dstpath, bool device, bool rdonly, bool noexec, bool recursive);
+
+typedef struct {
+   char   src[FS_PATH_MAX];
+   char   dst[FS_PATH_MAX];   // container path
+   char   link[FS_PATH_MAX];  // symlink target, no mount if not empty
+   bool   device;
+   bool   rdonly;
+   bool   noexec;
+   bool   recursive;          // submounts of src too
+   mode_t mode;
+   int    fd;                 // detached mount, -1 if none
+} t_mountEntry;
+
+typedef struct {
+   t_mountEntry *list;
+   int           nbmount;
+   int           maxmount;
+   bool          fdMounts;    // attach detached mounts, else mount by path
+} t_mountPlan;
+
+int mountPlanAdd(t_mountPlan *plan, const char *srcpath, const char *dstpath, bool device, bool rdonly, bool noexec);
+int mountPlanAddTree(t_mountPlan *plan, const char *srcpath, const char *dstpath, bool rdonly);
+int mountPlanAddLink(t_mountPlan *plan, const char *path, const char *target);
+int mountPlanPrepare(t_mountPlan *plan);
+int mountPlanAttach(t_mountPlan *plan, char *rootfs);
+void mountPlanFree(t_mountPlan *plan);
+int ldconfigCacheUpdate(char *rootfs, const char *libdirs);
+
+#define LDCACHE_PATH "/etc/ld.so.cache"
+#define LDCACHE_DIR  "etc"
+#define LDCACHE_NAME "ld.so.cache"
+#define LDCONF_DIR_PATH "/etc/ld.so.conf.d"
 
+typedef enum {
+   LDCACHE_FORMAT_OLD,
+   LDCACHE_FORMAT_NEW
+} e_ldcacheFormat;
+
+typedef struct {
+   char    *data;
+   size_t   size;
+   e_ldcacheFormat format;
+   uint32_t nlibs;
+   char    *entries;
+   char    *strings;  // base of entries strings offsets
+} t_ldcache;
+
+int ldcacheOpen(const char *path, t_ldcache *cache);
+void ldcacheClose(t_ldcache *cache);
+int ldcacheEntry(t_ldcache *cache, uint32_t idx, int32_t *flags, const char **key, const char **value, uint64_t *hwcap);
+bool ldcacheNativeFlags(int32_t flags);
+int ldcacheLookup(t_ldcache *cache, const char *soname, char *path, int pathlen, int32_t *libflags);
+
+typedef struct {
+   const char *soname;
+   const char *path;
+   int32_t     flags;
+} t_ldcacheLib;
+
+int ldcacheUpdate(const char *rootfs, t_ldcacheLib libs[], int nblibs);
+
+typedef int (*t_fsdirCallback)(const char *dirpath, const char *name, unsigned char type, void *ctx);
+
+int fsdirScan(const char *dirpath, const char *pattern, t_fsdirCallback callback, void *ctx);
+void fspathSortEntries(char entriesList[][FS_PATH_MAX], int nbentries);
 int fspathGetEntries(char *fspathPattern, char entriesList[][FS_PATH_MAX], int maxEntries);
 
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME        0x100000001b3ULL
+
+uint64_t fnvHash(uint64_t hash, const void *data, size_t len);
+
+// Devices cgroup rules (cgroupDevices.c)
+#define DEV_RULE_ANY      -1   // any major or minor
+#define DEV_ACCESS_MKNOD  1
+#define DEV_ACCESS_READ   2
+#define DEV_ACCESS_WRITE  4
+#define DEV_ACCESS_ALL    (DEV_ACCESS_MKNOD | DEV_ACCESS_READ | DEV_ACCESS_WRITE)
+
+typedef struct {
+   char    type;     // 'a' (all), 'b' or 'c'
+   int32_t major;    // or DEV_RULE_ANY
+   int32_t minor;    // or DEV_RULE_ANY
+   int32_t access;   // DEV_ACCESS_*
+   bool    allow;
+   bool    exact;    // never widened to any minor: its major may get new devices later
+} t_devRule;
+
+struct bpf_insn;
+
+int devRulesCoalesce(t_devRule ruleList[], int nbrule);
+int devRuleParse(const char *str, t_devRule *rule);
+int devRuleFormat(const t_devRule *rule, char *str, int len);
+int devFilterBuild(const t_devRule ruleList[], int nbrule, struct bpf_insn *insnList, int maxInsn);
+int cgroup1AllowDevices(pid_t pid, t_devRule ruleList[], int nbrule);
+int cgroup2AllowDevices(pid_t pid, const char *runtimeRules, t_devRule ruleList[], int nbrule);
+
 #endif // __INCLUDE_UTILS_H__
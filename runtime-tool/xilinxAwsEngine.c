@@ -5,12 +5,15 @@
  */
 
 #include <stdio.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <dlfcn.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "fpga_mgmt.h"
 
@@ -18,63 +21,163 @@
 
 #define AWS_FPFGA_LIB_MGMT "libfpga_mgmt.so"
 #define AWS_FPFGA_DRIVER "xdma"
+#define AWS_LOAD_POLL_MAX_MS 1000
 
 #define XILINK_SYSFS_DEVPATH_FMT "/sys/bus/pci/devices/0000:" PCI_BDF_FMT
+#define XILINK_SYSFS_DRIVER_PATH "/sys/bus/pci/drivers/" AWS_FPFGA_DRIVER
 
 static t_accelEngine xilinxAwsEngine = {
    .name = "XilinxAWS",
    .bistreamPath = "",  // unused
    .reconfigPhysfn = true,
    .reconfigVirtfn = false,
-   .sriovMode = false
+   .sriovMode = false,
+   .warmFunction = ACCELFUNC_UNKNOWN,
+   .loadTimeoutMs = 30000,
+   .loadPollMs = 50
 };
 
 static char *logtag = xilinxAwsEngine.name;
 
 // Accelerator device sysfs entries needing user read/write access on host
 static const char * const xilinxSysentriesRW[] = {
-#ifndef XILINX_DEBUG
    "resource0",
    "resource4"
-#endif
 };
 
+// sysfs dirs changing when FPGA slots are added/removed or rescanned after an image load
+static const char * const xilinxSyswatch[] = {
+   XILINK_SYSFS_DRIVER_PATH
+};
+
+
+// fpga_mgmt library, opened once and kept resident: enumeration, describe and concurrent loads share it
+static struct {
+   void *handle;
+   int (*init)(void);
+   int (*get_all_slot_specs)(struct fpga_slot_spec fpgaSlot[], int size);
+   int (*describe_local_image)(int slot_id, struct fpga_mgmt_image_info *info, uint32_t flags);
+   int (*load_local_image)(int slot_id, char *afi_id);
+   int (*rescan_slot_app_pfs)(int slot_id);
+} fpgaMgmt;
+static pthread_once_t fpgaMgmtOnce = PTHREAD_ONCE_INIT;
+
+static void openMgmtLib()
+{
+   fpgaMgmt.handle = dlopen(AWS_FPFGA_LIB_MGMT, RTLD_NOW);
+   if (fpgaMgmt.handle == NULL)
+      return;
+
+   fpgaMgmt.init = (int (*)()) dlsym(fpgaMgmt.handle, "fpga_mgmt_init");
+   fpgaMgmt.get_all_slot_specs = (int (*)()) dlsym(fpgaMgmt.handle, "fpga_pci_get_all_slot_specs");
+   fpgaMgmt.describe_local_image = (int (*)()) dlsym(fpgaMgmt.handle, "fpga_mgmt_describe_local_image");
+   fpgaMgmt.load_local_image = (int (*)()) dlsym(fpgaMgmt.handle, "fpga_mgmt_load_local_image");
+   fpgaMgmt.rescan_slot_app_pfs = (int (*)()) dlsym(fpgaMgmt.handle, "fpga_pci_rescan_slot_app_pfs");
+   if ( (! fpgaMgmt.get_all_slot_specs) || (! fpgaMgmt.describe_local_image) || (! fpgaMgmt.load_local_image)
+     || (! fpgaMgmt.rescan_slot_app_pfs))
+   {
+      log_error("%s: library %s: symbol not found", logtag, AWS_FPFGA_LIB_MGMT);
+      dlclose(fpgaMgmt.handle);
+      memset(&fpgaMgmt, 0, sizeof fpgaMgmt);
+      return;
+   }
+   // older libraries have no init entry point
+   if ((fpgaMgmt.init != NULL) && (fpgaMgmt.init() != 0))
+      log_warn("%s: fpga_mgmt_init failed", logtag);
+}
+
+static int useMgmtLib()
+{
+   pthread_once(&fpgaMgmtOnce, openMgmtLib);
+   return (fpgaMgmt.handle != NULL) ? 0 : -1;
+}
+
+// Read slot image info (status, PCI ids) and AGFI id currently loaded into a slot
+static int describeSlot(int slotId, struct fpga_mgmt_image_info *info, char *afiId, size_t afiIdLen)
+{
+   if (useMgmtLib() < 0)
+   {
+      log_error("%s: library %s not installed", logtag, AWS_FPFGA_LIB_MGMT);
+      return -1;
+   }
+
+   memset(info, 0, sizeof(struct fpga_mgmt_image_info));
+   if (fpgaMgmt.describe_local_image(slotId, info, 0) < 0)
+   {
+      log_error("%s: slot %d: failed to get image info", logtag, slotId);
+      return -1;
+   }
+   snprintf(afiId, afiIdLen, "%s", info->ids.afi_id);
+   return 0;
+}
+
+static int64_t elapsedMs(struct timespec *start)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+
+typedef struct {
+   t_acceldev *acceldevList;
+   int nbAcceldev;
+} t_slotDevpathCtx;
+
+// Add /dev/xdma<slot>* node to its slot device: slot number must be followed by a non digit,
+// so xdma1_user does not go to slot 10 and xdma10_user does not go to slot 1
+static int addSlotDevpath(const char *dirpath, const char *name, unsigned char type, void *ctx)
+{
+   t_slotDevpathCtx *slots = ctx;
+   const char *ptr = name + strlen(AWS_FPFGA_DRIVER);
+   char *end;
+   long slotId;
+   int idev, idevpath;
+
+   slotId = strtol(ptr, &end, 10);
+   if (end == ptr)
+      return 0;
+
+   for (idev = 0; idev < slots->nbAcceldev; idev++)
+   {
+      if (slots->acceldevList[idev].slotId != slotId)
+         continue;
+
+      for (idevpath = 0; idevpath < NB_DEVPATH_MAX; idevpath++)
+      {
+         if (slots->acceldevList[idev].devpath[idevpath][0] == '\0')
+         {
+            snprintf(slots->acceldevList[idev].devpath[idevpath], FS_PATH_MAX, "%s/%s", dirpath, name);
+            return 0;
+         }
+      }
+      log_warn("%s: slot %ld: too many device nodes, %s ignored", logtag, slotId, name);
+   }
+   return 0;
+}
 
-#ifndef XILINX_DEBUG
 // Enumerate all FPGA engines and accelerators
 static int enumerate(t_acceldev acceldevList[], int *nbAcceldev)
 {
-   int (*fpga_pci_get_all_slot_specs)(struct fpga_slot_spec fpgaSlot[], int size);
-   int (*fpga_mgmt_describe_local_image)(int slot_id, struct fpga_mgmt_image_info *info, uint32_t flags);
-   void *handle;
-
    struct fpga_slot_spec fpgaSlot[FPGA_SLOT_MAX];
    struct fpga_mgmt_image_info info;
-   char devpath[FS_PATH_MAX];
+   t_slotDevpathCtx ctx;
+   int firstdev = *nbAcceldev;
+   int nbdevpath;
    int islot, idev;
 
-   // Load fpga_mgmt library
-   handle = dlopen(AWS_FPFGA_LIB_MGMT, RTLD_NOW);
-   if (handle == NULL)
+   if (useMgmtLib() < 0)
    {
       log_warn("%s: library %s not installed", logtag, AWS_FPFGA_LIB_MGMT);
       return 0;
    }
-   fpga_pci_get_all_slot_specs = (int (*)()) dlsym(handle, "fpga_pci_get_all_slot_specs");
-   fpga_mgmt_describe_local_image = (int (*)()) dlsym(handle, "fpga_mgmt_describe_local_image");
-   if ((! fpga_pci_get_all_slot_specs) || (! fpga_mgmt_describe_local_image))
-   {
-      log_error("%s: library %s: symbol not found", logtag, AWS_FPFGA_LIB_MGMT);
-      dlclose(handle);
-      return -1;
-   }
 
    // Get all FPGA slots from sysfs
    memset(fpgaSlot, 0, sizeof(fpgaSlot));
-   if (fpga_pci_get_all_slot_specs(fpgaSlot, nitems(fpgaSlot)) < 0)
+   if (fpgaMgmt.get_all_slot_specs(fpgaSlot, nitems(fpgaSlot)) < 0)
    {
       log_error("%s: failed to get FPGA slots", logtag);
-      dlclose(handle);
       return -1;
    }
    for (islot = 0; islot < (int) nitems(fpgaSlot); ++islot)
@@ -84,14 +187,14 @@ static int enumerate(t_acceldev acceldevList[], int *nbAcceldev)
 
       // Get image info
       memset(&info, 0, sizeof(struct fpga_mgmt_image_info));
-      if (fpga_mgmt_describe_local_image(islot, &info, 0) < 0)
+      if (fpgaMgmt.describe_local_image(islot, &info, 0) < 0)
       {
          log_error("%s: slot %d: failed to get image info", logtag, islot);
-         dlclose(handle);
          return -1;
       }
 
       idev = *nbAcceldev;
+      memset(&acceldevList[idev], 0, sizeof(t_acceldev));
 
       acceldevList[idev].slotId = islot;
       acceldevList[idev].pcifnType = PCIFUNC_PHYSICAL;
@@ -106,99 +209,123 @@ static int enumerate(t_acceldev acceldevList[], int *nbAcceldev)
       snprintf(acceldevList[idev].bdf.str, PCI_BDF_LEN, PCI_BDF_FMT,
             acceldevList[idev].bdf.bus, acceldevList[idev].bdf.device, acceldevList[idev].bdf.function);
 
-      // Get all driver entries /dev/xdma0*
-      snprintf(devpath, FS_PATH_MAX, "%s/%s%d*", LINUX_DEV_PATH, AWS_FPFGA_DRIVER, islot);
-      fspathGetEntries(devpath, acceldevList[idev].devpath, NB_DEVPATH_MAX);
       // Both accelerator sysfs path and engine sysfs path need to be mounted to container
       snprintf(acceldevList[idev].syspathAccel, FS_PATH_MAX, XILINK_SYSFS_DEVPATH_FMT,
             fpgaSlot[islot].map[FPGA_APP_PF].bus, fpgaSlot[islot].map[FPGA_APP_PF].dev, fpgaSlot[islot].map[FPGA_APP_PF].func);
       snprintf(acceldevList[idev].syspathEngine, FS_PATH_MAX, XILINK_SYSFS_DEVPATH_FMT,
             fpgaSlot[islot].map[FPGA_MGMT_PF].bus, fpgaSlot[islot].map[FPGA_MGMT_PF].dev, fpgaSlot[islot].map[FPGA_MGMT_PF].func);
+      acceldevList[idev].numaNode = pciNumaNode(acceldevList[idev].syspathAccel);
 
       (*nbAcceldev) ++;
    }
 
-   dlclose(handle);
-   return 0;
-}
-#else
-// Fake accel device for tests
-static int enumerate(t_acceldev acceldevList[], int *nbAcceldev)
-{
-   int idev = *nbAcceldev;
-
-   acceldevList[idev].slotId = 0;
-   acceldevList[idev].pcifnType = PCIFUNC_PHYSICAL;
-   acceldevList[idev].enginetype = ACCEL_ENGINE_XILINX;
-   acceldevList[idev].accelfunc = 2;  // sha512
-   strcpy(acceldevList[idev].funcHwid, "agfi-0b55312dafbf39918");
-   acceldevList[idev].vendorId = 0x1000;
-   acceldevList[idev].deviceId = 0x1000;
-   acceldevList[idev].bdf.bus = 6;
-   acceldevList[idev].bdf.device = 0;
-   acceldevList[idev].bdf.function = 0;
-   snprintf(acceldevList[idev].bdf.str, PCI_BDF_LEN, PCI_BDF_FMT,
-         acceldevList[idev].bdf.bus, acceldevList[idev].bdf.device, acceldevList[idev].bdf.function);
-   fspathGetEntries("/dev/ttyS2*", acceldevList[idev].devpath, NB_DEVPATH_MAX);
-//   snprintf(acceldevList[idev].syspathAccel, FS_PATH_MAX, XILINK_SYSFS_DEVPATH_FMT, 0, 0x1f, 2);
-//   snprintf(acceldevList[idev].syspathEngine, FS_PATH_MAX, XILINK_SYSFS_DEVPATH_FMT, 0, 0x1f, 3);
-   (*nbAcceldev) ++;
-   log_debug("%s: return one fake accel device", logtag);
+   // Get all driver entries /dev/xdma<slot>* of all slots in one pass
+   ctx.acceldevList = & acceldevList[firstdev];
+   ctx.nbAcceldev = *nbAcceldev - firstdev;
+   if (fsdirScan(hostPath(HOST_PATH_DEV), AWS_FPFGA_DRIVER "[0-9]*", addSlotDevpath, &ctx) < 0)
+      return -1;
+   for (idev = firstdev; idev < *nbAcceldev; idev++)
+   {
+      for (nbdevpath = 0; (nbdevpath < NB_DEVPATH_MAX) && (acceldevList[idev].devpath[nbdevpath][0] != '\0'); nbdevpath++);
+      fspathSortEntries(acceldevList[idev].devpath, nbdevpath);
+   }
+
    return 0;
 }
-#endif
 
 
-// Load blue bitstream to Xilinx accelerator
+// Load AGFI to Xilinx accelerator slot, then poll slot until loaded (the load API does not wait).
+// Application PF is rescanned when the AGFI changes its PCI ids, as fpga-load-local-image does.
+// Several slots may be loading at the same time.
 static int loadBitstream(t_acceldev *acceldev, t_accelfuncConf *accelfuncConf)
 {
-   int (*fpga_mgmt_describe_local_image)(int slot_id, struct fpga_mgmt_image_info *info, uint32_t flags);
    struct fpga_mgmt_image_info info;
-   char cmd[FS_PATH_MAX];
-   void *handle;
+   char afiId[FUNCTION_HWID_LEN];
+   struct timespec start;
+   struct timespec delay;
+   int pollMs = (xilinxAwsEngine.loadPollMs > 0) ? xilinxAwsEngine.loadPollMs : 1;
 
-    // Add --request-timeout ??
-   sprintf(cmd, "fpga-load-local-image -S %d -I %s", acceldev->slotId, accelfuncConf->accelID);
-   if (system(cmd) != 0)
+   if (useMgmtLib() < 0)
+   {
+      log_error("%s: library %s not installed", logtag, AWS_FPFGA_LIB_MGMT);
+      return -1;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   snprintf(afiId, sizeof afiId, "%s", accelfuncConf->accelID);
+   if (fpgaMgmt.load_local_image(acceldev->slotId, afiId) != 0)
    {
       log_error("%s: Device %s: engine failed to load function %s", logtag, acceldev->bdf.str, accelfuncIndexToName(accelfuncConf->funcID));
       return -1;
    }
 
-   // Reload image info
-   if ((handle = dlopen(AWS_FPFGA_LIB_MGMT, RTLD_NOW)) != NULL)
+   // Wait for load completion, with exponential backoff
+   for (;;)
    {
-      fpga_mgmt_describe_local_image = (int (*)()) dlsym(handle, "fpga_mgmt_describe_local_image");
-      if (fpga_mgmt_describe_local_image != NULL)
+      if (describeSlot(acceldev->slotId, &info, acceldev->funcHwid, sizeof acceldev->funcHwid) < 0)
+         return -1;
+      if ((info.status == FPGA_STATUS_LOADED) && (! strcmp(acceldev->funcHwid, accelfuncConf->accelID)))
+         break;
+      // load failed or was replaced: no use waiting
+      if (info.status != FPGA_STATUS_BUSY)
       {
-         memset(&info, 0, sizeof(struct fpga_mgmt_image_info));
-         if (fpga_mgmt_describe_local_image(acceldev->slotId, &info, 0) < 0)
-         {
-            log_error("%s: slot %d: failed to get image info", logtag, acceldev->slotId);
-            return -1;
-         }
-         strcpy(acceldev->funcHwid, info.ids.afi_id);
+         log_error("%s: Device %s: AGFI id %s has status %d after reconfig",
+               logtag, acceldev->bdf.str, acceldev->funcHwid, info.status);
+         return -1;
+      }
+      if (elapsedMs(&start) >= xilinxAwsEngine.loadTimeoutMs)
+      {
+         log_error("%s: Device %s: function %s not loaded after %d ms (status %d)", logtag, acceldev->bdf.str,
+               accelfuncIndexToName(accelfuncConf->funcID), xilinxAwsEngine.loadTimeoutMs, info.status);
+         return -1;
       }
-      dlclose(handle);
+
+      delay.tv_sec = pollMs / 1000;
+      delay.tv_nsec = (pollMs % 1000) * 1000000L;
+      nanosleep(&delay, NULL);
+      pollMs = (pollMs * 2 < AWS_LOAD_POLL_MAX_MS) ? pollMs * 2 : AWS_LOAD_POLL_MAX_MS;
    }
 
-   // check slot contains expected image
-   if (strcmp(acceldev->funcHwid, accelfuncConf->accelID) != 0)
+   // AGFI with other PCI ids: application PF has to be rescanned to get them and its device nodes
+   if ( (info.ids.afi_device_ids.vendor_id != info.spec.map[FPGA_APP_PF].vendor_id)
+     || (info.ids.afi_device_ids.device_id != info.spec.map[FPGA_APP_PF].device_id))
    {
-      log_error("%s: Device %s: expected AGFI id %s after reconfig but has %s",
-            logtag, acceldev->bdf.str, accelfuncConf->accelID, acceldev->funcHwid);
-      return -1;
+      log_info("%s: Device %s: PCI ids %04x:%04x changed to %04x:%04x: rescan", logtag, acceldev->bdf.str,
+            info.spec.map[FPGA_APP_PF].vendor_id, info.spec.map[FPGA_APP_PF].device_id,
+            info.ids.afi_device_ids.vendor_id, info.ids.afi_device_ids.device_id);
+      if (fpgaMgmt.rescan_slot_app_pfs(acceldev->slotId) != 0)
+      {
+         log_error("%s: Device %s: failed to rescan application PF", logtag, acceldev->bdf.str);
+         return -1;
+      }
+      acceldev->vendorId = info.ids.afi_device_ids.vendor_id;
+      acceldev->deviceId = info.ids.afi_device_ids.device_id;
    }
+   acceldev->accelfunc = accelfuncConf->funcID;
+
+   log_info("%s: Device %s: function %s loaded in %" PRId64 " ms", logtag, acceldev->bdf.str,
+         accelfuncIndexToName(accelfuncConf->funcID), elapsedMs(&start));
+
+   return 0;
+}
 
-   log_info("%s: Device %s: function %s loaded", logtag, acceldev->bdf.str, accelfuncIndexToName(accelfuncConf->funcID));
 
+// Re-read AGFI currently loaded into slot
+static int refresh(t_acceldev *acceldev)
+{
+   struct fpga_mgmt_image_info info;
+
+   if (describeSlot(acceldev->slotId, &info, acceldev->funcHwid, sizeof acceldev->funcHwid) < 0)
+      return -1;
+   acceldev->accelfunc = acceleratorFuncHwidToIndex(ACCEL_ENGINE_XILINX, acceldev->funcHwid);
    return 0;
 }
 
 
 static t_accelOps xilinxAwsOps = {
    .enumerate = enumerate,
-   .loadBitstream = loadBitstream
+   .loadBitstream = loadBitstream,
+   .refresh = refresh
 };
 
 t_accelEngine * xilinxAwsRegister()
@@ -206,6 +333,9 @@ t_accelEngine * xilinxAwsRegister()
    xilinxAwsEngine.sysentriesRW = (char **) xilinxSysentriesRW;
    xilinxAwsEngine.nbsysentries = nitems(xilinxSysentriesRW);
 
+   xilinxAwsEngine.syswatch = (char **) xilinxSyswatch;
+   xilinxAwsEngine.nbsyswatch = nitems(xilinxSyswatch);
+
    xilinxAwsEngine.nblibs = 0;
 
    xilinxAwsEngine.accelops = & xilinxAwsOps;